@@ -0,0 +1,183 @@
+/* a backend for trying out protobuf_pass and the stream module's
+ * protobuf_pass: it reads messages preceded by their length as a
+ * varint, and answers each one with the same message.  each connection
+ * is served by a process of its own.
+ *
+ *   cc -o protobuf_echo protobuf_echo.c
+ *   ./protobuf_echo 7000
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PROTOBUF_ECHO_MAX_MESSAGE  (16 * 1024 * 1024)
+
+static int
+read_full(int fd, unsigned char *buf, size_t len)
+{
+  ssize_t  n;
+
+  while (len > 0) {
+    n = read(fd, buf, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      return -1;
+    }
+
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int
+write_full(int fd, unsigned char *buf, size_t len)
+{
+  ssize_t  n;
+
+  while (len > 0) {
+    n = write(fd, buf, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      return -1;
+    }
+
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/* echoes messages until the peer closes the connection, or sends
+ * something that is not a length-delimited message.
+ */
+
+static void
+serve(int fd)
+{
+  unsigned char  prefix[10];
+  unsigned char *message;
+  uint64_t       len;
+  size_t         n;
+
+  for ( ;; ) {
+    len = 0;
+
+    for (n = 0; n < sizeof(prefix); n++) {
+      if (read_full(fd, &prefix[n], 1) != 0) {
+        return;
+      }
+
+      len |= (uint64_t) (prefix[n] & 0x7f) << (7 * n);
+
+      if (!(prefix[n] & 0x80)) {
+        break;
+      }
+    }
+
+    if (n == sizeof(prefix) || len > PROTOBUF_ECHO_MAX_MESSAGE) {
+      fprintf(stderr, "protobuf_echo: bad message length\n");
+      return;
+    }
+
+    n++;
+
+    message = malloc(len ? len : 1);
+    if (message == NULL) {
+      return;
+    }
+
+    if (read_full(fd, message, len) != 0
+        || write_full(fd, prefix, n) != 0
+        || write_full(fd, message, len) != 0)
+    {
+      free(message);
+      return;
+    }
+
+    free(message);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  struct sockaddr_in  sin;
+  int                 s, fd, on;
+
+  if (argc != 2 || atoi(argv[1]) <= 0 || atoi(argv[1]) > 65535) {
+    fprintf(stderr, "usage: protobuf_echo port\n");
+    return 1;
+  }
+
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+
+  s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s == -1) {
+    perror("protobuf_echo: socket");
+    return 1;
+  }
+
+  on = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = htons((unsigned short) atoi(argv[1]));
+
+  if (bind(s, (struct sockaddr *) &sin, sizeof(sin)) == -1
+      || listen(s, 128) == -1)
+  {
+    perror("protobuf_echo: bind");
+    return 1;
+  }
+
+  for ( ;; ) {
+    fd = accept(s, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+
+      perror("protobuf_echo: accept");
+      return 1;
+    }
+
+    switch (fork()) {
+
+    case -1:
+      perror("protobuf_echo: fork");
+      break;
+
+    case 0:
+      close(s);
+      serve(fd);
+      _exit(0);
+
+    default:
+      break;
+    }
+
+    close(fd);
+  }
+}
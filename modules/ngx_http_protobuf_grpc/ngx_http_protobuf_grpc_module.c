@@ -0,0 +1,642 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_protobuf.h>
+
+/* gRPC services.  a location with protobuf_grpc answers gRPC calls to
+ * the services that protongx generated from the .proto files built
+ * into nginx: the request path names the method, the request body is
+ * a single length-prefixed message, and each reply is framed the same
+ * way and flushed as soon as it is sent, so a server-streaming method
+ * streams.  a reply that the client does not take at once blocks the
+ * call until the write event has drained it, so a slow client cannot
+ * make the replies pile up.  the call's status goes into the
+ * grpc-status and grpc-message trailers, which nginx sends on HTTP/2.
+ *
+ * compressed messages are not accepted, and client-streaming methods
+ * are answered as unimplemented.
+ */
+
+#define NGX_HTTP_PROTOBUF_GRPC_PREFIX  5
+
+typedef struct {
+  ngx_flag_t                          enable;
+  size_t                              max_message_size;
+} ngx_http_protobuf_grpc_loc_conf_t;
+
+typedef struct {
+  ngx_protobuf_rpc_t                  rpc;
+} ngx_http_protobuf_grpc_ctx_t;
+
+static ngx_int_t ngx_http_protobuf_grpc_handler(ngx_http_request_t *r);
+static void ngx_http_protobuf_grpc_body_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_protobuf_grpc_send(ngx_protobuf_rpc_t *rpc,
+                                             ngx_str_t *message);
+static void ngx_http_protobuf_grpc_finish(ngx_protobuf_rpc_t *rpc);
+static void ngx_http_protobuf_grpc_write_handler(ngx_http_request_t *r);
+static void ngx_http_protobuf_grpc_cleanup(void *data);
+static void *ngx_http_protobuf_grpc_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_protobuf_grpc_merge_loc_conf(ngx_conf_t *cf,
+                                                   void *parent,
+                                                   void *child);
+static char *ngx_http_protobuf_grpc(ngx_conf_t *cf,
+                                    ngx_command_t *cmd,
+                                    void *conf);
+
+static ngx_command_t ngx_http_protobuf_grpc_commands[] = {
+
+  { ngx_string("protobuf_grpc"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+    ngx_http_protobuf_grpc,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("protobuf_grpc_max_message_size"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_size_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_protobuf_grpc_loc_conf_t, max_message_size),
+    NULL },
+
+  ngx_null_command
+};
+
+static ngx_http_module_t ngx_http_protobuf_grpc_module_ctx = {
+  NULL,                                    /* preconfiguration */
+  NULL,                                    /* postconfiguration */
+  NULL,                                    /* create main configuration */
+  NULL,                                    /* init main configuration */
+  NULL,                                    /* create server configuration */
+  NULL,                                    /* merge server configuration */
+  ngx_http_protobuf_grpc_create_loc_conf,  /* create location configuration */
+  ngx_http_protobuf_grpc_merge_loc_conf    /* merge location configuration */
+};
+
+ngx_module_t ngx_http_protobuf_grpc_module = {
+  NGX_MODULE_V1,
+  &ngx_http_protobuf_grpc_module_ctx,  /* module context */
+  ngx_http_protobuf_grpc_commands,     /* module directives */
+  NGX_HTTP_MODULE,                     /* module type */
+  NULL,                                /* init master */
+  NULL,                                /* init module */
+  NULL,                                /* init process */
+  NULL,                                /* init thread */
+  NULL,                                /* exit thread */
+  NULL,                                /* exit process */
+  NULL,                                /* exit master */
+  NGX_MODULE_V1_PADDING
+};
+
+static ngx_int_t
+ngx_http_protobuf_grpc_handler(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_grpc_ctx_t  *ctx;
+  ngx_table_elt_t               *type;
+  ngx_pool_cleanup_t            *cln;
+  ngx_int_t                      rc;
+
+  if (r != r->main) {
+    return NGX_DECLINED;
+  }
+
+  if (!(r->method & NGX_HTTP_POST)) {
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+
+  /* application/grpc, or application/grpc+proto */
+
+  type = r->headers_in.content_type;
+
+  if (type == NULL
+      || type->value.len < sizeof("application/grpc") - 1
+      || ngx_strncasecmp(type->value.data, (u_char *) "application/grpc",
+                         sizeof("application/grpc") - 1) != 0
+      || (type->value.len > sizeof("application/grpc") - 1
+          && type->value.data[sizeof("application/grpc") - 1] != '+'
+          && type->value.data[sizeof("application/grpc") - 1] != ';'))
+  {
+    return NGX_HTTP_UNSUPPORTED_MEDIA_TYPE;
+  }
+
+  ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_protobuf_grpc_ctx_t));
+  if (ctx == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  /* set by ngx_pcalloc():
+   *
+   *   ctx->rpc.status = NGX_PROTOBUF_RPC_OK;
+   *   ctx->rpc.message = { 0, NULL };
+   *   ctx->rpc.cancel = NULL;
+   *   ctx->rpc.finished = 0;
+   *   ctx->rpc.cancelled = 0;
+   */
+
+  ctx->rpc.method = ngx_protobuf_find_method(&r->uri);
+  ctx->rpc.pool = r->pool;
+  ctx->rpc.log = r->connection->log;
+  ctx->rpc.data = r;
+  ctx->rpc.send = ngx_http_protobuf_grpc_send;
+  ctx->rpc.finish = ngx_http_protobuf_grpc_finish;
+
+  ngx_http_set_ctx(r, ctx, ngx_http_protobuf_grpc_module);
+
+  /* a call kept open by its implementation is cancelled if the request
+   * is freed first
+   */
+
+  cln = ngx_pool_cleanup_add(r->pool, 0);
+  if (cln == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  cln->handler = ngx_http_protobuf_grpc_cleanup;
+  cln->data = &ctx->rpc;
+
+  r->request_body_in_single_buf = 1;
+
+  rc = ngx_http_read_client_request_body(r,
+                                         ngx_http_protobuf_grpc_body_handler);
+  if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+    return rc;
+  }
+
+  return NGX_DONE;
+}
+
+/* appends a piece of the request body to the copy being gathered */
+
+static ngx_int_t
+ngx_http_protobuf_grpc_copy(void *data, u_char *pos, u_char *last)
+{
+  u_char  **p = data;
+
+  *p = ngx_cpymem(*p, pos, last - pos);
+
+  return NGX_OK;
+}
+
+/* the request body as a single buffer, read back from the temporary
+ * file if it was written to one.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_grpc_body(ngx_http_request_t *r, ngx_str_t *body)
+{
+  ngx_http_request_body_t  *rb = r->request_body;
+  ngx_chain_t              *cl;
+  ngx_buf_t                *b;
+  size_t                    len;
+  u_char                   *p;
+
+  if (rb == NULL || rb->bufs == NULL) {
+    ngx_str_null(body);
+    return NGX_OK;
+  }
+
+  b = rb->bufs->buf;
+
+  if (rb->bufs->next == NULL && ngx_buf_in_memory_only(b)) {
+    body->data = b->pos;
+    body->len = b->last - b->pos;
+    return NGX_OK;
+  }
+
+  len = 0;
+  for (cl = rb->bufs; cl; cl = cl->next) {
+    b = cl->buf;
+    len += b->in_file ? (size_t) (b->file_last - b->file_pos)
+                      : (size_t) (b->last - b->pos);
+  }
+
+  body->data = ngx_pnalloc(r->pool, len);
+  if (body->data == NULL) {
+    return NGX_ERROR;
+  }
+
+  p = body->data;
+
+  if (ngx_protobuf_read_chain(rb->bufs, r->pool,
+                              ngx_http_protobuf_grpc_copy, &p)
+      != NGX_OK)
+  {
+    return NGX_ERROR;
+  }
+
+  body->len = p - body->data;
+
+  return NGX_OK;
+}
+
+/* finds the request message in its frame, or fails the call */
+
+static ngx_int_t
+ngx_http_protobuf_grpc_frame(ngx_http_request_t *r,
+                             ngx_protobuf_rpc_t *rpc,
+                             ngx_str_t *body,
+                             ngx_str_t *message)
+{
+  ngx_http_protobuf_grpc_loc_conf_t  *pglcf;
+  uint32_t                            len;
+  u_char                             *p;
+
+  pglcf = ngx_http_get_module_loc_conf(r, ngx_http_protobuf_grpc_module);
+
+  if (body->len < NGX_HTTP_PROTOBUF_GRPC_PREFIX) {
+    rpc->status = NGX_PROTOBUF_RPC_INTERNAL;
+    ngx_str_set(&rpc->message, "missing request message");
+    return NGX_DECLINED;
+  }
+
+  p = body->data;
+
+  if (p[0] != 0) {
+    rpc->status = NGX_PROTOBUF_RPC_UNIMPLEMENTED;
+    ngx_str_set(&rpc->message, "compressed messages are not supported");
+    return NGX_DECLINED;
+  }
+
+  len = ((uint32_t) p[1] << 24) | ((uint32_t) p[2] << 16)
+        | ((uint32_t) p[3] << 8) | p[4];
+
+  if (len > pglcf->max_message_size) {
+    rpc->status = NGX_PROTOBUF_RPC_RESOURCE_EXHAUSTED;
+    ngx_str_set(&rpc->message, "request message is too large");
+    return NGX_DECLINED;
+  }
+
+  if (body->len - NGX_HTTP_PROTOBUF_GRPC_PREFIX != len) {
+    rpc->status = NGX_PROTOBUF_RPC_INTERNAL;
+    ngx_str_set(&rpc->message, "expected a single request message");
+    return NGX_DECLINED;
+  }
+
+  message->data = p + NGX_HTTP_PROTOBUF_GRPC_PREFIX;
+  message->len = len;
+
+  return NGX_OK;
+}
+
+static void
+ngx_http_protobuf_grpc_body_handler(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_grpc_ctx_t  *ctx;
+  ngx_protobuf_rpc_t            *rpc;
+  ngx_str_t                      body;
+  ngx_str_t                      message;
+  ngx_int_t                      rc;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_grpc_module);
+  rpc = &ctx->rpc;
+
+  if (ngx_http_protobuf_grpc_body(r, &body) != NGX_OK) {
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  if (rpc->method == NULL || rpc->method->handler == NULL) {
+    rpc->status = NGX_PROTOBUF_RPC_UNIMPLEMENTED;
+    ngx_protobuf_rpc_finish(rpc);
+    return;
+  }
+
+  if (ngx_http_protobuf_grpc_frame(r, rpc, &body, &message) != NGX_OK) {
+    ngx_protobuf_rpc_finish(rpc);
+    return;
+  }
+
+  rc = rpc->method->handler(rpc, &message);
+
+  /* the implementation finishes the call itself */
+
+  if (rc == NGX_AGAIN) {
+    return;
+  }
+
+  if (rc != NGX_OK && rpc->status == NGX_PROTOBUF_RPC_OK) {
+    rpc->status = NGX_PROTOBUF_RPC_INTERNAL;
+  }
+
+  ngx_protobuf_rpc_finish(rpc);
+}
+
+/* the response header goes out with the first reply, or with the
+ * trailers if there is none.  its length is unknown, and it promises
+ * trailers, so the HTTP/2 module does not end the stream with it.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_grpc_send_header(ngx_http_request_t *r)
+{
+  if (r->header_sent) {
+    return NGX_OK;
+  }
+
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = -1;
+  ngx_str_set(&r->headers_out.content_type, "application/grpc");
+  r->headers_out.content_type_len = r->headers_out.content_type.len;
+  r->expect_trailers = 1;
+
+  return ngx_http_send_header(r);
+}
+
+/* waits for the client to take more of the output, for no longer
+ * than send_timeout.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_grpc_wait(ngx_http_request_t *r)
+{
+  ngx_http_core_loc_conf_t  *clcf;
+  ngx_event_t               *wev;
+
+  clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+  wev = r->connection->write;
+
+  if (!wev->delayed) {
+    ngx_add_timer(wev, clcf->send_timeout);
+  }
+
+  return ngx_handle_write_event(wev, clcf->send_lowat);
+}
+
+/* sends a reply in its own frame.  the prefix and the message go out
+ * as two buffers, so the message is not copied.  if they cannot be
+ * written out at once, the call is told with NGX_AGAIN, and is ready
+ * again once the write event has drained the output.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_grpc_send(ngx_protobuf_rpc_t *rpc, ngx_str_t *message)
+{
+  ngx_http_request_t  *r = rpc->data;
+  ngx_chain_t          out[2];
+  ngx_buf_t           *b;
+  ngx_int_t            rc;
+  u_char              *p;
+
+  rc = ngx_http_protobuf_grpc_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  b = ngx_create_temp_buf(r->pool, NGX_HTTP_PROTOBUF_GRPC_PREFIX);
+  if (b == NULL) {
+    return NGX_ERROR;
+  }
+
+  p = b->last;
+  *p++ = 0;
+  *p++ = (u_char) (message->len >> 24);
+  *p++ = (u_char) (message->len >> 16);
+  *p++ = (u_char) (message->len >> 8);
+  *p++ = (u_char) message->len;
+  b->last = p;
+
+  out[0].buf = b;
+  out[0].next = &out[1];
+
+  b = ngx_calloc_buf(r->pool);
+  if (b == NULL) {
+    return NGX_ERROR;
+  }
+
+  b->pos = message->data;
+  b->last = message->data + message->len;
+  b->memory = (message->len > 0);
+  b->flush = 1;
+
+  out[1].buf = b;
+  out[1].next = NULL;
+
+  rc = ngx_http_output_filter(r, out);
+
+  if (rc == NGX_ERROR) {
+    return NGX_ERROR;
+  }
+
+  if (rc == NGX_AGAIN) {
+    r->write_event_handler = ngx_http_protobuf_grpc_write_handler;
+
+    if (ngx_http_protobuf_grpc_wait(r) != NGX_OK) {
+      return NGX_ERROR;
+    }
+  }
+
+  return rc;
+}
+
+/* writes out what is left of the replies, and unblocks the call once
+ * it is all gone.
+ */
+
+static void
+ngx_http_protobuf_grpc_write_handler(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_grpc_ctx_t  *ctx;
+  ngx_connection_t              *c;
+  ngx_event_t                   *wev;
+
+  c = r->connection;
+  wev = c->write;
+
+  if (wev->timedout) {
+    ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+    c->timedout = 1;
+    ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+    return;
+  }
+
+  if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+    ngx_http_finalize_request(r, NGX_ERROR);
+    return;
+  }
+
+  if (r->buffered || c->buffered) {
+    if (ngx_http_protobuf_grpc_wait(r) != NGX_OK) {
+      ngx_http_finalize_request(r, NGX_ERROR);
+    }
+
+    return;
+  }
+
+  if (wev->timer_set) {
+    ngx_del_timer(wev);
+  }
+
+  r->write_event_handler = ngx_http_request_empty_handler;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_grpc_module);
+
+  ngx_protobuf_rpc_ready(&ctx->rpc);
+}
+
+/* grpc-message is percent-encoded: everything but printable ASCII,
+ * and the percent sign itself.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_grpc_escape(ngx_pool_t *pool, ngx_str_t *src, ngx_str_t *dst)
+{
+  static u_char   hex[] = "0123456789ABCDEF";
+  ngx_uint_t      n;
+  size_t          i;
+  u_char         *p;
+  u_char          c;
+
+  n = 0;
+  for (i = 0; i < src->len; i++) {
+    c = src->data[i];
+    if (c < 0x20 || c > 0x7e || c == '%') {
+      n++;
+    }
+  }
+
+  if (n == 0) {
+    *dst = *src;
+    return NGX_OK;
+  }
+
+  p = ngx_pnalloc(pool, src->len + 2 * n);
+  if (p == NULL) {
+    return NGX_ERROR;
+  }
+
+  dst->data = p;
+
+  for (i = 0; i < src->len; i++) {
+    c = src->data[i];
+    if (c < 0x20 || c > 0x7e || c == '%') {
+      *p++ = '%';
+      *p++ = hex[c >> 4];
+      *p++ = hex[c & 0xf];
+    } else {
+      *p++ = c;
+    }
+  }
+
+  dst->len = p - dst->data;
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_protobuf_grpc_trailers(ngx_http_request_t *r, ngx_protobuf_rpc_t *rpc)
+{
+  ngx_table_elt_t  *h;
+  u_char           *p;
+
+  h = ngx_list_push(&r->headers_out.trailers);
+  if (h == NULL) {
+    return NGX_ERROR;
+  }
+
+  p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+  if (p == NULL) {
+    return NGX_ERROR;
+  }
+
+  h->hash = 1;
+  ngx_str_set(&h->key, "grpc-status");
+  h->value.data = p;
+  h->value.len = ngx_sprintf(p, "%ui", rpc->status) - p;
+
+  if (rpc->message.len == 0) {
+    return NGX_OK;
+  }
+
+  h = ngx_list_push(&r->headers_out.trailers);
+  if (h == NULL) {
+    return NGX_ERROR;
+  }
+
+  h->hash = 1;
+  ngx_str_set(&h->key, "grpc-message");
+
+  return ngx_http_protobuf_grpc_escape(r->pool, &rpc->message, &h->value);
+}
+
+static void
+ngx_http_protobuf_grpc_finish(ngx_protobuf_rpc_t *rpc)
+{
+  ngx_http_request_t  *r = rpc->data;
+  ngx_int_t            rc;
+
+  rc = ngx_http_protobuf_grpc_send_header(r);
+
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    ngx_http_finalize_request(r, rc);
+    return;
+  }
+
+  if (ngx_http_protobuf_grpc_trailers(r, rpc) != NGX_OK) {
+    ngx_http_finalize_request(r, NGX_ERROR);
+    return;
+  }
+
+  ngx_http_finalize_request(r, ngx_http_send_special(r, NGX_HTTP_LAST));
+}
+
+static void
+ngx_http_protobuf_grpc_cleanup(void *data)
+{
+  ngx_protobuf_rpc_t  *rpc = data;
+
+  ngx_protobuf_rpc_cancel(rpc);
+}
+
+static void *
+ngx_http_protobuf_grpc_create_loc_conf(ngx_conf_t *cf)
+{
+  ngx_http_protobuf_grpc_loc_conf_t  *conf;
+
+  conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_protobuf_grpc_loc_conf_t));
+  if (conf == NULL) {
+    return NULL;
+  }
+
+  /* set by ngx_pcalloc():
+   *
+   *   conf->enable = 0;
+   */
+
+  conf->max_message_size = NGX_CONF_UNSET_SIZE;
+
+  return conf;
+}
+
+static char *
+ngx_http_protobuf_grpc_merge_loc_conf(ngx_conf_t *cf,
+                                      void *parent,
+                                      void *child)
+{
+  ngx_http_protobuf_grpc_loc_conf_t  *prev = parent;
+  ngx_http_protobuf_grpc_loc_conf_t  *conf = child;
+
+  ngx_conf_merge_size_value(conf->max_message_size, prev->max_message_size,
+                            4 * 1024 * 1024);
+
+  return NGX_CONF_OK;
+}
+
+/* protobuf_grpc; */
+
+static char *
+ngx_http_protobuf_grpc(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_protobuf_grpc_loc_conf_t  *pglcf = conf;
+  ngx_http_core_loc_conf_t           *clcf;
+
+  if (pglcf->enable) {
+    return "is duplicate";
+  }
+
+  pglcf->enable = 1;
+
+  clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+  clcf->handler = ngx_http_protobuf_grpc_handler;
+
+  return NGX_CONF_OK;
+}
@@ -0,0 +1,862 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_protobuf.h>
+#include <ngx_http_protobuf.h>
+
+/* gRPC-Web.  requests from browsers are turned into native gRPC before
+ * the content handler sees them, so that they can be passed upstream
+ * with grpc_pass or served by protobuf_grpc, and the responses are
+ * turned back.  only the framing changes; messages are never decoded.
+ *
+ * in the binary mode (application/grpc-web) the frames are the same as
+ * in gRPC, and only the trailers differ: gRPC-Web sends them in a last
+ * frame of their own, flagged 0x80, so the response body filter moves
+ * them there.  in the text mode (application/grpc-web-text) the whole
+ * stream is also base64 encoded.  request bodies are decoded once they
+ * have been read, and responses are encoded as they stream through,
+ * with padding at the end of every frame, so each message reaches the
+ * browser as soon as it is sent.
+ */
+
+#define NGX_HTTP_PROTOBUF_GRPC_WEB_PREFIX    5
+#define NGX_HTTP_PROTOBUF_GRPC_WEB_TRAILERS  0x80
+
+typedef struct {
+  ngx_flag_t                          enable;
+} ngx_http_protobuf_grpc_web_loc_conf_t;
+
+typedef struct {
+  /* the status headers of a trailers-only response */
+  ngx_array_t                         trailers;
+
+  /* text mode: the bytes of the frame prefix that have been seen, and
+   * what is left of the frame; bytes that wait for a group of three
+   */
+  u_char                              prefix[NGX_HTTP_PROTOBUF_GRPC_WEB_PREFIX];
+  ngx_uint_t                          nprefix;
+  size_t                              rest;
+  u_char                              carry[4];
+  ngx_uint_t                          ncarry;
+  u_char                             *decoded;
+
+  ngx_chain_t                        *out;
+  ngx_chain_t                       **last_out;
+  ngx_buf_t                          *buf;
+  ngx_chain_t                        *free;
+  ngx_chain_t                        *busy;
+
+  ngx_http_protobuf_body_t            body;
+  unsigned                            text:1;
+  unsigned                            transcode:1;
+} ngx_http_protobuf_grpc_web_ctx_t;
+
+static ngx_int_t ngx_http_protobuf_grpc_web_init(ngx_conf_t *cf);
+static void *ngx_http_protobuf_grpc_web_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_protobuf_grpc_web_merge_loc_conf(ngx_conf_t *cf,
+                                                       void *parent,
+                                                       void *child);
+static void ngx_http_protobuf_grpc_web_body_handler(ngx_http_request_t *r);
+
+static ngx_command_t ngx_http_protobuf_grpc_web_commands[] = {
+
+  { ngx_string("protobuf_grpc_web"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_protobuf_grpc_web_loc_conf_t, enable),
+    NULL },
+
+  ngx_null_command
+};
+
+static ngx_http_module_t ngx_http_protobuf_grpc_web_module_ctx = {
+  NULL,                                        /* preconfiguration */
+  ngx_http_protobuf_grpc_web_init,             /* postconfiguration */
+  NULL,                                        /* create main configuration */
+  NULL,                                        /* init main configuration */
+  NULL,                                        /* create server configuration */
+  NULL,                                        /* merge server configuration */
+  ngx_http_protobuf_grpc_web_create_loc_conf,  /* create location configuration */
+  ngx_http_protobuf_grpc_web_merge_loc_conf    /* merge location configuration */
+};
+
+ngx_module_t ngx_http_protobuf_grpc_web_module = {
+  NGX_MODULE_V1,
+  &ngx_http_protobuf_grpc_web_module_ctx,  /* module context */
+  ngx_http_protobuf_grpc_web_commands,     /* module directives */
+  NGX_HTTP_MODULE,                         /* module type */
+  NULL,                                    /* init master */
+  NULL,                                    /* init module */
+  NULL,                                    /* init process */
+  NULL,                                    /* init thread */
+  NULL,                                    /* exit thread */
+  NULL,                                    /* exit process */
+  NULL,                                    /* exit master */
+  NGX_MODULE_V1_PADDING
+};
+
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+
+/* the headers that carry the status of a call */
+
+static ngx_uint_t
+ngx_http_protobuf_grpc_web_status(ngx_str_t *key)
+{
+  static ngx_str_t  names[] = {
+    ngx_string("grpc-status"),
+    ngx_string("grpc-message"),
+    ngx_string("grpc-status-details-bin")
+  };
+  ngx_uint_t        i;
+
+  for (i = 0; i < sizeof(names) / sizeof(ngx_str_t); i++) {
+    if (key->len == names[i].len
+        && ngx_strncasecmp(key->data, names[i].data, key->len) == 0)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static ngx_int_t
+ngx_http_protobuf_grpc_web_header_filter(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_grpc_web_ctx_t  *ctx;
+  ngx_list_part_t                   *part;
+  ngx_table_elt_t                   *h;
+  ngx_table_elt_t                  **t;
+  ngx_uint_t                         i;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_grpc_web_module);
+
+  /* errors of nginx's own are left for the browser to map */
+
+  if (ctx == NULL
+      || r != r->main
+      || r->headers_out.status != NGX_HTTP_OK
+      || r->header_only)
+  {
+    return ngx_http_next_header_filter(r);
+  }
+
+  if (ngx_array_init(&ctx->trailers, r->pool, 2, sizeof(ngx_table_elt_t *))
+      != NGX_OK)
+  {
+    return NGX_ERROR;
+  }
+
+  /* a trailers-only response has its status among the headers */
+
+  part = &r->headers_out.headers.part;
+  h = part->elts;
+
+  for (i = 0; /* void */ ; i++) {
+
+    if (i >= part->nelts) {
+      if (part->next == NULL) {
+        break;
+      }
+
+      part = part->next;
+      h = part->elts;
+      i = 0;
+    }
+
+    if (h[i].hash == 0 || !ngx_http_protobuf_grpc_web_status(&h[i].key)) {
+      continue;
+    }
+
+    t = ngx_array_push(&ctx->trailers);
+    if (t == NULL) {
+      return NGX_ERROR;
+    }
+
+    *t = &h[i];
+    h[i].hash = 0;
+  }
+
+  /* set by ngx_pcalloc():
+   *
+   *   ctx->nprefix = 0;
+   *   ctx->rest = 0;
+   *   ctx->ncarry = 0;
+   *   ctx->out = NULL;
+   *   ctx->buf = NULL;
+   */
+
+  ctx->last_out = &ctx->out;
+  ctx->transcode = 1;
+
+  if (ctx->text) {
+    r->filter_need_in_memory = 1;
+    ngx_str_set(&r->headers_out.content_type,
+                "application/grpc-web-text+proto");
+
+  } else {
+    ngx_str_set(&r->headers_out.content_type, "application/grpc-web+proto");
+  }
+
+  r->headers_out.content_type_len = r->headers_out.content_type.len;
+  r->headers_out.content_type_lowcase = NULL;
+
+  /* the trailers go into the body */
+
+  r->expect_trailers = 0;
+
+  ngx_http_clear_content_length(r);
+  ngx_http_clear_accept_ranges(r);
+
+  return ngx_http_next_header_filter(r);
+}
+
+/* room for at least len bytes in the current output buffer */
+
+static ngx_int_t
+ngx_http_protobuf_grpc_web_reserve(ngx_http_request_t *r,
+                                   ngx_http_protobuf_grpc_web_ctx_t *ctx,
+                                   size_t len)
+{
+  ngx_chain_t  *cl;
+  ngx_buf_t    *b;
+
+  if (ctx->buf != NULL && (size_t) (ctx->buf->end - ctx->buf->last) >= len) {
+    return NGX_OK;
+  }
+
+  cl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+  if (cl == NULL) {
+    return NGX_ERROR;
+  }
+
+  b = cl->buf;
+
+  if (b->start == NULL) {
+    b->start = ngx_palloc(r->pool, ngx_pagesize);
+    if (b->start == NULL) {
+      return NGX_ERROR;
+    }
+
+    b->pos = b->start;
+    b->last = b->start;
+    b->end = b->start + ngx_pagesize;
+    b->tag = (ngx_buf_tag_t) &ngx_http_protobuf_grpc_web_module;
+    b->temporary = 1;
+  }
+
+  *ctx->last_out = cl;
+  ctx->last_out = &cl->next;
+  ctx->buf = b;
+
+  return NGX_OK;
+}
+
+/* encodes len bytes of the stream.  whole groups of three are encoded
+ * as they come, and the bytes left over wait in the carry until more
+ * follow, or until the end of the frame pads them.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_grpc_web_encode(ngx_http_request_t *r,
+                                  ngx_http_protobuf_grpc_web_ctx_t *ctx,
+                                  u_char *p,
+                                  size_t len)
+{
+  size_t  n;
+
+  while (ctx->ncarry > 0 && ctx->ncarry < 3 && len > 0) {
+    ctx->carry[ctx->ncarry++] = *p++;
+    len--;
+  }
+
+  if (ctx->ncarry == 3) {
+    if (ngx_http_protobuf_grpc_web_reserve(r, ctx, 4) != NGX_OK) {
+      return NGX_ERROR;
+    }
+
+    ctx->buf->last = ngx_protobuf_base64_encode(ctx->buf->last,
+                                                ctx->carry, 3);
+    ctx->ncarry = 0;
+  }
+
+  while (len >= 3) {
+    if (ngx_http_protobuf_grpc_web_reserve(r, ctx, 4) != NGX_OK) {
+      return NGX_ERROR;
+    }
+
+    n = (ctx->buf->end - ctx->buf->last) / 4 * 3;
+    if (n > len / 3 * 3) {
+      n = len / 3 * 3;
+    }
+
+    ctx->buf->last = ngx_protobuf_base64_encode(ctx->buf->last, p, n);
+    p += n;
+    len -= n;
+  }
+
+  while (len > 0) {
+    ctx->carry[ctx->ncarry++] = *p++;
+    len--;
+  }
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_protobuf_grpc_web_pad(ngx_http_request_t *r,
+                               ngx_http_protobuf_grpc_web_ctx_t *ctx)
+{
+  if (ctx->ncarry == 0) {
+    return NGX_OK;
+  }
+
+  if (ngx_http_protobuf_grpc_web_reserve(r, ctx, 4) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  ctx->buf->last = ngx_protobuf_base64_encode(ctx->buf->last,
+                                              ctx->carry, ctx->ncarry);
+  ctx->ncarry = 0;
+
+  return NGX_OK;
+}
+
+/* encodes a piece of the response, following the frames through it
+ * to pad at the end of each.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_grpc_web_frames(ngx_http_request_t *r,
+                                  ngx_http_protobuf_grpc_web_ctx_t *ctx,
+                                  u_char *p,
+                                  u_char *last)
+{
+  size_t  n;
+  u_char *q;
+
+  while (p < last) {
+
+    if (ctx->nprefix < NGX_HTTP_PROTOBUF_GRPC_WEB_PREFIX) {
+      ctx->prefix[ctx->nprefix++] = *p;
+
+      if (ngx_http_protobuf_grpc_web_encode(r, ctx, p, 1) != NGX_OK) {
+        return NGX_ERROR;
+      }
+
+      p++;
+
+      if (ctx->nprefix < NGX_HTTP_PROTOBUF_GRPC_WEB_PREFIX) {
+        continue;
+      }
+
+      q = ctx->prefix;
+      ctx->rest = ((size_t) q[1] << 24) | ((size_t) q[2] << 16)
+                  | ((size_t) q[3] << 8) | q[4];
+
+    } else {
+      n = ngx_min((size_t) (last - p), ctx->rest);
+
+      if (ngx_http_protobuf_grpc_web_encode(r, ctx, p, n) != NGX_OK) {
+        return NGX_ERROR;
+      }
+
+      p += n;
+      ctx->rest -= n;
+    }
+
+    if (ctx->rest == 0) {
+      ctx->nprefix = 0;
+
+      if (ngx_http_protobuf_grpc_web_pad(r, ctx) != NGX_OK) {
+        return NGX_ERROR;
+      }
+    }
+  }
+
+  return NGX_OK;
+}
+
+/* the trailer frame: the status headers of a trailers-only response and
+ * the trailers, as "name:value\r\n" lines with lowercase names.  the
+ * trailers are taken out of the list, so that the HTTP/2 and chunked
+ * filters do not send them again.
+ */
+
+static ngx_buf_t *
+ngx_http_protobuf_grpc_web_trailers(ngx_http_request_t *r,
+                                    ngx_http_protobuf_grpc_web_ctx_t *ctx)
+{
+  ngx_list_part_t   *part;
+  ngx_table_elt_t   *h;
+  ngx_table_elt_t  **t;
+  ngx_buf_t         *b;
+  ngx_uint_t         i;
+  size_t             len;
+  u_char            *p;
+
+  part = &r->headers_out.trailers.part;
+  h = part->elts;
+
+  for (i = 0; /* void */ ; i++) {
+
+    if (i >= part->nelts) {
+      if (part->next == NULL) {
+        break;
+      }
+
+      part = part->next;
+      h = part->elts;
+      i = 0;
+    }
+
+    if (h[i].hash == 0) {
+      continue;
+    }
+
+    t = ngx_array_push(&ctx->trailers);
+    if (t == NULL) {
+      return NULL;
+    }
+
+    *t = &h[i];
+    h[i].hash = 0;
+  }
+
+  t = ctx->trailers.elts;
+
+  len = 0;
+  for (i = 0; i < ctx->trailers.nelts; i++) {
+    len += t[i]->key.len + sizeof(":") - 1 + t[i]->value.len
+           + sizeof(CRLF) - 1;
+  }
+
+  b = ngx_create_temp_buf(r->pool, NGX_HTTP_PROTOBUF_GRPC_WEB_PREFIX + len);
+  if (b == NULL) {
+    return NULL;
+  }
+
+  p = b->last;
+  *p++ = NGX_HTTP_PROTOBUF_GRPC_WEB_TRAILERS;
+  *p++ = (u_char) (len >> 24);
+  *p++ = (u_char) (len >> 16);
+  *p++ = (u_char) (len >> 8);
+  *p++ = (u_char) len;
+
+  for (i = 0; i < ctx->trailers.nelts; i++) {
+    ngx_strlow(p, t[i]->key.data, t[i]->key.len);
+    p += t[i]->key.len;
+    *p++ = ':';
+    p = ngx_cpymem(p, t[i]->value.data, t[i]->value.len);
+    *p++ = CR; *p++ = LF;
+  }
+
+  b->last = p;
+
+  return b;
+}
+
+static ngx_int_t
+ngx_http_protobuf_grpc_web_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+  ngx_http_protobuf_grpc_web_ctx_t  *ctx;
+  ngx_chain_t                       *cl;
+  ngx_chain_t                       *out;
+  ngx_buf_t                         *b;
+  ngx_buf_t                         *tb;
+  ngx_uint_t                         flush, last;
+  ngx_int_t                          rc;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_grpc_web_module);
+
+  if (ctx == NULL || !ctx->transcode) {
+    return ngx_http_next_body_filter(r, in);
+  }
+
+  flush = 0;
+  last = 0;
+
+  for (cl = in; cl; cl = cl->next) {
+    b = cl->buf;
+
+    tb = NULL;
+
+    if (b->last_buf) {
+      tb = ngx_http_protobuf_grpc_web_trailers(r, ctx);
+      if (tb == NULL) {
+        return NGX_ERROR;
+      }
+
+      last = 1;
+    }
+
+    if (ctx->text) {
+      if (ngx_http_protobuf_grpc_web_frames(r, ctx, b->pos, b->last)
+          != NGX_OK)
+      {
+        return NGX_ERROR;
+      }
+
+      b->pos = b->last;
+
+      if (tb != NULL) {
+        if (ngx_http_protobuf_grpc_web_frames(r, ctx, tb->pos, tb->last)
+            != NGX_OK)
+        {
+          return NGX_ERROR;
+        }
+
+        /* a response cut short in the middle of a frame */
+
+        if (ngx_http_protobuf_grpc_web_pad(r, ctx) != NGX_OK) {
+          return NGX_ERROR;
+        }
+      }
+
+      if (b->flush) {
+        flush = 1;
+      }
+
+      continue;
+    }
+
+    /* the binary mode passes the frames on as they are */
+
+    if (tb != NULL) {
+      b->last_buf = 0;
+      b->sync = (ngx_buf_size(b) == 0);
+    }
+
+    out = ngx_alloc_chain_link(r->pool);
+    if (out == NULL) {
+      return NGX_ERROR;
+    }
+
+    out->buf = b;
+    *ctx->last_out = out;
+    ctx->last_out = &out->next;
+
+    if (tb != NULL) {
+      tb->last_buf = 1;
+
+      out = ngx_alloc_chain_link(r->pool);
+      if (out == NULL) {
+        return NGX_ERROR;
+      }
+
+      out->buf = tb;
+      *ctx->last_out = out;
+      ctx->last_out = &out->next;
+    }
+  }
+
+  if (ctx->text && (flush || last)) {
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+      return NGX_ERROR;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+      return NGX_ERROR;
+    }
+
+    b->flush = flush;
+    b->last_buf = last;
+
+    cl->buf = b;
+    *ctx->last_out = cl;
+    ctx->last_out = &cl->next;
+  }
+
+  *ctx->last_out = NULL;
+
+  out = ctx->out;
+
+  ctx->out = NULL;
+  ctx->last_out = &ctx->out;
+  ctx->buf = NULL;
+
+  if (out == NULL && ctx->busy == NULL) {
+    return NGX_OK;
+  }
+
+  rc = ngx_http_next_body_filter(r, out);
+
+  ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &out,
+                          (ngx_buf_tag_t) &ngx_http_protobuf_grpc_web_module);
+
+  return rc;
+}
+
+/* turns the request into a gRPC one.  the content type loses its
+ * "-web" or "-web-text" (keeping any "+proto" after it); text bodies
+ * are read, and decoded in the body handler.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_grpc_web_handler(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_grpc_web_loc_conf_t  *pglcf;
+  ngx_http_protobuf_grpc_web_ctx_t       *ctx;
+  ngx_table_elt_t                        *h;
+  ngx_uint_t                              text;
+  size_t                                  skip;
+  u_char                                 *p;
+
+  if (r != r->main || !(r->method & NGX_HTTP_POST)) {
+    return NGX_DECLINED;
+  }
+
+  pglcf = ngx_http_get_module_loc_conf(r, ngx_http_protobuf_grpc_web_module);
+
+  if (!pglcf->enable) {
+    return NGX_DECLINED;
+  }
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_grpc_web_module);
+
+  if (ctx != NULL) {
+    return ngx_http_protobuf_read_body(r, &ctx->body,
+                                       ngx_http_protobuf_grpc_web_body_handler);
+  }
+
+  h = r->headers_in.content_type;
+
+  if (h == NULL
+      || h->value.len < sizeof("application/grpc-web") - 1
+      || ngx_strncasecmp(h->value.data, (u_char *) "application/grpc-web",
+                         sizeof("application/grpc-web") - 1) != 0)
+  {
+    return NGX_DECLINED;
+  }
+
+  skip = sizeof("application/grpc-web") - 1;
+  text = 0;
+
+  if (h->value.len >= sizeof("application/grpc-web-text") - 1
+      && ngx_strncasecmp(h->value.data + skip, (u_char *) "-text",
+                         sizeof("-text") - 1) == 0)
+  {
+    skip += sizeof("-text") - 1;
+    text = 1;
+  }
+
+  p = ngx_pnalloc(r->pool, sizeof("application/grpc") - 1
+                           + h->value.len - skip);
+  if (p == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  h->value.len = ngx_cpymem(ngx_cpymem(p, "application/grpc",
+                                       sizeof("application/grpc") - 1),
+                            h->value.data + skip, h->value.len - skip)
+                 - p;
+  h->value.data = p;
+
+  ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_protobuf_grpc_web_ctx_t));
+  if (ctx == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  ngx_http_set_ctx(r, ctx, ngx_http_protobuf_grpc_web_module);
+
+  ctx->text = text;
+
+  if (!text) {
+    ctx->body.done = 1;
+    return NGX_DECLINED;
+  }
+
+  return ngx_http_protobuf_read_body(r, &ctx->body,
+                                     ngx_http_protobuf_grpc_web_body_handler);
+}
+
+/* decodes a piece of a text body at ctx->decoded.  characters are
+ * decoded four at a time, and up to three wait in the carry for the
+ * rest of their group.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_grpc_web_decode(void *data, u_char *p, u_char *last)
+{
+  ngx_http_protobuf_grpc_web_ctx_t  *ctx = data;
+  size_t                             n;
+
+  while (ctx->ncarry > 0 && ctx->ncarry < 4 && p < last) {
+    ctx->carry[ctx->ncarry++] = *p++;
+  }
+
+  if (ctx->ncarry == 4) {
+    ctx->decoded = ngx_protobuf_base64_decode(ctx->decoded, ctx->carry, 4);
+    if (ctx->decoded == NULL) {
+      return NGX_DECLINED;
+    }
+
+    ctx->ncarry = 0;
+  }
+
+  n = (last - p) / 4 * 4;
+
+  ctx->decoded = ngx_protobuf_base64_decode(ctx->decoded, p, n);
+  if (ctx->decoded == NULL) {
+    return NGX_DECLINED;
+  }
+
+  for (p += n; p < last; p++) {
+    ctx->carry[ctx->ncarry++] = *p;
+  }
+
+  return NGX_OK;
+}
+
+/* replaces a text body with the frames it encodes. */
+
+static ngx_int_t
+ngx_http_protobuf_grpc_web_request_body(ngx_http_request_t *r,
+                                        ngx_http_protobuf_grpc_web_ctx_t *ctx)
+{
+  ngx_http_request_body_t  *rb = r->request_body;
+  ngx_chain_t              *cl;
+  ngx_buf_t                *b;
+  u_char                   *start;
+  u_char                   *p;
+  size_t                    len;
+  ngx_int_t                 rc;
+
+  if (rb == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  len = 0;
+  for (cl = rb->bufs; cl; cl = cl->next) {
+    b = cl->buf;
+    len += b->in_file ? (size_t) (b->file_last - b->file_pos)
+                      : (size_t) (b->last - b->pos);
+  }
+
+  start = ngx_pnalloc(r->pool, len / 4 * 3 + 3);
+  if (start == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  ctx->decoded = start;
+
+  rc = ngx_protobuf_read_chain(rb->bufs, r->pool,
+                               ngx_http_protobuf_grpc_web_decode, ctx);
+  if (rc == NGX_ERROR) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  if (rc != NGX_OK) {
+    return NGX_HTTP_BAD_REQUEST;
+  }
+
+  p = ctx->decoded;
+
+  if (ctx->ncarry != 0) {
+    return NGX_HTTP_BAD_REQUEST;
+  }
+
+  b = ngx_calloc_buf(r->pool);
+  if (b == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  b->start = start;
+  b->pos = start;
+  b->last = p;
+  b->end = p;
+  b->temporary = (p > start);
+  b->last_buf = 1;
+
+  cl = ngx_alloc_chain_link(r->pool);
+  if (cl == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  cl->buf = b;
+  cl->next = NULL;
+
+  rb->bufs = cl;
+
+  r->headers_in.content_length_n = p - start;
+
+  if (r->headers_in.content_length) {
+    p = ngx_pnalloc(r->pool, NGX_OFF_T_LEN);
+    if (p == NULL) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_in.content_length->value.data = p;
+    r->headers_in.content_length->value.len =
+      ngx_sprintf(p, "%O", r->headers_in.content_length_n) - p;
+  }
+
+  return NGX_OK;
+}
+
+static void
+ngx_http_protobuf_grpc_web_body_handler(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_grpc_web_ctx_t  *ctx;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_grpc_web_module);
+
+  ngx_http_protobuf_body_done(r, &ctx->body,
+                              ngx_http_protobuf_grpc_web_request_body(r, ctx));
+}
+
+static ngx_int_t
+ngx_http_protobuf_grpc_web_init(ngx_conf_t *cf)
+{
+  ngx_http_handler_pt        *h;
+  ngx_http_core_main_conf_t  *cmcf;
+
+  cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+  h = ngx_array_push(&cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
+  if (h == NULL) {
+    return NGX_ERROR;
+  }
+
+  *h = ngx_http_protobuf_grpc_web_handler;
+
+  ngx_http_next_header_filter = ngx_http_top_header_filter;
+  ngx_http_top_header_filter = ngx_http_protobuf_grpc_web_header_filter;
+
+  ngx_http_next_body_filter = ngx_http_top_body_filter;
+  ngx_http_top_body_filter = ngx_http_protobuf_grpc_web_body_filter;
+
+  return NGX_OK;
+}
+
+static void *
+ngx_http_protobuf_grpc_web_create_loc_conf(ngx_conf_t *cf)
+{
+  ngx_http_protobuf_grpc_web_loc_conf_t  *conf;
+
+  conf = ngx_palloc(cf->pool, sizeof(ngx_http_protobuf_grpc_web_loc_conf_t));
+  if (conf == NULL) {
+    return NULL;
+  }
+
+  conf->enable = NGX_CONF_UNSET;
+
+  return conf;
+}
+
+static char *
+ngx_http_protobuf_grpc_web_merge_loc_conf(ngx_conf_t *cf,
+                                          void *parent,
+                                          void *child)
+{
+  ngx_http_protobuf_grpc_web_loc_conf_t  *prev = parent;
+  ngx_http_protobuf_grpc_web_loc_conf_t  *conf = child;
+
+  ngx_conf_merge_value(conf->enable, prev->enable, 0);
+
+  return NGX_CONF_OK;
+}
@@ -0,0 +1,1356 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_protobuf.h>
+#include <ngx_http_protobuf.h>
+#include <math.h>
+
+/* transcoding between JSON and protobuf.  JSON request bodies are
+ * turned into protobuf before they are passed on (see
+ * ngx_protobuf_json_parse), and protobuf responses into JSON.
+ *
+ * responses are transcoded by a body filter.  the response is parsed
+ * as it streams through, across buffer boundaries, and JSON is written
+ * as soon as each value has been read, following the generated
+ * message, field and enum descriptors.  output goes into buffers of
+ * protobuf_json_buffer_size bytes, which are passed on as they fill
+ * up, so no response is ever held in full.  the header is held back
+ * until the first buffer is passed on.
+ *
+ * the proto3 JSON mapping is followed where it can be without looking
+ * ahead: fields are named by their json_name, enums by their value
+ * names, 64-bit integers are quoted, and bytes are base64 encoded.
+ * the elements of a repeated field become an array, which needs them
+ * to be contiguous, as protobuf serializers write them.  a field that
+ * comes back after other fields, such as in messages concatenated to
+ * merge them, would need the output to be held; such a response is
+ * rejected instead, with a 502 if nothing has been sent yet.
+ */
+
+#define NGX_HTTP_PROTOBUF_JSON_MAX_DEPTH  32
+
+#define NGX_HTTP_PROTOBUF_JSON_TAG        0
+#define NGX_HTTP_PROTOBUF_JSON_SCALAR     1
+#define NGX_HTTP_PROTOBUF_JSON_LENGTH     2
+#define NGX_HTTP_PROTOBUF_JSON_STRING     3
+#define NGX_HTTP_PROTOBUF_JSON_BYTES      4
+#define NGX_HTTP_PROTOBUF_JSON_SKIP       5
+
+typedef struct {
+  ngx_protobuf_message_descriptor_t  *message;
+  ngx_protobuf_message_descriptor_t  *request;
+  size_t                              buffer_size;
+} ngx_http_protobuf_json_loc_conf_t;
+
+typedef struct {
+  ngx_protobuf_message_descriptor_t  *desc;
+  off_t                               end;
+  ngx_protobuf_field_descriptor_t    *open;      /* repeated field */
+  ngx_uint_t                          nelts;
+  ngx_uint_t                          nmembers;
+  u_char                             *seen;      /* bit per field slot */
+  size_t                              nseen;
+} ngx_http_protobuf_json_level_t;
+
+typedef struct {
+  ngx_uint_t                          state;
+  ngx_protobuf_field_descriptor_t    *field;     /* NULL if skipped */
+  ngx_uint_t                          wire;
+  u_char                              scalar[10];
+  ngx_uint_t                          nscalar;
+  ngx_uint_t                          need;      /* fixed width, or 0 */
+  uint64_t                            rest;
+  off_t                               packed;    /* end of packed run */
+  u_char                              carry[3];
+  ngx_uint_t                          ncarry;
+  ngx_uint_t                          groups;
+
+  off_t                               offset;
+  ngx_uint_t                          depth;
+  ngx_http_protobuf_json_level_t      level[NGX_HTTP_PROTOBUF_JSON_MAX_DEPTH];
+
+  ngx_chain_t                        *out;
+  ngx_chain_t                       **last_out;
+  ngx_buf_t                          *buf;
+  ngx_chain_t                        *free;
+  ngx_chain_t                        *busy;
+  size_t                              buffer_size;
+  ngx_http_protobuf_body_t            body;
+  unsigned                            transcode:1;
+  unsigned                            started:1;
+  unsigned                            header_sent:1;
+} ngx_http_protobuf_json_ctx_t;
+
+static ngx_int_t ngx_http_protobuf_json_init(ngx_conf_t *cf);
+static void *ngx_http_protobuf_json_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_protobuf_json_merge_loc_conf(ngx_conf_t *cf,
+                                                   void *parent,
+                                                   void *child);
+static char *ngx_http_protobuf_json(ngx_conf_t *cf,
+                                    ngx_command_t *cmd,
+                                    void *conf);
+static void ngx_http_protobuf_json_body_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_protobuf_json_enter(ngx_http_request_t *r,
+    ngx_http_protobuf_json_level_t *level,
+    ngx_protobuf_message_descriptor_t *desc);
+
+static ngx_command_t ngx_http_protobuf_json_commands[] = {
+
+  { ngx_string("protobuf_json"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_http_protobuf_json,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_protobuf_json_loc_conf_t, message),
+    NULL },
+
+  { ngx_string("protobuf_json_request"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_http_protobuf_json,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_protobuf_json_loc_conf_t, request),
+    NULL },
+
+  { ngx_string("protobuf_json_buffer_size"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_size_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_protobuf_json_loc_conf_t, buffer_size),
+    NULL },
+
+  ngx_null_command
+};
+
+static ngx_http_module_t ngx_http_protobuf_json_module_ctx = {
+  NULL,                                    /* preconfiguration */
+  ngx_http_protobuf_json_init,             /* postconfiguration */
+  NULL,                                    /* create main configuration */
+  NULL,                                    /* init main configuration */
+  NULL,                                    /* create server configuration */
+  NULL,                                    /* merge server configuration */
+  ngx_http_protobuf_json_create_loc_conf,  /* create location configuration */
+  ngx_http_protobuf_json_merge_loc_conf    /* merge location configuration */
+};
+
+ngx_module_t ngx_http_protobuf_json_module = {
+  NGX_MODULE_V1,
+  &ngx_http_protobuf_json_module_ctx,  /* module context */
+  ngx_http_protobuf_json_commands,     /* module directives */
+  NGX_HTTP_MODULE,                     /* module type */
+  NULL,                                /* init master */
+  NULL,                                /* init module */
+  NULL,                                /* init process */
+  NULL,                                /* init thread */
+  NULL,                                /* exit thread */
+  NULL,                                /* exit process */
+  NULL,                                /* exit master */
+  NGX_MODULE_V1_PADDING
+};
+
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+
+static ngx_int_t
+ngx_http_protobuf_json_header_filter(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_json_loc_conf_t  *plcf;
+  ngx_http_protobuf_json_ctx_t       *ctx;
+
+  plcf = ngx_http_get_module_loc_conf(r, ngx_http_protobuf_json_module);
+
+  if (plcf->message == NULL
+      || r->headers_out.status != NGX_HTTP_OK
+      || r->header_only)
+  {
+    return ngx_http_next_header_filter(r);
+  }
+
+  /* the context may have been created for the request body */
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_json_module);
+
+  if (ctx == NULL) {
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_protobuf_json_ctx_t));
+    if (ctx == NULL) {
+      return NGX_ERROR;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_protobuf_json_module);
+  }
+
+  /* set by ngx_pcalloc():
+   *
+   *   ctx->state = NGX_HTTP_PROTOBUF_JSON_TAG;
+   *   ctx->depth = 0;
+   *   ctx->out = NULL;
+   *   ctx->buf = NULL;
+   *   ctx->started = 0;
+   *   ctx->header_sent = 0;
+   */
+
+  if (ngx_http_protobuf_json_enter(r, &ctx->level[0], plcf->message)
+      != NGX_OK)
+  {
+    return NGX_ERROR;
+  }
+
+  ctx->last_out = &ctx->out;
+  ctx->buffer_size = plcf->buffer_size;
+  ctx->transcode = 1;
+
+  r->filter_need_in_memory = 1;
+
+  ngx_str_set(&r->headers_out.content_type, "application/json");
+  r->headers_out.content_type_len = r->headers_out.content_type.len;
+  r->headers_out.content_type_lowcase = NULL;
+
+  ngx_http_clear_content_length(r);
+  ngx_http_clear_accept_ranges(r);
+  ngx_http_weak_etag(r);
+
+  /* the header is sent by the body filter, so that a response that
+   * cannot be transcoded can still become a 502.
+   */
+
+  return NGX_OK;
+}
+
+/* starts a message at a nesting level.  the bitmap of the fields seen
+ * is kept with the level and reused, so it only grows to the largest
+ * message at that depth.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_json_enter(ngx_http_request_t *r,
+                             ngx_http_protobuf_json_level_t *level,
+                             ngx_protobuf_message_descriptor_t *desc)
+{
+  size_t  n;
+
+  n = (desc->nfields + 7) / 8;
+
+  if (n > level->nseen) {
+    level->seen = ngx_palloc(r->pool, n);
+    if (level->seen == NULL) {
+      return NGX_ERROR;
+    }
+
+    level->nseen = n;
+  }
+
+  ngx_memzero(level->seen, n);
+
+  level->desc = desc;
+  level->open = NULL;
+  level->nmembers = 0;
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_protobuf_json_write(ngx_http_request_t *r,
+                             ngx_http_protobuf_json_ctx_t *ctx,
+                             u_char *p,
+                             size_t len)
+{
+  ngx_chain_t  *cl;
+  ngx_buf_t    *b;
+  size_t        n;
+
+  while (len > 0) {
+    if (ctx->buf == NULL || ctx->buf->last == ctx->buf->end) {
+      cl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+      if (cl == NULL) {
+        return NGX_ERROR;
+      }
+
+      b = cl->buf;
+
+      if (b->start == NULL) {
+        b->start = ngx_palloc(r->pool, ctx->buffer_size);
+        if (b->start == NULL) {
+          return NGX_ERROR;
+        }
+
+        b->pos = b->start;
+        b->last = b->start;
+        b->end = b->start + ctx->buffer_size;
+        b->tag = (ngx_buf_tag_t) &ngx_http_protobuf_json_module;
+        b->temporary = 1;
+      }
+
+      *ctx->last_out = cl;
+      ctx->last_out = &cl->next;
+      ctx->buf = b;
+    }
+
+    n = ctx->buf->end - ctx->buf->last;
+    if (n > len) {
+      n = len;
+    }
+
+    ctx->buf->last = ngx_cpymem(ctx->buf->last, p, n);
+    p += n;
+    len -= n;
+  }
+
+  return NGX_OK;
+}
+
+#define ngx_http_protobuf_json_literal(r, ctx, s)                        \
+  ngx_http_protobuf_json_write(r, ctx, (u_char *) s, sizeof(s) - 1)
+
+/* closes the array of the repeated field that was last seen */
+
+static ngx_int_t
+ngx_http_protobuf_json_close(ngx_http_request_t *r,
+                             ngx_http_protobuf_json_ctx_t *ctx)
+{
+  ngx_http_protobuf_json_level_t  *level = &ctx->level[ctx->depth];
+
+  if (level->open == NULL) {
+    return NGX_OK;
+  }
+
+  level->open = NULL;
+
+  return ngx_http_protobuf_json_literal(r, ctx, "]");
+}
+
+/* writes the name of a member, or the separator between two elements
+ * of the same repeated field.  a member that was already written is
+ * declined, since JSON member names have to be unique.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_json_member(ngx_http_request_t *r,
+                              ngx_http_protobuf_json_ctx_t *ctx,
+                              ngx_protobuf_field_descriptor_t *field,
+                              ngx_uint_t slot)
+{
+  ngx_http_protobuf_json_level_t  *level = &ctx->level[ctx->depth];
+  u_char                           bit;
+
+  if (level->open == field) {
+    return NGX_OK;
+  }
+
+  bit = (u_char) (1 << (slot % 8));
+
+  if (level->seen[slot / 8] & bit) {
+    return NGX_DECLINED;
+  }
+
+  level->seen[slot / 8] |= bit;
+
+  if (ngx_http_protobuf_json_close(r, ctx) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  if (level->nmembers++ > 0
+      && ngx_http_protobuf_json_literal(r, ctx, ",") != NGX_OK)
+  {
+    return NGX_ERROR;
+  }
+
+  if (ngx_http_protobuf_json_literal(r, ctx, "\"") != NGX_OK
+      || ngx_http_protobuf_json_write(r, ctx, field->json_name.data,
+                                      field->json_name.len) != NGX_OK
+      || ngx_http_protobuf_json_literal(r, ctx, "\":") != NGX_OK)
+  {
+    return NGX_ERROR;
+  }
+
+  if (field->label == NGX_PROTOBUF_LABEL_REPEATED) {
+    level->open = field;
+    level->nelts = 0;
+    return ngx_http_protobuf_json_literal(r, ctx, "[");
+  }
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_protobuf_json_element(ngx_http_request_t *r,
+                               ngx_http_protobuf_json_ctx_t *ctx)
+{
+  ngx_http_protobuf_json_level_t  *level = &ctx->level[ctx->depth];
+
+  if (level->open != NULL && level->nelts++ > 0) {
+    return ngx_http_protobuf_json_literal(r, ctx, ",");
+  }
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_protobuf_json_scalar(ngx_http_request_t *r,
+                              ngx_http_protobuf_json_ctx_t *ctx)
+{
+  ngx_protobuf_field_descriptor_t  *field = ctx->field;
+  ngx_str_t                        *name;
+  u_char                            buf[64], *p, *pos, *end;
+  uint64_t                          u64;
+  int64_t                           i64;
+  uint32_t                          u32;
+  int32_t                           i32;
+  float                             f;
+  double                            d;
+  ngx_int_t                         rc;
+
+  pos = ctx->scalar;
+  end = ctx->scalar + ctx->nscalar;
+  p = buf;
+
+  switch (field->type) {
+  case NGX_PROTOBUF_TYPE_BOOL:
+    rc = ngx_protobuf_read_uint64(&pos, end, &u64);
+    p = ngx_cpymem(p, u64 ? "true" : "false", u64 ? 4 : 5);
+    break;
+  case NGX_PROTOBUF_TYPE_ENUM:
+    rc = ngx_protobuf_read_uint64(&pos, end, &u64);
+    name = ngx_protobuf_enum_name(field->enum_type, (int32_t) u64);
+    if (name != NULL) {
+      /* value names are identifiers, and need no escaping */
+      if (ngx_http_protobuf_json_element(r, ctx) != NGX_OK
+          || ngx_http_protobuf_json_literal(r, ctx, "\"") != NGX_OK
+          || ngx_http_protobuf_json_write(r, ctx, name->data,
+                                          name->len) != NGX_OK
+          || ngx_http_protobuf_json_literal(r, ctx, "\"") != NGX_OK)
+      {
+        return NGX_ERROR;
+      }
+      return rc;
+    }
+    p = ngx_sprintf(p, "%D", (int32_t) u64);
+    break;
+  case NGX_PROTOBUF_TYPE_INT32:
+    rc = ngx_protobuf_read_uint64(&pos, end, &u64);
+    p = ngx_sprintf(p, "%D", (int32_t) u64);
+    break;
+  case NGX_PROTOBUF_TYPE_UINT32:
+    rc = ngx_protobuf_read_uint64(&pos, end, &u64);
+    p = ngx_sprintf(p, "%uD", (uint32_t) u64);
+    break;
+  case NGX_PROTOBUF_TYPE_SINT32:
+    rc = ngx_protobuf_read_sint32(&pos, end, &i32);
+    p = ngx_sprintf(p, "%D", i32);
+    break;
+  case NGX_PROTOBUF_TYPE_FIXED32:
+    rc = ngx_protobuf_read_fixed32(&pos, end, &u32);
+    p = ngx_sprintf(p, "%uD", u32);
+    break;
+  case NGX_PROTOBUF_TYPE_SFIXED32:
+    rc = ngx_protobuf_read_sfixed32(&pos, end, &i32);
+    p = ngx_sprintf(p, "%D", i32);
+    break;
+  case NGX_PROTOBUF_TYPE_INT64:
+    rc = ngx_protobuf_read_uint64(&pos, end, &u64);
+    p = ngx_sprintf(p, "\"%L\"", (int64_t) u64);
+    break;
+  case NGX_PROTOBUF_TYPE_UINT64:
+    rc = ngx_protobuf_read_uint64(&pos, end, &u64);
+    p = ngx_sprintf(p, "\"%uL\"", u64);
+    break;
+  case NGX_PROTOBUF_TYPE_SINT64:
+    rc = ngx_protobuf_read_sint64(&pos, end, &i64);
+    p = ngx_sprintf(p, "\"%L\"", i64);
+    break;
+  case NGX_PROTOBUF_TYPE_FIXED64:
+    rc = ngx_protobuf_read_fixed64(&pos, end, &u64);
+    p = ngx_sprintf(p, "\"%uL\"", u64);
+    break;
+  case NGX_PROTOBUF_TYPE_SFIXED64:
+    rc = ngx_protobuf_read_sfixed64(&pos, end, &i64);
+    p = ngx_sprintf(p, "\"%L\"", i64);
+    break;
+  case NGX_PROTOBUF_TYPE_FLOAT:
+  case NGX_PROTOBUF_TYPE_DOUBLE:
+    if (field->type == NGX_PROTOBUF_TYPE_FLOAT) {
+      rc = ngx_protobuf_read_float(&pos, end, &f);
+      d = f;
+    } else {
+      rc = ngx_protobuf_read_double(&pos, end, &d);
+    }
+
+    if (isnan(d)) {
+      p = ngx_cpymem(p, "\"NaN\"", 5);
+    } else if (isinf(d)) {
+      p = (d > 0) ? ngx_cpymem(p, "\"Infinity\"", 10)
+                  : ngx_cpymem(p, "\"-Infinity\"", 11);
+    } else {
+      /* ngx_sprintf() has no shortest round-trip format */
+      p += snprintf((char *) p, sizeof(buf),
+                    (field->type == NGX_PROTOBUF_TYPE_FLOAT) ? "%.9g"
+                                                             : "%.17g",
+                    d);
+    }
+    break;
+  default:
+    rc = NGX_ABORT;
+    break;
+  }
+
+  if (rc != NGX_OK) {
+    return NGX_ABORT;
+  }
+
+  if (ngx_http_protobuf_json_element(r, ctx) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  return ngx_http_protobuf_json_write(r, ctx, buf, p - buf);
+}
+
+/* writes string bytes, escaped as JSON requires.  strings are assumed
+ * to hold valid UTF-8, which is passed through.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_json_escape(ngx_http_request_t *r,
+                              ngx_http_protobuf_json_ctx_t *ctx,
+                              u_char *p,
+                              size_t len)
+{
+  static u_char   hex[] = "0123456789abcdef";
+  u_char         *run, *last, esc[6];
+  size_t          n;
+
+  last = p + len;
+
+  for (run = p; p < last; p++) {
+    if (*p >= 0x20 && *p != '"' && *p != '\\') {
+      continue;
+    }
+
+    if (ngx_http_protobuf_json_write(r, ctx, run, p - run) != NGX_OK) {
+      return NGX_ERROR;
+    }
+
+    esc[0] = '\\';
+    n = 2;
+
+    switch (*p) {
+    case '"':  esc[1] = '"';  break;
+    case '\\': esc[1] = '\\'; break;
+    case '\b': esc[1] = 'b';  break;
+    case '\f': esc[1] = 'f';  break;
+    case '\n': esc[1] = 'n';  break;
+    case '\r': esc[1] = 'r';  break;
+    case '\t': esc[1] = 't';  break;
+    default:
+      esc[1] = 'u';
+      esc[2] = '0';
+      esc[3] = '0';
+      esc[4] = hex[*p >> 4];
+      esc[5] = hex[*p & 0x0f];
+      n = 6;
+      break;
+    }
+
+    if (ngx_http_protobuf_json_write(r, ctx, esc, n) != NGX_OK) {
+      return NGX_ERROR;
+    }
+
+    run = p + 1;
+  }
+
+  return ngx_http_protobuf_json_write(r, ctx, run, p - run);
+}
+
+/* writes bytes in base64.  up to two bytes are carried over to the
+ * next call, so that only the last group of the value is padded.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_json_base64(ngx_http_request_t *r,
+                              ngx_http_protobuf_json_ctx_t *ctx,
+                              u_char *p,
+                              size_t len,
+                              ngx_uint_t final)
+{
+  u_char     out[1024];
+  ngx_str_t  src, dst;
+  size_t     n;
+
+  dst.data = out;
+
+  while (ctx->ncarry > 0 && ctx->ncarry < 3 && len > 0) {
+    ctx->carry[ctx->ncarry++] = *p++;
+    len--;
+  }
+
+  if (ctx->ncarry == 3 || (final && ctx->ncarry > 0)) {
+    src.data = ctx->carry;
+    src.len = ctx->ncarry;
+    ngx_encode_base64(&dst, &src);
+
+    if (ngx_http_protobuf_json_write(r, ctx, dst.data, dst.len) != NGX_OK) {
+      return NGX_ERROR;
+    }
+
+    ctx->ncarry = 0;
+  }
+
+  while (len > 0) {
+    n = ngx_min(len, sizeof(out) / 4 * 3);
+
+    if (n % 3 && !final) {
+      n -= n % 3;
+
+      if (n == 0) {
+        ngx_memcpy(ctx->carry, p, len);
+        ctx->ncarry = len;
+        break;
+      }
+    }
+
+    src.data = p;
+    src.len = n;
+    ngx_encode_base64(&dst, &src);
+
+    if (ngx_http_protobuf_json_write(r, ctx, dst.data, dst.len) != NGX_OK) {
+      return NGX_ERROR;
+    }
+
+    p += n;
+    len -= n;
+  }
+
+  return NGX_OK;
+}
+
+/* closes the messages that end at the current offset */
+
+static ngx_int_t
+ngx_http_protobuf_json_pop(ngx_http_request_t *r,
+                           ngx_http_protobuf_json_ctx_t *ctx)
+{
+  while (ctx->depth > 0 && ctx->offset >= ctx->level[ctx->depth].end) {
+    if (ctx->offset > ctx->level[ctx->depth].end) {
+      return NGX_ABORT;
+    }
+
+    if (ngx_http_protobuf_json_close(r, ctx) != NGX_OK
+        || ngx_http_protobuf_json_literal(r, ctx, "}") != NGX_OK)
+    {
+      return NGX_ERROR;
+    }
+
+    ctx->depth--;
+  }
+
+  return NGX_OK;
+}
+
+/* decides what to do with a field once its tag has been read */
+
+static ngx_int_t
+ngx_http_protobuf_json_field(ngx_http_request_t *r,
+                             ngx_http_protobuf_json_ctx_t *ctx)
+{
+  ngx_protobuf_message_descriptor_t  *desc;
+  ngx_protobuf_field_descriptor_t    *field;
+  ngx_uint_t                          slot;
+  uint32_t                            header;
+  ngx_int_t                           rc;
+  u_char                             *p;
+
+  p = ctx->scalar;
+  if (ngx_protobuf_read_uint32(&p, p + ctx->nscalar, &header) != NGX_OK) {
+    return NGX_ABORT;
+  }
+
+  ctx->wire = header & 0x07;
+  ctx->nscalar = 0;
+  ctx->field = NULL;
+
+  desc = ctx->level[ctx->depth].desc;
+  field = NULL;
+  slot = 0;
+
+  /* groups are skipped */
+  if (ctx->groups == 0 && ctx->wire != NGX_PROTOBUF_WIRETYPE_START_GROUP) {
+    slot = ngx_protobuf_field_slot(desc, header >> 3);
+    if (slot < desc->nfields) {
+      field = desc->fields[slot];
+    }
+  }
+
+  if (field != NULL
+      && ctx->wire != field->wire_type
+      && !(field->label == NGX_PROTOBUF_LABEL_REPEATED
+           && ctx->wire == NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED))
+  {
+    field = NULL;
+  }
+
+  if (field != NULL) {
+    ctx->field = field;
+
+    rc = ngx_http_protobuf_json_member(r, ctx, field, slot);
+    if (rc != NGX_OK) {
+      return rc;
+    }
+  }
+
+  ctx->packed = -1;
+
+  switch (ctx->wire) {
+  case NGX_PROTOBUF_WIRETYPE_VARINT:
+    ctx->state = NGX_HTTP_PROTOBUF_JSON_SCALAR;
+    ctx->need = 0;
+    break;
+  case NGX_PROTOBUF_WIRETYPE_FIXED64:
+    ctx->state = NGX_HTTP_PROTOBUF_JSON_SCALAR;
+    ctx->need = 8;
+    break;
+  case NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED:
+    ctx->state = NGX_HTTP_PROTOBUF_JSON_LENGTH;
+    break;
+  case NGX_PROTOBUF_WIRETYPE_START_GROUP:
+    if (++ctx->groups > NGX_PROTOBUF_MAX_GROUP_DEPTH) {
+      return NGX_ABORT;
+    }
+    break;
+  case NGX_PROTOBUF_WIRETYPE_END_GROUP:
+    if (ctx->groups-- == 0) {
+      return NGX_ABORT;
+    }
+    break;
+  case NGX_PROTOBUF_WIRETYPE_FIXED32:
+    ctx->state = NGX_HTTP_PROTOBUF_JSON_SCALAR;
+    ctx->need = 4;
+    break;
+  default:
+    return NGX_ABORT;
+  }
+
+  return NGX_OK;
+}
+
+/* starts on a length-delimited value once its length has been read */
+
+static ngx_int_t
+ngx_http_protobuf_json_value(ngx_http_request_t *r,
+                             ngx_http_protobuf_json_ctx_t *ctx,
+                             uint64_t len)
+{
+  ngx_protobuf_field_descriptor_t  *field = ctx->field;
+  ngx_http_protobuf_json_level_t   *level;
+
+  ctx->rest = len;
+
+  if (field == NULL) {
+    ctx->state = NGX_HTTP_PROTOBUF_JSON_SKIP;
+    return NGX_OK;
+  }
+
+  if (field->wire_type != NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED) {
+    /* a packed run of scalars, read one by one */
+    ctx->packed = ctx->offset + len;
+    ctx->state = (len > 0) ? NGX_HTTP_PROTOBUF_JSON_SCALAR
+                           : NGX_HTTP_PROTOBUF_JSON_TAG;
+    ctx->need = (field->wire_type == NGX_PROTOBUF_WIRETYPE_FIXED64) ? 8
+              : (field->wire_type == NGX_PROTOBUF_WIRETYPE_FIXED32) ? 4
+              : 0;
+    return NGX_OK;
+  }
+
+  if (ngx_http_protobuf_json_element(r, ctx) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  switch (field->type) {
+  case NGX_PROTOBUF_TYPE_MESSAGE:
+    if (ctx->depth + 1 == NGX_HTTP_PROTOBUF_JSON_MAX_DEPTH) {
+      return NGX_ABORT;
+    }
+
+    level = &ctx->level[++ctx->depth];
+
+    if (ngx_http_protobuf_json_enter(r, level, field->message) != NGX_OK) {
+      return NGX_ERROR;
+    }
+
+    level->end = ctx->offset + len;
+
+    ctx->state = NGX_HTTP_PROTOBUF_JSON_TAG;
+
+    return ngx_http_protobuf_json_literal(r, ctx, "{");
+
+  case NGX_PROTOBUF_TYPE_BYTES:
+    ctx->state = NGX_HTTP_PROTOBUF_JSON_BYTES;
+    ctx->ncarry = 0;
+    break;
+
+  default:
+    ctx->state = NGX_HTTP_PROTOBUF_JSON_STRING;
+    break;
+  }
+
+  if (ngx_http_protobuf_json_literal(r, ctx, "\"") != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  if (len == 0) {
+    ctx->state = NGX_HTTP_PROTOBUF_JSON_TAG;
+    return ngx_http_protobuf_json_literal(r, ctx, "\"");
+  }
+
+  return NGX_OK;
+}
+
+/* runs the input through the state machine */
+
+static ngx_int_t
+ngx_http_protobuf_json_parse(ngx_http_request_t *r,
+                             ngx_http_protobuf_json_ctx_t *ctx,
+                             u_char *p,
+                             u_char *last)
+{
+  uint64_t   len;
+  u_char    *q;
+  size_t     n;
+  ngx_int_t  rc;
+
+  while (p < last) {
+    switch (ctx->state) {
+
+    case NGX_HTTP_PROTOBUF_JSON_TAG:
+    case NGX_HTTP_PROTOBUF_JSON_LENGTH:
+      if (ctx->nscalar == 0
+          && ctx->state == NGX_HTTP_PROTOBUF_JSON_TAG
+          && ctx->groups == 0)
+      {
+        rc = ngx_http_protobuf_json_pop(r, ctx);
+        if (rc != NGX_OK) {
+          return rc;
+        }
+      }
+
+      ctx->scalar[ctx->nscalar++] = *p;
+      ctx->offset++;
+
+      if (*p++ & 0x80) {
+        if (ctx->nscalar == sizeof(ctx->scalar)) {
+          return NGX_ABORT;
+        }
+        break;
+      }
+
+      if (ctx->state == NGX_HTTP_PROTOBUF_JSON_TAG) {
+        rc = ngx_http_protobuf_json_field(r, ctx);
+      } else {
+        q = ctx->scalar;
+        if (ngx_protobuf_read_uint64(&q, q + ctx->nscalar, &len) != NGX_OK) {
+          return NGX_ABORT;
+        }
+        ctx->nscalar = 0;
+        rc = ngx_http_protobuf_json_value(r, ctx, len);
+      }
+
+      if (rc != NGX_OK) {
+        return rc;
+      }
+      break;
+
+    case NGX_HTTP_PROTOBUF_JSON_SCALAR:
+      if (ctx->need > 0) {
+        n = ngx_min((size_t) (last - p), ctx->need - ctx->nscalar);
+        ngx_memcpy(ctx->scalar + ctx->nscalar, p, n);
+        ctx->nscalar += n;
+        ctx->offset += n;
+        p += n;
+
+        if (ctx->nscalar < ctx->need) {
+          break;
+        }
+      } else {
+        ctx->scalar[ctx->nscalar++] = *p;
+        ctx->offset++;
+
+        if (*p++ & 0x80) {
+          if (ctx->nscalar == sizeof(ctx->scalar)) {
+            return NGX_ABORT;
+          }
+          break;
+        }
+      }
+
+      if (ctx->field != NULL) {
+        rc = ngx_http_protobuf_json_scalar(r, ctx);
+        if (rc != NGX_OK) {
+          return rc;
+        }
+      }
+
+      ctx->nscalar = 0;
+
+      if (ctx->packed < 0 || ctx->offset == ctx->packed) {
+        ctx->state = NGX_HTTP_PROTOBUF_JSON_TAG;
+      } else if (ctx->offset > ctx->packed) {
+        return NGX_ABORT;
+      }
+      break;
+
+    case NGX_HTTP_PROTOBUF_JSON_STRING:
+    case NGX_HTTP_PROTOBUF_JSON_BYTES:
+    case NGX_HTTP_PROTOBUF_JSON_SKIP:
+      n = ngx_min((uint64_t) (last - p), ctx->rest);
+
+      ctx->offset += n;
+      ctx->rest -= n;
+
+      if (ctx->state == NGX_HTTP_PROTOBUF_JSON_STRING) {
+        rc = ngx_http_protobuf_json_escape(r, ctx, p, n);
+      } else if (ctx->state == NGX_HTTP_PROTOBUF_JSON_BYTES) {
+        rc = ngx_http_protobuf_json_base64(r, ctx, p, n, ctx->rest == 0);
+      } else {
+        rc = NGX_OK;
+      }
+
+      if (rc != NGX_OK) {
+        return rc;
+      }
+
+      p += n;
+
+      if (ctx->rest == 0) {
+        if (ctx->state != NGX_HTTP_PROTOBUF_JSON_SKIP
+            && ngx_http_protobuf_json_literal(r, ctx, "\"") != NGX_OK)
+        {
+          return NGX_ERROR;
+        }
+        ctx->state = NGX_HTTP_PROTOBUF_JSON_TAG;
+      }
+      break;
+    }
+  }
+
+  return NGX_OK;
+}
+
+/* finishes the top level message at the end of the response */
+
+static ngx_int_t
+ngx_http_protobuf_json_finish(ngx_http_request_t *r,
+                              ngx_http_protobuf_json_ctx_t *ctx)
+{
+  ngx_int_t  rc;
+
+  if (ctx->state != NGX_HTTP_PROTOBUF_JSON_TAG
+      || ctx->nscalar > 0
+      || ctx->groups > 0)
+  {
+    return NGX_ABORT;
+  }
+
+  rc = ngx_http_protobuf_json_pop(r, ctx);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  if (ctx->depth > 0) {
+    return NGX_ABORT;
+  }
+
+  if (ngx_http_protobuf_json_close(r, ctx) != NGX_OK
+      || ngx_http_protobuf_json_literal(r, ctx, "}") != NGX_OK)
+  {
+    return NGX_ERROR;
+  }
+
+  return NGX_OK;
+}
+
+/* a response that cannot be transcoded becomes a 502 as long as
+ * nothing has been sent; after that, it can only be cut short.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_json_fail(ngx_http_request_t *r,
+                            ngx_http_protobuf_json_ctx_t *ctx)
+{
+  if (ctx->header_sent) {
+    return NGX_ERROR;
+  }
+
+  ctx->transcode = 0;
+
+  return ngx_http_filter_finalize_request(r, &ngx_http_protobuf_json_module,
+                                          NGX_HTTP_BAD_GATEWAY);
+}
+
+static ngx_int_t
+ngx_http_protobuf_json_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+  ngx_http_protobuf_json_ctx_t  *ctx;
+  ngx_chain_t                   *cl, *out, **ll;
+  ngx_buf_t                     *b;
+  ngx_uint_t                     flush, last;
+  ngx_int_t                      rc;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_json_module);
+
+  if (ctx == NULL || !ctx->transcode) {
+    return ngx_http_next_body_filter(r, in);
+  }
+
+  if (!ctx->started) {
+    ctx->started = 1;
+
+    if (ngx_http_protobuf_json_literal(r, ctx, "{") != NGX_OK) {
+      return NGX_ERROR;
+    }
+  }
+
+  flush = 0;
+  last = 0;
+
+  for (cl = in; cl; cl = cl->next) {
+    b = cl->buf;
+
+    rc = ngx_http_protobuf_json_parse(r, ctx, b->pos, b->last);
+
+    b->pos = b->last;
+
+    if (rc == NGX_OK && (b->last_buf || b->last_in_chain)) {
+      rc = ngx_http_protobuf_json_finish(r, ctx);
+      last = b->last_buf ? 1 : 2;
+    }
+
+    if (rc == NGX_ERROR) {
+      return NGX_ERROR;
+    }
+
+    if (rc == NGX_DECLINED) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "field \"%V\" repeats in protobuf response at offset %O",
+                    &ctx->field->name, ctx->offset);
+      return ngx_http_protobuf_json_fail(r, ctx);
+    }
+
+    if (rc != NGX_OK) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "malformed protobuf response at offset %O",
+                    ctx->offset);
+      return ngx_http_protobuf_json_fail(r, ctx);
+    }
+
+    if (b->flush) {
+      flush = 1;
+    }
+  }
+
+  if (flush || last) {
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+      return NGX_ERROR;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+      return NGX_ERROR;
+    }
+
+    b->flush = flush;
+    b->last_buf = (last == 1);
+    b->last_in_chain = (last != 0);
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    *ctx->last_out = cl;
+  }
+
+  out = ctx->out;
+
+  ctx->out = NULL;
+  ctx->last_out = &ctx->out;
+
+  /* unless the output is flushed, the buffer that is being filled is
+   * kept until it is full.
+   */
+
+  if (!flush && !last
+      && ctx->buf != NULL
+      && ctx->buf->last < ctx->buf->end)
+  {
+    for (ll = &out; (*ll)->buf != ctx->buf; ll = &(*ll)->next) {
+      /* void */
+    }
+
+    ctx->out = *ll;
+    ctx->last_out = &(*ll)->next;
+    *ll = NULL;
+
+  } else {
+    ctx->buf = NULL;
+  }
+
+  if (out == NULL && ctx->busy == NULL) {
+    return NGX_OK;
+  }
+
+  if (!ctx->header_sent) {
+    ctx->header_sent = 1;
+
+    rc = ngx_http_next_header_filter(r);
+    if (rc == NGX_ERROR || rc > NGX_OK) {
+      return NGX_ERROR;
+    }
+  }
+
+  rc = ngx_http_next_body_filter(r, out);
+
+  ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &out,
+                          (ngx_buf_tag_t) &ngx_http_protobuf_json_module);
+
+  return rc;
+}
+
+/* reads JSON request bodies, which are transcoded once they are in. */
+
+static ngx_int_t
+ngx_http_protobuf_json_request_handler(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_json_loc_conf_t  *plcf;
+  ngx_http_protobuf_json_ctx_t       *ctx;
+  ngx_table_elt_t                    *h;
+
+  if (r != r->main
+      || !(r->method & (NGX_HTTP_POST|NGX_HTTP_PUT|NGX_HTTP_PATCH)))
+  {
+    return NGX_DECLINED;
+  }
+
+  plcf = ngx_http_get_module_loc_conf(r, ngx_http_protobuf_json_module);
+
+  if (plcf->request == NULL) {
+    return NGX_DECLINED;
+  }
+
+  /* other bodies are passed on as they are */
+
+  h = r->headers_in.content_type;
+
+  if (h == NULL
+      || h->value.len < sizeof("application/json") - 1
+      || ngx_strncasecmp(h->value.data, (u_char *) "application/json",
+                         sizeof("application/json") - 1) != 0)
+  {
+    return NGX_DECLINED;
+  }
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_json_module);
+
+  if (ctx == NULL) {
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_protobuf_json_ctx_t));
+    if (ctx == NULL) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_protobuf_json_module);
+  }
+
+  return ngx_http_protobuf_read_body(r, &ctx->body,
+                                     ngx_http_protobuf_json_body_handler);
+}
+
+/* replaces a JSON request body with the protobuf message */
+
+static ngx_int_t
+ngx_http_protobuf_json_request_body(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_json_loc_conf_t  *plcf;
+  ngx_http_request_body_t            *rb;
+  ngx_protobuf_json_t                 json;
+  ngx_chain_t                        *cl;
+  ngx_buf_t                          *b;
+  ngx_str_t                           out;
+  ngx_int_t                           rc;
+  u_char                             *p;
+
+  plcf = ngx_http_get_module_loc_conf(r, ngx_http_protobuf_json_module);
+
+  rb = r->request_body;
+  if (rb == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  /* protobuf is rarely longer than the JSON it came from */
+
+  if (ngx_protobuf_json_init(&json, plcf->request,
+                             (r->headers_in.content_length_n > 0)
+                             ? (size_t) r->headers_in.content_length_n
+                             : ngx_pagesize,
+                             r->pool)
+      != NGX_OK)
+  {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  rc = ngx_protobuf_read_chain(rb->bufs, r->pool,
+                               (ngx_protobuf_chunk_pt) ngx_protobuf_json_parse,
+                               &json);
+
+  if (rc == NGX_OK) {
+    rc = ngx_protobuf_json_finish(&json, &out);
+  }
+
+  if (rc == NGX_ERROR) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  if (rc != NGX_OK) {
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "malformed JSON request body for %V",
+                  &plcf->request->name);
+    return NGX_HTTP_BAD_REQUEST;
+  }
+
+  b = ngx_calloc_buf(r->pool);
+  if (b == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  b->start = out.data;
+  b->pos = out.data;
+  b->last = out.data + out.len;
+  b->end = b->last;
+  b->temporary = 1;
+  b->last_buf = 1;
+
+  cl = ngx_alloc_chain_link(r->pool);
+  if (cl == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  cl->buf = b;
+  cl->next = NULL;
+
+  rb->bufs = cl;
+
+  r->headers_in.content_length_n = out.len;
+
+  if (r->headers_in.content_length) {
+    p = ngx_pnalloc(r->pool, NGX_OFF_T_LEN);
+    if (p == NULL) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_in.content_length->value.data = p;
+    r->headers_in.content_length->value.len =
+      ngx_sprintf(p, "%O", (off_t) out.len) - p;
+  }
+
+  ngx_str_set(&r->headers_in.content_type->value, "application/x-protobuf");
+
+  return NGX_OK;
+}
+
+static void
+ngx_http_protobuf_json_body_handler(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_json_ctx_t  *ctx;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_json_module);
+
+  ngx_http_protobuf_body_done(r, &ctx->body,
+                              ngx_http_protobuf_json_request_body(r));
+}
+
+static ngx_int_t
+ngx_http_protobuf_json_init(ngx_conf_t *cf)
+{
+  ngx_http_handler_pt        *h;
+  ngx_http_core_main_conf_t  *cmcf;
+
+  cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+  h = ngx_array_push(&cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
+  if (h == NULL) {
+    return NGX_ERROR;
+  }
+
+  *h = ngx_http_protobuf_json_request_handler;
+
+  ngx_http_next_header_filter = ngx_http_top_header_filter;
+  ngx_http_top_header_filter = ngx_http_protobuf_json_header_filter;
+
+  ngx_http_next_body_filter = ngx_http_top_body_filter;
+  ngx_http_top_body_filter = ngx_http_protobuf_json_body_filter;
+
+  return NGX_OK;
+}
+
+static void *
+ngx_http_protobuf_json_create_loc_conf(ngx_conf_t *cf)
+{
+  ngx_http_protobuf_json_loc_conf_t  *conf;
+
+  conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_protobuf_json_loc_conf_t));
+  if (conf == NULL) {
+    return NULL;
+  }
+
+  /* set by ngx_pcalloc():
+   *
+   *   conf->message = NULL;
+   *   conf->request = NULL;
+   */
+
+  conf->buffer_size = NGX_CONF_UNSET_SIZE;
+
+  return conf;
+}
+
+static char *
+ngx_http_protobuf_json_merge_loc_conf(ngx_conf_t *cf,
+                                      void *parent,
+                                      void *child)
+{
+  ngx_http_protobuf_json_loc_conf_t  *prev = parent;
+  ngx_http_protobuf_json_loc_conf_t  *conf = child;
+
+  if (conf->message == NULL) {
+    conf->message = prev->message;
+  }
+
+  if (conf->request == NULL) {
+    conf->request = prev->request;
+  }
+
+  ngx_conf_merge_size_value(conf->buffer_size, prev->buffer_size,
+                            (size_t) ngx_pagesize);
+
+  return NGX_CONF_OK;
+}
+
+/* protobuf_json message.Type;
+ * protobuf_json_request message.Type;
+ */
+
+static char *
+ngx_http_protobuf_json(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_protobuf_message_descriptor_t  **desc;
+  ngx_str_t                           *value;
+
+  desc = (ngx_protobuf_message_descriptor_t **) ((char *) conf + cmd->offset);
+
+  if (*desc != NULL) {
+    return "is duplicate";
+  }
+
+  value = cf->args->elts;
+
+  *desc = ngx_protobuf_find_message(&value[1]);
+  if (*desc == NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "unknown message type \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
+}
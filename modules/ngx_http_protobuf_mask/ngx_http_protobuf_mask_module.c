@@ -0,0 +1,898 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_protobuf.h>
+
+/* a body filter that applies a field mask to protobuf responses.  the
+ * response is parsed as it streams through, across buffer boundaries,
+ * and the fields that are not in the mask are skipped over.  fields
+ * that are in the mask are copied, and only the submessages named by a
+ * longer path are parsed in turn.
+ *
+ * such a submessage may shrink, but the bytes that follow its length
+ * prefix are written before its new length is known.  its prefix is
+ * therefore reserved at the width of the old length and filled in,
+ * padded, when the submessage ends.  output up to the first open
+ * prefix is passed on; the rest is held until the prefix is written.
+ */
+
+#define NGX_HTTP_PROTOBUF_MASK_MAX_DEPTH   16
+#define NGX_HTTP_PROTOBUF_MASK_MAX_TAG     5
+#define NGX_HTTP_PROTOBUF_MASK_MAX_VARINT  10
+
+#define NGX_HTTP_PROTOBUF_MASK_TAG         0
+#define NGX_HTTP_PROTOBUF_MASK_VARINT      1
+#define NGX_HTTP_PROTOBUF_MASK_LENGTH      2
+#define NGX_HTTP_PROTOBUF_MASK_BYTES       3
+
+#define NGX_HTTP_PROTOBUF_MASK_DROP        0
+#define NGX_HTTP_PROTOBUF_MASK_KEEP        1
+#define NGX_HTTP_PROTOBUF_MASK_ENTER       2
+
+/* a field in the mask.  the whole field is kept if it has no children */
+
+typedef struct {
+  uint32_t                            number;
+  ngx_array_t                        *children;
+} ngx_http_protobuf_mask_node_t;
+
+typedef struct {
+  ngx_protobuf_message_descriptor_t  *message;
+  ngx_http_complex_value_t           *mask;
+  ngx_array_t                        *nodes;     /* if mask is constant */
+} ngx_http_protobuf_mask_loc_conf_t;
+
+typedef struct {
+  off_t                               end;
+  ngx_array_t                        *nodes;
+  u_char                             *prefix;
+  size_t                              width;
+  off_t                               start;
+  ngx_chain_t                        *cl;        /* holds the prefix */
+} ngx_http_protobuf_mask_level_t;
+
+typedef struct {
+  ngx_uint_t                          state;
+  ngx_uint_t                          action;
+  u_char                              head[NGX_HTTP_PROTOBUF_MASK_MAX_VARINT];
+  ngx_uint_t                          nhead;
+  u_char                              len[NGX_HTTP_PROTOBUF_MASK_MAX_VARINT];
+  ngx_uint_t                          nlen;
+  ngx_uint_t                          nvarint;
+  uint64_t                            rest;
+  ngx_array_t                        *enter;
+  ngx_uint_t                          groups;
+  ngx_uint_t                          group_action;
+
+  off_t                               offset;    /* input bytes */
+  off_t                               written;   /* output bytes */
+
+  ngx_uint_t                          depth;
+  ngx_http_protobuf_mask_level_t      level[NGX_HTTP_PROTOBUF_MASK_MAX_DEPTH];
+
+  ngx_chain_t                        *out;
+  ngx_chain_t                       **last_out;
+  ngx_chain_t                        *cl;
+  ngx_buf_t                          *buf;
+  ngx_chain_t                        *free;
+  ngx_chain_t                        *busy;
+} ngx_http_protobuf_mask_ctx_t;
+
+static ngx_int_t ngx_http_protobuf_mask_init(ngx_conf_t *cf);
+static void *ngx_http_protobuf_mask_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_protobuf_mask_merge_loc_conf(ngx_conf_t *cf,
+                                                   void *parent,
+                                                   void *child);
+static char *ngx_http_protobuf_mask(ngx_conf_t *cf,
+                                    ngx_command_t *cmd,
+                                    void *conf);
+
+static ngx_command_t ngx_http_protobuf_mask_commands[] = {
+
+  { ngx_string("protobuf_mask"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+    ngx_http_protobuf_mask,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+
+  ngx_null_command
+};
+
+static ngx_http_module_t ngx_http_protobuf_mask_module_ctx = {
+  NULL,                                    /* preconfiguration */
+  ngx_http_protobuf_mask_init,             /* postconfiguration */
+  NULL,                                    /* create main configuration */
+  NULL,                                    /* init main configuration */
+  NULL,                                    /* create server configuration */
+  NULL,                                    /* merge server configuration */
+  ngx_http_protobuf_mask_create_loc_conf,  /* create location configuration */
+  ngx_http_protobuf_mask_merge_loc_conf    /* merge location configuration */
+};
+
+ngx_module_t ngx_http_protobuf_mask_module = {
+  NGX_MODULE_V1,
+  &ngx_http_protobuf_mask_module_ctx,  /* module context */
+  ngx_http_protobuf_mask_commands,     /* module directives */
+  NGX_HTTP_MODULE,                     /* module type */
+  NULL,                                /* init master */
+  NULL,                                /* init module */
+  NULL,                                /* init process */
+  NULL,                                /* init thread */
+  NULL,                                /* exit thread */
+  NULL,                                /* exit process */
+  NULL,                                /* exit master */
+  NGX_MODULE_V1_PADDING
+};
+
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+
+/* adds the paths of a mask ("a,b.c,b.d") to a tree of nodes.  returns
+ * NGX_DECLINED, with the offending path in err, if a path does not name
+ * fields of the message.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_mask_compile(ngx_pool_t *pool,
+                               ngx_protobuf_message_descriptor_t *message,
+                               ngx_str_t *mask,
+                               ngx_array_t **nodes,
+                               ngx_str_t *err)
+{
+  ngx_protobuf_field_descriptor_t    *fields[NGX_HTTP_PROTOBUF_MASK_MAX_DEPTH];
+  ngx_protobuf_field_descriptor_t    *field;
+  ngx_http_protobuf_mask_node_t      *node;
+  ngx_array_t                        *level;
+  ngx_protobuf_path_t                 pp;
+  ngx_uint_t                          i, depth;
+  u_char                             *p, *last, *end;
+  u_char                              errstr[NGX_MAX_CONF_ERRSTR];
+
+  if (*nodes == NULL) {
+    *nodes = ngx_array_create(pool, 4, sizeof(ngx_http_protobuf_mask_node_t));
+    if (*nodes == NULL) {
+      return NGX_ERROR;
+    }
+  }
+
+  p = mask->data;
+  last = mask->data + mask->len;
+
+  while (p < last) {
+    end = ngx_strlchr(p, last, ',');
+    if (end == NULL) {
+      end = last;
+    }
+
+    while (p < end && *p == ' ') {
+      p++;
+    }
+
+    err->data = p;
+    err->len = end - p;
+
+    while (err->len > 0 && err->data[err->len - 1] == ' ') {
+      err->len--;
+    }
+
+    p = end + 1;
+
+    if (err->len == 0) {
+      continue;
+    }
+
+    ngx_memzero(&pp, sizeof(ngx_protobuf_path_t));
+
+    pp.path = *err;
+    pp.message = message;
+    pp.fields = fields;
+    pp.max = NGX_HTTP_PROTOBUF_MASK_MAX_DEPTH - 1;
+    pp.repeated = 1;
+    pp.err.len = NGX_MAX_CONF_ERRSTR;
+    pp.err.data = errstr;
+
+    if (ngx_protobuf_resolve_path(&pp) != NGX_OK) {
+      return NGX_DECLINED;
+    }
+
+    level = *nodes;
+
+    for (depth = 0; depth < pp.depth; ++depth) {
+      field = fields[depth];
+
+      node = level->elts;
+      for (i = 0; i < level->nelts; ++i) {
+        if (node[i].number == field->number) {
+          break;
+        }
+      }
+
+      if (i == level->nelts) {
+        node = ngx_array_push(level);
+        if (node == NULL) {
+          return NGX_ERROR;
+        }
+
+        node->number = field->number;
+        node->children = NULL;
+
+        if (depth + 1 < pp.depth) {
+          node->children = ngx_array_create(pool, 2,
+                                     sizeof(ngx_http_protobuf_mask_node_t));
+          if (node->children == NULL) {
+            return NGX_ERROR;
+          }
+        }
+      } else {
+        node += i;
+
+        if (node->children == NULL) {
+          /* the whole field is kept already */
+          break;
+        }
+
+        if (depth + 1 == pp.depth) {
+          node->children = NULL;
+        }
+      }
+
+      level = node->children;
+    }
+  }
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_protobuf_mask_header_filter(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_mask_loc_conf_t  *plcf;
+  ngx_http_protobuf_mask_ctx_t       *ctx;
+  ngx_array_t                        *nodes;
+  ngx_str_t                           mask, err;
+  ngx_int_t                           rc;
+
+  plcf = ngx_http_get_module_loc_conf(r, ngx_http_protobuf_mask_module);
+
+  if (plcf->message == NULL
+      || r->headers_out.status != NGX_HTTP_OK
+      || r->header_only)
+  {
+    return ngx_http_next_header_filter(r);
+  }
+
+  nodes = plcf->nodes;
+
+  if (nodes == NULL) {
+    if (ngx_http_complex_value(r, plcf->mask, &mask) != NGX_OK) {
+      return NGX_ERROR;
+    }
+
+    if (mask.len == 0) {
+      return ngx_http_next_header_filter(r);
+    }
+
+    rc = ngx_http_protobuf_mask_compile(r->pool, plcf->message, &mask,
+                                        &nodes, &err);
+    if (rc == NGX_ERROR) {
+      return NGX_ERROR;
+    }
+
+    if (rc == NGX_DECLINED) {
+      ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                    "invalid field mask path \"%V\" for %V",
+                    &err, &plcf->message->name);
+      return ngx_http_next_header_filter(r);
+    }
+  }
+
+  ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_protobuf_mask_ctx_t));
+  if (ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  /* set by ngx_pcalloc():
+   *
+   *   ctx->state = NGX_HTTP_PROTOBUF_MASK_TAG;
+   *   ctx->depth = 0;
+   *   ctx->out = NULL;
+   *   ctx->buf = NULL;
+   */
+
+  ctx->level[0].nodes = nodes;
+  ctx->last_out = &ctx->out;
+
+  ngx_http_set_ctx(r, ctx, ngx_http_protobuf_mask_module);
+
+  r->filter_need_in_memory = 1;
+
+  ngx_http_clear_content_length(r);
+  ngx_http_clear_accept_ranges(r);
+  ngx_http_weak_etag(r);
+
+  return ngx_http_next_header_filter(r);
+}
+
+/* makes room for at least n contiguous bytes of output */
+
+static ngx_int_t
+ngx_http_protobuf_mask_room(ngx_http_request_t *r,
+                            ngx_http_protobuf_mask_ctx_t *ctx,
+                            size_t n)
+{
+  ngx_chain_t  *cl;
+  ngx_buf_t    *b;
+
+  if (ctx->buf != NULL && (size_t) (ctx->buf->end - ctx->buf->last) >= n) {
+    return NGX_OK;
+  }
+
+  cl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+  if (cl == NULL) {
+    return NGX_ERROR;
+  }
+
+  b = cl->buf;
+
+  if (b->start == NULL) {
+    b->start = ngx_palloc(r->pool, ngx_pagesize);
+    if (b->start == NULL) {
+      return NGX_ERROR;
+    }
+
+    b->pos = b->start;
+    b->last = b->start;
+    b->end = b->start + ngx_pagesize;
+    b->tag = (ngx_buf_tag_t) &ngx_http_protobuf_mask_module;
+    b->temporary = 1;
+  }
+
+  *ctx->last_out = cl;
+  ctx->last_out = &cl->next;
+
+  ctx->cl = cl;
+  ctx->buf = b;
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_protobuf_mask_write(ngx_http_request_t *r,
+                             ngx_http_protobuf_mask_ctx_t *ctx,
+                             u_char *p,
+                             size_t len)
+{
+  size_t  n;
+
+  ctx->written += len;
+
+  while (len > 0) {
+    if (ngx_http_protobuf_mask_room(r, ctx, 1) != NGX_OK) {
+      return NGX_ERROR;
+    }
+
+    n = ctx->buf->end - ctx->buf->last;
+    if (n > len) {
+      n = len;
+    }
+
+    ctx->buf->last = ngx_cpymem(ctx->buf->last, p, n);
+    p += n;
+    len -= n;
+  }
+
+  return NGX_OK;
+}
+
+/* enters a submessage: its tag is written, and its length reserved */
+
+static ngx_int_t
+ngx_http_protobuf_mask_push(ngx_http_request_t *r,
+                            ngx_http_protobuf_mask_ctx_t *ctx,
+                            uint64_t len)
+{
+  ngx_http_protobuf_mask_level_t  *level;
+  size_t                           width;
+
+  if (len > NGX_MAX_UINT32_VALUE) {
+    return NGX_ABORT;
+  }
+
+  width = ngx_protobuf_size_uint32((uint32_t) len);
+
+  if (ngx_http_protobuf_mask_room(r, ctx, ctx->nhead + width) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  ctx->buf->last = ngx_cpymem(ctx->buf->last, ctx->head, ctx->nhead);
+  ctx->written += ctx->nhead + width;
+
+  level = &ctx->level[++ctx->depth];
+
+  level->end = ctx->offset + len;
+  level->nodes = ctx->enter;
+  level->prefix = ctx->buf->last;
+  level->width = width;
+  level->start = ctx->written;
+  level->cl = ctx->cl;
+
+  ctx->buf->last += width;
+
+  return NGX_OK;
+}
+
+/* leaves the submessages that end at the current input offset */
+
+static ngx_int_t
+ngx_http_protobuf_mask_pop(ngx_http_protobuf_mask_ctx_t *ctx)
+{
+  ngx_http_protobuf_mask_level_t  *level;
+
+  while (ctx->depth > 0) {
+    level = &ctx->level[ctx->depth];
+
+    if (ctx->offset < level->end) {
+      break;
+    }
+
+    if (ctx->offset > level->end) {
+      return NGX_ABORT;
+    }
+
+    ngx_protobuf_write_padded_uint32(level->prefix,
+                                     ctx->written - level->start,
+                                     level->width);
+    ctx->depth--;
+  }
+
+  return NGX_OK;
+}
+
+/* decides what happens to a field once its tag has been read */
+
+static ngx_int_t
+ngx_http_protobuf_mask_field(ngx_http_request_t *r,
+                             ngx_http_protobuf_mask_ctx_t *ctx)
+{
+  ngx_http_protobuf_mask_node_t  *node;
+  ngx_array_t                    *nodes;
+  ngx_uint_t                      i;
+  uint32_t                        header, wire;
+  u_char                         *p;
+
+  p = ctx->head;
+  if (ngx_protobuf_read_uint32(&p, p + ctx->nhead, &header) != NGX_OK) {
+    return NGX_ABORT;
+  }
+
+  wire = header & 0x07;
+
+  if (ctx->groups > 0) {
+    ctx->action = ctx->group_action;
+
+    if (wire == NGX_PROTOBUF_WIRETYPE_START_GROUP) {
+      if (++ctx->groups > NGX_PROTOBUF_MAX_GROUP_DEPTH) {
+        return NGX_ABORT;
+      }
+    } else if (wire == NGX_PROTOBUF_WIRETYPE_END_GROUP) {
+      ctx->groups--;
+    }
+
+  } else {
+    nodes = ctx->level[ctx->depth].nodes;
+    node = nodes->elts;
+
+    for (i = 0; i < nodes->nelts; ++i) {
+      if (node[i].number == (header >> 3)) {
+        break;
+      }
+    }
+
+    if (i == nodes->nelts) {
+      ctx->action = NGX_HTTP_PROTOBUF_MASK_DROP;
+    } else if (node[i].children != NULL
+               && wire == NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED
+               && ctx->depth + 1 < NGX_HTTP_PROTOBUF_MASK_MAX_DEPTH)
+    {
+      ctx->action = NGX_HTTP_PROTOBUF_MASK_ENTER;
+      ctx->enter = node[i].children;
+    } else {
+      ctx->action = NGX_HTTP_PROTOBUF_MASK_KEEP;
+    }
+
+    if (wire == NGX_PROTOBUF_WIRETYPE_START_GROUP) {
+      ctx->groups = 1;
+      ctx->group_action = ctx->action;
+    } else if (wire == NGX_PROTOBUF_WIRETYPE_END_GROUP) {
+      return NGX_ABORT;
+    }
+  }
+
+  if (ctx->action == NGX_HTTP_PROTOBUF_MASK_KEEP) {
+    if (ngx_http_protobuf_mask_write(r, ctx, ctx->head,
+                                     ctx->nhead) != NGX_OK)
+    {
+      return NGX_ERROR;
+    }
+  }
+
+  switch (wire) {
+  case NGX_PROTOBUF_WIRETYPE_VARINT:
+    ctx->state = NGX_HTTP_PROTOBUF_MASK_VARINT;
+    ctx->nvarint = 0;
+    break;
+  case NGX_PROTOBUF_WIRETYPE_FIXED64:
+    ctx->state = NGX_HTTP_PROTOBUF_MASK_BYTES;
+    ctx->rest = 8;
+    break;
+  case NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED:
+    ctx->state = NGX_HTTP_PROTOBUF_MASK_LENGTH;
+    ctx->nlen = 0;
+    return NGX_OK;
+  case NGX_PROTOBUF_WIRETYPE_START_GROUP:
+  case NGX_PROTOBUF_WIRETYPE_END_GROUP:
+    ctx->state = NGX_HTTP_PROTOBUF_MASK_TAG;
+    break;
+  case NGX_PROTOBUF_WIRETYPE_FIXED32:
+    ctx->state = NGX_HTTP_PROTOBUF_MASK_BYTES;
+    ctx->rest = 4;
+    break;
+  default:
+    return NGX_ABORT;
+  }
+
+  ctx->nhead = 0;
+
+  return NGX_OK;
+}
+
+/* runs the input through the state machine */
+
+static ngx_int_t
+ngx_http_protobuf_mask_parse(ngx_http_request_t *r,
+                             ngx_http_protobuf_mask_ctx_t *ctx,
+                             u_char *p,
+                             u_char *last)
+{
+  uint64_t   len;
+  u_char    *q;
+  size_t     n;
+  ngx_int_t  rc;
+
+  while (p < last) {
+    switch (ctx->state) {
+
+    case NGX_HTTP_PROTOBUF_MASK_TAG:
+      if (ctx->nhead == 0 && ngx_http_protobuf_mask_pop(ctx) != NGX_OK) {
+        return NGX_ABORT;
+      }
+
+      ctx->head[ctx->nhead++] = *p;
+      ctx->offset++;
+
+      if (*p++ & 0x80) {
+        if (ctx->nhead == NGX_HTTP_PROTOBUF_MASK_MAX_TAG) {
+          return NGX_ABORT;
+        }
+        break;
+      }
+
+      rc = ngx_http_protobuf_mask_field(r, ctx);
+      if (rc != NGX_OK) {
+        return rc;
+      }
+      break;
+
+    case NGX_HTTP_PROTOBUF_MASK_VARINT:
+      for (q = p; q < last && (*q & 0x80); q++) { /* void */ }
+
+      if (q < last) {
+        ctx->state = NGX_HTTP_PROTOBUF_MASK_TAG;
+        q++;
+      }
+
+      n = q - p;
+
+      ctx->nvarint += n;
+      if (ctx->nvarint > NGX_HTTP_PROTOBUF_MASK_MAX_VARINT) {
+        return NGX_ABORT;
+      }
+
+      if (ctx->action == NGX_HTTP_PROTOBUF_MASK_KEEP
+          && ngx_http_protobuf_mask_write(r, ctx, p, n) != NGX_OK)
+      {
+        return NGX_ERROR;
+      }
+
+      ctx->offset += n;
+      p = q;
+      break;
+
+    case NGX_HTTP_PROTOBUF_MASK_LENGTH:
+      ctx->len[ctx->nlen++] = *p;
+      ctx->offset++;
+
+      if (*p++ & 0x80) {
+        if (ctx->nlen == NGX_HTTP_PROTOBUF_MASK_MAX_VARINT) {
+          return NGX_ABORT;
+        }
+        break;
+      }
+
+      q = ctx->len;
+      if (ngx_protobuf_read_uint64(&q, q + ctx->nlen, &len) != NGX_OK) {
+        return NGX_ABORT;
+      }
+
+      if (ctx->action == NGX_HTTP_PROTOBUF_MASK_ENTER) {
+        rc = ngx_http_protobuf_mask_push(r, ctx, len);
+        if (rc != NGX_OK) {
+          return rc;
+        }
+
+        ctx->state = NGX_HTTP_PROTOBUF_MASK_TAG;
+        ctx->nhead = 0;
+        break;
+      }
+
+      if (ctx->action == NGX_HTTP_PROTOBUF_MASK_KEEP
+          && ngx_http_protobuf_mask_write(r, ctx, ctx->len,
+                                          ctx->nlen) != NGX_OK)
+      {
+        return NGX_ERROR;
+      }
+
+      ctx->state = (len > 0) ? NGX_HTTP_PROTOBUF_MASK_BYTES
+                             : NGX_HTTP_PROTOBUF_MASK_TAG;
+      ctx->rest = len;
+      ctx->nhead = 0;
+      break;
+
+    case NGX_HTTP_PROTOBUF_MASK_BYTES:
+      n = last - p;
+      if (n > ctx->rest) {
+        n = ctx->rest;
+      }
+
+      if (ctx->action == NGX_HTTP_PROTOBUF_MASK_KEEP
+          && ngx_http_protobuf_mask_write(r, ctx, p, n) != NGX_OK)
+      {
+        return NGX_ERROR;
+      }
+
+      ctx->offset += n;
+      ctx->rest -= n;
+      p += n;
+
+      if (ctx->rest == 0) {
+        ctx->state = NGX_HTTP_PROTOBUF_MASK_TAG;
+      }
+      break;
+    }
+  }
+
+  return NGX_OK;
+}
+
+/* cuts off the output that is ready to be passed on: all of it, or the
+ * part before the buffer that holds the first open length prefix.
+ */
+
+static ngx_chain_t *
+ngx_http_protobuf_mask_ready(ngx_http_protobuf_mask_ctx_t *ctx)
+{
+  ngx_chain_t  *out, *cl, *hold;
+
+  out = ctx->out;
+
+  if (ctx->depth == 0) {
+    ctx->out = NULL;
+    ctx->last_out = &ctx->out;
+    ctx->cl = NULL;
+    ctx->buf = NULL;
+    return out;
+  }
+
+  hold = ctx->level[1].cl;
+
+  if (out == hold) {
+    return NULL;
+  }
+
+  for (cl = out; cl->next != hold; cl = cl->next) { /* void */ }
+
+  cl->next = NULL;
+  ctx->out = hold;
+
+  return out;
+}
+
+static ngx_int_t
+ngx_http_protobuf_mask_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+  ngx_http_protobuf_mask_ctx_t  *ctx;
+  ngx_chain_t                   *cl, *out, **ll;
+  ngx_buf_t                     *b;
+  ngx_uint_t                     flush, last;
+  ngx_int_t                      rc;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_mask_module);
+
+  if (ctx == NULL) {
+    return ngx_http_next_body_filter(r, in);
+  }
+
+  flush = 0;
+  last = 0;
+
+  for (cl = in; cl; cl = cl->next) {
+    b = cl->buf;
+
+    rc = ngx_http_protobuf_mask_parse(r, ctx, b->pos, b->last);
+
+    b->pos = b->last;
+
+    if (rc == NGX_ERROR) {
+      return NGX_ERROR;
+    }
+
+    if (rc == NGX_OK && (b->last_buf || b->last_in_chain)) {
+      if (ctx->state != NGX_HTTP_PROTOBUF_MASK_TAG || ctx->nhead > 0
+          || ngx_http_protobuf_mask_pop(ctx) != NGX_OK
+          || ctx->depth > 0)
+      {
+        rc = NGX_ABORT;
+      }
+
+      last = b->last_buf ? 1 : 2;
+    }
+
+    if (rc != NGX_OK) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "malformed protobuf response at offset %O",
+                    ctx->offset);
+      return NGX_ERROR;
+    }
+
+    if (b->flush) {
+      flush = 1;
+    }
+  }
+
+  out = ngx_http_protobuf_mask_ready(ctx);
+
+  if (flush || last) {
+    for (ll = &out; *ll; ll = &(*ll)->next) { /* void */ }
+
+    *ll = ngx_alloc_chain_link(r->pool);
+    if (*ll == NULL) {
+      return NGX_ERROR;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+      return NGX_ERROR;
+    }
+
+    b->flush = flush;
+    b->last_buf = (last == 1);
+    b->last_in_chain = (last != 0);
+
+    (*ll)->buf = b;
+    (*ll)->next = NULL;
+  }
+
+  if (out == NULL && ctx->busy == NULL) {
+    return NGX_OK;
+  }
+
+  rc = ngx_http_next_body_filter(r, out);
+
+  ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &out,
+                          (ngx_buf_tag_t) &ngx_http_protobuf_mask_module);
+
+  return rc;
+}
+
+static ngx_int_t
+ngx_http_protobuf_mask_init(ngx_conf_t *cf)
+{
+  ngx_http_next_header_filter = ngx_http_top_header_filter;
+  ngx_http_top_header_filter = ngx_http_protobuf_mask_header_filter;
+
+  ngx_http_next_body_filter = ngx_http_top_body_filter;
+  ngx_http_top_body_filter = ngx_http_protobuf_mask_body_filter;
+
+  return NGX_OK;
+}
+
+static void *
+ngx_http_protobuf_mask_create_loc_conf(ngx_conf_t *cf)
+{
+  /* set by ngx_pcalloc():
+   *
+   *   conf->message = NULL;
+   *   conf->mask = NULL;
+   *   conf->nodes = NULL;
+   */
+
+  return ngx_pcalloc(cf->pool, sizeof(ngx_http_protobuf_mask_loc_conf_t));
+}
+
+static char *
+ngx_http_protobuf_mask_merge_loc_conf(ngx_conf_t *cf,
+                                      void *parent,
+                                      void *child)
+{
+  ngx_http_protobuf_mask_loc_conf_t  *prev = parent;
+  ngx_http_protobuf_mask_loc_conf_t  *conf = child;
+
+  if (conf->message == NULL) {
+    conf->message = prev->message;
+    conf->mask = prev->mask;
+    conf->nodes = prev->nodes;
+  }
+
+  return NGX_CONF_OK;
+}
+
+/* protobuf_mask message.Type mask; */
+
+static char *
+ngx_http_protobuf_mask(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_protobuf_mask_loc_conf_t  *plcf = conf;
+  ngx_http_compile_complex_value_t    ccv;
+  ngx_str_t                          *value, err;
+  ngx_int_t                           rc;
+
+  if (plcf->message != NULL) {
+    return "is duplicate";
+  }
+
+  value = cf->args->elts;
+
+  plcf->message = ngx_protobuf_find_message(&value[1]);
+  if (plcf->message == NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "unknown message type \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  plcf->mask = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+  if (plcf->mask == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+  ccv.cf = cf;
+  ccv.value = &value[2];
+  ccv.complex_value = plcf->mask;
+
+  if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+    return NGX_CONF_ERROR;
+  }
+
+  if (plcf->mask->lengths != NULL) {
+    return NGX_CONF_OK;
+  }
+
+  /* a constant mask is compiled once */
+
+  rc = ngx_http_protobuf_mask_compile(cf->pool, plcf->message, &value[2],
+                                      &plcf->nodes, &err);
+  if (rc == NGX_ERROR) {
+    return NGX_CONF_ERROR;
+  }
+
+  if (rc == NGX_DECLINED) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid field mask path \"%V\" for %V",
+                       &err, &plcf->message->name);
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
+}
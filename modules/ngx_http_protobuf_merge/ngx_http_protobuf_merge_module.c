@@ -0,0 +1,420 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_protobuf.h>
+
+/* protobuf merges messages that are concatenated on the wire, so the
+ * responses of several subrequests are combined into one message by
+ * sending their bytes one after the other.  nothing is unpacked: each
+ * response is passed on as the in-memory buffers of its subrequest,
+ * optionally preceded by a header that nests it under a field.
+ */
+
+#define NGX_HTTP_PROTOBUF_MERGE_TYPE  "application/x-protobuf"
+
+typedef struct {
+  ngx_http_complex_value_t          uri;
+  uint32_t                          field;   /* 0 if not nested */
+} ngx_http_protobuf_merge_part_t;
+
+typedef struct {
+  ngx_array_t                      *parts;
+} ngx_http_protobuf_merge_loc_conf_t;
+
+typedef struct {
+  ngx_chain_t                      *out;
+  ngx_uint_t                        status;
+  unsigned                          done:1;
+} ngx_http_protobuf_merge_result_t;
+
+typedef struct {
+  ngx_http_protobuf_merge_result_t *results;
+  ngx_uint_t                        pending;
+} ngx_http_protobuf_merge_ctx_t;
+
+static ngx_int_t ngx_http_protobuf_merge_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_protobuf_merge_done(ngx_http_request_t *r,
+                                              void *data,
+                                              ngx_int_t rc);
+static void ngx_http_protobuf_merge_send(ngx_http_request_t *r);
+static ngx_int_t ngx_http_protobuf_merge_output(ngx_http_request_t *r,
+    ngx_http_protobuf_merge_ctx_t *ctx);
+static void *ngx_http_protobuf_merge_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_protobuf_merge(ngx_conf_t *cf,
+                                     ngx_command_t *cmd,
+                                     void *conf);
+
+static ngx_command_t ngx_http_protobuf_merge_commands[] = {
+
+  { ngx_string("protobuf_merge"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+    ngx_http_protobuf_merge,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+
+  ngx_null_command
+};
+
+static ngx_http_module_t ngx_http_protobuf_merge_module_ctx = {
+  NULL,                                      /* preconfiguration */
+  NULL,                                      /* postconfiguration */
+  NULL,                                      /* create main configuration */
+  NULL,                                      /* init main configuration */
+  NULL,                                      /* create server configuration */
+  NULL,                                      /* merge server configuration */
+  ngx_http_protobuf_merge_create_loc_conf,   /* create location configuration */
+  NULL                                       /* merge location configuration */
+};
+
+ngx_module_t ngx_http_protobuf_merge_module = {
+  NGX_MODULE_V1,
+  &ngx_http_protobuf_merge_module_ctx,  /* module context */
+  ngx_http_protobuf_merge_commands,     /* module directives */
+  NGX_HTTP_MODULE,                      /* module type */
+  NULL,                                 /* init master */
+  NULL,                                 /* init module */
+  NULL,                                 /* init process */
+  NULL,                                 /* init thread */
+  NULL,                                 /* exit thread */
+  NULL,                                 /* exit process */
+  NULL,                                 /* exit master */
+  NGX_MODULE_V1_PADDING
+};
+
+/* issues all of the subrequests at once.  the request is kept alive
+ * until the last of them has finished, and is then answered from the
+ * write event handler.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_merge_handler(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_merge_loc_conf_t  *mlcf;
+  ngx_http_protobuf_merge_part_t      *part;
+  ngx_http_protobuf_merge_ctx_t       *ctx;
+  ngx_http_post_subrequest_t          *ps;
+  ngx_http_request_t                  *sr;
+  ngx_str_t                            uri, args;
+  ngx_uint_t                           i, flags;
+  ngx_int_t                            rc;
+
+  if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  mlcf = ngx_http_get_module_loc_conf(r, ngx_http_protobuf_merge_module);
+
+  ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_protobuf_merge_ctx_t));
+  if (ctx == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  ctx->results = ngx_pcalloc(r->pool, mlcf->parts->nelts *
+                             sizeof(ngx_http_protobuf_merge_result_t));
+  if (ctx->results == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  ngx_http_set_ctx(r, ctx, ngx_http_protobuf_merge_module);
+
+  part = mlcf->parts->elts;
+
+  for (i = 0; i < mlcf->parts->nelts; ++i) {
+    if (ngx_http_complex_value(r, &part[i].uri, &uri) != NGX_OK) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_str_null(&args);
+    flags = NGX_HTTP_LOG_UNSAFE;
+
+    if (ngx_http_parse_unsafe_uri(r, &uri, &args, &flags) != NGX_OK) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+    if (ps == NULL) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ps->handler = ngx_http_protobuf_merge_done;
+    ps->data = &ctx->results[i];
+
+    if (ngx_http_subrequest(r, &uri, &args, &sr, ps,
+                            NGX_HTTP_SUBREQUEST_IN_MEMORY
+                            |NGX_HTTP_SUBREQUEST_WAITED) != NGX_OK)
+    {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->pending++;
+  }
+
+  r->write_event_handler = ngx_http_protobuf_merge_send;
+  r->main->count++;
+
+  return NGX_DONE;
+}
+
+/* keeps the response of a finished subrequest.  the handler can run
+ * more than once for the same subrequest, so only the first call
+ * counts.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_merge_done(ngx_http_request_t *r, void *data, ngx_int_t rc)
+{
+  ngx_http_protobuf_merge_result_t  *result = data;
+  ngx_http_protobuf_merge_ctx_t     *ctx;
+
+  if (result->done) {
+    return rc;
+  }
+
+  ctx = ngx_http_get_module_ctx(r->parent, ngx_http_protobuf_merge_module);
+
+  result->done = 1;
+  result->out = r->out;
+
+  if (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+    result->status = NGX_HTTP_BAD_GATEWAY;
+  } else {
+    result->status = r->headers_out.status;
+  }
+
+  ctx->pending--;
+
+  return rc;
+}
+
+static void
+ngx_http_protobuf_merge_send(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_merge_ctx_t  *ctx;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_merge_module);
+
+  if (ctx->pending > 0) {
+    return;
+  }
+
+  r->write_event_handler = ngx_http_request_empty_handler;
+
+  ngx_http_finalize_request(r, ngx_http_protobuf_merge_output(r, ctx));
+}
+
+static ngx_int_t
+ngx_http_protobuf_merge_link(ngx_http_request_t *r, ngx_chain_t ***ll,
+                             ngx_buf_t *b)
+{
+  ngx_chain_t  *cl;
+
+  cl = ngx_alloc_chain_link(r->pool);
+  if (cl == NULL) {
+    return NGX_ERROR;
+  }
+
+  cl->buf = b;
+  cl->next = NULL;
+  **ll = cl;
+  *ll = &cl->next;
+
+  return NGX_OK;
+}
+
+/* builds the response from the subrequests' buffers.  the buffers are
+ * shadowed rather than linked directly, since the subrequests may
+ * have marked them as the last in their own output.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_merge_output(ngx_http_request_t *r,
+                               ngx_http_protobuf_merge_ctx_t *ctx)
+{
+  ngx_http_protobuf_merge_loc_conf_t  *mlcf;
+  ngx_http_protobuf_merge_part_t      *part;
+  ngx_http_protobuf_merge_result_t    *result;
+  ngx_chain_t                         *out, **ll, *cl;
+  ngx_buf_t                           *b, *last;
+  off_t                                len;
+  size_t                               n;
+  ngx_uint_t                           i;
+  ngx_int_t                            rc;
+
+  mlcf = ngx_http_get_module_loc_conf(r, ngx_http_protobuf_merge_module);
+  part = mlcf->parts->elts;
+
+  out = NULL;
+  ll = &out;
+  last = NULL;
+  len = 0;
+
+  for (i = 0; i < mlcf->parts->nelts; ++i) {
+    result = &ctx->results[i];
+
+    if (result->status != NGX_HTTP_OK) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "protobuf merge: part %ui returned status %ui",
+                    i + 1, result->status);
+      return NGX_HTTP_BAD_GATEWAY;
+    }
+
+    n = 0;
+    for (cl = result->out; cl; cl = cl->next) {
+      if (!ngx_buf_in_memory_only(cl->buf)) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "protobuf merge: part %ui is not in memory", i + 1);
+        return NGX_HTTP_BAD_GATEWAY;
+      }
+      n += cl->buf->last - cl->buf->pos;
+    }
+
+    if (part[i].field != 0) {
+      b = ngx_create_temp_buf(r->pool,
+                              ngx_protobuf_size_message_field(n, part[i].field)
+                              - n);
+      if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+      b->last = ngx_protobuf_write_message_header(b->last, n, part[i].field);
+      len += b->last - b->pos;
+
+      if (ngx_http_protobuf_merge_link(r, &ll, b) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+      last = b;
+    }
+
+    for (cl = result->out; cl; cl = cl->next) {
+      if (cl->buf->last == cl->buf->pos) {
+        continue;
+      }
+
+      b = ngx_calloc_buf(r->pool);
+      if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+      b->start = b->pos = cl->buf->pos;
+      b->end = b->last = cl->buf->last;
+      b->memory = 1;
+
+      if (ngx_http_protobuf_merge_link(r, &ll, b) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+      last = b;
+    }
+
+    len += n;
+  }
+
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = len;
+
+  ngx_str_set(&r->headers_out.content_type, NGX_HTTP_PROTOBUF_MERGE_TYPE);
+  r->headers_out.content_type_len = r->headers_out.content_type.len;
+  r->headers_out.content_type_lowcase = NULL;
+
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    return rc;
+  }
+
+  if (last == NULL) {
+    return ngx_http_send_special(r, NGX_HTTP_LAST);
+  }
+
+  last->last_buf = 1;
+  last->last_in_chain = 1;
+
+  return ngx_http_output_filter(r, out);
+}
+
+static void *
+ngx_http_protobuf_merge_create_loc_conf(ngx_conf_t *cf)
+{
+  ngx_http_protobuf_merge_loc_conf_t  *conf;
+
+  conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_protobuf_merge_loc_conf_t));
+  if (conf == NULL) {
+    return NULL;
+  }
+
+  /* set by ngx_pcalloc():
+   *
+   *   conf->parts = NULL;
+   *
+   * the parts are not inherited, as the content handler is only set
+   * in the locations that list them.
+   */
+
+  return conf;
+}
+
+/* protobuf_merge uri [field=number]; */
+
+static char *
+ngx_http_protobuf_merge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_protobuf_merge_loc_conf_t  *mlcf = conf;
+  ngx_http_protobuf_merge_part_t      *part;
+  ngx_http_compile_complex_value_t     ccv;
+  ngx_http_core_loc_conf_t            *clcf;
+  ngx_str_t                           *value;
+  ngx_int_t                            n;
+
+  value = cf->args->elts;
+
+  if (mlcf->parts == NULL) {
+    mlcf->parts = ngx_array_create(cf->pool, 4,
+                                   sizeof(ngx_http_protobuf_merge_part_t));
+    if (mlcf->parts == NULL) {
+      return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_protobuf_merge_handler;
+  }
+
+  part = ngx_array_push(mlcf->parts);
+  if (part == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+  ccv.cf = cf;
+  ccv.value = &value[1];
+  ccv.complex_value = &part->uri;
+
+  if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+    return NGX_CONF_ERROR;
+  }
+
+  part->field = 0;
+
+  if (cf->args->nelts == 3) {
+    if (value[2].len <= 6 || ngx_strncmp(value[2].data, "field=", 6) != 0) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                         "invalid parameter \"%V\"", &value[2]);
+      return NGX_CONF_ERROR;
+    }
+
+    n = ngx_atoi(value[2].data + 6, value[2].len - 6);
+    if (n == NGX_ERROR || n == 0 || n > NGX_PROTOBUF_MAX_FIELD) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                         "invalid field number \"%V\"", &value[2]);
+      return NGX_CONF_ERROR;
+    }
+
+    part->field = (uint32_t) n;
+  }
+
+  return NGX_CONF_OK;
+}
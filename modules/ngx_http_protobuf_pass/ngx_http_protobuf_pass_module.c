@@ -0,0 +1,958 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_protobuf.h>
+
+/* passes requests to backends that speak length-delimited protobuf
+ * over plain TCP: each message on the connection is preceded by its
+ * length as a varint, and each request is answered with one message.
+ * the upstream side follows the memcached module.
+ *
+ * with protobuf_pass_request, the request message is built from the
+ * fields given there, evaluated per request, and packed directly into
+ * the buffer that is sent; the response is the reply message alone.
+ * otherwise the request body holds any number of delimited messages,
+ * which are sent upstream in one go, as a pipeline, and the response
+ * is the replies in the same form, passed on as they arrive.
+ *
+ * replies are parsed as they are read, and never buffered whole.  a
+ * connection whose replies all arrived, and nothing more, is handed
+ * back to the keepalive cache of the upstream.
+ */
+
+#define NGX_HTTP_PROTOBUF_PASS_TYPE  "application/x-protobuf"
+
+typedef struct {
+  ngx_protobuf_field_descriptor_t    *field;
+  ngx_http_complex_value_t            value;
+} ngx_http_protobuf_pass_field_t;
+
+typedef struct {
+  ngx_http_upstream_conf_t            upstream;
+  ngx_protobuf_message_descriptor_t  *request;
+  ngx_array_t                        *fields;
+} ngx_http_protobuf_pass_loc_conf_t;
+
+typedef struct {
+  ngx_http_request_t                 *request;
+  /* the requests sent, and the replies still to come */
+  ngx_uint_t                          requests;
+  ngx_uint_t                          replies;
+  /* the length prefix being read, and what is left of the reply */
+  uint64_t                            length;
+  ngx_uint_t                          shift;
+  off_t                               rest;
+  unsigned                            body:1;
+  unsigned                            pipelined:1;
+} ngx_http_protobuf_pass_ctx_t;
+
+static ngx_int_t ngx_http_protobuf_pass_create_request(ngx_http_request_t *r);
+static ngx_int_t ngx_http_protobuf_pass_reinit_request(ngx_http_request_t *r);
+static ngx_int_t ngx_http_protobuf_pass_process_header(ngx_http_request_t *r);
+static ngx_int_t ngx_http_protobuf_pass_filter_init(void *data);
+static ngx_int_t ngx_http_protobuf_pass_filter(void *data, ssize_t bytes);
+static void ngx_http_protobuf_pass_abort_request(ngx_http_request_t *r);
+static void ngx_http_protobuf_pass_finalize_request(ngx_http_request_t *r,
+                                                    ngx_int_t rc);
+static void ngx_http_protobuf_pass_body_handler(ngx_http_request_t *r);
+static void *ngx_http_protobuf_pass_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_protobuf_pass_merge_loc_conf(ngx_conf_t *cf,
+                                                   void *parent,
+                                                   void *child);
+static char *ngx_http_protobuf_pass(ngx_conf_t *cf,
+                                    ngx_command_t *cmd,
+                                    void *conf);
+static char *ngx_http_protobuf_pass_request(ngx_conf_t *cf,
+                                            ngx_command_t *cmd,
+                                            void *conf);
+
+static ngx_conf_bitmask_t  ngx_http_protobuf_pass_next_upstream_masks[] = {
+  { ngx_string("error"), NGX_HTTP_UPSTREAM_FT_ERROR },
+  { ngx_string("timeout"), NGX_HTTP_UPSTREAM_FT_TIMEOUT },
+  { ngx_string("invalid_response"), NGX_HTTP_UPSTREAM_FT_INVALID_HEADER },
+  { ngx_string("off"), NGX_HTTP_UPSTREAM_FT_OFF },
+  { ngx_null_string, 0 }
+};
+
+static ngx_command_t ngx_http_protobuf_pass_commands[] = {
+
+  { ngx_string("protobuf_pass"),
+    NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1,
+    ngx_http_protobuf_pass,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("protobuf_pass_request"),
+    NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_1MORE,
+    ngx_http_protobuf_pass_request,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("protobuf_pass_connect_timeout"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_msec_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_protobuf_pass_loc_conf_t, upstream.connect_timeout),
+    NULL },
+
+  { ngx_string("protobuf_pass_send_timeout"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_msec_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_protobuf_pass_loc_conf_t, upstream.send_timeout),
+    NULL },
+
+  { ngx_string("protobuf_pass_read_timeout"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_msec_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_protobuf_pass_loc_conf_t, upstream.read_timeout),
+    NULL },
+
+  { ngx_string("protobuf_pass_buffer_size"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_size_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_protobuf_pass_loc_conf_t, upstream.buffer_size),
+    NULL },
+
+  { ngx_string("protobuf_pass_next_upstream"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+    ngx_conf_set_bitmask_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_protobuf_pass_loc_conf_t, upstream.next_upstream),
+    &ngx_http_protobuf_pass_next_upstream_masks },
+
+  ngx_null_command
+};
+
+static ngx_http_module_t ngx_http_protobuf_pass_module_ctx = {
+  NULL,                                    /* preconfiguration */
+  NULL,                                    /* postconfiguration */
+  NULL,                                    /* create main configuration */
+  NULL,                                    /* init main configuration */
+  NULL,                                    /* create server configuration */
+  NULL,                                    /* merge server configuration */
+  ngx_http_protobuf_pass_create_loc_conf,  /* create location configuration */
+  ngx_http_protobuf_pass_merge_loc_conf    /* merge location configuration */
+};
+
+ngx_module_t ngx_http_protobuf_pass_module = {
+  NGX_MODULE_V1,
+  &ngx_http_protobuf_pass_module_ctx,  /* module context */
+  ngx_http_protobuf_pass_commands,     /* module directives */
+  NGX_HTTP_MODULE,                     /* module type */
+  NULL,                                /* init master */
+  NULL,                                /* init module */
+  NULL,                                /* init process */
+  NULL,                                /* init thread */
+  NULL,                                /* exit thread */
+  NULL,                                /* exit process */
+  NULL,                                /* exit master */
+  NGX_MODULE_V1_PADDING
+};
+
+static ngx_int_t
+ngx_http_protobuf_pass_handler(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_pass_loc_conf_t  *plcf;
+  ngx_http_protobuf_pass_ctx_t       *ctx;
+  ngx_http_upstream_t                *u;
+  ngx_int_t                           rc;
+
+  plcf = ngx_http_get_module_loc_conf(r, ngx_http_protobuf_pass_module);
+
+  if (plcf->request == NULL) {
+    if (!(r->method & NGX_HTTP_POST)) {
+      return NGX_HTTP_NOT_ALLOWED;
+    }
+
+  } else {
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST))) {
+      return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+      return rc;
+    }
+  }
+
+  if (ngx_http_upstream_create(r) != NGX_OK) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  u = r->upstream;
+
+  ngx_str_set(&u->schema, "protobuf://");
+  u->output.tag = (ngx_buf_tag_t) &ngx_http_protobuf_pass_module;
+
+  u->conf = &plcf->upstream;
+
+  u->create_request = ngx_http_protobuf_pass_create_request;
+  u->reinit_request = ngx_http_protobuf_pass_reinit_request;
+  u->process_header = ngx_http_protobuf_pass_process_header;
+  u->abort_request = ngx_http_protobuf_pass_abort_request;
+  u->finalize_request = ngx_http_protobuf_pass_finalize_request;
+
+  ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_protobuf_pass_ctx_t));
+  if (ctx == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  /* set by ngx_pcalloc():
+   *
+   *   ctx->requests = 0;
+   *   ctx->length = 0;
+   *   ctx->shift = 0;
+   *   ctx->body = 0;
+   */
+
+  ctx->request = r;
+  ctx->pipelined = (plcf->request == NULL);
+
+  ngx_http_set_ctx(r, ctx, ngx_http_protobuf_pass_module);
+
+  u->input_filter_init = ngx_http_protobuf_pass_filter_init;
+  u->input_filter = ngx_http_protobuf_pass_filter;
+  u->input_filter_ctx = ctx;
+
+  if (ctx->pipelined) {
+    rc = ngx_http_read_client_request_body(r,
+                                         ngx_http_protobuf_pass_body_handler);
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+      return rc;
+    }
+
+    return NGX_DONE;
+  }
+
+  ctx->requests = 1;
+
+  r->main->count++;
+
+  ngx_http_upstream_init(r);
+
+  return NGX_DONE;
+}
+
+/* reads the next byte of a length prefix.  returns NGX_OK once the
+ * prefix is complete, NGX_AGAIN before, or NGX_ERROR if it is not a
+ * valid length.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_pass_prefix(ngx_http_protobuf_pass_ctx_t *ctx, u_char c)
+{
+  if (ctx->shift > 63) {
+    return NGX_ERROR;
+  }
+
+  ctx->length |= (uint64_t) (c & 0x7f) << ctx->shift;
+  ctx->shift += 7;
+
+  if (c & 0x80) {
+    return NGX_AGAIN;
+  }
+
+  if (ctx->length > (uint64_t) NGX_MAX_OFF_T_VALUE) {
+    return NGX_ERROR;
+  }
+
+  ctx->rest = (off_t) ctx->length;
+  ctx->length = 0;
+  ctx->shift = 0;
+
+  return NGX_OK;
+}
+
+/* counts the delimited messages in the request body.  the prefixes of
+ * messages that were written to a file are read back, and the messages
+ * themselves are skipped.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_pass_count(ngx_http_request_t *r,
+                             ngx_http_protobuf_pass_ctx_t *ctx)
+{
+  ngx_chain_t  *cl;
+  ngx_buf_t    *b;
+  u_char        prefix[16];
+  u_char       *p, *last;
+  off_t         offset, size;
+  ssize_t       n;
+  ngx_int_t     rc;
+
+  if (r->request_body == NULL) {
+    return NGX_ERROR;
+  }
+
+  for (cl = r->request_body->bufs; cl; cl = cl->next) {
+    b = cl->buf;
+
+    if (b->in_file) {
+      offset = b->file_pos;
+      size = b->file_last;
+    } else {
+      offset = 0;
+      size = b->last - b->pos;
+    }
+
+    while (offset < size) {
+
+      if (ctx->body) {
+        n = (ssize_t) ngx_min(size - offset, ctx->rest);
+
+        offset += n;
+        ctx->rest -= n;
+
+        if (ctx->rest == 0) {
+          ctx->body = 0;
+        }
+
+        continue;
+      }
+
+      if (b->in_file) {
+        n = ngx_read_file(b->file, prefix,
+                          (size_t) ngx_min(size - offset,
+                                           (off_t) sizeof(prefix)),
+                          offset);
+        if (n == NGX_ERROR || n == 0) {
+          return NGX_ERROR;
+        }
+
+        p = prefix;
+        last = prefix + n;
+
+      } else {
+        p = b->pos + offset;
+        last = b->last;
+      }
+
+      do {
+        rc = ngx_http_protobuf_pass_prefix(ctx, *p++);
+      } while (rc == NGX_AGAIN && p < last);
+
+      offset += p - (b->in_file ? prefix : b->pos + offset);
+
+      if (rc == NGX_ERROR) {
+        return NGX_DECLINED;
+      }
+
+      if (rc == NGX_OK) {
+        ctx->requests++;
+        ctx->body = (ctx->rest > 0);
+      }
+    }
+  }
+
+  /* the body ends in the middle of a message */
+
+  if (ctx->body || ctx->shift > 0) {
+    return NGX_DECLINED;
+  }
+
+  return (ctx->requests > 0) ? NGX_OK : NGX_DECLINED;
+}
+
+static void
+ngx_http_protobuf_pass_body_handler(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_pass_ctx_t  *ctx;
+  ngx_int_t                      rc;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_pass_module);
+
+  rc = ngx_http_protobuf_pass_count(r, ctx);
+
+  if (rc == NGX_DECLINED) {
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "request body is not a sequence of delimited messages");
+    ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+    return;
+  }
+
+  if (rc != NGX_OK) {
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  ngx_http_upstream_init(r);
+}
+
+/* packs the request.  the values of the fields are evaluated and sized
+ * first, and the message is then written, with its length prefix, into
+ * a buffer of exactly that size, which is what goes upstream.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_pass_pack(ngx_http_request_t *r,
+                            ngx_http_protobuf_pass_loc_conf_t *plcf)
+{
+  ngx_http_protobuf_pass_field_t   *f;
+  ngx_protobuf_field_descriptor_t  *field;
+  ngx_http_upstream_t              *u = r->upstream;
+  ngx_chain_t                      *cl;
+  ngx_buf_t                        *b;
+  ngx_str_t                        *values;
+  u_char                           *scalars, *p, *q;
+  size_t                            size;
+  ngx_uint_t                        i, n;
+
+  n = plcf->fields ? plcf->fields->nelts : 0;
+  f = n ? plcf->fields->elts : NULL;
+
+  values = ngx_palloc(r->pool, (n + 1) * sizeof(ngx_str_t));
+  if (values == NULL) {
+    return NGX_ERROR;
+  }
+
+  /* scalars are encoded into scratch space to learn their width */
+
+  scalars = ngx_pnalloc(r->pool, (n + 1) * 10);
+  if (scalars == NULL) {
+    return NGX_ERROR;
+  }
+
+  size = 0;
+
+  for (i = 0; i < n; i++) {
+    field = f[i].field;
+
+    if (ngx_http_complex_value(r, &f[i].value, &values[i]) != NGX_OK) {
+      return NGX_ERROR;
+    }
+
+    size += ngx_protobuf_size_uint32((field->number << 3)
+                                     | field->wire_type);
+
+    if (field->wire_type == NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED) {
+      size += ngx_protobuf_size_string(&values[i]);
+      continue;
+    }
+
+    p = ngx_protobuf_parse_value(field, &values[i], scalars + i * 10);
+    if (p == NULL) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "invalid value \"%V\" of field \"%V\"",
+                    &values[i], &field->name);
+      return NGX_ERROR;
+    }
+
+    /* the scratch value now stands in for the text */
+
+    values[i].data = scalars + i * 10;
+    values[i].len = p - values[i].data;
+
+    size += values[i].len;
+  }
+
+  b = ngx_create_temp_buf(r->pool, ngx_protobuf_size_uint32(size) + size);
+  if (b == NULL) {
+    return NGX_ERROR;
+  }
+
+  q = ngx_protobuf_write_uint32(b->last, size);
+
+  for (i = 0; i < n; i++) {
+    field = f[i].field;
+
+    q = ngx_protobuf_write_uint32(q, (field->number << 3) | field->wire_type);
+
+    if (field->wire_type == NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED) {
+      q = ngx_protobuf_write_string(q, &values[i]);
+    } else {
+      q = ngx_cpymem(q, values[i].data, values[i].len);
+    }
+  }
+
+  b->last = q;
+
+  cl = ngx_alloc_chain_link(r->pool);
+  if (cl == NULL) {
+    return NGX_ERROR;
+  }
+
+  cl->buf = b;
+  cl->next = NULL;
+
+  u->request_bufs = cl;
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_protobuf_pass_create_request(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_pass_loc_conf_t  *plcf;
+  ngx_http_upstream_t                *u = r->upstream;
+  ngx_chain_t                        *body, *cl, **ll;
+  ngx_buf_t                          *b;
+
+  plcf = ngx_http_get_module_loc_conf(r, ngx_http_protobuf_pass_module);
+
+  if (plcf->request != NULL) {
+    return ngx_http_protobuf_pass_pack(r, plcf);
+  }
+
+  /* the body goes as it is, in buffers of our own, as proxy sends it */
+
+  body = u->request_bufs;
+  ll = &u->request_bufs;
+
+  for ( /* void */ ; body; body = body->next) {
+    b = ngx_alloc_buf(r->pool);
+    if (b == NULL) {
+      return NGX_ERROR;
+    }
+
+    ngx_memcpy(b, body->buf, sizeof(ngx_buf_t));
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+      return NGX_ERROR;
+    }
+
+    cl->buf = b;
+    *ll = cl;
+    ll = &cl->next;
+  }
+
+  *ll = NULL;
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_protobuf_pass_reinit_request(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_pass_ctx_t  *ctx;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_pass_module);
+
+  ctx->length = 0;
+  ctx->shift = 0;
+  ctx->rest = 0;
+  ctx->body = 0;
+
+  return NGX_OK;
+}
+
+/* there is no header: the response starts with the length of the
+ * first reply.  a single reply is sent on without it, so the length
+ * is read here; pipelined replies keep theirs, and are left to the
+ * filter whole.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_pass_process_header(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_pass_ctx_t  *ctx;
+  ngx_http_upstream_t           *u = r->upstream;
+  ngx_int_t                      rc;
+  u_char                        *p;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_pass_module);
+
+  if (!ctx->pipelined) {
+    p = u->buffer.pos;
+    rc = NGX_AGAIN;
+
+    while (rc == NGX_AGAIN && p < u->buffer.last) {
+      rc = ngx_http_protobuf_pass_prefix(ctx, *p++);
+    }
+
+    u->buffer.pos = p;
+
+    if (rc == NGX_AGAIN) {
+      return NGX_AGAIN;
+    }
+
+    if (rc == NGX_ERROR) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "upstream sent invalid message length");
+      return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+    }
+
+    u->headers_in.content_length_n = ctx->rest;
+  }
+
+  ctx->replies = ctx->requests;
+
+  u->headers_in.status_n = 200;
+  u->state->status = 200;
+
+  ngx_str_set(&r->headers_out.content_type, NGX_HTTP_PROTOBUF_PASS_TYPE);
+  r->headers_out.content_type_len = r->headers_out.content_type.len;
+  r->headers_out.content_type_lowcase = NULL;
+
+  return NGX_OK;
+}
+
+/* u->length stays positive for as long as replies are due, so that a
+ * connection closed early is not taken for the end of the response.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_pass_filter_init(void *data)
+{
+  ngx_http_protobuf_pass_ctx_t  *ctx = data;
+  ngx_http_upstream_t           *u = ctx->request->upstream;
+
+  if (!ctx->pipelined) {
+    ctx->body = 1;
+    u->length = ctx->rest;
+
+    if (u->length == 0) {
+      ctx->body = 0;
+      ctx->replies = 0;
+      u->keepalive = 1;
+    }
+
+    return NGX_OK;
+  }
+
+  u->length = 1;
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_protobuf_pass_filter(void *data, ssize_t bytes)
+{
+  ngx_http_protobuf_pass_ctx_t  *ctx = data;
+  ngx_http_request_t            *r = ctx->request;
+  ngx_http_upstream_t           *u = r->upstream;
+  ngx_chain_t                   *cl, **ll;
+  ngx_buf_t                     *b;
+  u_char                        *p, *last;
+  off_t                          n;
+  ngx_int_t                      rc;
+
+  b = &u->buffer;
+
+  p = b->last;
+  last = b->last + bytes;
+
+  b->last = last;
+
+  /* follow the replies through the bytes read */
+
+  while (p < last && ctx->replies > 0) {
+
+    if (ctx->body) {
+      n = ngx_min(last - p, ctx->rest);
+
+      p += n;
+      ctx->rest -= n;
+
+      if (ctx->rest == 0) {
+        ctx->body = 0;
+        ctx->replies--;
+      }
+
+      continue;
+    }
+
+    rc = ngx_http_protobuf_pass_prefix(ctx, *p++);
+
+    if (rc == NGX_ERROR) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "upstream sent invalid message length");
+      return NGX_ERROR;
+    }
+
+    if (rc == NGX_OK) {
+      if (ctx->rest > 0) {
+        ctx->body = 1;
+      } else {
+        ctx->replies--;
+      }
+    }
+  }
+
+  if (p > last - bytes) {
+    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+      ll = &cl->next;
+    }
+
+    cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs);
+    if (cl == NULL) {
+      return NGX_ERROR;
+    }
+
+    cl->buf->flush = 1;
+    cl->buf->memory = 1;
+
+    *ll = cl;
+
+    cl->buf->pos = last - bytes;
+    cl->buf->last = p;
+    cl->buf->tag = u->output.tag;
+  }
+
+  if (ctx->replies > 0) {
+    if (!ctx->pipelined) {
+      u->length = ctx->rest;
+    }
+
+    return NGX_OK;
+  }
+
+  u->length = 0;
+
+  if (p < last) {
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                  "upstream sent more data than expected");
+    u->keepalive = 0;
+    return NGX_OK;
+  }
+
+  u->keepalive = 1;
+
+  return NGX_OK;
+}
+
+static void
+ngx_http_protobuf_pass_abort_request(ngx_http_request_t *r)
+{
+  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                 "abort http protobuf request");
+  return;
+}
+
+static void
+ngx_http_protobuf_pass_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
+{
+  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                 "finalize http protobuf request");
+  return;
+}
+
+static void *
+ngx_http_protobuf_pass_create_loc_conf(ngx_conf_t *cf)
+{
+  ngx_http_protobuf_pass_loc_conf_t  *conf;
+
+  conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_protobuf_pass_loc_conf_t));
+  if (conf == NULL) {
+    return NULL;
+  }
+
+  /* set by ngx_pcalloc():
+   *
+   *   conf->upstream.bufs.num = 0;
+   *   conf->upstream.next_upstream = 0;
+   *   conf->upstream.temp_path = NULL;
+   *   conf->request = NULL;
+   *   conf->fields = NULL;
+   */
+
+  conf->upstream.local = NGX_CONF_UNSET_PTR;
+  conf->upstream.next_upstream_tries = NGX_CONF_UNSET_UINT;
+  conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
+  conf->upstream.send_timeout = NGX_CONF_UNSET_MSEC;
+  conf->upstream.read_timeout = NGX_CONF_UNSET_MSEC;
+  conf->upstream.next_upstream_timeout = NGX_CONF_UNSET_MSEC;
+
+  conf->upstream.buffer_size = NGX_CONF_UNSET_SIZE;
+
+  /* the hardcoded values */
+  conf->upstream.cyclic_temp_file = 0;
+  conf->upstream.buffering = 0;
+  conf->upstream.ignore_client_abort = 0;
+  conf->upstream.send_lowat = 0;
+  conf->upstream.bufs.num = 0;
+  conf->upstream.busy_buffers_size = 0;
+  conf->upstream.max_temp_file_size = 0;
+  conf->upstream.temp_file_write_size = 0;
+  conf->upstream.intercept_errors = 1;
+  conf->upstream.intercept_404 = 1;
+  conf->upstream.pass_request_headers = 0;
+  conf->upstream.pass_request_body = 0;
+  conf->upstream.force_ranges = 1;
+
+  return conf;
+}
+
+static char *
+ngx_http_protobuf_pass_merge_loc_conf(ngx_conf_t *cf,
+                                      void *parent,
+                                      void *child)
+{
+  ngx_http_protobuf_pass_loc_conf_t  *prev = parent;
+  ngx_http_protobuf_pass_loc_conf_t  *conf = child;
+
+  ngx_conf_merge_ptr_value(conf->upstream.local, prev->upstream.local, NULL);
+
+  ngx_conf_merge_uint_value(conf->upstream.next_upstream_tries,
+                            prev->upstream.next_upstream_tries, 0);
+
+  ngx_conf_merge_msec_value(conf->upstream.connect_timeout,
+                            prev->upstream.connect_timeout, 60000);
+
+  ngx_conf_merge_msec_value(conf->upstream.send_timeout,
+                            prev->upstream.send_timeout, 60000);
+
+  ngx_conf_merge_msec_value(conf->upstream.read_timeout,
+                            prev->upstream.read_timeout, 60000);
+
+  ngx_conf_merge_msec_value(conf->upstream.next_upstream_timeout,
+                            prev->upstream.next_upstream_timeout, 0);
+
+  ngx_conf_merge_size_value(conf->upstream.buffer_size,
+                            prev->upstream.buffer_size,
+                            (size_t) ngx_pagesize);
+
+  ngx_conf_merge_bitmask_value(conf->upstream.next_upstream,
+                               prev->upstream.next_upstream,
+                               (NGX_CONF_BITMASK_SET
+                                |NGX_HTTP_UPSTREAM_FT_ERROR
+                                |NGX_HTTP_UPSTREAM_FT_TIMEOUT));
+
+  if (conf->upstream.next_upstream & NGX_HTTP_UPSTREAM_FT_OFF) {
+    conf->upstream.next_upstream = NGX_CONF_BITMASK_SET
+                                   |NGX_HTTP_UPSTREAM_FT_OFF;
+  }
+
+  if (conf->upstream.upstream == NULL) {
+    conf->upstream.upstream = prev->upstream.upstream;
+  }
+
+  if (conf->request == NULL) {
+    conf->request = prev->request;
+    conf->fields = prev->fields;
+  }
+
+  return NGX_CONF_OK;
+}
+
+/* protobuf_pass address; */
+
+static char *
+ngx_http_protobuf_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_protobuf_pass_loc_conf_t  *plcf = conf;
+  ngx_http_core_loc_conf_t           *clcf;
+  ngx_str_t                          *value;
+  ngx_url_t                           u;
+
+  if (plcf->upstream.upstream) {
+    return "is duplicate";
+  }
+
+  value = cf->args->elts;
+
+  ngx_memzero(&u, sizeof(ngx_url_t));
+
+  u.url = value[1];
+  u.no_resolve = 1;
+
+  plcf->upstream.upstream = ngx_http_upstream_add(cf, &u, 0);
+  if (plcf->upstream.upstream == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+  clcf->handler = ngx_http_protobuf_pass_handler;
+
+  if (clcf->name.len && clcf->name.data[clcf->name.len - 1] == '/') {
+    clcf->auto_redirect = 1;
+  }
+
+  return NGX_CONF_OK;
+}
+
+/* protobuf_pass_request type [field=value ...]; */
+
+static char *
+ngx_http_protobuf_pass_request(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_protobuf_pass_loc_conf_t  *plcf = conf;
+  ngx_http_protobuf_pass_field_t     *f;
+  ngx_http_compile_complex_value_t    ccv;
+  ngx_str_t                          *value, name, text;
+  ngx_uint_t                          i, k;
+  u_char                             *eq;
+
+  if (plcf->request != NULL) {
+    return "is duplicate";
+  }
+
+  value = cf->args->elts;
+
+  plcf->request = ngx_protobuf_find_message(&value[1]);
+  if (plcf->request == NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "unknown message type \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  plcf->fields = ngx_array_create(cf->pool, cf->args->nelts,
+                                  sizeof(ngx_http_protobuf_pass_field_t));
+  if (plcf->fields == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  for (i = 2; i < cf->args->nelts; i++) {
+    eq = ngx_strlchr(value[i].data, value[i].data + value[i].len, '=');
+    if (eq == NULL || eq == value[i].data) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                         "invalid parameter \"%V\"", &value[i]);
+      return NGX_CONF_ERROR;
+    }
+
+    name.data = value[i].data;
+    name.len = eq - value[i].data;
+
+    text.data = eq + 1;
+    text.len = value[i].data + value[i].len - text.data;
+
+    f = ngx_array_push(plcf->fields);
+    if (f == NULL) {
+      return NGX_CONF_ERROR;
+    }
+
+    f->field = NULL;
+    for (k = 0; k < plcf->request->nfields; ++k) {
+      if (plcf->request->fields[k]->name.len == name.len
+          && ngx_strncmp(plcf->request->fields[k]->name.data, name.data,
+                         name.len) == 0)
+      {
+        f->field = plcf->request->fields[k];
+        break;
+      }
+    }
+
+    if (f->field == NULL) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                         "message type \"%V\" has no field \"%V\"",
+                         &value[1], &name);
+      return NGX_CONF_ERROR;
+    }
+
+    if (f->field->type == NGX_PROTOBUF_TYPE_MESSAGE
+        || f->field->type == NGX_PROTOBUF_TYPE_GROUP)
+    {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                         "field \"%V\" is not a scalar", &name);
+      return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &text;
+    ccv.complex_value = &f->value;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+      return NGX_CONF_ERROR;
+    }
+  }
+
+  return NGX_CONF_OK;
+}
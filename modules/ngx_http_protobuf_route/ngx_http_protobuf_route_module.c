@@ -0,0 +1,639 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_protobuf.h>
+
+/* routing keys taken from a field of a protobuf request body.  the body
+ * chain is read in place, one buffer after another, and parsing stops
+ * at the first occurrence of the field: everything before it is
+ * skipped without being decoded, and nothing after it is looked at.
+ * the key is meant for "hash $key consistent" in an upstream block, or
+ * for a map that names the upstream.
+ */
+
+#define NGX_HTTP_PROTOBUF_ROUTE_MAX_DEPTH  16
+
+#define NGX_HTTP_PROTOBUF_ROUTE_UNKNOWN    0
+#define NGX_HTTP_PROTOBUF_ROUTE_FOUND      1
+#define NGX_HTTP_PROTOBUF_ROUTE_NOT_FOUND  2
+
+typedef struct {
+  ngx_str_t                           message;
+  ngx_uint_t                          index;
+  ngx_uint_t                          depth;
+  ngx_protobuf_field_descriptor_t    *path[NGX_HTTP_PROTOBUF_ROUTE_MAX_DEPTH];
+} ngx_http_protobuf_route_t;
+
+typedef struct {
+  ngx_uint_t                          nroutes;
+} ngx_http_protobuf_route_main_conf_t;
+
+typedef struct {
+  ngx_uint_t                          state;
+  ngx_str_t                           key;
+} ngx_http_protobuf_route_key_t;
+
+typedef struct {
+  ngx_http_protobuf_route_key_t      *keys;
+  off_t                               bytes;
+  ngx_uint_t                          fields;
+} ngx_http_protobuf_route_ctx_t;
+
+/* a position in the request body chain */
+
+typedef struct {
+  ngx_chain_t                        *cl;
+  u_char                             *pos;
+  off_t                               offset;
+  ngx_uint_t                          fields;
+} ngx_http_protobuf_route_cursor_t;
+
+static ngx_int_t ngx_http_protobuf_route_get(ngx_http_request_t *r,
+                                             ngx_http_variable_value_t *v,
+                                             uintptr_t data);
+static ngx_int_t ngx_http_protobuf_route_counter(ngx_http_request_t *r,
+                                                 ngx_http_variable_value_t *v,
+                                                 uintptr_t data);
+static ngx_int_t ngx_http_protobuf_route_add_variables(ngx_conf_t *cf);
+static void *ngx_http_protobuf_route_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_protobuf_route(ngx_conf_t *cf,
+                                     ngx_command_t *cmd,
+                                     void *conf);
+
+static ngx_command_t ngx_http_protobuf_route_commands[] = {
+
+  { ngx_string("protobuf_route"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3,
+    ngx_http_protobuf_route,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+
+  ngx_null_command
+};
+
+static ngx_http_module_t ngx_http_protobuf_route_module_ctx = {
+  ngx_http_protobuf_route_add_variables,     /* preconfiguration */
+  NULL,                                      /* postconfiguration */
+  ngx_http_protobuf_route_create_main_conf,  /* create main configuration */
+  NULL,                                      /* init main configuration */
+  NULL,                                      /* create server configuration */
+  NULL,                                      /* merge server configuration */
+  NULL,                                      /* create location configuration */
+  NULL                                       /* merge location configuration */
+};
+
+ngx_module_t ngx_http_protobuf_route_module = {
+  NGX_MODULE_V1,
+  &ngx_http_protobuf_route_module_ctx,  /* module context */
+  ngx_http_protobuf_route_commands,     /* module directives */
+  NGX_HTTP_MODULE,                      /* module type */
+  NULL,                                 /* init master */
+  NULL,                                 /* init module */
+  NULL,                                 /* init process */
+  NULL,                                 /* init thread */
+  NULL,                                 /* exit thread */
+  NULL,                                 /* exit process */
+  NULL,                                 /* exit master */
+  NGX_MODULE_V1_PADDING
+};
+
+static ngx_http_variable_t ngx_http_protobuf_route_vars[] = {
+
+  { ngx_string("protobuf_route_bytes"), NULL,
+    ngx_http_protobuf_route_counter,
+    offsetof(ngx_http_protobuf_route_ctx_t, bytes),
+    NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+  { ngx_string("protobuf_route_fields"), NULL,
+    ngx_http_protobuf_route_counter,
+    offsetof(ngx_http_protobuf_route_ctx_t, fields),
+    NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+  ngx_http_null_variable
+};
+
+static ngx_http_protobuf_route_ctx_t *
+ngx_http_protobuf_route_ctx(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_route_main_conf_t  *prmcf;
+  ngx_http_protobuf_route_ctx_t        *ctx;
+
+  r = r->main;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_route_module);
+  if (ctx != NULL) {
+    return ctx;
+  }
+
+  prmcf = ngx_http_get_module_main_conf(r, ngx_http_protobuf_route_module);
+
+  ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_protobuf_route_ctx_t));
+  if (ctx == NULL) {
+    return NULL;
+  }
+
+  ctx->keys = ngx_pcalloc(r->pool, prmcf->nroutes
+                          * sizeof(ngx_http_protobuf_route_key_t));
+  if (ctx->keys == NULL) {
+    return NULL;
+  }
+
+  ngx_http_set_ctx(r, ctx, ngx_http_protobuf_route_module);
+
+  return ctx;
+}
+
+/* moves past the end of exhausted buffers.  the body ends at the first
+ * buffer that is not in memory.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_route_fill(ngx_http_protobuf_route_cursor_t *c)
+{
+  while (c->cl != NULL && c->pos == c->cl->buf->last) {
+    c->cl = c->cl->next;
+    if (c->cl == NULL || !ngx_buf_in_memory_only(c->cl->buf)) {
+      c->cl = NULL;
+      break;
+    }
+    c->pos = c->cl->buf->pos;
+  }
+
+  return (c->cl == NULL) ? NGX_DECLINED : NGX_OK;
+}
+
+/* reads a varint, which may be split across buffers.  the raw bytes are
+ * copied to raw, if it is not NULL.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_route_varint(ngx_http_protobuf_route_cursor_t *c,
+                               uint64_t *value,
+                               u_char *raw,
+                               size_t *len)
+{
+  uint64_t    v;
+  ngx_uint_t  n;
+  u_char      b;
+
+  v = 0;
+
+  for (n = 0; n < 10; ++n) {
+    if (ngx_http_protobuf_route_fill(c) != NGX_OK) {
+      return NGX_DECLINED;
+    }
+
+    b = *c->pos++;
+    c->offset++;
+
+    if (raw != NULL) {
+      raw[n] = b;
+    }
+
+    v |= (uint64_t) (b & 0x7f) << (7 * n);
+
+    if (!(b & 0x80)) {
+      *value = v;
+      if (len != NULL) {
+        *len = n + 1;
+      }
+      return NGX_OK;
+    }
+  }
+
+  return NGX_ABORT;
+}
+
+/* skips len bytes, or copies them to buf if it is not NULL */
+
+static ngx_int_t
+ngx_http_protobuf_route_skip(ngx_http_protobuf_route_cursor_t *c,
+                             uint64_t len,
+                             u_char *buf)
+{
+  size_t  n;
+
+  while (len > 0) {
+    if (ngx_http_protobuf_route_fill(c) != NGX_OK) {
+      return NGX_DECLINED;
+    }
+
+    n = c->cl->buf->last - c->pos;
+    if (n > len) {
+      n = len;
+    }
+
+    if (buf != NULL) {
+      buf = ngx_cpymem(buf, c->pos, n);
+    }
+
+    c->pos += n;
+    c->offset += n;
+    len -= n;
+  }
+
+  return NGX_OK;
+}
+
+/* checks that len more bytes are in the body, before they are copied */
+
+static ngx_int_t
+ngx_http_protobuf_route_available(ngx_http_protobuf_route_cursor_t *c,
+                                  uint64_t len)
+{
+  ngx_chain_t  *cl;
+  uint64_t      n;
+
+  if (c->cl == NULL) {
+    return NGX_DECLINED;
+  }
+
+  n = c->cl->buf->last - c->pos;
+
+  for (cl = c->cl->next; n < len && cl; cl = cl->next) {
+    if (!ngx_buf_in_memory_only(cl->buf)) {
+      break;
+    }
+    n += cl->buf->last - cl->buf->pos;
+  }
+
+  return (n >= len) ? NGX_OK : NGX_DECLINED;
+}
+
+/* reads the value of the field the cursor is at, as text */
+
+static ngx_int_t
+ngx_http_protobuf_route_value(ngx_http_request_t *r,
+                              ngx_http_protobuf_route_cursor_t *c,
+                              ngx_protobuf_field_descriptor_t *field,
+                              ngx_str_t *key)
+{
+  u_char    raw[10];
+  size_t    len;
+  uint64_t  v;
+  ngx_int_t rc;
+
+  switch (field->wire_type) {
+  case NGX_PROTOBUF_WIRETYPE_VARINT:
+    rc = ngx_http_protobuf_route_varint(c, &v, raw, &len);
+    break;
+  case NGX_PROTOBUF_WIRETYPE_FIXED64:
+    len = 8;
+    rc = ngx_http_protobuf_route_skip(c, len, raw);
+    break;
+  case NGX_PROTOBUF_WIRETYPE_FIXED32:
+    len = 4;
+    rc = ngx_http_protobuf_route_skip(c, len, raw);
+    break;
+  default:
+    rc = ngx_http_protobuf_route_varint(c, &v, NULL, NULL);
+    if (rc != NGX_OK) {
+      return rc;
+    }
+
+    key->len = v;
+
+    /* strings are copied only if they are split across buffers */
+
+    if (ngx_http_protobuf_route_fill(c) == NGX_OK
+        && (uint64_t) (c->cl->buf->last - c->pos) >= v)
+    {
+      key->data = c->pos;
+      return ngx_http_protobuf_route_skip(c, v, NULL);
+    }
+
+    rc = ngx_http_protobuf_route_available(c, v);
+    if (rc != NGX_OK) {
+      return rc;
+    }
+
+    key->data = ngx_pnalloc(r->pool, v);
+    if (key->data == NULL) {
+      return NGX_ERROR;
+    }
+
+    return ngx_http_protobuf_route_skip(c, v, key->data);
+  }
+
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  return ngx_protobuf_format_value(field, raw, raw + len, r->pool, key);
+}
+
+/* finds the first occurrence of the route's field.  a submessage on the
+ * path is entered where it is found, and left again if it ends without
+ * the rest of the path, in which case the search continues after it.
+ * returns NGX_DECLINED if the body ends first.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_route_find(ngx_http_request_t *r,
+                             ngx_http_protobuf_route_t *route,
+                             ngx_http_protobuf_route_cursor_t *c,
+                             ngx_str_t *key)
+{
+  ngx_protobuf_field_descriptor_t  *field;
+  off_t                             end[NGX_HTTP_PROTOBUF_ROUTE_MAX_DEPTH];
+  ngx_uint_t                        depth, groups;
+  uint64_t                          header, len;
+  uint32_t                          wire;
+  ngx_int_t                         rc;
+
+  depth = 0;
+  groups = 0;
+
+  for ( ;; ) {
+    while (depth > 0 && c->offset >= end[depth]) {
+      if (c->offset > end[depth]) {
+        return NGX_ABORT;
+      }
+      depth--;
+    }
+
+    rc = ngx_http_protobuf_route_varint(c, &header, NULL, NULL);
+    if (rc != NGX_OK) {
+      return rc;
+    }
+
+    wire = header & 0x07;
+    field = route->path[depth];
+
+    if (groups == 0
+        && (header >> 3) == field->number
+        && wire == field->wire_type)
+    {
+      if (depth == route->depth - 1) {
+        return ngx_http_protobuf_route_value(r, c, field, key);
+      }
+
+      rc = ngx_http_protobuf_route_varint(c, &len, NULL, NULL);
+      if (rc != NGX_OK) {
+        return rc;
+      }
+
+      end[++depth] = c->offset + len;
+      continue;
+    }
+
+    c->fields++;
+
+    switch (wire) {
+    case NGX_PROTOBUF_WIRETYPE_VARINT:
+      rc = ngx_http_protobuf_route_varint(c, &len, NULL, NULL);
+      break;
+    case NGX_PROTOBUF_WIRETYPE_FIXED64:
+      rc = ngx_http_protobuf_route_skip(c, 8, NULL);
+      break;
+    case NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED:
+      rc = ngx_http_protobuf_route_varint(c, &len, NULL, NULL);
+      if (rc == NGX_OK) {
+        rc = ngx_http_protobuf_route_skip(c, len, NULL);
+      }
+      break;
+    case NGX_PROTOBUF_WIRETYPE_START_GROUP:
+      if (++groups > NGX_PROTOBUF_MAX_GROUP_DEPTH) {
+        return NGX_ABORT;
+      }
+      rc = NGX_OK;
+      break;
+    case NGX_PROTOBUF_WIRETYPE_END_GROUP:
+      if (groups == 0) {
+        return NGX_ABORT;
+      }
+      groups--;
+      rc = NGX_OK;
+      break;
+    case NGX_PROTOBUF_WIRETYPE_FIXED32:
+      rc = ngx_http_protobuf_route_skip(c, 4, NULL);
+      break;
+    default:
+      rc = NGX_ABORT;
+      break;
+    }
+
+    if (rc != NGX_OK) {
+      return rc;
+    }
+  }
+}
+
+/* the key is not found until the body has been read, so the variable
+ * is not cacheable; once the search has come to an end, its result is
+ * kept for the rest of the request.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_route_get(ngx_http_request_t *r,
+                            ngx_http_variable_value_t *v,
+                            uintptr_t data)
+{
+  ngx_http_protobuf_route_t         *route = (ngx_http_protobuf_route_t *) data;
+  ngx_http_protobuf_route_cursor_t   c;
+  ngx_http_protobuf_route_ctx_t     *ctx;
+  ngx_http_protobuf_route_key_t     *key;
+  ngx_http_request_body_t           *rb;
+  ngx_str_t                          text;
+  ngx_int_t                          rc;
+
+  ctx = ngx_http_protobuf_route_ctx(r);
+  if (ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  key = &ctx->keys[route->index];
+
+  if (key->state == NGX_HTTP_PROTOBUF_ROUTE_UNKNOWN) {
+    rb = r->main->request_body;
+
+    if (rb == NULL || rb->bufs == NULL
+        || !ngx_buf_in_memory_only(rb->bufs->buf))
+    {
+      v->not_found = 1;
+      return NGX_OK;
+    }
+
+    c.cl = rb->bufs;
+    c.pos = rb->bufs->buf->pos;
+    c.offset = 0;
+    c.fields = 0;
+
+    rc = ngx_http_protobuf_route_find(r, route, &c, &text);
+
+    switch (rc) {
+    case NGX_OK:
+      key->state = NGX_HTTP_PROTOBUF_ROUTE_FOUND;
+      key->key = text;
+      break;
+    case NGX_DECLINED:
+      if (rb->rest > 0) {
+        /* more of the body may have arrived when we are asked again */
+        v->not_found = 1;
+        return NGX_OK;
+      }
+      key->state = NGX_HTTP_PROTOBUF_ROUTE_NOT_FOUND;
+      break;
+    case NGX_ERROR:
+      return NGX_ERROR;
+    default:
+      ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                    "malformed %V request body", &route->message);
+      key->state = NGX_HTTP_PROTOBUF_ROUTE_NOT_FOUND;
+      break;
+    }
+
+    ctx->bytes += c.offset;
+    ctx->fields += c.fields;
+  }
+
+  if (key->state != NGX_HTTP_PROTOBUF_ROUTE_FOUND) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+
+  v->data = key->key.data;
+  v->len = key->key.len;
+  v->valid = 1;
+  v->no_cacheable = 0;
+  v->not_found = 0;
+
+  return NGX_OK;
+}
+
+/* $protobuf_route_bytes and $protobuf_route_fields: the number of body
+ * bytes read and of fields skipped while looking for routing keys.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_route_counter(ngx_http_request_t *r,
+                                ngx_http_variable_value_t *v,
+                                uintptr_t data)
+{
+  ngx_http_protobuf_route_ctx_t  *ctx;
+  u_char                         *p;
+
+  ctx = ngx_http_get_module_ctx(r->main, ngx_http_protobuf_route_module);
+  if (ctx == NULL) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+
+  p = ngx_pnalloc(r->pool, NGX_OFF_T_LEN);
+  if (p == NULL) {
+    return NGX_ERROR;
+  }
+
+  v->data = p;
+
+  if (data == offsetof(ngx_http_protobuf_route_ctx_t, bytes)) {
+    p = ngx_sprintf(p, "%O", ctx->bytes);
+  } else {
+    p = ngx_sprintf(p, "%ui", ctx->fields);
+  }
+
+  v->len = p - v->data;
+  v->valid = 1;
+  v->no_cacheable = 0;
+  v->not_found = 0;
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_protobuf_route_add_variables(ngx_conf_t *cf)
+{
+  ngx_http_variable_t  *var, *v;
+
+  for (v = ngx_http_protobuf_route_vars; v->name.len; v++) {
+    var = ngx_http_add_variable(cf, &v->name, v->flags);
+    if (var == NULL) {
+      return NGX_ERROR;
+    }
+
+    var->get_handler = v->get_handler;
+    var->data = v->data;
+  }
+
+  return NGX_OK;
+}
+
+static void *
+ngx_http_protobuf_route_create_main_conf(ngx_conf_t *cf)
+{
+  /* set by ngx_pcalloc():
+   *
+   *   conf->nroutes = 0;
+   */
+
+  return ngx_pcalloc(cf->pool, sizeof(ngx_http_protobuf_route_main_conf_t));
+}
+
+/* protobuf_route $name message.Type field[.field...]; */
+
+static char *
+ngx_http_protobuf_route(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_protobuf_route_main_conf_t  *prmcf = conf;
+  ngx_protobuf_message_descriptor_t    *desc;
+  ngx_http_protobuf_route_t            *route;
+  ngx_http_variable_t                  *v;
+  ngx_str_t                            *value, name;
+  ngx_protobuf_path_t                   pp;
+  u_char                                errstr[NGX_MAX_CONF_ERRSTR];
+
+  value = cf->args->elts;
+
+  name = value[1];
+
+  if (name.len < 2 || name.data[0] != '$') {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid variable name \"%V\"", &name);
+    return NGX_CONF_ERROR;
+  }
+
+  name.len--;
+  name.data++;
+
+  desc = ngx_protobuf_find_message(&value[2]);
+  if (desc == NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "unknown message type \"%V\"", &value[2]);
+    return NGX_CONF_ERROR;
+  }
+
+  route = ngx_pcalloc(cf->pool, sizeof(ngx_http_protobuf_route_t));
+  if (route == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  route->message = desc->name;
+  route->index = prmcf->nroutes++;
+
+  ngx_memzero(&pp, sizeof(ngx_protobuf_path_t));
+
+  pp.path = value[3];
+  pp.message = desc;
+  pp.fields = route->path;
+  pp.max = NGX_HTTP_PROTOBUF_ROUTE_MAX_DEPTH;
+  pp.err.len = NGX_MAX_CONF_ERRSTR;
+  pp.err.data = errstr;
+
+  if (ngx_protobuf_resolve_path(&pp) != NGX_OK) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &pp.err);
+    return NGX_CONF_ERROR;
+  }
+
+  route->depth = pp.depth;
+
+  v = ngx_http_add_variable(cf, &name, NGX_HTTP_VAR_NOCACHEABLE);
+  if (v == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  v->get_handler = ngx_http_protobuf_route_get;
+  v->data = (uintptr_t) route;
+
+  return NGX_CONF_OK;
+}
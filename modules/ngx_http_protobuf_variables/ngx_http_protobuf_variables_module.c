@@ -0,0 +1,630 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_protobuf.h>
+#include <ngx_http_protobuf.h>
+
+/* variables whose values are fields of a protobuf request body.  the
+ * field paths of all variables over the same message type are kept in
+ * a tree, and the first access to any of them scans the body once,
+ * descending only into the submessages on some path and remembering
+ * where the last occurrence of each field's value starts.  values are
+ * decoded from there on every access, and strings point into the
+ * body.
+ */
+
+#define NGX_HTTP_PROTOBUF_VAR_MAX_DEPTH  16
+
+#define NGX_HTTP_PROTOBUF_VAR_UNSCANNED  0
+#define NGX_HTTP_PROTOBUF_VAR_SCANNED    1
+#define NGX_HTTP_PROTOBUF_VAR_MALFORMED  2
+
+typedef struct ngx_http_protobuf_var_node_s ngx_http_protobuf_var_node_t;
+
+struct ngx_http_protobuf_var_node_s {
+  uint32_t                            number;
+  ngx_protobuf_field_descriptor_t    *field;
+  ngx_int_t                           value;     /* slot, or -1 */
+  ngx_array_t                         children;  /* of nodes */
+};
+
+typedef struct {
+  ngx_protobuf_message_descriptor_t  *message;
+  ngx_array_t                         nodes;
+} ngx_http_protobuf_var_message_t;
+
+typedef struct {
+  ngx_uint_t                          message;
+  ngx_uint_t                          value;
+  ngx_protobuf_field_descriptor_t    *field;
+} ngx_http_protobuf_var_t;
+
+typedef struct {
+  ngx_array_t                         messages;
+  ngx_uint_t                          nvalues;
+} ngx_http_protobuf_var_main_conf_t;
+
+typedef struct {
+  ngx_flag_t                          read_body;
+} ngx_http_protobuf_var_loc_conf_t;
+
+typedef struct {
+  ngx_str_t                           body;
+  u_char                            **values;
+  u_char                             *state;     /* per message */
+  ngx_http_protobuf_body_t            read;
+  unsigned                            gathered:1;
+} ngx_http_protobuf_var_ctx_t;
+
+static ngx_int_t ngx_http_protobuf_var_handler(ngx_http_request_t *r);
+static void ngx_http_protobuf_var_body_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_protobuf_var_get(ngx_http_request_t *r,
+                                           ngx_http_variable_value_t *v,
+                                           uintptr_t data);
+static ngx_int_t ngx_http_protobuf_var_init(ngx_conf_t *cf);
+static void *ngx_http_protobuf_var_create_main_conf(ngx_conf_t *cf);
+static void *ngx_http_protobuf_var_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_protobuf_var_merge_loc_conf(ngx_conf_t *cf,
+                                                  void *parent,
+                                                  void *child);
+static char *ngx_http_protobuf_variable(ngx_conf_t *cf,
+                                        ngx_command_t *cmd,
+                                        void *conf);
+
+static ngx_command_t ngx_http_protobuf_var_commands[] = {
+
+  { ngx_string("protobuf_variable"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3,
+    ngx_http_protobuf_variable,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("protobuf_read_body"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_protobuf_var_loc_conf_t, read_body),
+    NULL },
+
+  ngx_null_command
+};
+
+static ngx_http_module_t ngx_http_protobuf_variables_module_ctx = {
+  NULL,                                    /* preconfiguration */
+  ngx_http_protobuf_var_init,              /* postconfiguration */
+  ngx_http_protobuf_var_create_main_conf,  /* create main configuration */
+  NULL,                                    /* init main configuration */
+  NULL,                                    /* create server configuration */
+  NULL,                                    /* merge server configuration */
+  ngx_http_protobuf_var_create_loc_conf,   /* create location configuration */
+  ngx_http_protobuf_var_merge_loc_conf     /* merge location configuration */
+};
+
+ngx_module_t ngx_http_protobuf_variables_module = {
+  NGX_MODULE_V1,
+  &ngx_http_protobuf_variables_module_ctx,  /* module context */
+  ngx_http_protobuf_var_commands,           /* module directives */
+  NGX_HTTP_MODULE,                          /* module type */
+  NULL,                                     /* init master */
+  NULL,                                     /* init module */
+  NULL,                                     /* init process */
+  NULL,                                     /* init thread */
+  NULL,                                     /* exit thread */
+  NULL,                                     /* exit process */
+  NULL,                                     /* exit master */
+  NGX_MODULE_V1_PADDING
+};
+
+/* the context lives on the main request, which owns the body */
+
+static ngx_http_protobuf_var_ctx_t *
+ngx_http_protobuf_var_ctx(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_var_main_conf_t  *pmcf;
+  ngx_http_protobuf_var_ctx_t        *ctx;
+
+  r = r->main;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_variables_module);
+  if (ctx != NULL) {
+    return ctx;
+  }
+
+  pmcf = ngx_http_get_module_main_conf(r, ngx_http_protobuf_variables_module);
+
+  ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_protobuf_var_ctx_t));
+  if (ctx == NULL) {
+    return NULL;
+  }
+
+  ctx->values = ngx_pcalloc(r->pool, pmcf->nvalues * sizeof(u_char *));
+  ctx->state = ngx_pcalloc(r->pool, pmcf->messages.nelts);
+  if (ctx->values == NULL || ctx->state == NULL) {
+    return NULL;
+  }
+
+  ngx_http_set_ctx(r, ctx, ngx_http_protobuf_variables_module);
+
+  return ctx;
+}
+
+/* reads the request body before the variables are needed by the
+ * access and preaccess phases.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_var_handler(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_var_loc_conf_t  *plcf;
+  ngx_http_protobuf_var_ctx_t       *ctx;
+
+  if (r != r->main || !(r->method & (NGX_HTTP_POST|NGX_HTTP_PUT))) {
+    return NGX_DECLINED;
+  }
+
+  plcf = ngx_http_get_module_loc_conf(r, ngx_http_protobuf_variables_module);
+
+  if (!plcf->read_body) {
+    return NGX_DECLINED;
+  }
+
+  ctx = ngx_http_protobuf_var_ctx(r);
+  if (ctx == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  r->request_body_in_single_buf = 1;
+
+  return ngx_http_protobuf_read_body(r, &ctx->read,
+                                     ngx_http_protobuf_var_body_handler);
+}
+
+static void
+ngx_http_protobuf_var_body_handler(ngx_http_request_t *r)
+{
+  ngx_http_protobuf_var_ctx_t  *ctx;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_protobuf_variables_module);
+
+  ngx_http_protobuf_body_done(r, &ctx->read, NGX_OK);
+}
+
+static ngx_int_t
+ngx_http_protobuf_var_copy(void *data, u_char *pos, u_char *last)
+{
+  u_char  **p = data;
+
+  *p = ngx_cpymem(*p, pos, last - pos);
+
+  return NGX_OK;
+}
+
+/* the request body as a single buffer in ctx->body.  a body in more
+ * than one buffer, or in a file, is gathered once per request.
+ * returns NGX_DECLINED if the body has not been read (yet).
+ */
+
+static ngx_int_t
+ngx_http_protobuf_var_body(ngx_http_request_t *r,
+                           ngx_http_protobuf_var_ctx_t *ctx)
+{
+  ngx_http_request_body_t  *rb;
+  ngx_chain_t              *cl;
+  ngx_buf_t                *b;
+  size_t                    len;
+  u_char                   *p;
+
+  if (ctx->gathered) {
+    return NGX_OK;
+  }
+
+  rb = r->main->request_body;
+
+  if (rb == NULL || rb->rest > 0) {
+    return NGX_DECLINED;
+  }
+
+  if (rb->bufs == NULL) {
+    ngx_str_null(&ctx->body);
+    ctx->gathered = 1;
+    return NGX_OK;
+  }
+
+  if (rb->bufs->next == NULL && ngx_buf_in_memory_only(rb->bufs->buf)) {
+    ctx->body.data = rb->bufs->buf->pos;
+    ctx->body.len = rb->bufs->buf->last - rb->bufs->buf->pos;
+    ctx->gathered = 1;
+    return NGX_OK;
+  }
+
+  len = 0;
+  for (cl = rb->bufs; cl; cl = cl->next) {
+    b = cl->buf;
+
+    if (ngx_buf_in_memory(b)) {
+      len += b->last - b->pos;
+
+    } else if (b->in_file) {
+      len += b->file_last - b->file_pos;
+    }
+  }
+
+  p = ngx_pnalloc(r->pool, len);
+  if (p == NULL) {
+    return NGX_ERROR;
+  }
+
+  ctx->body.data = p;
+
+  if (ngx_protobuf_read_chain(rb->bufs, r->pool,
+                              ngx_http_protobuf_var_copy, &p)
+      != NGX_OK)
+  {
+    return NGX_ERROR;
+  }
+
+  ctx->body.len = p - ctx->body.data;
+  ctx->gathered = 1;
+
+  return NGX_OK;
+}
+
+/* records the value of every field in the tree.  every occurrence of
+ * a submessage is visited, so later occurrences override earlier ones,
+ * just as they would if the message were merged by unpacking it.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_var_scan(u_char *p, u_char *end, ngx_array_t *nodes,
+                           u_char **values)
+{
+  ngx_http_protobuf_var_node_t  *node;
+  ngx_uint_t                     i;
+  uint32_t                       header, len;
+  u_char                        *value, *q;
+
+  node = nodes->elts;
+
+  while (p < end) {
+    if (ngx_protobuf_read_uint32(&p, end, &header) != NGX_OK) {
+      return NGX_ABORT;
+    }
+
+    value = p;
+
+    if (ngx_protobuf_skip_field(&p, end, header >> 3,
+                                header & 0x07) != NGX_OK)
+    {
+      return NGX_ABORT;
+    }
+
+    for (i = 0; i < nodes->nelts; ++i) {
+      if (node[i].number == (header >> 3)) {
+        break;
+      }
+    }
+
+    if (i == nodes->nelts || (header & 0x07) != node[i].field->wire_type) {
+      continue;
+    }
+
+    if (node[i].value >= 0) {
+      values[node[i].value] = value;
+    }
+
+    if (node[i].children.nelts > 0) {
+      q = value;
+      if (ngx_protobuf_read_uint32(&q, p, &len) != NGX_OK) {
+        return NGX_ABORT;
+      }
+
+      if (ngx_http_protobuf_var_scan(q, p, &node[i].children,
+                                     values) != NGX_OK)
+      {
+        return NGX_ABORT;
+      }
+    }
+  }
+
+  return NGX_OK;
+}
+
+/* variables are not cacheable, so that one evaluated before the body
+ * was read is looked up again afterwards.  the body itself is scanned
+ * only once per request and message type.
+ */
+
+static ngx_int_t
+ngx_http_protobuf_var_get(ngx_http_request_t *r,
+                          ngx_http_variable_value_t *v,
+                          uintptr_t data)
+{
+  ngx_http_protobuf_var_t            *var = (ngx_http_protobuf_var_t *) data;
+  ngx_http_protobuf_var_main_conf_t  *pmcf;
+  ngx_http_protobuf_var_message_t    *message;
+  ngx_http_protobuf_var_ctx_t        *ctx;
+  ngx_str_t                           text;
+  u_char                             *pos;
+  ngx_int_t                           rc;
+
+  ctx = ngx_http_protobuf_var_ctx(r);
+  if (ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  if (ctx->state[var->message] == NGX_HTTP_PROTOBUF_VAR_UNSCANNED) {
+    rc = ngx_http_protobuf_var_body(r, ctx);
+    if (rc == NGX_ERROR) {
+      return NGX_ERROR;
+    }
+
+    if (rc == NGX_DECLINED) {
+      v->not_found = 1;
+      return NGX_OK;
+    }
+
+    pmcf = ngx_http_get_module_main_conf(r,
+                                         ngx_http_protobuf_variables_module);
+    message = pmcf->messages.elts;
+    message += var->message;
+
+    if (ngx_http_protobuf_var_scan(ctx->body.data,
+                                   ctx->body.data + ctx->body.len,
+                                   &message->nodes,
+                                   ctx->values) == NGX_OK)
+    {
+      ctx->state[var->message] = NGX_HTTP_PROTOBUF_VAR_SCANNED;
+    } else {
+      ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                    "malformed %V request body", &message->message->name);
+      ctx->state[var->message] = NGX_HTTP_PROTOBUF_VAR_MALFORMED;
+    }
+  }
+
+  pos = ctx->values[var->value];
+
+  if (ctx->state[var->message] != NGX_HTTP_PROTOBUF_VAR_SCANNED
+      || pos == NULL)
+  {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+
+  rc = ngx_protobuf_format_value(var->field, pos,
+                                 ctx->body.data + ctx->body.len,
+                                 r->pool, &text);
+  if (rc == NGX_ERROR) {
+    return NGX_ERROR;
+  }
+
+  if (rc != NGX_OK) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+
+  v->data = text.data;
+  v->len = text.len;
+  v->valid = 1;
+  v->no_cacheable = 0;
+  v->not_found = 0;
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_protobuf_var_init(ngx_conf_t *cf)
+{
+  ngx_http_handler_pt        *h;
+  ngx_http_core_main_conf_t  *cmcf;
+
+  cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+  h = ngx_array_push(&cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
+  if (h == NULL) {
+    return NGX_ERROR;
+  }
+
+  *h = ngx_http_protobuf_var_handler;
+
+  return NGX_OK;
+}
+
+static void *
+ngx_http_protobuf_var_create_main_conf(ngx_conf_t *cf)
+{
+  ngx_http_protobuf_var_main_conf_t  *conf;
+
+  conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_protobuf_var_main_conf_t));
+  if (conf == NULL) {
+    return NULL;
+  }
+
+  if (ngx_array_init(&conf->messages, cf->pool, 2,
+                     sizeof(ngx_http_protobuf_var_message_t)) != NGX_OK)
+  {
+    return NULL;
+  }
+
+  return conf;
+}
+
+static void *
+ngx_http_protobuf_var_create_loc_conf(ngx_conf_t *cf)
+{
+  ngx_http_protobuf_var_loc_conf_t  *conf;
+
+  conf = ngx_palloc(cf->pool, sizeof(ngx_http_protobuf_var_loc_conf_t));
+  if (conf == NULL) {
+    return NULL;
+  }
+
+  conf->read_body = NGX_CONF_UNSET;
+
+  return conf;
+}
+
+static char *
+ngx_http_protobuf_var_merge_loc_conf(ngx_conf_t *cf,
+                                     void *parent,
+                                     void *child)
+{
+  ngx_http_protobuf_var_loc_conf_t  *prev = parent;
+  ngx_http_protobuf_var_loc_conf_t  *conf = child;
+
+  ngx_conf_merge_value(conf->read_body, prev->read_body, 0);
+
+  return NGX_CONF_OK;
+}
+
+/* finds the node for a field in a level of the tree, or adds one */
+
+static ngx_http_protobuf_var_node_t *
+ngx_http_protobuf_var_node(ngx_conf_t *cf, ngx_array_t *nodes,
+                           ngx_protobuf_field_descriptor_t *field)
+{
+  ngx_http_protobuf_var_node_t  *node;
+  ngx_uint_t                     i;
+
+  node = nodes->elts;
+
+  for (i = 0; i < nodes->nelts; ++i) {
+    if (node[i].number == field->number) {
+      return &node[i];
+    }
+  }
+
+  node = ngx_array_push(nodes);
+  if (node == NULL) {
+    return NULL;
+  }
+
+  node->number = field->number;
+  node->field = field;
+  node->value = -1;
+
+  if (ngx_array_init(&node->children, cf->pool, 1,
+                     sizeof(ngx_http_protobuf_var_node_t)) != NGX_OK)
+  {
+    return NULL;
+  }
+
+  return node;
+}
+
+/* protobuf_variable $name message.Type field[.field...]; */
+
+static char *
+ngx_http_protobuf_variable(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_protobuf_var_main_conf_t  *pmcf = conf;
+  ngx_protobuf_message_descriptor_t  *desc;
+  ngx_protobuf_field_descriptor_t    *fields[NGX_HTTP_PROTOBUF_VAR_MAX_DEPTH];
+  ngx_http_protobuf_var_message_t    *message;
+  ngx_http_protobuf_var_node_t       *node;
+  ngx_http_protobuf_var_t            *var;
+  ngx_http_variable_t                *v;
+  ngx_array_t                        *nodes;
+  ngx_str_t                          *value, name;
+  ngx_protobuf_path_t                 pp;
+  ngx_uint_t                          i;
+  u_char                              errstr[NGX_MAX_CONF_ERRSTR];
+
+  value = cf->args->elts;
+
+  name = value[1];
+
+  if (name.len < 2 || name.data[0] != '$') {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid variable name \"%V\"", &name);
+    return NGX_CONF_ERROR;
+  }
+
+  name.len--;
+  name.data++;
+
+  desc = ngx_protobuf_find_message(&value[2]);
+  if (desc == NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "unknown message type \"%V\"", &value[2]);
+    return NGX_CONF_ERROR;
+  }
+
+  ngx_memzero(&pp, sizeof(ngx_protobuf_path_t));
+
+  pp.path = value[3];
+  pp.message = desc;
+  pp.fields = fields;
+  pp.max = NGX_HTTP_PROTOBUF_VAR_MAX_DEPTH;
+  pp.err.len = NGX_MAX_CONF_ERRSTR;
+  pp.err.data = errstr;
+
+  if (ngx_protobuf_resolve_path(&pp) != NGX_OK) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &pp.err);
+    return NGX_CONF_ERROR;
+  }
+
+  message = pmcf->messages.elts;
+
+  for (i = 0; i < pmcf->messages.nelts; ++i) {
+    if (message[i].message == desc) {
+      break;
+    }
+  }
+
+  if (i == pmcf->messages.nelts) {
+    message = ngx_array_push(&pmcf->messages);
+    if (message == NULL) {
+      return NGX_CONF_ERROR;
+    }
+
+    message->message = desc;
+
+    if (ngx_array_init(&message->nodes, cf->pool, 2,
+                       sizeof(ngx_http_protobuf_var_node_t)) != NGX_OK)
+    {
+      return NGX_CONF_ERROR;
+    }
+  } else {
+    message += i;
+  }
+
+  var = ngx_palloc(cf->pool, sizeof(ngx_http_protobuf_var_t));
+  if (var == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  var->message = message - (ngx_http_protobuf_var_message_t *)
+                           pmcf->messages.elts;
+
+  /* walk the path, adding nodes to the tree as needed */
+
+  nodes = &message->nodes;
+  node = NULL;
+
+  for (i = 0; i < pp.depth; ++i) {
+    node = ngx_http_protobuf_var_node(cf, nodes, fields[i]);
+    if (node == NULL) {
+      return NGX_CONF_ERROR;
+    }
+
+    nodes = &node->children;
+  }
+
+  if (node->value < 0) {
+    node->value = pmcf->nvalues++;
+  }
+
+  var->value = node->value;
+  var->field = node->field;
+
+  v = ngx_http_add_variable(cf, &name, NGX_HTTP_VAR_NOCACHEABLE);
+  if (v == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  v->get_handler = ngx_http_protobuf_var_get;
+  v->data = (uintptr_t) var;
+
+  return NGX_CONF_OK;
+}
@@ -0,0 +1,1352 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+#include <ngx_protobuf.h>
+
+/* balances length-delimited protobuf frames, rather than connections,
+ * across the servers of a stream upstream.  the client connection is
+ * split into frames, each preceded by its length as a varint, and each
+ * frame is sent whole to one of the servers: the one that the routing
+ * field of the frame hashes to, or the next one in turn if the frame
+ * has no such field.  the field is found by a partial parse that stops
+ * at its first occurrence, as in the http route module.
+ *
+ * keys are hashed consistently, as by the ketama library: each server
+ * has points on a ring in proportion to its weight, and a key goes to
+ * the server of the first point at or after its hash.  a server that
+ * is down or fails is passed over for the next point, so only its own
+ * keys move, and they move back once it is up again.
+ *
+ * a session opens at most one connection to each server, when a frame
+ * is first sent there, and the replies that come back on any of them
+ * are passed to the client whole, in the order they complete.  frames
+ * are never split or interleaved, so a protocol that multiplexes calls
+ * on one connection must carry its own call ids in the frames.
+ *
+ * each buffer holds at most one frame of protobuf_pass_buffer_size
+ * bytes or less; a longer frame ends the session.  when a buffer is
+ * full, the side that fills it waits until it is drained.
+ */
+
+#define NGX_STREAM_PROTOBUF_PASS_MAX_DEPTH  16
+#define NGX_STREAM_PROTOBUF_PASS_POINTS     160
+
+typedef struct {
+  uint32_t                            hash;
+  /* the index of the server in the upstream */
+  ngx_uint_t                          peer;
+} ngx_stream_protobuf_pass_point_t;
+
+typedef struct {
+  ngx_uint_t                          number;
+  ngx_stream_protobuf_pass_point_t    point[1];
+} ngx_stream_protobuf_pass_points_t;
+
+typedef struct {
+  ngx_stream_upstream_srv_conf_t     *upstream;
+  ngx_stream_protobuf_pass_points_t  *points;
+  ngx_msec_t                          connect_timeout;
+  ngx_msec_t                          timeout;
+  size_t                              buffer_size;
+  ngx_uint_t                          depth;
+  ngx_protobuf_field_descriptor_t    *path[NGX_STREAM_PROTOBUF_PASS_MAX_DEPTH];
+} ngx_stream_protobuf_pass_srv_conf_t;
+
+typedef struct {
+  ngx_stream_session_t               *session;
+  ngx_peer_connection_t               pc;
+  /* replies read from the server, and frames to be sent to it */
+  ngx_buf_t                          *in;
+  ngx_buf_t                          *out;
+  /* the frames sent that are still to be answered */
+  ngx_uint_t                          due;
+  unsigned                            connected:1;
+  unsigned                            failed:1;
+  unsigned                            eof:1;
+} ngx_stream_protobuf_pass_peer_t;
+
+typedef struct {
+  ngx_stream_protobuf_pass_peer_t    *peers;
+  ngx_uint_t                          npeers;
+  /* the next server in turn for frames without a key, and for replies */
+  ngx_uint_t                          next;
+  ngx_uint_t                          turn;
+  /* the server chosen for the first frame in the buffer */
+  ngx_stream_protobuf_pass_peer_t    *peer;
+  /* frames read from the client, and replies to be sent to it */
+  ngx_buf_t                          *in;
+  ngx_buf_t                          *out;
+  unsigned                            eof:1;
+} ngx_stream_protobuf_pass_ctx_t;
+
+static void ngx_stream_protobuf_pass_handler(ngx_stream_session_t *s);
+static void ngx_stream_protobuf_pass_client_handler(ngx_event_t *ev);
+static void ngx_stream_protobuf_pass_peer_handler(ngx_event_t *ev);
+static void ngx_stream_protobuf_pass_process(ngx_stream_session_t *s);
+static void ngx_stream_protobuf_pass_finalize(ngx_stream_session_t *s,
+                                              ngx_uint_t rc);
+static void *ngx_stream_protobuf_pass_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_stream_protobuf_pass_merge_srv_conf(ngx_conf_t *cf,
+                                                     void *parent,
+                                                     void *child);
+static char *ngx_stream_protobuf_pass(ngx_conf_t *cf,
+                                      ngx_command_t *cmd,
+                                      void *conf);
+static char *ngx_stream_protobuf_pass_route(ngx_conf_t *cf,
+                                            ngx_command_t *cmd,
+                                            void *conf);
+
+static ngx_command_t ngx_stream_protobuf_pass_commands[] = {
+
+  { ngx_string("protobuf_pass"),
+    NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+    ngx_stream_protobuf_pass,
+    NGX_STREAM_SRV_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("protobuf_pass_route"),
+    NGX_STREAM_SRV_CONF|NGX_CONF_TAKE2,
+    ngx_stream_protobuf_pass_route,
+    NGX_STREAM_SRV_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("protobuf_pass_connect_timeout"),
+    NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_msec_slot,
+    NGX_STREAM_SRV_CONF_OFFSET,
+    offsetof(ngx_stream_protobuf_pass_srv_conf_t, connect_timeout),
+    NULL },
+
+  { ngx_string("protobuf_pass_timeout"),
+    NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_msec_slot,
+    NGX_STREAM_SRV_CONF_OFFSET,
+    offsetof(ngx_stream_protobuf_pass_srv_conf_t, timeout),
+    NULL },
+
+  { ngx_string("protobuf_pass_buffer_size"),
+    NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_size_slot,
+    NGX_STREAM_SRV_CONF_OFFSET,
+    offsetof(ngx_stream_protobuf_pass_srv_conf_t, buffer_size),
+    NULL },
+
+  ngx_null_command
+};
+
+static ngx_stream_module_t ngx_stream_protobuf_pass_module_ctx = {
+  NULL,                                      /* preconfiguration */
+  NULL,                                      /* postconfiguration */
+  NULL,                                      /* create main configuration */
+  NULL,                                      /* init main configuration */
+  ngx_stream_protobuf_pass_create_srv_conf,  /* create server configuration */
+  ngx_stream_protobuf_pass_merge_srv_conf    /* merge server configuration */
+};
+
+ngx_module_t ngx_stream_protobuf_pass_module = {
+  NGX_MODULE_V1,
+  &ngx_stream_protobuf_pass_module_ctx,  /* module context */
+  ngx_stream_protobuf_pass_commands,     /* module directives */
+  NGX_STREAM_MODULE,                     /* module type */
+  NULL,                                  /* init master */
+  NULL,                                  /* init module */
+  NULL,                                  /* init process */
+  NULL,                                  /* init thread */
+  NULL,                                  /* exit thread */
+  NULL,                                  /* exit process */
+  NULL,                                  /* exit master */
+  NGX_MODULE_V1_PADDING
+};
+
+/* the servers are taken from the upstream when the session starts, in
+ * its order, which is the one the points of the ring refer to.  a
+ * server that is marked down is taken as failed, and so is one that
+ * cannot be connected to later on, for the rest of the session.
+ */
+
+static void
+ngx_stream_protobuf_pass_handler(ngx_stream_session_t *s)
+{
+  ngx_stream_protobuf_pass_srv_conf_t  *pscf;
+  ngx_stream_protobuf_pass_ctx_t       *ctx;
+  ngx_stream_protobuf_pass_peer_t      *peer;
+  ngx_stream_upstream_rr_peers_t       *peers;
+  ngx_stream_upstream_rr_peer_t        *rp;
+  ngx_connection_t                     *c;
+  ngx_uint_t                            live;
+  size_t                                n;
+
+  c = s->connection;
+
+  pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_protobuf_pass_module);
+
+  ctx = ngx_pcalloc(c->pool, sizeof(ngx_stream_protobuf_pass_ctx_t));
+  if (ctx == NULL) {
+    ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  /* set by ngx_pcalloc():
+   *
+   *   ctx->npeers = 0;
+   *   ctx->next = 0;
+   *   ctx->turn = 0;
+   *   ctx->peer = NULL;
+   *   ctx->eof = 0;
+   */
+
+  ngx_stream_set_ctx(s, ctx, ngx_stream_protobuf_pass_module);
+
+  peers = pscf->upstream->peer.data;
+
+  ngx_stream_upstream_rr_peers_rlock(peers);
+
+  ctx->peers = ngx_pcalloc(c->pool,
+                           peers->number
+                           * sizeof(ngx_stream_protobuf_pass_peer_t));
+  if (ctx->peers == NULL) {
+    ngx_stream_upstream_rr_peers_unlock(peers);
+    ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  live = 0;
+
+  for (rp = peers->peer; rp && ctx->npeers < peers->number; rp = rp->next) {
+    peer = &ctx->peers[ctx->npeers++];
+
+    peer->session = s;
+    peer->pc.sockaddr = rp->sockaddr;
+    peer->pc.socklen = rp->socklen;
+    peer->pc.name = &rp->name;
+
+    if (rp->down) {
+      peer->failed = 1;
+      continue;
+    }
+
+    live++;
+  }
+
+  ngx_stream_upstream_rr_peers_unlock(peers);
+
+  if (live == 0) {
+    ngx_log_error(NGX_LOG_ERR, c->log, 0, "no live upstreams");
+    ngx_stream_finalize_session(s, NGX_STREAM_BAD_GATEWAY);
+    return;
+  }
+
+  ctx->in = ngx_create_temp_buf(c->pool, pscf->buffer_size);
+  if (ctx->in == NULL) {
+    ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  ctx->out = ngx_create_temp_buf(c->pool, pscf->buffer_size);
+  if (ctx->out == NULL) {
+    ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  /* data read by the preread phase */
+
+  if (c->buffer && c->buffer->pos < c->buffer->last) {
+    n = c->buffer->last - c->buffer->pos;
+
+    if (n > pscf->buffer_size) {
+      ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                    "client sent too large frame");
+      ngx_stream_finalize_session(s, NGX_STREAM_BAD_REQUEST);
+      return;
+    }
+
+    ctx->in->last = ngx_cpymem(ctx->in->last, c->buffer->pos, n);
+    c->buffer->pos = c->buffer->last;
+  }
+
+  c->log->action = "passing protobuf frames";
+
+  c->read->handler = ngx_stream_protobuf_pass_client_handler;
+  c->write->handler = ngx_stream_protobuf_pass_client_handler;
+
+  ngx_stream_protobuf_pass_process(s);
+}
+
+static void
+ngx_stream_protobuf_pass_client_handler(ngx_event_t *ev)
+{
+  ngx_connection_t      *c;
+  ngx_stream_session_t  *s;
+
+  c = ev->data;
+  s = c->data;
+
+  if (ev->timedout) {
+    ngx_connection_error(c, NGX_ETIMEDOUT, "connection timed out");
+    ngx_stream_protobuf_pass_finalize(s, NGX_STREAM_OK);
+    return;
+  }
+
+  ngx_stream_protobuf_pass_process(s);
+}
+
+static ngx_int_t
+ngx_stream_protobuf_pass_test_connect(ngx_connection_t *c)
+{
+  int        err;
+  socklen_t  len;
+
+  err = 0;
+  len = sizeof(int);
+
+  if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+    err = ngx_socket_errno;
+  }
+
+  if (err) {
+    (void) ngx_connection_error(c, err, "connect() failed");
+    return NGX_ERROR;
+  }
+
+  return NGX_OK;
+}
+
+/* leaves out a server that could not be connected to.  nothing has been
+ * sent to it yet, so the frames queued for it are routed again, to the
+ * servers that are left, before any frame read after them.
+ */
+
+static void
+ngx_stream_protobuf_pass_fail(ngx_stream_protobuf_pass_ctx_t *ctx,
+                              ngx_stream_protobuf_pass_peer_t *peer)
+{
+  ngx_close_connection(peer->pc.connection);
+
+  peer->pc.connection = NULL;
+  peer->failed = 1;
+  peer->due = 0;
+
+  /* the server chosen for the next frame may be this one, and the next
+   * frame to route is now one of those queued here
+   */
+
+  ctx->peer = NULL;
+}
+
+static void
+ngx_stream_protobuf_pass_peer_handler(ngx_event_t *ev)
+{
+  ngx_stream_protobuf_pass_ctx_t   *ctx;
+  ngx_stream_protobuf_pass_peer_t  *peer;
+  ngx_connection_t                 *c;
+  ngx_stream_session_t             *s;
+
+  c = ev->data;
+  peer = c->data;
+  s = peer->session;
+
+  ctx = ngx_stream_get_module_ctx(s, ngx_stream_protobuf_pass_module);
+
+  if (!peer->connected) {
+    if (ev->timedout) {
+      ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
+      ngx_stream_protobuf_pass_fail(ctx, peer);
+      ngx_stream_protobuf_pass_process(s);
+      return;
+    }
+
+    if (ngx_stream_protobuf_pass_test_connect(c) != NGX_OK) {
+      ngx_stream_protobuf_pass_fail(ctx, peer);
+      ngx_stream_protobuf_pass_process(s);
+      return;
+    }
+
+    if (c->write->timer_set) {
+      ngx_del_timer(c->write);
+    }
+
+    peer->connected = 1;
+  }
+
+  if (ev->timedout) {
+    ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
+    ngx_stream_protobuf_pass_finalize(s, NGX_STREAM_BAD_GATEWAY);
+    return;
+  }
+
+  ngx_stream_protobuf_pass_process(s);
+}
+
+/* finds the frame at the start of the buffer.  returns NGX_OK with the
+ * size of the frame, prefix included, NGX_AGAIN if it is not complete
+ * yet, or NGX_ERROR if its length is invalid or the frame would not
+ * fit in the buffer.
+ */
+
+static ngx_int_t
+ngx_stream_protobuf_pass_frame(ngx_buf_t *b, size_t *size)
+{
+  u_char      *p;
+  uint64_t     len;
+  ngx_uint_t   shift;
+
+  len = 0;
+
+  for (p = b->pos, shift = 0; p < b->last; p++, shift += 7) {
+    if (shift > 63) {
+      return NGX_ERROR;
+    }
+
+    len |= (uint64_t) (*p & 0x7f) << shift;
+
+    if (!(*p & 0x80)) {
+      p++;
+
+      if (len > (uint64_t) (b->end - b->start - (p - b->pos))) {
+        return NGX_ERROR;
+      }
+
+      if (len > (uint64_t) (b->last - p)) {
+        return NGX_AGAIN;
+      }
+
+      *size = (p - b->pos) + len;
+      return NGX_OK;
+    }
+  }
+
+  return NGX_AGAIN;
+}
+
+/* makes room for size more bytes at the end of the buffer, by moving
+ * what is left in it to the start.
+ */
+
+static ngx_int_t
+ngx_stream_protobuf_pass_room(ngx_buf_t *b, size_t size)
+{
+  if (b->pos == b->last) {
+    b->pos = b->start;
+    b->last = b->start;
+  }
+
+  if ((size_t) (b->end - b->last) >= size) {
+    return NGX_OK;
+  }
+
+  if (b->pos > b->start) {
+    b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+    b->pos = b->start;
+  }
+
+  return ((size_t) (b->end - b->last) >= size) ? NGX_OK : NGX_DECLINED;
+}
+
+/* returns NGX_OK if something was read, NGX_AGAIN if nothing was, and
+ * NGX_DONE at the end of the stream.
+ */
+
+static ngx_int_t
+ngx_stream_protobuf_pass_recv(ngx_connection_t *c, ngx_buf_t *b)
+{
+  ssize_t  n;
+
+  if (!c->read->ready || ngx_stream_protobuf_pass_room(b, 1) != NGX_OK) {
+    return NGX_AGAIN;
+  }
+
+  n = c->recv(c, b->last, b->end - b->last);
+
+  if (n == NGX_AGAIN) {
+    return NGX_AGAIN;
+  }
+
+  if (n == NGX_ERROR) {
+    return NGX_ERROR;
+  }
+
+  if (n == 0) {
+    return NGX_DONE;
+  }
+
+  b->last += n;
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_stream_protobuf_pass_send(ngx_connection_t *c, ngx_buf_t *b)
+{
+  ssize_t  n;
+
+  if (!c->write->ready || b->pos == b->last) {
+    return NGX_AGAIN;
+  }
+
+  n = c->send(c, b->pos, b->last - b->pos);
+
+  if (n == NGX_ERROR) {
+    return NGX_ERROR;
+  }
+
+  if (n == NGX_AGAIN || n == 0) {
+    return NGX_AGAIN;
+  }
+
+  b->pos += n;
+
+  return NGX_OK;
+}
+
+/* finds the first occurrence of the routing field in a frame.  as in
+ * the http route module, a submessage on the path is entered where it
+ * is found, and left again if it ends without the rest of the path.
+ * the key is the encoded value of the field.
+ */
+
+static ngx_int_t
+ngx_stream_protobuf_pass_key(ngx_stream_protobuf_pass_srv_conf_t *pscf,
+                             u_char *p,
+                             u_char *end,
+                             ngx_str_t *key)
+{
+  ngx_protobuf_field_descriptor_t  *field;
+  u_char                           *last[NGX_STREAM_PROTOBUF_PASS_MAX_DEPTH];
+  ngx_uint_t                        depth;
+  uint32_t                          header, number, wire;
+  uint64_t                          len;
+
+  depth = 0;
+  last[0] = end;
+
+  for ( ;; ) {
+    while (p == last[depth]) {
+      if (depth == 0) {
+        return NGX_DECLINED;
+      }
+      depth--;
+    }
+
+    if (ngx_protobuf_read_uint32(&p, last[depth], &header) != NGX_OK) {
+      return NGX_ABORT;
+    }
+
+    number = header >> 3;
+    wire = header & 0x07;
+    field = pscf->path[depth];
+
+    if (number == field->number && wire == field->wire_type) {
+      if (depth == pscf->depth - 1) {
+        key->data = p;
+
+        if (ngx_protobuf_skip_field(&p, last[depth], number, wire)
+            != NGX_OK)
+        {
+          return NGX_ABORT;
+        }
+
+        key->len = p - key->data;
+        return NGX_OK;
+      }
+
+      if (ngx_protobuf_read_uint64(&p, last[depth], &len) != NGX_OK
+          || len > (uint64_t) (last[depth] - p))
+      {
+        return NGX_ABORT;
+      }
+
+      depth++;
+      last[depth] = p + len;
+      continue;
+    }
+
+    if (ngx_protobuf_skip_field(&p, last[depth], number, wire) != NGX_OK) {
+      return NGX_ABORT;
+    }
+  }
+}
+
+static ngx_int_t
+ngx_stream_protobuf_pass_connect(ngx_stream_session_t *s,
+                                 ngx_stream_protobuf_pass_peer_t *peer)
+{
+  ngx_stream_protobuf_pass_srv_conf_t  *pscf;
+  ngx_peer_connection_t                *pc;
+  ngx_connection_t                     *c;
+  ngx_int_t                             rc;
+
+  c = s->connection;
+
+  pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_protobuf_pass_module);
+
+  if (peer->in == NULL) {
+    peer->in = ngx_create_temp_buf(c->pool, pscf->buffer_size);
+    if (peer->in == NULL) {
+      return NGX_ERROR;
+    }
+
+    peer->out = ngx_create_temp_buf(c->pool, pscf->buffer_size);
+    if (peer->out == NULL) {
+      return NGX_ERROR;
+    }
+  }
+
+  pc = &peer->pc;
+
+  pc->get = ngx_event_get_peer;
+  pc->log = c->log;
+  pc->log_error = NGX_ERROR_ERR;
+  pc->tries = 1;
+
+  rc = ngx_event_connect_peer(pc);
+
+  ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                 "protobuf pass connect to %V: %i", pc->name, rc);
+
+  if (rc == NGX_ERROR) {
+    return NGX_ERROR;
+  }
+
+  if (rc == NGX_BUSY || rc == NGX_DECLINED) {
+    peer->failed = 1;
+    return NGX_DECLINED;
+  }
+
+  pc->connection->data = peer;
+  pc->connection->pool = c->pool;
+  pc->connection->log = c->log;
+  pc->connection->read->log = c->log;
+  pc->connection->write->log = c->log;
+  pc->connection->read->handler = ngx_stream_protobuf_pass_peer_handler;
+  pc->connection->write->handler = ngx_stream_protobuf_pass_peer_handler;
+
+  if (rc == NGX_AGAIN) {
+    ngx_add_timer(pc->connection->write, pscf->connect_timeout);
+    return NGX_OK;
+  }
+
+  peer->connected = 1;
+
+  return NGX_OK;
+}
+
+/* takes the n-th server for a frame, connecting to it if needed.
+ * returns NGX_DECLINED if it has failed or is closing its connection.
+ */
+
+static ngx_int_t
+ngx_stream_protobuf_pass_use(ngx_stream_session_t *s,
+                             ngx_stream_protobuf_pass_ctx_t *ctx,
+                             ngx_uint_t n)
+{
+  ngx_stream_protobuf_pass_peer_t  *peer;
+  ngx_int_t                         rc;
+
+  if (n >= ctx->npeers) {
+    return NGX_DECLINED;
+  }
+
+  peer = &ctx->peers[n];
+
+  if (peer->failed || peer->eof) {
+    return NGX_DECLINED;
+  }
+
+  if (peer->pc.connection == NULL) {
+    rc = ngx_stream_protobuf_pass_connect(s, peer);
+
+    if (rc == NGX_ERROR) {
+      return NGX_STREAM_INTERNAL_SERVER_ERROR;
+    }
+
+    if (rc == NGX_DECLINED) {
+      return NGX_DECLINED;
+    }
+  }
+
+  ctx->peer = peer;
+
+  return NGX_OK;
+}
+
+/* chooses the server for the frame at pos: the one of the first point
+ * of the ring at or after the hash of its key or, without a key, the
+ * next one in turn.  if that server cannot be used, the servers of the
+ * points after it, or the servers after it in turn, are tried.
+ */
+
+static ngx_int_t
+ngx_stream_protobuf_pass_choose(ngx_stream_session_t *s,
+                                ngx_stream_protobuf_pass_ctx_t *ctx,
+                                u_char *pos,
+                                size_t size)
+{
+  ngx_stream_protobuf_pass_srv_conf_t  *pscf;
+  ngx_stream_protobuf_pass_points_t    *points;
+  ngx_str_t                             key;
+  ngx_uint_t                            i, n, lo, hi;
+  uint32_t                              hash;
+  uint64_t                              len;
+  u_char                               *p, *last;
+  ngx_int_t                             rc;
+
+  pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_protobuf_pass_module);
+
+  p = pos;
+  last = pos + size;
+
+  (void) ngx_protobuf_read_uint64(&p, last, &len);
+
+  points = pscf->points;
+
+  if (points != NULL
+      && ngx_stream_protobuf_pass_key(pscf, p, last, &key) == NGX_OK)
+  {
+    hash = ngx_crc32_long(key.data, key.len);
+
+    lo = 0;
+    hi = points->number;
+
+    while (lo < hi) {
+      n = (lo + hi) / 2;
+
+      if (hash > points->point[n].hash) {
+        lo = n + 1;
+
+      } else {
+        hi = n;
+      }
+    }
+
+    for (i = 0; i < points->number; i++) {
+      n = points->point[(lo + i) % points->number].peer;
+
+      rc = ngx_stream_protobuf_pass_use(s, ctx, n);
+      if (rc != NGX_DECLINED) {
+        return rc;
+      }
+    }
+
+  } else {
+    n = ctx->next++;
+
+    for (i = 0; i < ctx->npeers; i++) {
+      rc = ngx_stream_protobuf_pass_use(s, ctx, (n + i) % ctx->npeers);
+      if (rc != NGX_DECLINED) {
+        return rc;
+      }
+    }
+  }
+
+  ngx_log_error(NGX_LOG_ERR, s->connection->log, 0, "no live upstreams");
+
+  return NGX_STREAM_BAD_GATEWAY;
+}
+
+/* moves the complete frames in a buffer to the servers they are routed
+ * to, until one of them has no room.  returns NGX_OK if any were moved,
+ * NGX_AGAIN if none were, or the status that ends the session.
+ */
+
+static ngx_int_t
+ngx_stream_protobuf_pass_route_frames(ngx_stream_session_t *s,
+                                      ngx_stream_protobuf_pass_ctx_t *ctx,
+                                      ngx_buf_t *b)
+{
+  ngx_stream_protobuf_pass_peer_t  *peer;
+  size_t                            size;
+  ngx_int_t                         rc, moved;
+
+  moved = NGX_AGAIN;
+
+  for ( ;; ) {
+    rc = ngx_stream_protobuf_pass_frame(b, &size);
+
+    if (rc == NGX_ERROR) {
+      ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                    "client sent invalid or too large frame");
+      return NGX_STREAM_BAD_REQUEST;
+    }
+
+    if (rc == NGX_AGAIN) {
+      return moved;
+    }
+
+    if (ctx->peer == NULL) {
+      rc = ngx_stream_protobuf_pass_choose(s, ctx, b->pos, size);
+      if (rc != NGX_OK) {
+        return rc;
+      }
+    }
+
+    peer = ctx->peer;
+
+    if (ngx_stream_protobuf_pass_room(peer->out, size) != NGX_OK) {
+      return moved;
+    }
+
+    peer->out->last = ngx_cpymem(peer->out->last, b->pos, size);
+    b->pos += size;
+
+    peer->due++;
+    ctx->peer = NULL;
+
+    moved = NGX_OK;
+  }
+}
+
+/* moves the frames queued for servers that have failed, and then the
+ * complete frames read from the client, to the servers they are routed
+ * to.  the frames of a buffer are only looked at once those before it
+ * have all been moved, so that ctx->peer always refers to the first of
+ * them left.  returns NGX_OK if any were moved, NGX_AGAIN if none were,
+ * or the status that ends the session.
+ */
+
+static ngx_int_t
+ngx_stream_protobuf_pass_requests(ngx_stream_session_t *s,
+                                  ngx_stream_protobuf_pass_ctx_t *ctx)
+{
+  ngx_stream_protobuf_pass_peer_t  *peer;
+  ngx_uint_t                        i;
+  ngx_int_t                         rc, moved;
+
+  moved = NGX_AGAIN;
+
+  for (i = 0; i < ctx->npeers; i++) {
+    peer = &ctx->peers[i];
+
+    if (!peer->failed || peer->out == NULL) {
+      continue;
+    }
+
+    rc = ngx_stream_protobuf_pass_route_frames(s, ctx, peer->out);
+
+    if (rc > NGX_OK) {
+      return rc;
+    }
+
+    if (rc == NGX_OK) {
+      moved = NGX_OK;
+    }
+
+    if (peer->out->pos != peer->out->last) {
+      return moved;
+    }
+  }
+
+  rc = ngx_stream_protobuf_pass_route_frames(s, ctx, ctx->in);
+
+  if (rc == NGX_AGAIN) {
+    return moved;
+  }
+
+  return rc;
+}
+
+/* moves the complete replies read from the servers to the client.  the
+ * server that is looked at first changes each time, so that none of
+ * them can keep the others waiting.
+ */
+
+static ngx_int_t
+ngx_stream_protobuf_pass_replies(ngx_stream_session_t *s,
+                                 ngx_stream_protobuf_pass_ctx_t *ctx)
+{
+  ngx_stream_protobuf_pass_peer_t  *peer;
+  ngx_uint_t                        i;
+  size_t                            size;
+  ngx_int_t                         rc, moved;
+
+  moved = NGX_AGAIN;
+
+  ctx->turn++;
+
+  for (i = 0; i < ctx->npeers; i++) {
+    peer = &ctx->peers[(ctx->turn + i) % ctx->npeers];
+
+    if (peer->in == NULL) {
+      continue;
+    }
+
+    for ( ;; ) {
+      rc = ngx_stream_protobuf_pass_frame(peer->in, &size);
+
+      if (rc == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "upstream %V sent invalid or too large frame",
+                      peer->pc.name);
+        return NGX_STREAM_BAD_GATEWAY;
+      }
+
+      if (rc == NGX_AGAIN
+          || ngx_stream_protobuf_pass_room(ctx->out, size) != NGX_OK)
+      {
+        break;
+      }
+
+      ctx->out->last = ngx_cpymem(ctx->out->last, peer->in->pos, size);
+      peer->in->pos += size;
+
+      if (peer->due > 0) {
+        peer->due--;
+      }
+
+      moved = NGX_OK;
+    }
+  }
+
+  return moved;
+}
+
+/* sends the frames queued for a server, and reads its replies.  once a
+ * server has closed the connection and all its replies are passed on,
+ * the connection is closed as well, and opened again by the next frame
+ * routed there; if replies were still due, the session ends.
+ */
+
+static ngx_int_t
+ngx_stream_protobuf_pass_upstream(ngx_stream_session_t *s,
+                                  ngx_stream_protobuf_pass_peer_t *peer)
+{
+  ngx_connection_t  *c;
+  size_t             size;
+  ngx_int_t          rc, moved;
+
+  c = peer->pc.connection;
+
+  if (c == NULL || !peer->connected) {
+    return NGX_AGAIN;
+  }
+
+  if (peer->eof) {
+    if (ngx_stream_protobuf_pass_frame(peer->in, &size) == NGX_OK) {
+      return NGX_AGAIN;
+    }
+
+    if (peer->due > 0
+        || peer->in->pos != peer->in->last
+        || peer->out->pos != peer->out->last)
+    {
+      ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                    "upstream %V prematurely closed connection",
+                    peer->pc.name);
+      return NGX_STREAM_BAD_GATEWAY;
+    }
+
+    ngx_close_connection(c);
+
+    peer->pc.connection = NULL;
+    peer->connected = 0;
+    peer->eof = 0;
+
+    return NGX_OK;
+  }
+
+  moved = NGX_AGAIN;
+
+  rc = ngx_stream_protobuf_pass_send(c, peer->out);
+
+  if (rc == NGX_ERROR) {
+    return NGX_STREAM_BAD_GATEWAY;
+  }
+
+  if (rc == NGX_OK) {
+    moved = NGX_OK;
+  }
+
+  rc = ngx_stream_protobuf_pass_recv(c, peer->in);
+
+  if (rc == NGX_ERROR) {
+    return NGX_STREAM_BAD_GATEWAY;
+  }
+
+  if (rc == NGX_OK || rc == NGX_DONE) {
+    if (c->read->timer_set) {
+      ngx_del_timer(c->read);
+    }
+
+    peer->eof = (rc == NGX_DONE);
+    moved = NGX_OK;
+  }
+
+  return moved;
+}
+
+/* moves data along until nothing more can be done without waiting,
+ * then waits.  the session ends once the client has closed its side,
+ * and every frame it sent has been answered.
+ */
+
+static void
+ngx_stream_protobuf_pass_process(ngx_stream_session_t *s)
+{
+  ngx_stream_protobuf_pass_srv_conf_t  *pscf;
+  ngx_stream_protobuf_pass_ctx_t       *ctx;
+  ngx_stream_protobuf_pass_peer_t      *peer;
+  ngx_connection_t                     *c, *pc;
+  ngx_uint_t                            i, progress;
+  size_t                                size;
+  ngx_int_t                             rc;
+
+  c = s->connection;
+
+  pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_protobuf_pass_module);
+  ctx = ngx_stream_get_module_ctx(s, ngx_stream_protobuf_pass_module);
+
+  do {
+    progress = 0;
+
+    if (!ctx->eof) {
+      rc = ngx_stream_protobuf_pass_recv(c, ctx->in);
+
+      if (rc == NGX_ERROR) {
+        ngx_stream_protobuf_pass_finalize(s, NGX_STREAM_OK);
+        return;
+      }
+
+      if (rc == NGX_OK || rc == NGX_DONE) {
+        ctx->eof = (rc == NGX_DONE);
+        progress = 1;
+      }
+    }
+
+    rc = ngx_stream_protobuf_pass_requests(s, ctx);
+
+    if (rc > NGX_OK) {
+      ngx_stream_protobuf_pass_finalize(s, rc);
+      return;
+    }
+
+    if (rc == NGX_OK) {
+      progress = 1;
+    }
+
+    for (i = 0; i < ctx->npeers; i++) {
+      rc = ngx_stream_protobuf_pass_upstream(s, &ctx->peers[i]);
+
+      if (rc > NGX_OK) {
+        ngx_stream_protobuf_pass_finalize(s, rc);
+        return;
+      }
+
+      if (rc == NGX_OK) {
+        progress = 1;
+      }
+    }
+
+    rc = ngx_stream_protobuf_pass_replies(s, ctx);
+
+    if (rc > NGX_OK) {
+      ngx_stream_protobuf_pass_finalize(s, rc);
+      return;
+    }
+
+    if (rc == NGX_OK) {
+      progress = 1;
+    }
+
+    rc = ngx_stream_protobuf_pass_send(c, ctx->out);
+
+    if (rc == NGX_ERROR) {
+      ngx_stream_protobuf_pass_finalize(s, NGX_STREAM_OK);
+      return;
+    }
+
+    if (rc == NGX_OK) {
+      progress = 1;
+    }
+
+    if (progress && c->read->timer_set) {
+      ngx_del_timer(c->read);
+    }
+
+  } while (progress);
+
+  if (ctx->eof
+      && ctx->out->pos == ctx->out->last
+      && ngx_stream_protobuf_pass_frame(ctx->in, &size) != NGX_OK)
+  {
+    for (i = 0; i < ctx->npeers; i++) {
+      peer = &ctx->peers[i];
+
+      if (peer->due > 0
+          || (peer->out != NULL && peer->out->pos != peer->out->last))
+      {
+        break;
+      }
+    }
+
+    if (i == ctx->npeers) {
+      ngx_stream_protobuf_pass_finalize(s, NGX_STREAM_OK);
+      return;
+    }
+  }
+
+  for (i = 0; i < ctx->npeers; i++) {
+    peer = &ctx->peers[i];
+    pc = peer->pc.connection;
+
+    if (pc == NULL || !peer->connected) {
+      continue;
+    }
+
+    if (ngx_handle_write_event(pc->write, 0) != NGX_OK
+        || ngx_handle_read_event(pc->read, 0) != NGX_OK)
+    {
+      ngx_stream_protobuf_pass_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+      return;
+    }
+
+    /* a server is timed out only while it owes replies */
+
+    if (peer->due > 0) {
+      if (!pc->read->timer_set) {
+        ngx_add_timer(pc->read, pscf->timeout);
+      }
+
+    } else if (pc->read->timer_set) {
+      ngx_del_timer(pc->read);
+    }
+  }
+
+  if (ngx_handle_write_event(c->write, 0) != NGX_OK
+      || ngx_handle_read_event(c->read, 0) != NGX_OK)
+  {
+    ngx_stream_protobuf_pass_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  if (!c->read->timer_set) {
+    ngx_add_timer(c->read, pscf->timeout);
+  }
+}
+
+static void
+ngx_stream_protobuf_pass_finalize(ngx_stream_session_t *s, ngx_uint_t rc)
+{
+  ngx_stream_protobuf_pass_ctx_t  *ctx;
+  ngx_uint_t                       i;
+
+  ctx = ngx_stream_get_module_ctx(s, ngx_stream_protobuf_pass_module);
+
+  for (i = 0; i < ctx->npeers; i++) {
+    if (ctx->peers[i].pc.connection != NULL) {
+      ngx_close_connection(ctx->peers[i].pc.connection);
+      ctx->peers[i].pc.connection = NULL;
+    }
+  }
+
+  ngx_stream_finalize_session(s, rc);
+}
+
+static void *
+ngx_stream_protobuf_pass_create_srv_conf(ngx_conf_t *cf)
+{
+  ngx_stream_protobuf_pass_srv_conf_t  *conf;
+
+  conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_protobuf_pass_srv_conf_t));
+  if (conf == NULL) {
+    return NULL;
+  }
+
+  /* set by ngx_pcalloc():
+   *
+   *   conf->upstream = NULL;
+   *   conf->points = NULL;
+   *   conf->depth = 0;
+   */
+
+  conf->connect_timeout = NGX_CONF_UNSET_MSEC;
+  conf->timeout = NGX_CONF_UNSET_MSEC;
+  conf->buffer_size = NGX_CONF_UNSET_SIZE;
+
+  return conf;
+}
+
+static int ngx_libc_cdecl
+ngx_stream_protobuf_pass_cmp_points(const void *one, const void *two)
+{
+  const ngx_stream_protobuf_pass_point_t  *a = one;
+  const ngx_stream_protobuf_pass_point_t  *b = two;
+
+  /* points that collide are ordered by server, so that every worker
+   * builds the same ring
+   */
+
+  if (a->hash != b->hash) {
+    return (a->hash < b->hash) ? -1 : 1;
+  }
+
+  return (a->peer > b->peer) - (a->peer < b->peer);
+}
+
+/* builds the ring of the upstream: weight * 160 points for each of its
+ * servers, whether down or not, at the crc32 of its address followed
+ * by the number of the point.
+ */
+
+static ngx_stream_protobuf_pass_points_t *
+ngx_stream_protobuf_pass_init_points(ngx_conf_t *cf,
+                                     ngx_stream_upstream_srv_conf_t *us)
+{
+  ngx_stream_protobuf_pass_points_t  *points;
+  ngx_stream_upstream_rr_peers_t     *peers;
+  ngx_stream_upstream_rr_peer_t      *rp;
+  ngx_uint_t                          i, j, m, n;
+  uint32_t                            hash;
+  u_char                              number[4];
+
+  peers = us->peer.data;
+
+  n = 0;
+
+  for (rp = peers->peer; rp; rp = rp->next) {
+    n += (ngx_uint_t) rp->weight * NGX_STREAM_PROTOBUF_PASS_POINTS;
+  }
+
+  points = ngx_palloc(cf->pool, sizeof(ngx_stream_protobuf_pass_points_t)
+                                + sizeof(ngx_stream_protobuf_pass_point_t)
+                                  * (n ? n - 1 : 0));
+  if (points == NULL) {
+    return NULL;
+  }
+
+  points->number = 0;
+
+  for (rp = peers->peer, i = 0; rp; rp = rp->next, i++) {
+    m = (ngx_uint_t) rp->weight * NGX_STREAM_PROTOBUF_PASS_POINTS;
+
+    for (j = 0; j < m; j++) {
+      number[0] = (u_char) j;
+      number[1] = (u_char) (j >> 8);
+      number[2] = (u_char) (j >> 16);
+      number[3] = (u_char) (j >> 24);
+
+      ngx_crc32_init(hash);
+      ngx_crc32_update(&hash, rp->name.data, rp->name.len);
+      ngx_crc32_update(&hash, number, 4);
+      ngx_crc32_final(hash);
+
+      points->point[points->number].hash = hash;
+      points->point[points->number].peer = i;
+      points->number++;
+    }
+  }
+
+  ngx_qsort(points->point, points->number,
+            sizeof(ngx_stream_protobuf_pass_point_t),
+            ngx_stream_protobuf_pass_cmp_points);
+
+  return points;
+}
+
+static char *
+ngx_stream_protobuf_pass_merge_srv_conf(ngx_conf_t *cf,
+                                        void *parent,
+                                        void *child)
+{
+  ngx_stream_protobuf_pass_srv_conf_t  *prev = parent;
+  ngx_stream_protobuf_pass_srv_conf_t  *conf = child;
+
+  ngx_conf_merge_msec_value(conf->connect_timeout,
+                            prev->connect_timeout, 60000);
+
+  ngx_conf_merge_msec_value(conf->timeout,
+                            prev->timeout, 10 * 60000);
+
+  ngx_conf_merge_size_value(conf->buffer_size,
+                            prev->buffer_size, 65536);
+
+  /* the servers of the upstream are known by now, as the upstream
+   * module has initialized its main configuration before this one is
+   * merged
+   */
+
+  if (conf->upstream && conf->depth > 0 && conf->points == NULL) {
+    conf->points = ngx_stream_protobuf_pass_init_points(cf, conf->upstream);
+    if (conf->points == NULL) {
+      return NGX_CONF_ERROR;
+    }
+  }
+
+  return NGX_CONF_OK;
+}
+
+/* protobuf_pass address; */
+
+static char *
+ngx_stream_protobuf_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_stream_protobuf_pass_srv_conf_t  *pscf = conf;
+  ngx_stream_core_srv_conf_t           *cscf;
+  ngx_str_t                            *value;
+  ngx_url_t                             u;
+
+  if (pscf->upstream) {
+    return "is duplicate";
+  }
+
+  value = cf->args->elts;
+
+  ngx_memzero(&u, sizeof(ngx_url_t));
+
+  u.url = value[1];
+  u.no_resolve = 1;
+
+  pscf->upstream = ngx_stream_upstream_add(cf, &u, 0);
+  if (pscf->upstream == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  cscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_core_module);
+
+  cscf->handler = ngx_stream_protobuf_pass_handler;
+
+  return NGX_CONF_OK;
+}
+
+/* protobuf_pass_route type field.path; */
+
+static char *
+ngx_stream_protobuf_pass_route(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_stream_protobuf_pass_srv_conf_t  *pscf = conf;
+  ngx_protobuf_message_descriptor_t    *desc;
+  ngx_str_t                            *value;
+  ngx_protobuf_path_t                   pp;
+  u_char                                errstr[NGX_MAX_CONF_ERRSTR];
+
+  if (pscf->depth > 0) {
+    return "is duplicate";
+  }
+
+  value = cf->args->elts;
+
+  desc = ngx_protobuf_find_message(&value[1]);
+  if (desc == NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "unknown message type \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  ngx_memzero(&pp, sizeof(ngx_protobuf_path_t));
+
+  pp.path = value[2];
+  pp.message = desc;
+  pp.fields = pscf->path;
+  pp.max = NGX_STREAM_PROTOBUF_PASS_MAX_DEPTH;
+  pp.err.len = NGX_MAX_CONF_ERRSTR;
+  pp.err.data = errstr;
+
+  if (ngx_protobuf_resolve_path(&pp) != NGX_OK) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &pp.err);
+    return NGX_CONF_ERROR;
+  }
+
+  pscf->depth = pp.depth;
+
+  return NGX_CONF_OK;
+}
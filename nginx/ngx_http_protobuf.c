@@ -0,0 +1,62 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_http_protobuf.h>
+
+/* reads the request body from a phase handler.  the handler returns
+ * what this returns: NGX_DECLINED once the body is in and the phase
+ * can move on, NGX_DONE while it is being read, or an error status.
+ * the body handler finishes with ngx_http_protobuf_body_done().
+ */
+
+ngx_int_t
+ngx_http_protobuf_read_body(ngx_http_request_t *r,
+                            ngx_http_protobuf_body_t *body,
+                            ngx_http_client_body_handler_pt handler)
+{
+  ngx_int_t  rc;
+
+  if (body->done) {
+    return NGX_DECLINED;
+  }
+
+  if (body->reading) {
+    return NGX_DONE;
+  }
+
+  body->reading = 1;
+
+  rc = ngx_http_read_client_request_body(r, handler);
+  if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+    return rc;
+  }
+
+  ngx_http_finalize_request(r, NGX_DONE);
+
+  return NGX_DONE;
+}
+
+/* called from the body handler with the status of whatever it did
+ * with the body.  as in the mirror module, the phases are resumed from
+ * here, and the body is preserved for the content handler, which reads
+ * it again.
+ */
+
+void
+ngx_http_protobuf_body_done(ngx_http_request_t *r,
+                            ngx_http_protobuf_body_t *body,
+                            ngx_int_t rc)
+{
+  body->reading = 0;
+  body->done = 1;
+
+  if (rc != NGX_OK) {
+    ngx_http_finalize_request(r, rc);
+    return;
+  }
+
+  r->preserve_body = 1;
+
+  r->write_event_handler = ngx_http_core_run_phases;
+  ngx_http_core_run_phases(r);
+}
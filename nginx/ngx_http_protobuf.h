@@ -0,0 +1,26 @@
+#ifndef _NGX_HTTP_PROTOBUF_H_INCLUDED_
+#define _NGX_HTTP_PROTOBUF_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_protobuf.h>
+
+/* state of a request body read from a phase handler.  it lives in the
+ * reading module's request context, which is zeroed by ngx_pcalloc().
+ */
+
+typedef struct {
+  unsigned  reading:1;
+  unsigned  done:1;
+} ngx_http_protobuf_body_t;
+
+ngx_int_t ngx_http_protobuf_read_body(ngx_http_request_t *r,
+                                      ngx_http_protobuf_body_t *body,
+                                      ngx_http_client_body_handler_pt handler);
+
+void ngx_http_protobuf_body_done(ngx_http_request_t *r,
+                                 ngx_http_protobuf_body_t *body,
+                                 ngx_int_t rc);
+
+#endif /* _NGX_HTTP_PROTOBUF_H_INCLUDED_ */
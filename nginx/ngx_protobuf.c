@@ -1,11 +1,45 @@
 #include <ngx_core.h>
 #include <ngx_protobuf.h>
+#include <math.h>
+
+/* a registry as it is built for the cycle being configured */
+
+typedef struct {
+  ngx_protobuf_registry_t            *registry;
+  ngx_protobuf_registry_t             frozen;
+  ngx_array_t                         imported;
+} ngx_protobuf_registry_build_t;
+
+/* the registries and RPC methods of a cycle.  they are built aside
+ * while the cycle is configured, and only replace the live ones from
+ * init_module, once nginx has committed to the cycle, so a failed
+ * reload leaves the running configuration alone.  the methods are
+ * kept by path in an open addressing table with at least twice as
+ * many slots as there are methods.
+ */
+
+typedef struct {
+  ngx_array_t                         registries;
+  ngx_protobuf_method_descriptor_t  **methods;
+  ngx_uint_t                          methods_mask;
+} ngx_protobuf_conf_t;
 
+static void *ngx_protobuf_create_conf(ngx_cycle_t *cycle);
 static char *ngx_protobuf_init(ngx_cycle_t *cycle, void *conf);
+static ngx_int_t ngx_protobuf_init_module(ngx_cycle_t *cycle);
+static ngx_int_t ngx_protobuf_init_process(ngx_cycle_t *cycle);
+static void ngx_protobuf_exit_process(ngx_cycle_t *cycle);
+static ngx_int_t ngx_protobuf_freeze_registry(
+    ngx_protobuf_registry_build_t *build, ngx_pool_t *pool);
+static ngx_int_t ngx_protobuf_init_methods(ngx_cycle_t *cycle,
+                                           ngx_protobuf_conf_t *pcf);
+
+/* the configuration of the running cycle */
+static ngx_protobuf_conf_t *ngx_protobuf_conf;
 
 static ngx_core_module_t ngx_protobuf_module_ctx = {
   ngx_string("protobuf"),
-  NULL,
+  ngx_protobuf_create_conf,
   ngx_protobuf_init
 };
 
@@ -15,34 +49,108 @@ ngx_module_t ngx_protobuf_module = {
   NULL,                      /* module directives */
   NGX_CORE_MODULE,           /* module type */
   NULL,                      /* init master */
-  NULL,                      /* init module */
-  NULL,                      /* init process */
+  ngx_protobuf_init_module,  /* init module */
+  ngx_protobuf_init_process, /* init process */
   NULL,                      /* init thread */
   NULL,                      /* exit thread */
-  NULL,                      /* exit process */
+  ngx_protobuf_exit_process, /* exit process */
   NULL,                      /* exit master */
   NGX_MODULE_V1_PADDING
 };
 
+static void *
+ngx_protobuf_create_conf(ngx_cycle_t *cycle)
+{
+  ngx_protobuf_conf_t  *pcf;
+
+  pcf = ngx_pcalloc(cycle->pool, sizeof(ngx_protobuf_conf_t));
+  if (pcf == NULL) {
+    return NULL;
+  }
+
+  /* set by ngx_pcalloc():
+   *
+   *   pcf->methods = NULL;
+   *   pcf->methods_mask = 0;
+   */
+
+  if (ngx_array_init(&pcf->registries, cycle->pool, 8,
+                     sizeof(ngx_protobuf_registry_build_t))
+      != NGX_OK)
+  {
+    return NULL;
+  }
+
+  return pcf;
+}
+
 static char *
 ngx_protobuf_init(ngx_cycle_t *cycle, void *conf)
 {
-  ngx_protobuf_module_t  *module;
-  ngx_uint_t              i;
+  ngx_protobuf_conf_t            *pcf = conf;
+  ngx_protobuf_module_t          *module;
+  ngx_protobuf_registry_build_t  *build;
+  ngx_uint_t                      i;
 
   /* register extensions */
   for (i = 0; ngx_modules[i]; i++) {
     if (ngx_modules[i]->type == NGX_PROTOBUF_MODULE) {
       module = ngx_modules[i]->ctx;
       if (module != NULL && module->register_extensions != NULL) {
-        module->register_extensions(cycle);
+        if (module->register_extensions(cycle) != NGX_OK) {
+          return NGX_CONF_ERROR;
+        }
       }
     }
   }
 
+  build = pcf->registries.elts;
+  for (i = 0; i < pcf->registries.nelts; i++) {
+    if (ngx_protobuf_freeze_registry(&build[i], cycle->pool) != NGX_OK) {
+      return NGX_CONF_ERROR;
+    }
+  }
+
+  if (ngx_protobuf_init_methods(cycle, pcf) != NGX_OK) {
+    return NGX_CONF_ERROR;
+  }
+
   return NGX_CONF_OK;
 }
 
+/* nginx has committed to the new cycle: switch the registries over to
+ * its frozen arrays.  a registry that the previous cycle filled and
+ * this one did not is emptied, since its arrays go away with the
+ * previous cycle's pool.
+ */
+
+static ngx_int_t
+ngx_protobuf_init_module(ngx_cycle_t *cycle)
+{
+  ngx_protobuf_conf_t            *pcf;
+  ngx_protobuf_registry_build_t  *build;
+  ngx_uint_t                      i;
+
+  pcf = (ngx_protobuf_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                             ngx_protobuf_module);
+
+  if (ngx_protobuf_conf != NULL) {
+    build = ngx_protobuf_conf->registries.elts;
+    for (i = 0; i < ngx_protobuf_conf->registries.nelts; i++) {
+      ngx_memzero(build[i].registry, sizeof(ngx_protobuf_registry_t));
+    }
+  }
+
+  build = pcf->registries.elts;
+  for (i = 0; i < pcf->registries.nelts; i++) {
+    *build[i].registry = build[i].frozen;
+  }
+
+  ngx_protobuf_conf = pcf;
+
+  return NGX_OK;
+}
+
 ngx_int_t
 ngx_protobuf_read_string(u_char **buf,
                          u_char *end,
@@ -85,6 +193,66 @@ ngx_protobuf_read_string(u_char **buf,
   return NGX_OK;
 }
 
+ngx_int_t
+ngx_protobuf_read_string_copy(u_char **buf,
+                              u_char *end,
+                              ngx_str_t *val,
+                              ngx_pool_t *pool)
+{
+  uint64_t  v;
+
+  if (ngx_protobuf_read_uint64(buf, end, &v) != NGX_OK
+      || v > (uint64_t) (end - *buf))
+  {
+    *buf = end;
+
+    return NGX_ABORT;
+  }
+
+  val->data = ngx_palloc(pool, v);
+  if (val->data == NULL) {
+    *buf = end;
+
+    return NGX_ERROR;
+  }
+
+  ngx_memcpy(val->data, *buf, v);
+  val->len = v;
+  *buf += v;
+
+  return NGX_OK;
+}
+
+ngx_int_t
+ngx_protobuf_read_padded_string_copy(u_char **buf,
+                                     u_char *end,
+                                     ngx_str_t *val,
+                                     ngx_pool_t *pool)
+{
+  uint64_t  v;
+
+  if (ngx_protobuf_read_padded_uint64(buf, end, &v) != NGX_OK
+      || v > (uint64_t) (end - *buf))
+  {
+    *buf = end;
+
+    return NGX_ABORT;
+  }
+
+  val->data = ngx_palloc(pool, v);
+  if (val->data == NULL) {
+    *buf = end;
+
+    return NGX_ERROR;
+  }
+
+  ngx_memcpy(val->data, *buf, v);
+  val->len = v;
+  *buf += v;
+
+  return NGX_OK;
+}
+
 ngx_int_t
 ngx_protobuf_skip(u_char **pos, u_char *end, uint32_t wire)
 {
@@ -114,6 +282,58 @@ ngx_protobuf_skip(u_char **pos, u_char *end, uint32_t wire)
   return rc;
 }
 
+/* skip the rest of a group, up to and including its end tag */
+
+static ngx_int_t
+ngx_protobuf_skip_group(u_char **pos, u_char *end, uint32_t field,
+                        ngx_uint_t depth)
+{
+  uint32_t   header;
+  ngx_int_t  rc;
+
+  if (depth == 0) {
+    return NGX_ABORT;
+  }
+
+  while (*pos < end) {
+    if (ngx_protobuf_read_uint32(pos, end, &header) != NGX_OK) {
+      return NGX_ABORT;
+    }
+
+    switch (header & 0x07) {
+    case NGX_PROTOBUF_WIRETYPE_END_GROUP:
+      return ((header >> 3) == field) ? NGX_OK : NGX_ABORT;
+    case NGX_PROTOBUF_WIRETYPE_START_GROUP:
+      rc = ngx_protobuf_skip_group(pos, end, header >> 3, depth - 1);
+      break;
+    default:
+      rc = ngx_protobuf_skip(pos, end, header & 0x07);
+      break;
+    }
+
+    if (rc != NGX_OK) {
+      return rc;
+    }
+  }
+
+  /* the group was not terminated */
+  return NGX_ABORT;
+}
+
+/* like ngx_protobuf_skip, but groups are skipped as well */
+
+ngx_int_t
+ngx_protobuf_skip_field(u_char **pos, u_char *end, uint32_t field,
+                        uint32_t wire)
+{
+  if (wire == NGX_PROTOBUF_WIRETYPE_START_GROUP) {
+    return ngx_protobuf_skip_group(pos, end, field,
+                                   NGX_PROTOBUF_MAX_GROUP_DEPTH);
+  }
+
+  return ngx_protobuf_skip(pos, end, wire);
+}
+
 void *
 ngx_protobuf_push_array(ngx_array_t **a, ngx_pool_t *p, size_t n)
 {
@@ -135,150 +355,251 @@ ngx_protobuf_push_array(ngx_array_t **a, ngx_pool_t *p, size_t n)
   return ret;
 }
 
-static ngx_inline void *
-ngx_protobuf_find_node(ngx_rbtree_t *tree, uint32_t field)
+/* extension descriptors have the lifetime of the cycle, so they are
+ * collected in the configuration of the cycle being set up, and the
+ * registry's arrays are allocated from the cycle pool.
+ */
+
+ngx_int_t
+ngx_protobuf_import_extension(ngx_protobuf_registry_t *registry,
+                              ngx_protobuf_field_descriptor_t *desc,
+                              ngx_cycle_t *cycle)
 {
-  ngx_rbtree_node_t *node;
+  ngx_protobuf_conf_t              *pcf;
+  ngx_protobuf_registry_build_t    *build;
+  ngx_protobuf_field_descriptor_t **slot;
+  ngx_uint_t                        i;
+
+  pcf = (ngx_protobuf_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                             ngx_protobuf_module);
+
+  build = pcf->registries.elts;
+  for (i = 0; i < pcf->registries.nelts; i++) {
+    if (build[i].registry == registry) {
+      break;
+    }
+  }
 
-  node = tree->root;
-  while (node != tree->sentinel) {
-    if (field < node->key) {
-      node = node->left;
-    } else if (field > node->key) {
-      node = node->right;
-    } else {
-      return node;
+  if (i == pcf->registries.nelts) {
+    build = ngx_array_push(&pcf->registries);
+    if (build == NULL) {
+      return NGX_ERROR;
+    }
+
+    ngx_memzero(&build->frozen, sizeof(ngx_protobuf_registry_t));
+    build->registry = registry;
+
+    if (ngx_array_init(&build->imported, cycle->pool, 8, sizeof(*slot))
+        != NGX_OK)
+    {
+      return NGX_ERROR;
     }
+  } else {
+    build += i;
   }
 
-  return NULL;
+  slot = ngx_array_push(&build->imported);
+  if (slot == NULL) {
+    return NGX_ERROR;
+  }
+
+  *slot = desc;
+
+  return NGX_OK;
 }
 
-static ngx_int_t
-ngx_protobuf_init_rbtree(ngx_rbtree_t **tree, ngx_pool_t *pool)
+static int ngx_libc_cdecl
+ngx_protobuf_cmp_extensions(const void *one, const void *two)
 {
-  ngx_rbtree_node_t *sentinel;
+  ngx_protobuf_field_descriptor_t * const *a = one;
+  ngx_protobuf_field_descriptor_t * const *b = two;
 
-  if (*tree != NULL) {
-    return NGX_OK;
+  if ((*a)->number < (*b)->number) {
+    return -1;
   }
 
-  sentinel = ngx_pcalloc(pool, sizeof(ngx_rbtree_node_t));
-  if (sentinel == NULL) {
+  return ((*a)->number > (*b)->number);
+}
+
+static ngx_int_t
+ngx_protobuf_freeze_registry(ngx_protobuf_registry_build_t *build,
+                             ngx_pool_t *pool)
+{
+  ngx_protobuf_registry_t          *reg = &build->frozen;
+  ngx_protobuf_field_descriptor_t **desc;
+  ngx_uint_t                        i, n;
+
+  desc = build->imported.elts;
+  n = build->imported.nelts;
+
+  /* ngx_sort is stable, so when a field number was imported more than
+   * once, the last import of that number wins.
+   */
+  ngx_sort(desc, n, sizeof(*desc), ngx_protobuf_cmp_extensions);
+
+  reg->numbers = ngx_palloc(pool, n * sizeof(uint32_t));
+  reg->descriptors = ngx_palloc(pool, n * sizeof(*desc));
+  if (reg->numbers == NULL || reg->descriptors == NULL) {
     return NGX_ERROR;
   }
 
-  *tree = ngx_pcalloc(pool, sizeof(ngx_rbtree_t));
-  if (*tree == NULL) {
-    return NGX_ERROR;
+  reg->nelts = 0;
+  for (i = 0; i < n; ++i) {
+    if (i + 1 < n && desc[i + 1]->number == desc[i]->number) {
+      continue;
+    }
+    reg->numbers[reg->nelts] = desc[i]->number;
+    reg->descriptors[reg->nelts] = desc[i];
+    reg->nelts++;
   }
 
-  ngx_rbtree_init(*tree, sentinel, ngx_rbtree_insert_value);
+  reg->base = reg->numbers[0];
+  reg->dense = (reg->numbers[reg->nelts - 1] - reg->base == reg->nelts - 1);
 
   return NGX_OK;
 }
 
-static void *
-ngx_protobuf_rbtree_node(ngx_rbtree_t  *tree,
-                         uint32_t       key,
-                         ngx_pool_t    *pool,
-                         size_t         size)
+static ngx_inline ngx_protobuf_field_descriptor_t *
+ngx_protobuf_find_extension(ngx_protobuf_registry_t *reg, uint32_t field)
 {
-  ngx_rbtree_node_t *node;
+  ngx_uint_t  i, n, half;
 
-  node = ngx_protobuf_find_node(tree, key);
-  if (node == NULL) {
-    /* allocate and initialize the node */
-    node = ngx_pcalloc(pool, size);
-    if (node != NULL) {
-      node->key = key;
-      ngx_rbtree_insert(tree, node);
-    }
+  if (reg->dense) {
+    field -= reg->base;
+    return (field < reg->nelts) ? reg->descriptors[field] : NULL;
   }
 
-  return node;
+  if (reg->nelts == 0) {
+    return NULL;
+  }
+
+  /* the loop narrows the range without a data-dependent branch, so the
+   * compiler can use a conditional move for each step.
+   */
+  i = 0;
+  for (n = reg->nelts; n > 1; n -= half) {
+    half = n / 2;
+    i = (reg->numbers[i + half] <= field) ? i + half : i;
+  }
+
+  return (reg->numbers[i] == field) ? reg->descriptors[i] : NULL;
 }
 
-/* extension objects have the lifetime of the entire process, so the
- * tree and its nodes are allocated from the cycle pool.
+/* the index of an extension field in a message's extensions, or the
+ * index at which it would be inserted if it is not set.
  */
 
-ngx_int_t
-ngx_protobuf_import_extension(ngx_rbtree_t **registry,
-                              ngx_protobuf_field_descriptor_t *desc,
-                              ngx_cycle_t *cycle)
+static ngx_inline ngx_uint_t
+ngx_protobuf_extension_slot(ngx_protobuf_extensions_t *ext, uint32_t field)
 {
-  ngx_protobuf_extension_descriptor_t *node;
+  ngx_uint_t  lo, hi, mid;
 
-  if (ngx_protobuf_init_rbtree(registry, cycle->pool) != NGX_OK) {
-    return NGX_ERROR;
-  }
+  lo = 0;
+  hi = ext->nelts;
 
-  node = ngx_protobuf_rbtree_node(*registry,
-                                  desc->number,
-                                  cycle->pool,
-                                  sizeof(ngx_protobuf_extension_descriptor_t));
-  if (node == NULL) {
-    return NGX_ERROR;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (ext->elts[mid].number < field) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
   }
 
-  node->descriptor = desc;
-
-  return NGX_OK;
+  return lo;
 }
 
 /* get the value for an extension field (or NULL if not found) */
 
 ngx_protobuf_value_t *
-ngx_protobuf_get_extension(ngx_rbtree_t *extensions, uint32_t field)
+ngx_protobuf_get_extension(ngx_protobuf_extensions_t *extensions,
+                           uint32_t field)
 {
-  ngx_protobuf_extension_field_t *node;
+  ngx_uint_t  i;
 
-  if (extensions == NULL) {
+  i = ngx_protobuf_extension_slot(extensions, field);
+  if (i == extensions->nelts || extensions->elts[i].number != field) {
     return NULL;
   }
 
-  node = ngx_protobuf_find_node(extensions, field);
-  if (node == NULL) {
+  return &extensions->elts[i].value;
+}
+
+/* find an extension field, or insert an empty one in field number
+ * order.  the array doubles when it is full.
+ */
+
+static ngx_protobuf_extension_field_t *
+ngx_protobuf_extension_node(ngx_protobuf_extensions_t *ext,
+                            ngx_protobuf_field_descriptor_t *desc,
+                            ngx_pool_t *pool)
+{
+  ngx_protobuf_extension_field_t  *elts, *node;
+  ngx_uint_t                       i, n;
+
+  i = ngx_protobuf_extension_slot(ext, desc->number);
+  if (i < ext->nelts && ext->elts[i].number == desc->number) {
+    return &ext->elts[i];
+  }
+
+  if (pool == NULL) {
     return NULL;
   }
 
-  return &node->value;
+  if (ext->nelts == ext->nalloc) {
+    n = (ext->nalloc != 0) ? 2 * ext->nalloc : 4;
+
+    elts = ngx_palloc(pool, n * sizeof(ngx_protobuf_extension_field_t));
+    if (elts == NULL) {
+      return NULL;
+    }
+
+    if (ext->nelts > 0) {
+      ngx_memcpy(elts, ext->elts,
+                 ext->nelts * sizeof(ngx_protobuf_extension_field_t));
+    }
+
+    ext->elts = elts;
+    ext->nalloc = n;
+  }
+
+  node = &ext->elts[i];
+
+  if (i < ext->nelts) {
+    ngx_memmove(node + 1, node,
+                (ext->nelts - i) * sizeof(ngx_protobuf_extension_field_t));
+  }
+
+  ngx_memzero(node, sizeof(ngx_protobuf_extension_field_t));
+  node->number = desc->number;
+  node->descriptor = desc;
+  ext->nelts++;
+
+  return node;
 }
 
 static ngx_int_t
-ngx_protobuf_get_extension_node(ngx_rbtree_t **extensions,
-                                ngx_rbtree_t *registry,
+ngx_protobuf_get_extension_node(ngx_protobuf_extensions_t *extensions,
+                                ngx_protobuf_registry_t *registry,
                                 uint32_t field,
                                 ngx_protobuf_extension_field_t **node,
                                 ngx_pool_t *pool)
 {
-  ngx_protobuf_extension_descriptor_t *desc;
+  ngx_protobuf_field_descriptor_t *desc;
 
   *node = NULL;
 
-  desc = ngx_protobuf_find_node(registry, field);
+  desc = ngx_protobuf_find_extension(registry, field);
   if (desc == NULL) {
     /* trying to set an extension with an invalid field number */
     return NGX_ABORT;
   }
 
-  /* allocate/init the extension rbtree if needed */
-  if (ngx_protobuf_init_rbtree(extensions, pool) != NGX_OK) {
-    /* could not allocate the extension rbtree */
-    return NGX_ERROR;
-  }
-
-  /* find or create the extension's rbtree node */
-  *node = ngx_protobuf_rbtree_node(*extensions, field, pool,
-    sizeof(ngx_protobuf_extension_field_t));
+  *node = ngx_protobuf_extension_node(extensions, desc, pool);
   if (*node == NULL) {
-    /* could not allocate the extension's rbtree node */
+    /* could not grow the extension array */
     return NGX_ERROR;
   }
-  if ((*node)->descriptor == NULL) {
-    (*node)->descriptor = desc->descriptor;
-  }
 
   return NGX_OK;
 }
@@ -293,9 +614,19 @@ ngx_protobuf_extension_field(ngx_protobuf_extension_field_t   *node,
     obj = ngx_protobuf_push_array(&node->value.u.v_repeated,
                                   pool,
                                   node->descriptor->width);
+    if (obj != NULL && node->descriptor->defaults != NULL) {
+      ngx_memcpy(obj, node->descriptor->defaults, node->descriptor->width);
+    }
   } else if (node->descriptor->type == NGX_PROTOBUF_TYPE_MESSAGE) {
     if (node->value.u.v_message == NULL) {
-      node->value.u.v_message = ngx_pcalloc(pool, node->descriptor->width);
+      if (node->descriptor->defaults != NULL) {
+        node->value.u.v_message =
+          ngx_protobuf_alloc_default(pool, node->descriptor->defaults,
+                                     node->descriptor->width);
+      } else {
+        node->value.u.v_message = ngx_pcalloc(pool,
+                                              node->descriptor->width);
+      }
     }
     obj = node->value.u.v_message;
   } else {
@@ -308,8 +639,8 @@ ngx_protobuf_extension_field(ngx_protobuf_extension_field_t   *node,
 /* set an extension field's value */
 
 ngx_int_t
-ngx_protobuf_set_extension(ngx_rbtree_t **extensions,
-                           ngx_rbtree_t *registry,
+ngx_protobuf_set_extension(ngx_protobuf_extensions_t *extensions,
+                           ngx_protobuf_registry_t *registry,
                            uint32_t field,
                            ngx_protobuf_value_t *value,
                            ngx_pool_t *pool)
@@ -317,33 +648,33 @@ ngx_protobuf_set_extension(ngx_rbtree_t **extensions,
   ngx_protobuf_extension_field_t  *n = NULL;
   ngx_int_t                        rc;
 
+  if (value == NULL || !value->exists) {
+    ngx_protobuf_clear_extension(extensions, field);
+    return NGX_OK;
+  }
+
   rc = ngx_protobuf_get_extension_node(extensions, registry, field, &n, pool);
   if (rc != NGX_OK) {
     return rc;
   }
 
-  if (value != NULL && value->exists) {
-    /* check for type consistency */
-    if (value->type != n->descriptor->type) {
-      /* value type does not match descriptor type */
-      return NGX_ABORT;
-    } else {
-      /* shallow copy the value */
-      memcpy(&n->value, value, sizeof(ngx_protobuf_value_t));
-    }
-  } else {
-    /* clear the value */
-    ngx_memzero(&n->value, sizeof(ngx_protobuf_value_t));
+  /* check for type consistency */
+  if (value->type != n->descriptor->type) {
+    /* value type does not match descriptor type */
+    return NGX_ABORT;
   }
 
+  /* shallow copy the value */
+  ngx_memcpy(&n->value, value, sizeof(ngx_protobuf_value_t));
+
   return NGX_OK;
 }
 
 /* push an element onto a repeated extension field's array. */
 
 ngx_int_t
-ngx_protobuf_add_extension(ngx_rbtree_t **extensions,
-                           ngx_rbtree_t *registry,
+ngx_protobuf_add_extension(ngx_protobuf_extensions_t *extensions,
+                           ngx_protobuf_registry_t *registry,
                            uint32_t field,
                            void **ptr,
                            ngx_pool_t *pool)
@@ -361,122 +692,66 @@ ngx_protobuf_add_extension(ngx_rbtree_t **extensions,
     return NGX_ERROR;
   }
 
+  n->value.exists = 1;
+  n->value.type = n->descriptor->type;
+
   return NGX_OK;
 }
 
-/* clears an extension field.  the node itself is kept around, but
- * the node's value is cleared.
+/* clears an extension field by removing it from the message's
+ * extensions.
  */
 
-void ngx_protobuf_clear_extension(ngx_rbtree_t *extensions,
+void ngx_protobuf_clear_extension(ngx_protobuf_extensions_t *extensions,
                                   uint32_t field)
 {
-  ngx_protobuf_value_t *value;
+  ngx_uint_t  i;
 
-  value = ngx_protobuf_get_extension(extensions, field);
-  if (value != NULL) {
-    ngx_memzero(value, sizeof(ngx_protobuf_value_t));
+  i = ngx_protobuf_extension_slot(extensions, field);
+  if (i == extensions->nelts || extensions->elts[i].number != field) {
+    return;
   }
-}
 
-static ngx_int_t
-ngx_protobuf_unpack_extension_value(ngx_protobuf_field_descriptor_t *field,
-                                    void *obj,
-                                    ngx_protobuf_context_t *ctx)
-{
-  u_char    **pos = &ctx->buffer.pos;
-  u_char     *end = ctx->buffer.last;
-  ngx_int_t   rc = NGX_OK;
-  uint32_t    mlen;
+  extensions->nelts--;
 
-  switch (field->type) {
-  case NGX_PROTOBUF_TYPE_MESSAGE:
-    rc = ngx_protobuf_read_uint32(pos, end, &mlen);
-    if (rc == NGX_OK) {
-      ctx->buffer.last = ctx->buffer.pos + mlen;
-      rc = field->unpack(obj, ctx);
-      ctx->buffer.last = end;
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_BYTES:
-  case NGX_PROTOBUF_TYPE_STRING:
-    rc = ngx_protobuf_read_string(pos, end, obj, ctx->pool);
-    break;
-  case NGX_PROTOBUF_TYPE_BOOL:
-    rc = ngx_protobuf_read_bool(pos, end, obj);
-    break;
-  case NGX_PROTOBUF_TYPE_ENUM:    
-  case NGX_PROTOBUF_TYPE_UINT32:
-  case NGX_PROTOBUF_TYPE_INT32:
-    rc = ngx_protobuf_read_uint32(pos, end, obj);
-    break;
-  case NGX_PROTOBUF_TYPE_SINT32:
-    rc = ngx_protobuf_read_sint32(pos, end, obj);
-    break;
-  case NGX_PROTOBUF_TYPE_UINT64:
-  case NGX_PROTOBUF_TYPE_INT64:
-    rc = ngx_protobuf_read_uint64(pos, end, obj);
-    break;
-  case NGX_PROTOBUF_TYPE_SINT64:
-    rc = ngx_protobuf_read_sint64(pos, end, obj);
-    break;
-  case NGX_PROTOBUF_TYPE_FIXED32:
-    rc = ngx_protobuf_read_fixed32(pos, end, obj);
-    break;
-  case NGX_PROTOBUF_TYPE_SFIXED32:
-    rc = ngx_protobuf_read_sfixed32(pos, end, obj);
-    break;
-  case NGX_PROTOBUF_TYPE_FLOAT:
-    rc = ngx_protobuf_read_float(pos, end, obj);
-    break;
-  case NGX_PROTOBUF_TYPE_FIXED64:
-    rc = ngx_protobuf_read_fixed64(pos, end, obj);
-    break;
-  case NGX_PROTOBUF_TYPE_SFIXED64:
-    rc = ngx_protobuf_read_sfixed64(pos, end, obj);
-    break;
-  case NGX_PROTOBUF_TYPE_DOUBLE:
-    rc = ngx_protobuf_read_double(pos, end, obj);
-    break;
-  default:
-    break;
+  if (i < extensions->nelts) {
+    ngx_memmove(&extensions->elts[i], &extensions->elts[i + 1],
+                (extensions->nelts - i)
+                * sizeof(ngx_protobuf_extension_field_t));
   }
-
-  return rc;
 }
 
 ngx_int_t
 ngx_protobuf_unpack_extension(uint32_t field,
                               ngx_protobuf_wiretype_e wire,
                               ngx_protobuf_context_t *ctx,
-                              ngx_rbtree_t *registry,
-                              ngx_rbtree_t **extensions)
+                              ngx_protobuf_registry_t *registry,
+                              ngx_protobuf_extensions_t *ext)
 {
-  u_char                               **pos = &ctx->buffer.pos;
-  u_char                                *end = ctx->buffer.last;
-  ngx_flag_t                             packed = 0;
-  ngx_protobuf_extension_descriptor_t   *rnode = NULL;
-  ngx_protobuf_extension_field_t        *onode = NULL;
-  ngx_protobuf_field_descriptor_t       *desc;
-  void                                  *obj;
-  uint32_t                               mlen;
-  u_char                                *mend;
-  ngx_int_t                              rc = NGX_OK;
-
-  /* if the type allows extensions but none were registered, skip. */
-  if (registry == NULL) {
-    return ngx_protobuf_skip(pos, end, wire);
+  u_char                           **pos = &ctx->buffer.pos;
+  u_char                            *end = ctx->buffer.last;
+  ngx_flag_t                         packed = 0;
+  ngx_protobuf_extension_field_t    *onode = NULL;
+  ngx_protobuf_field_descriptor_t   *desc;
+  void                              *obj;
+  uint32_t                           mlen;
+  u_char                            *mend;
+  ngx_int_t                          rc = NGX_OK;
+
+  /* if the type allows extensions but none were registered, the field
+   * is unknown, and the caller either skips or keeps it.
+   */
+  if (registry->nelts == 0) {
+    return NGX_DECLINED;
   }
 
   /* look for the extension based on field number */
-  rnode = ngx_protobuf_find_node(registry, field);
-  if (rnode == NULL) {
+  desc = ngx_protobuf_find_extension(registry, field);
+  if (desc == NULL) {
     /* caller will either skip or unpack unknown field */
     return NGX_DECLINED;
   }
 
-  desc = rnode->descriptor;
-
   /* the wire types should match, unless it's a packed field. */
   if (desc->wire_type != wire) {
     if (wire == NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED && desc->packed) {
@@ -491,18 +766,10 @@ ngx_protobuf_unpack_extension(uint32_t field,
     return NGX_ERROR;
   }
 
-  if (ngx_protobuf_init_rbtree(extensions, ctx->pool) != NGX_OK) {
-    return NGX_ERROR;
-  }
-
-  onode = ngx_protobuf_rbtree_node(*extensions, field, ctx->pool,
-    sizeof(ngx_protobuf_extension_field_t));
+  onode = ngx_protobuf_extension_node(ext, desc, ctx->pool);
   if (onode == NULL) {
     return NGX_ERROR;
   }
-  if (onode->descriptor == NULL) {
-    onode->descriptor = desc;
-  }
 
   if (packed) {
     /* packed repeated field */
@@ -523,7 +790,7 @@ ngx_protobuf_unpack_extension(uint32_t field,
         rc = NGX_ERROR;
         break;
       }
-      rc = ngx_protobuf_unpack_extension_value(desc, obj, ctx);
+      rc = desc->unpack_value(obj, ctx);
       if (rc != NGX_OK) {
         break;
       } else {
@@ -538,7 +805,7 @@ ngx_protobuf_unpack_extension(uint32_t field,
       return NGX_ERROR;
     }
 
-    rc = ngx_protobuf_unpack_extension_value(desc, obj, ctx);
+    rc = desc->unpack_value(obj, ctx);
   }
 
   if (rc == NGX_OK) {
@@ -549,759 +816,3092 @@ ngx_protobuf_unpack_extension(uint32_t field,
   return rc;
 }
 
-typedef ngx_int_t (*ngx_protobuf_rbtree_callback_pt)
-  (ngx_rbtree_node_t *node, void *data);
-
-static ngx_int_t
-ngx_protobuf_rbtree_node_iterate(ngx_rbtree_node_t *node,
-                                 ngx_rbtree_node_t *sentinel,
-                                 ngx_rbtree_key_t lower,
-                                 ngx_rbtree_key_t upper,
-                                 ngx_protobuf_rbtree_callback_pt fptr,
-                                 void *data);
-
-static ngx_int_t
-ngx_protobuf_rbtree_node_iterate(ngx_rbtree_node_t *node,
-                                 ngx_rbtree_node_t *sentinel,
-                                 ngx_rbtree_key_t lower,
-                                 ngx_rbtree_key_t upper,
-                                 ngx_protobuf_rbtree_callback_pt fptr,
-                                 void *data)
-{
-  ngx_int_t rc;
-
-  if (node->left != sentinel && node->left->key >= lower) {
-    rc = ngx_protobuf_rbtree_node_iterate(node->left, sentinel,
-                                          lower, upper,
-                                          fptr, data);
-    if (rc != NGX_OK) {
-      return rc;
-    }
+static size_t
+ngx_protobuf_size_extension(ngx_protobuf_extension_field_t *field)
+{
+  if (!field->value.exists) {
+    return 0;
   }
 
-  if (node->key >= lower && node->key <= upper) {
-    rc = fptr(node, data);
-    if (rc != NGX_OK) {
-      return rc;
-    }
-  }
+  return field->descriptor->size_field(&field->value);
+}
 
-  if (node->right != sentinel && node->right->key <= upper) {
-    rc = ngx_protobuf_rbtree_node_iterate(node->right, sentinel,
-                                          lower, upper,
-                                          fptr, data);
-    if (rc != NGX_OK) {
-      return rc;
-    }
+/* size the extensions with field numbers in [lower, upper) */
+
+static size_t
+ngx_protobuf_size_extension_range(ngx_protobuf_extensions_t *extensions,
+                                  uint32_t lower,
+                                  uint32_t upper)
+{
+  ngx_uint_t  i;
+  size_t      size = 0;
+
+  for (i = ngx_protobuf_extension_slot(extensions, lower);
+       i < extensions->nelts && extensions->elts[i].number < upper;
+       ++i)
+  {
+    size += ngx_protobuf_size_extension(&extensions->elts[i]);
   }
 
-  return NGX_OK;
+  return size;
 }
 
-static ngx_int_t
-ngx_protobuf_rbtree_iterate(ngx_rbtree_t *tree,
-                            ngx_rbtree_key_t lower,
-                            ngx_rbtree_key_t upper,
-                            ngx_protobuf_rbtree_callback_pt fptr,
-                            void *data)
+size_t
+ngx_protobuf_size_extensions(ngx_protobuf_extensions_t *extensions)
 {
-  ngx_int_t rc = NGX_OK;
+  ngx_uint_t  i;
+  size_t      size = 0;
 
-  if (tree->root != tree->sentinel) {
-    rc = ngx_protobuf_rbtree_node_iterate(tree->root,
-                                          tree->sentinel,
-                                          lower,
-                                          upper,
-                                          fptr,
-                                          data);
+  for (i = 0; i < extensions->nelts; ++i) {
+    size += ngx_protobuf_size_extension(&extensions->elts[i]);
   }
 
-  return rc;
+  return size;
 }
 
-static size_t
-ngx_protobuf_packed_field_size(ngx_protobuf_field_descriptor_t *field,
-                               ngx_array_t *data)
+/* the values of message extensions can be changed without marking
+ * their extendee, so an extendee that has any is never clean.
+ */
+
+ngx_int_t
+ngx_protobuf_extensions_clean(ngx_protobuf_extensions_t *extensions)
+{
+  ngx_uint_t  i;
+
+  for (i = 0; i < extensions->nelts; ++i) {
+    if (extensions->elts[i].value.exists
+        && extensions->elts[i].descriptor->type == NGX_PROTOBUF_TYPE_MESSAGE)
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static ngx_int_t
+ngx_protobuf_pack_extension(ngx_protobuf_extension_field_t *field,
+                            ngx_protobuf_context_t *ctx)
 {
-  void        *elts;
-  ngx_uint_t   nelts;
-  size_t       p = 0; 
-  ngx_uint_t   i;
+  size_t  size;
 
-  if (data == NULL || data->elts == NULL || data->nelts == 0) {
+  if (!field->value.exists) {
     return NGX_OK;
   }
 
-  elts = data->elts;
-  nelts = data->nelts;
+  size = field->descriptor->size_field(&field->value);
+  if (ctx->buffer.pos + size > ctx->buffer.last) {
+    return NGX_ABORT;
+  }
 
-  switch (field->type) {
-  case NGX_PROTOBUF_TYPE_BOOL:
-    for (i = 0; i < nelts; ++i) {
-      p += ngx_protobuf_size_uint32((((uint32_t *)elts)[i] != 0));
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_ENUM:
-  case NGX_PROTOBUF_TYPE_UINT32:
-  case NGX_PROTOBUF_TYPE_INT32:
-    for (i = 0; i < nelts; ++i) {
-      p += ngx_protobuf_size_uint32(((uint32_t *)elts)[i]);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_SINT32:
-    for (i = 0; i < nelts; ++i) {
-      p += ngx_protobuf_size_sint32(((int32_t *)elts)[i]);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_UINT64:
-  case NGX_PROTOBUF_TYPE_INT64:
-    for (i = 0; i < nelts; ++i) {
-      p += ngx_protobuf_size_uint64(((uint64_t *)elts)[i]);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_SINT64:
-    for (i = 0; i < nelts; ++i) {
-      p += ngx_protobuf_size_sint64(((int64_t *)elts)[i]);
+  return field->descriptor->pack_field(&field->value, ctx);
+}
+
+/* pack the extensions with field numbers in [lower, upper) */
+
+ngx_int_t
+ngx_protobuf_pack_extensions(ngx_protobuf_extensions_t *extensions,
+                             uint32_t lower,
+                             uint32_t upper,
+                             ngx_protobuf_context_t *ctx)
+{
+  ngx_uint_t  i;
+  ngx_int_t   rc;
+
+  for (i = ngx_protobuf_extension_slot(extensions, lower);
+       i < extensions->nelts && extensions->elts[i].number < upper;
+       ++i)
+  {
+    rc = ngx_protobuf_pack_extension(&extensions->elts[i], ctx);
+    if (rc != NGX_OK) {
+      return rc;
     }
-    break;
-  case NGX_PROTOBUF_TYPE_FIXED32:
-  case NGX_PROTOBUF_TYPE_SFIXED32:
-  case NGX_PROTOBUF_TYPE_FLOAT:
-    p = 4 * nelts;
-    break;
-  case NGX_PROTOBUF_TYPE_FIXED64:
-  case NGX_PROTOBUF_TYPE_SFIXED64:
-  case NGX_PROTOBUF_TYPE_DOUBLE:
-    p = 8 * nelts;
-    break;
-  default:
-    break;
   }
 
-  return p;
+  return NGX_OK;
 }
 
-static size_t
-ngx_protobuf_repeated_field_size(ngx_protobuf_field_descriptor_t *field,
-                                 ngx_array_t *data)
+ngx_int_t
+ngx_protobuf_unpack_unknown_field(uint32_t field,
+				  ngx_protobuf_wiretype_e wire,
+				  ngx_protobuf_context_t *ctx,
+				  ngx_array_t **unknown)
 {
-  uint32_t     fnum = field->number;
-  void        *elts;
-  ngx_uint_t   nelts;
-  size_t       p = 0;
-  size_t       n;
-  ngx_uint_t   i;
+  u_char                        **pos = &ctx->buffer.pos;
+  u_char                         *end = ctx->buffer.last;
+  ngx_protobuf_unknown_field_t   *u;
+  ngx_int_t                       rc;
 
-  if (data == NULL || data->elts == NULL || data->nelts == 0) {
-    return NGX_OK;
+  /* groups can't be kept as a single value */
+  if (wire == NGX_PROTOBUF_WIRETYPE_START_GROUP) {
+    return ngx_protobuf_skip_field(pos, end, field, wire);
   }
 
-  elts = data->elts;
-  nelts = data->nelts;
+  u = ngx_protobuf_push_array(unknown, ctx->pool,
+			      sizeof(ngx_protobuf_unknown_field_t));
+  if (u == NULL) {
+    return NGX_ERROR;
+  }
 
-  switch (field->type) {
-  case NGX_PROTOBUF_TYPE_MESSAGE:
-    for (i = 0; i < nelts; ++i) {
-      n = field->size(((void **)elts) + i);
-      p += ngx_protobuf_size_message_field(n, fnum);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_BYTES:
-  case NGX_PROTOBUF_TYPE_STRING:
-    for (i = 0; i < nelts; ++i) {
-      p += ngx_protobuf_size_string_field((ngx_str_t *)elts + i, fnum);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_BOOL:
-    for (i = 0; i < nelts; ++i) {
-      p += ngx_protobuf_size_uint32_field((((uint32_t *)elts)[i] != 0), fnum);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_ENUM:
-  case NGX_PROTOBUF_TYPE_UINT32:
-  case NGX_PROTOBUF_TYPE_INT32:
-    for (i = 0; i < nelts; ++i) {
-      p += ngx_protobuf_size_uint32_field(((uint32_t *)elts)[i], fnum);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_SINT32:
-    for (i = 0; i < nelts; ++i) {
-      p += ngx_protobuf_size_sint32_field(((int32_t *)elts)[i], fnum);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_UINT64:
-  case NGX_PROTOBUF_TYPE_INT64:
-    for (i = 0; i < nelts; ++i) {
-      p += ngx_protobuf_size_uint64_field(((uint64_t *)elts)[i], fnum);
-    }
+  u->number = field;
+  u->wire_type = wire;
+
+  switch (wire) {
+  case NGX_PROTOBUF_WIRETYPE_VARINT:
+    rc = ngx_protobuf_read_uint64(pos, end, &u->value.u.v_uint64);
     break;
-  case NGX_PROTOBUF_TYPE_SINT64:
-    for (i = 0; i < nelts; ++i) {
-      p += ngx_protobuf_size_sint64_field(((int64_t *)elts)[i], fnum);
-    }
+  case NGX_PROTOBUF_WIRETYPE_FIXED64:
+    rc = ngx_protobuf_read_fixed64(pos, end, &u->value.u.v_uint64);
     break;
-  case NGX_PROTOBUF_TYPE_FIXED32:
-  case NGX_PROTOBUF_TYPE_SFIXED32:
-  case NGX_PROTOBUF_TYPE_FLOAT:
-    p = nelts * ngx_protobuf_size_fixed32_field(fnum);
+  case NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED:
+    rc = ngx_protobuf_read_string(pos, end, &u->value.u.v_bytes,
+				  (ctx->reuse_strings) ? NULL : ctx->pool);
     break;
-  case NGX_PROTOBUF_TYPE_FIXED64:
-  case NGX_PROTOBUF_TYPE_SFIXED64:
-  case NGX_PROTOBUF_TYPE_DOUBLE:
-    p = nelts * ngx_protobuf_size_fixed64_field(fnum);
+  case NGX_PROTOBUF_WIRETYPE_FIXED32:
+    rc = ngx_protobuf_read_fixed32(pos, end, &u->value.u.v_uint32);
     break;
   default:
+    rc = NGX_ABORT;
     break;
   }
 
-  return p;
+  return rc;
 }
 
-static size_t
-ngx_protobuf_single_field_size(ngx_protobuf_field_descriptor_t *field,
-                               ngx_protobuf_value_t *value)
+size_t
+ngx_protobuf_size_unknown_field(ngx_protobuf_unknown_field_t *field)
 {
-  uint32_t fnum = field->number;
-  size_t   p = 0;
-  size_t   n;
+  size_t n;
 
-  switch (field->type) {
-  case NGX_PROTOBUF_TYPE_MESSAGE:
-    n = field->size(value->u.v_message);
-    p = ngx_protobuf_size_message_field(n, fnum);
+  switch (field->wire_type) {
+  case NGX_PROTOBUF_WIRETYPE_VARINT:
+    n = ngx_protobuf_size_uint64_field(field->value.u.v_uint64, field->number);
     break;
-  case NGX_PROTOBUF_TYPE_BYTES:
-  case NGX_PROTOBUF_TYPE_STRING:
-    p = ngx_protobuf_size_string_field(&value->u.v_bytes, fnum);
+  case NGX_PROTOBUF_WIRETYPE_FIXED64:
+    n = ngx_protobuf_size_fixed64_field(field->number);
     break;
-  case NGX_PROTOBUF_TYPE_BOOL:
-    p = ngx_protobuf_size_uint32_field((value->u.v_uint32 != 0), fnum);
+  case NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED:
+    n = ngx_protobuf_size_string_field(&field->value.u.v_bytes, field->number);
     break;
-  case NGX_PROTOBUF_TYPE_ENUM:
-  case NGX_PROTOBUF_TYPE_UINT32:
-  case NGX_PROTOBUF_TYPE_INT32:
-    p = ngx_protobuf_size_uint32_field(value->u.v_uint32, fnum);
+  case NGX_PROTOBUF_WIRETYPE_FIXED32:
+    n = ngx_protobuf_size_fixed32_field(field->number);
     break;
-  case NGX_PROTOBUF_TYPE_SINT32:
-    p = ngx_protobuf_size_sint32_field(value->u.v_int32, fnum);
+  default:
+    /* we won't pack an unknown field of a bogus wire type */
+    n = 0;
     break;
-  case NGX_PROTOBUF_TYPE_UINT64:
-  case NGX_PROTOBUF_TYPE_INT64:
-    p = ngx_protobuf_size_uint64_field(value->u.v_uint64, fnum);
+  }
+
+  return n;
+}
+
+ngx_int_t
+ngx_protobuf_pack_unknown_field(ngx_protobuf_unknown_field_t *field,
+				ngx_protobuf_context_t *ctx)
+{
+  switch (field->wire_type) {
+  case NGX_PROTOBUF_WIRETYPE_VARINT:
+    ctx->buffer.pos = ngx_protobuf_write_uint64_field(ctx->buffer.pos,
+						      field->value.u.v_uint64,
+						      field->number);
     break;
-  case NGX_PROTOBUF_TYPE_SINT64:
-    p = ngx_protobuf_size_sint64_field(value->u.v_int64, fnum);
+  case NGX_PROTOBUF_WIRETYPE_FIXED64:
+    ctx->buffer.pos = ngx_protobuf_write_fixed64_field(ctx->buffer.pos,
+						       field->value.u.v_uint64,
+						       field->number);
     break;
-  case NGX_PROTOBUF_TYPE_FIXED32:
-  case NGX_PROTOBUF_TYPE_SFIXED32:
-  case NGX_PROTOBUF_TYPE_FLOAT:
-    p = ngx_protobuf_size_fixed32_field(fnum);
+  case NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED:
+    ctx->buffer.pos = ngx_protobuf_write_string_field(ctx->buffer.pos,
+						      &field->value.u.v_bytes,
+						      field->number);
     break;
-  case NGX_PROTOBUF_TYPE_FIXED64:
-  case NGX_PROTOBUF_TYPE_SFIXED64:
-  case NGX_PROTOBUF_TYPE_DOUBLE:
-    p = ngx_protobuf_size_fixed64_field(fnum);
+  case NGX_PROTOBUF_WIRETYPE_FIXED32:
+    ctx->buffer.pos = ngx_protobuf_write_fixed32_field(ctx->buffer.pos,
+						       field->value.u.v_uint32,
+						       field->number);
     break;
   default:
+    /* we won't pack an unknown field of a bogus wire type */
     break;
   }
 
-  return p;
+  return NGX_OK;
 }
 
-static ngx_int_t
-ngx_protobuf_size_extension(ngx_rbtree_node_t *node, void *data)
+/* packing backwards.  extensions and unknown fields are packed forwards
+ * into the space just before the current position, so only they need
+ * to be sized.
+ */
+
+ngx_int_t
+ngx_protobuf_pack_extensions_reverse(ngx_protobuf_extensions_t *extensions,
+                                     uint32_t lower,
+                                     uint32_t upper,
+                                     ngx_protobuf_context_t *ctx)
 {
-  ngx_protobuf_extension_field_t   *field =
-    (ngx_protobuf_extension_field_t *)node;
-  ngx_protobuf_field_descriptor_t  *desc = field->descriptor;
-  uint32_t                          fnum = desc->number;
-  ngx_protobuf_value_t             *fval = &field->value;
-  size_t                           *size = (size_t *)data;
-  size_t                            n;
+  ngx_protobuf_context_t  fwd;
+  size_t                  size;
+  ngx_int_t               rc;
 
-  if (!field->value.exists) {
-    return NGX_OK;
-  }
+  size = ngx_protobuf_size_extension_range(extensions, lower, upper);
 
-  if (desc->label == NGX_PROTOBUF_LABEL_REPEATED) {
-    if (desc->packed) {
-      n = ngx_protobuf_packed_field_size(desc, fval->u.v_repeated);
-      *size += ngx_protobuf_size_message_field(n, fnum);
-    } else {
-      *size += ngx_protobuf_repeated_field_size(desc, fval->u.v_repeated);
-    }
-  } else {
-    *size += ngx_protobuf_single_field_size(desc, fval);
+  if (!NGX_PROTOBUF_REVERSE_ROOM(ctx, size)) {
+    return NGX_ABORT;
   }
 
-  return NGX_OK;
-}
-
-size_t
-ngx_protobuf_size_extensions(ngx_rbtree_t *extensions)
-{
-  size_t size = 0;
+  fwd = *ctx;
+  fwd.buffer.pos = ctx->buffer.pos - size;
+  fwd.buffer.last = ctx->buffer.pos;
 
-  ngx_protobuf_rbtree_iterate(extensions,
-                              0,
-                              -1,
-                              ngx_protobuf_size_extension,
-                              &size);
+  rc = ngx_protobuf_pack_extensions(extensions, lower, upper, &fwd);
+  if (rc == NGX_OK) {
+    ctx->buffer.pos -= size;
+  }
 
-  return size;
+  return rc;
 }
 
-static ngx_int_t
-ngx_protobuf_pack_packed_field(ngx_protobuf_field_descriptor_t *field,
-                               ngx_protobuf_context_t *ctx,
-                               ngx_array_t *data)
+ngx_int_t
+ngx_protobuf_pack_unknown_reverse(ngx_array_t *unknown,
+                                  ngx_protobuf_context_t *ctx)
 {
-  uint32_t     fnum = field->number;
-  void        *elts;
-  ngx_uint_t   nelts;
-  ngx_uint_t   i;
-  size_t       n;
+  ngx_protobuf_unknown_field_t  *unk;
+  ngx_uint_t                     i;
+  u_char                        *mark;
+  size_t                         n;
 
-  if (data == NULL || data->elts == NULL || data->nelts == 0) {
+  if (unknown == NULL || unknown->nelts == 0) {
     return NGX_OK;
   }
 
-  elts = data->elts;
-  nelts = data->nelts;
+  unk = unknown->elts;
 
-  n = ngx_protobuf_packed_field_size(field, data);
-  ctx->buffer.pos =
-    ngx_protobuf_write_message_header(ctx->buffer.pos, n, fnum);
-
-  switch (field->type) {
-  case NGX_PROTOBUF_TYPE_BOOL:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_uint32(ctx->buffer.pos,
-                                  (((uint32_t *)elts)[i] != 0));
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_ENUM:
-  case NGX_PROTOBUF_TYPE_UINT32:
-  case NGX_PROTOBUF_TYPE_INT32:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_uint32(ctx->buffer.pos, ((uint32_t *)elts)[i]);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_SINT32:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_sint32(ctx->buffer.pos, ((int32_t *)elts)[i]);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_UINT64:
-  case NGX_PROTOBUF_TYPE_INT64:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_uint64(ctx->buffer.pos, ((uint64_t *)elts)[i]);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_SINT64:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_sint64(ctx->buffer.pos, ((int64_t *)elts)[i]);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_FIXED32:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_fixed32(ctx->buffer.pos, ((uint32_t *)elts)[i]);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_SFIXED32:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_sfixed32(ctx->buffer.pos, ((int32_t *)elts)[i]);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_FLOAT:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_float(ctx->buffer.pos, ((float *)elts)[i]);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_FIXED64:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_fixed64(ctx->buffer.pos, ((uint64_t *)elts)[i]);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_SFIXED64:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_sfixed64(ctx->buffer.pos, ((int64_t *)elts)[i]);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_DOUBLE:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_double(ctx->buffer.pos, ((double *)elts)[i]);
+  for (i = unknown->nelts; i > 0; --i) {
+    n = ngx_protobuf_size_unknown_field(unk + i - 1);
+    if (!NGX_PROTOBUF_REVERSE_ROOM(ctx, n)) {
+      return NGX_ABORT;
     }
-    break;
-  default:
-    break;
+
+    ctx->buffer.pos -= n;
+    mark = ctx->buffer.pos;
+    ngx_protobuf_pack_unknown_field(unk + i - 1, ctx);
+    ctx->buffer.pos = mark;
   }
 
   return NGX_OK;
 }
 
-static ngx_int_t
-ngx_protobuf_pack_repeated_field(ngx_protobuf_field_descriptor_t *field,
+ngx_int_t
+ngx_protobuf_unpack_unknown_span(u_char *start,
+                                 uint32_t field,
+                                 ngx_protobuf_wiretype_e wire,
                                  ngx_protobuf_context_t *ctx,
-                                 ngx_array_t *data)
+                                 ngx_array_t **unknown)
 {
-  uint32_t     fnum = field->number;
-  void        *elts;
-  ngx_uint_t   nelts;
-  ngx_uint_t   i;
-  size_t       n;
+  ngx_protobuf_unknown_span_t  *span;
 
-  if (data == NULL || data->elts == NULL || data->nelts == 0) {
-    return NGX_OK;
+  if (ngx_protobuf_skip_field(&ctx->buffer.pos, ctx->buffer.last,
+                              field, wire) != NGX_OK)
+  {
+    return NGX_ABORT;
   }
 
-  elts = data->elts;
-  nelts = data->nelts;
-
-  switch (field->type) {
-  case NGX_PROTOBUF_TYPE_MESSAGE:
-    for (i = 0; i < nelts; ++i) {
-      n = field->size(((void **)elts) + i);
-      ctx->buffer.pos =
-        ngx_protobuf_write_message_header(ctx->buffer.pos, n, fnum);
-      field->pack(((void **)elts) + i, ctx);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_BYTES:
-  case NGX_PROTOBUF_TYPE_STRING:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_string_field(ctx->buffer.pos,
-                                        (ngx_str_t *)elts + i, fnum);
-    }
-    break;
-  case NGX_PROTOBUF_TYPE_BOOL:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_uint32_field(ctx->buffer.pos,
-                                        (((uint32_t *)elts)[i] != 0), fnum);
+  /* extend the last span if this field directly follows it */
+  if (*unknown != NULL && (*unknown)->nelts > 0) {
+    span = (ngx_protobuf_unknown_span_t *) (*unknown)->elts
+      + (*unknown)->nelts - 1;
+    if (span->aliased && span->data + span->len == start) {
+      span->len = ctx->buffer.pos - span->data;
+      return NGX_OK;
     }
-    break;
-  case NGX_PROTOBUF_TYPE_ENUM:
+  }
+
+  span = ngx_protobuf_push_array(unknown, ctx->pool,
+                                 sizeof(ngx_protobuf_unknown_span_t));
+  if (span == NULL) {
+    return NGX_ERROR;
+  }
+
+  span->data = start;
+  span->len = ctx->buffer.pos - start;
+  span->aliased = 1;
+
+  return NGX_OK;
+}
+
+/* give the spans that still point into the input their own copy */
+
+ngx_int_t
+ngx_protobuf_copy_unknown_spans(ngx_array_t *unknown, ngx_pool_t *pool)
+{
+  ngx_protobuf_unknown_span_t  *span = unknown->elts;
+  ngx_uint_t                    i;
+  u_char                       *p;
+
+  for (i = 0; i < unknown->nelts; ++i) {
+    if (!span[i].aliased) {
+      continue;
+    }
+
+    p = ngx_pnalloc(pool, span[i].len);
+    if (p == NULL) {
+      return NGX_ERROR;
+    }
+
+    ngx_memcpy(p, span[i].data, span[i].len);
+    span[i].data = p;
+    span[i].aliased = 0;
+  }
+
+  return NGX_OK;
+}
+
+size_t
+ngx_protobuf_size_unknown_spans(ngx_array_t *unknown)
+{
+  ngx_protobuf_unknown_span_t  *span = unknown->elts;
+  ngx_uint_t                    i;
+  size_t                        size = 0;
+
+  for (i = 0; i < unknown->nelts; ++i) {
+    size += span[i].len;
+  }
+
+  return size;
+}
+
+ngx_int_t
+ngx_protobuf_pack_unknown_spans(ngx_array_t *unknown,
+                                ngx_protobuf_context_t *ctx)
+{
+  ngx_protobuf_unknown_span_t  *span = unknown->elts;
+  ngx_uint_t                    i;
+
+  for (i = 0; i < unknown->nelts; ++i) {
+    if (span[i].len > (size_t) (ctx->buffer.last - ctx->buffer.pos)) {
+      return NGX_ABORT;
+    }
+
+    ctx->buffer.pos = ngx_cpymem(ctx->buffer.pos, span[i].data, span[i].len);
+  }
+
+  return NGX_OK;
+}
+
+ngx_int_t
+ngx_protobuf_pack_unknown_spans_reverse(ngx_array_t *unknown,
+                                        ngx_protobuf_context_t *ctx)
+{
+  ngx_protobuf_unknown_span_t  *span = unknown->elts;
+  ngx_uint_t                    i;
+
+  for (i = unknown->nelts; i > 0; --i) {
+    if (!NGX_PROTOBUF_REVERSE_ROOM(ctx, span[i - 1].len)) {
+      return NGX_ABORT;
+    }
+
+    ctx->buffer.pos -= span[i - 1].len;
+    ngx_memcpy(ctx->buffer.pos, span[i - 1].data, span[i - 1].len);
+  }
+
+  return NGX_OK;
+}
+
+
+/* shared memory message store */
+
+#define ngx_protobuf_shm_hold(snapshot, slot)                           \
+  (snapshot)->holders[(slot) / 32] |= (uint32_t) 1 << ((slot) % 32)
+
+#define ngx_protobuf_shm_unhold(snapshot, slot)                         \
+  (snapshot)->holders[(slot) / 32] &= ~((uint32_t) 1 << ((slot) % 32))
+
+/* frees a snapshot once it has been replaced and no worker holds it.
+ * the caller must hold the slab pool mutex.
+ */
+
+static void
+ngx_protobuf_shm_free_locked(ngx_slab_pool_t *shpool,
+                             ngx_protobuf_shm_store_t *store,
+                             ngx_protobuf_shm_snapshot_t *snapshot)
+{
+  ngx_protobuf_shm_snapshot_t  **sp;
+  ngx_uint_t                     i;
+
+  if (!snapshot->retired) {
+    return;
+  }
+
+  for (i = 0; i < NGX_PROTOBUF_SHM_HOLDERS; ++i) {
+    if (snapshot->holders[i]) {
+      return;
+    }
+  }
+
+  for (sp = &store->retired; *sp != NULL; sp = &(*sp)->next) {
+    if (*sp == snapshot) {
+      *sp = snapshot->next;
+      break;
+    }
+  }
+
+  ngx_slab_free_locked(shpool, snapshot);
+}
+
+/* drops every hold of a process slot, whose process is gone.  the
+ * caller must hold the slab pool mutex.
+ */
+
+static void
+ngx_protobuf_shm_forget_locked(ngx_slab_pool_t *shpool,
+                               ngx_protobuf_shm_store_t *store,
+                               ngx_uint_t slot)
+{
+  ngx_protobuf_shm_snapshot_t  *snapshot, *next;
+
+  if (store->current != NULL) {
+    ngx_protobuf_shm_unhold(store->current, slot);
+  }
+
+  for (snapshot = store->retired; snapshot != NULL; snapshot = next) {
+    next = snapshot->next;
+    ngx_protobuf_shm_unhold(snapshot, slot);
+    ngx_protobuf_shm_free_locked(shpool, store, snapshot);
+  }
+}
+
+static ngx_int_t
+ngx_protobuf_shm_init_zone(ngx_shm_zone_t *zone, void *data)
+{
+  ngx_protobuf_shm_ctx_t  *octx = data;
+  ngx_protobuf_shm_ctx_t  *ctx = zone->data;
+  ngx_int_t                slot;
+
+  if (octx != NULL) {
+    /* reload: the zone and its contents carry over.  the master drops
+     * the holds of the slots that have no live process, which are left
+     * by workers that crashed while shutting down.
+     */
+    ctx->shpool = octx->shpool;
+    ctx->store = octx->store;
+
+    if (ngx_process == NGX_PROCESS_MASTER) {
+      ngx_shmtx_lock(&ctx->shpool->mutex);
+
+      for (slot = 0; slot < NGX_MAX_PROCESSES; ++slot) {
+        if (slot >= ngx_last_process || ngx_processes[slot].pid == -1) {
+          ngx_protobuf_shm_forget_locked(ctx->shpool, ctx->store, slot);
+        }
+      }
+
+      ngx_shmtx_unlock(&ctx->shpool->mutex);
+    }
+
+    return NGX_OK;
+  }
+
+  ctx->shpool = (ngx_slab_pool_t *)zone->shm.addr;
+
+  if (zone->shm.exists) {
+    ctx->store = ctx->shpool->data;
+
+    return NGX_OK;
+  }
+
+  ctx->store = ngx_slab_alloc(ctx->shpool, sizeof(ngx_protobuf_shm_store_t));
+  if (ctx->store == NULL) {
+    return NGX_ERROR;
+  }
+
+  ngx_memzero(ctx->store, sizeof(ngx_protobuf_shm_store_t));
+  ctx->shpool->data = ctx->store;
+
+  return NGX_OK;
+}
+
+ngx_shm_zone_t *
+ngx_protobuf_shm_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag)
+{
+  ngx_shm_zone_t          *zone;
+  ngx_protobuf_shm_ctx_t  *ctx;
+
+  zone = ngx_shared_memory_add(cf, name, size, tag);
+  if (zone == NULL) {
+    return NULL;
+  }
+
+  if (zone->data == NULL) {
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_protobuf_shm_ctx_t));
+    if (ctx == NULL) {
+      return NULL;
+    }
+
+    zone->init = ngx_protobuf_shm_init_zone;
+    zone->data = ctx;
+  }
+
+  return zone;
+}
+
+/* a worker drops the holds of its slot when it starts, since they
+ * can only be left over from a crashed worker that it replaces, and
+ * again when it exits.
+ */
+
+static void
+ngx_protobuf_shm_forget(ngx_cycle_t *cycle)
+{
+  ngx_protobuf_shm_ctx_t  *ctx;
+  ngx_shm_zone_t          *zone;
+  ngx_list_part_t         *part;
+  ngx_uint_t               i;
+
+  part = &cycle->shared_memory.part;
+  zone = part->elts;
+
+  for (i = 0; /* void */ ; i++) {
+
+    if (i >= part->nelts) {
+      if (part->next == NULL) {
+        break;
+      }
+      part = part->next;
+      zone = part->elts;
+      i = 0;
+    }
+
+    if (zone[i].init != ngx_protobuf_shm_init_zone) {
+      continue;
+    }
+
+    ctx = zone[i].data;
+
+    if (ctx->store == NULL) {
+      continue;
+    }
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+    ngx_protobuf_shm_forget_locked(ctx->shpool, ctx->store,
+                                   ngx_process_slot);
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+  }
+}
+
+static ngx_int_t
+ngx_protobuf_init_process(ngx_cycle_t *cycle)
+{
+  ngx_protobuf_shm_forget(cycle);
+
+  return NGX_OK;
+}
+
+static void
+ngx_protobuf_exit_process(ngx_cycle_t *cycle)
+{
+  ngx_protobuf_shm_forget(cycle);
+}
+
+/* packs the object into a new snapshot and atomically makes it the
+ * current one.  workers pick up the new version on their next call
+ * to ngx_protobuf_shm_view.
+ */
+
+ngx_int_t
+ngx_protobuf_shm_publish(ngx_shm_zone_t *zone,
+                         void *obj,
+                         ngx_protobuf_size_pt size,
+                         ngx_protobuf_pack_pt pack)
+{
+  ngx_protobuf_shm_ctx_t       *ctx = zone->data;
+  ngx_slab_pool_t              *shpool = ctx->shpool;
+  ngx_protobuf_shm_store_t     *store = ctx->store;
+  ngx_protobuf_shm_snapshot_t  *snapshot;
+  ngx_protobuf_shm_snapshot_t  *old;
+  ngx_protobuf_context_t        pctx;
+  size_t                        len;
+  ngx_int_t                     rc;
+
+  len = size(obj);
+
+  snapshot = ngx_slab_alloc(shpool, sizeof(ngx_protobuf_shm_snapshot_t) + len);
+  if (snapshot == NULL) {
+    return NGX_ERROR;
+  }
+
+  ngx_memzero(snapshot->holders, sizeof(snapshot->holders));
+  snapshot->retired = 0;
+  snapshot->len = len;
+  snapshot->data = (u_char *)(snapshot + 1);
+  snapshot->next = NULL;
+
+  /* nobody else can see the snapshot yet, so pack without the lock */
+
+  ngx_memzero(&pctx, sizeof(ngx_protobuf_context_t));
+  pctx.buffer.start = snapshot->data;
+  pctx.buffer.pos = snapshot->data;
+  pctx.buffer.last = snapshot->data + len;
+  pctx.log = zone->shm.log;
+
+  rc = pack(obj, &pctx);
+  if (rc != NGX_OK) {
+    ngx_slab_free(shpool, snapshot);
+    return rc;
+  }
+
+  ngx_shmtx_lock(&shpool->mutex);
+
+  old = store->current;
+  snapshot->version = store->version + 1;
+  store->current = snapshot;
+
+  ngx_memory_barrier();
+
+  store->version = snapshot->version;
+
+  if (old != NULL) {
+    old->retired = 1;
+    old->next = store->retired;
+    store->retired = old;
+    ngx_protobuf_shm_free_locked(shpool, store, old);
+  }
+
+  ngx_shmtx_unlock(&shpool->mutex);
+
+  return NGX_OK;
+}
+
+static void
+ngx_protobuf_shm_release(ngx_protobuf_shm_view_t *view)
+{
+  ngx_slab_pool_t  *shpool = view->shpool;
+
+  if (--view->refcount > 0) {
+    return;
+  }
+
+  ngx_shmtx_lock(&shpool->mutex);
+  ngx_protobuf_shm_unhold(view->snapshot, ngx_process_slot);
+  ngx_protobuf_shm_free_locked(shpool, view->store, view->snapshot);
+  ngx_shmtx_unlock(&shpool->mutex);
+
+  /* the view itself lives in this pool */
+  ngx_destroy_pool(view->pool);
+}
+
+static void
+ngx_protobuf_shm_cleanup(void *data)
+{
+  ngx_protobuf_shm_release(data);
+}
+
+/* unpacks the current snapshot into a new view for this worker */
+
+static ngx_protobuf_shm_view_t *
+ngx_protobuf_shm_refresh(ngx_shm_zone_t *zone,
+                         size_t width,
+                         const void *defaults,
+                         ngx_protobuf_unpack_pt unpack)
+{
+  ngx_protobuf_shm_ctx_t       *ctx = zone->data;
+  ngx_slab_pool_t              *shpool = ctx->shpool;
+  ngx_protobuf_shm_snapshot_t  *snapshot;
+  ngx_protobuf_shm_view_t      *view;
+  ngx_protobuf_context_t        pctx;
+  ngx_pool_t                   *pool;
+
+  ngx_shmtx_lock(&shpool->mutex);
+
+  snapshot = ctx->store->current;
+  if (snapshot != NULL) {
+    ngx_protobuf_shm_hold(snapshot, ngx_process_slot);
+  }
+
+  ngx_shmtx_unlock(&shpool->mutex);
+
+  if (snapshot == NULL) {
+    /* nothing has been published yet */
+    return NULL;
+  }
+
+  pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, zone->shm.log);
+  if (pool == NULL) {
+    goto failed;
+  }
+
+  view = ngx_palloc(pool, sizeof(ngx_protobuf_shm_view_t));
+  if (view == NULL) {
+    goto failed;
+  }
+
+  if (defaults != NULL) {
+    view->obj = ngx_protobuf_alloc_default(pool, defaults, width);
+  } else {
+    view->obj = ngx_pcalloc(pool, width);
+  }
+  if (view->obj == NULL) {
+    goto failed;
+  }
+
+  /* string fields point into shared memory, which stays put for as
+   * long as the view holds its reference to the snapshot.
+   */
+
+  ngx_memzero(&pctx, sizeof(ngx_protobuf_context_t));
+  pctx.buffer.start = snapshot->data;
+  pctx.buffer.pos = snapshot->data;
+  pctx.buffer.last = snapshot->data + snapshot->len;
+  pctx.reuse_strings = 1;
+  pctx.pool = pool;
+  pctx.log = zone->shm.log;
+
+  if (unpack(view->obj, &pctx) != NGX_OK) {
+    goto failed;
+  }
+
+  view->snapshot = snapshot;
+  view->shpool = shpool;
+  view->store = ctx->store;
+  view->pool = pool;
+  view->refcount = 1;  /* held by the zone context */
+
+  if (ctx->view != NULL) {
+    ngx_protobuf_shm_release(ctx->view);
+  }
+
+  ctx->view = view;
+
+  return view;
+
+failed:
+
+  if (pool != NULL) {
+    ngx_destroy_pool(pool);
+  }
+
+  ngx_shmtx_lock(&shpool->mutex);
+  ngx_protobuf_shm_unhold(snapshot, ngx_process_slot);
+  ngx_protobuf_shm_free_locked(shpool, ctx->store, snapshot);
+  ngx_shmtx_unlock(&shpool->mutex);
+
+  return NULL;
+}
+
+/* returns this worker's unpacked copy of the current snapshot, which
+ * must be treated as read-only.  the object remains valid until the
+ * given pool is destroyed, even if a newer version is published in
+ * the meantime.  returns NULL if nothing has been published yet or
+ * if the snapshot could not be unpacked.
+ */
+
+void *
+ngx_protobuf_shm_view(ngx_shm_zone_t *zone,
+                      size_t width,
+                      const void *defaults,
+                      ngx_protobuf_unpack_pt unpack,
+                      ngx_pool_t *pool)
+{
+  ngx_protobuf_shm_ctx_t   *ctx = zone->data;
+  ngx_protobuf_shm_view_t  *view = ctx->view;
+  ngx_pool_cleanup_t       *cln;
+
+  if (view == NULL || view->snapshot->version != ctx->store->version) {
+    view = ngx_protobuf_shm_refresh(zone, width, defaults, unpack);
+    if (view == NULL) {
+      return NULL;
+    }
+  }
+
+  cln = ngx_pool_cleanup_add(pool, 0);
+  if (cln == NULL) {
+    return NULL;
+  }
+
+  cln->handler = ngx_protobuf_shm_cleanup;
+  cln->data = view;
+  view->refcount++;
+
+  return view->obj;
+}
+
+/* field indexes */
+
+typedef struct {
+  ngx_uint_t                   slot;
+  ngx_protobuf_index_entry_t   entry;
+} ngx_protobuf_index_temp_t;
+
+/* returns the slot of a field number in a message descriptor, or
+ * nfields if the message has no such field.
+ */
+
+ngx_uint_t
+ngx_protobuf_field_slot(ngx_protobuf_message_descriptor_t *desc,
+                        uint32_t field)
+{
+  ngx_uint_t  lo = 0;
+  ngx_uint_t  hi = desc->nfields;
+  ngx_uint_t  mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (field < desc->fields[mid]->number) {
+      hi = mid;
+    } else if (field > desc->fields[mid]->number) {
+      lo = mid + 1;
+    } else {
+      return mid;
+    }
+  }
+
+  return desc->nfields;
+}
+
+/* looks up a message type by its full name (e.g. "cookie.User") in the
+ * protobuf modules that are built into nginx.
+ */
+
+ngx_protobuf_message_descriptor_t *
+ngx_protobuf_find_message(ngx_str_t *name)
+{
+  ngx_protobuf_message_descriptor_t  **desc;
+  ngx_protobuf_module_t               *module;
+  ngx_uint_t                           i;
+
+  for (i = 0; ngx_modules[i]; i++) {
+    if (ngx_modules[i]->type != NGX_PROTOBUF_MODULE) {
+      continue;
+    }
+
+    module = ngx_modules[i]->ctx;
+    if (module == NULL || module->messages == NULL) {
+      continue;
+    }
+
+    for (desc = module->messages; *desc != NULL; desc++) {
+      if ((*desc)->name.len == name->len
+          && ngx_strncmp((*desc)->name.data, name->data, name->len) == 0)
+      {
+        return *desc;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/* builds the table of RPC methods from the services of the protobuf
+ * modules that are built into nginx.  the first of two methods with
+ * the same path is kept.
+ */
+
+static ngx_int_t
+ngx_protobuf_init_methods(ngx_cycle_t *cycle, ngx_protobuf_conf_t *pcf)
+{
+  ngx_protobuf_service_descriptor_t  **svc;
+  ngx_protobuf_method_descriptor_t    *method, **table;
+  ngx_protobuf_module_t               *module;
+  ngx_uint_t                           i, j, n, size, slot;
+
+  n = 0;
+  table = NULL;
+  size = 0;
+
+  for ( ;; ) {
+    for (i = 0; ngx_modules[i]; i++) {
+      if (ngx_modules[i]->type != NGX_PROTOBUF_MODULE) {
+        continue;
+      }
+
+      module = ngx_modules[i]->ctx;
+      if (module == NULL || module->services == NULL) {
+        continue;
+      }
+
+      for (svc = module->services; *svc != NULL; svc++) {
+        if (table == NULL) {
+          n += (*svc)->nmethods;
+          continue;
+        }
+
+        for (j = 0; j < (*svc)->nmethods; j++) {
+          method = &(*svc)->methods[j];
+
+          slot = ngx_hash_key(method->path.data, method->path.len)
+                 & (size - 1);
+
+          while (table[slot] != NULL
+                 && (table[slot]->path.len != method->path.len
+                     || ngx_strncmp(table[slot]->path.data, method->path.data,
+                                    method->path.len) != 0))
+          {
+            slot = (slot + 1) & (size - 1);
+          }
+
+          if (table[slot] == NULL) {
+            table[slot] = method;
+          }
+        }
+      }
+    }
+
+    if (table != NULL || n == 0) {
+      break;
+    }
+
+    /* the methods have been counted; insert them on the second pass */
+
+    for (size = 2; size < 2 * n; size <<= 1) { /* void */ }
+
+    table = ngx_pcalloc(cycle->pool, size * sizeof(*table));
+    if (table == NULL) {
+      return NGX_ERROR;
+    }
+  }
+
+  pcf->methods = table;
+  pcf->methods_mask = size - 1;
+
+  return NGX_OK;
+}
+
+/* looks up an RPC method by its path (e.g. "/pkg.Service/Method") */
+
+ngx_protobuf_method_descriptor_t *
+ngx_protobuf_find_method(ngx_str_t *path)
+{
+  ngx_protobuf_conf_t               *pcf = ngx_protobuf_conf;
+  ngx_protobuf_method_descriptor_t  *method;
+  ngx_uint_t                         slot;
+
+  if (pcf == NULL || pcf->methods == NULL) {
+    return NULL;
+  }
+
+  slot = ngx_hash_key(path->data, path->len) & pcf->methods_mask;
+
+  while ((method = pcf->methods[slot]) != NULL) {
+    if (method->path.len == path->len
+        && ngx_strncmp(method->path.data, path->data, path->len) == 0)
+    {
+      return method;
+    }
+
+    slot = (slot + 1) & pcf->methods_mask;
+  }
+
+  return NULL;
+}
+
+/* unpacks the request of a call.  strings alias the request, which
+ * must outlive the call.  a malformed request fails the call with
+ * INVALID_ARGUMENT.
+ */
+
+ngx_int_t
+ngx_protobuf_rpc_unpack(ngx_protobuf_rpc_t *rpc,
+                        ngx_str_t *request,
+                        void *obj,
+                        ngx_protobuf_unpack_pt unpack)
+{
+  ngx_protobuf_context_t  ctx;
+
+  ngx_memzero(&ctx, sizeof(ngx_protobuf_context_t));
+  ctx.buffer.start = request->data;
+  ctx.buffer.pos = request->data;
+  ctx.buffer.last = request->data + request->len;
+  ctx.reuse_strings = 1;
+  ctx.pool = rpc->pool;
+  ctx.log = rpc->log;
+
+  if (unpack(obj, &ctx) != NGX_OK) {
+    rpc->status = NGX_PROTOBUF_RPC_INVALID_ARGUMENT;
+    ngx_str_set(&rpc->message, "malformed request");
+    return NGX_DECLINED;
+  }
+
+  return NGX_OK;
+}
+
+/* packs a reply of a call and hands it to the transport.  a call that
+ * has failed or finished takes no more replies, and one that the
+ * transport could not write out is blocked until it is ready again.
+ */
+
+ngx_int_t
+ngx_protobuf_rpc_send(ngx_protobuf_rpc_t *rpc,
+                      void *obj,
+                      ngx_protobuf_size_pt size,
+                      ngx_protobuf_pack_pt pack)
+{
+  ngx_protobuf_context_t  ctx;
+  ngx_str_t               message;
+  ngx_int_t               rc;
+
+  if (rpc->status != NGX_PROTOBUF_RPC_OK || rpc->finished) {
+    return NGX_ERROR;
+  }
+
+  message.len = size(obj);
+  message.data = ngx_palloc(rpc->pool, message.len);
+  if (message.data == NULL) {
+    return NGX_ERROR;
+  }
+
+  ngx_memzero(&ctx, sizeof(ngx_protobuf_context_t));
+  ctx.buffer.start = message.data;
+  ctx.buffer.pos = message.data;
+  ctx.buffer.last = message.data + message.len;
+  ctx.pool = rpc->pool;
+  ctx.log = rpc->log;
+
+  if (pack(obj, &ctx) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  rc = rpc->send(rpc, &message);
+
+  if (rc == NGX_AGAIN) {
+    rpc->blocked = 1;
+  }
+
+  return rc;
+}
+
+/* ends a call that its implementation kept open */
+
+void
+ngx_protobuf_rpc_finish(ngx_protobuf_rpc_t *rpc)
+{
+  if (rpc->finished) {
+    return;
+  }
+
+  rpc->finished = 1;
+  rpc->finish(rpc);
+}
+
+/* ends a call that went away before it finished.  the transport calls
+ * this from a cleanup handler of the memory that holds the call.
+ */
+
+void
+ngx_protobuf_rpc_cancel(ngx_protobuf_rpc_t *rpc)
+{
+  if (rpc->finished) {
+    return;
+  }
+
+  rpc->finished = 1;
+  rpc->cancelled = 1;
+  rpc->status = NGX_PROTOBUF_RPC_CANCELLED;
+
+  if (rpc->cancel) {
+    rpc->cancel(rpc);
+  }
+}
+
+/* unblocks a call once the transport has written out what it was
+ * given.  the transport calls this when its output drains.
+ */
+
+void
+ngx_protobuf_rpc_ready(ngx_protobuf_rpc_t *rpc)
+{
+  if (rpc->finished || !rpc->blocked) {
+    return;
+  }
+
+  rpc->blocked = 0;
+
+  if (rpc->ready) {
+    rpc->ready(rpc);
+  }
+}
+
+/* the field with a given number, or NULL */
+
+ngx_protobuf_field_descriptor_t *
+ngx_protobuf_find_field(ngx_protobuf_message_descriptor_t *desc,
+                        uint32_t number)
+{
+  ngx_uint_t  slot;
+
+  slot = ngx_protobuf_field_slot(desc, number);
+
+  return (slot < desc->nfields) ? desc->fields[slot] : NULL;
+}
+
+/* the name of an enum value, or NULL if the number has none */
+
+ngx_str_t *
+ngx_protobuf_enum_name(ngx_protobuf_enum_descriptor_t *desc, int32_t number)
+{
+  ngx_uint_t  lo = 0;
+  ngx_uint_t  hi = desc->nvalues;
+  ngx_uint_t  mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (number < desc->values[mid].number) {
+      hi = mid;
+    } else if (number > desc->values[mid].number) {
+      lo = mid + 1;
+    } else {
+      return &desc->values[mid].name;
+    }
+  }
+
+  return NULL;
+}
+
+/* base64 codec for bulk data.  the encoder turns each 12 bits of input
+ * into two output characters with one lookup, and the decoder looks
+ * up each character in a table of its bits already shifted into
+ * place, so a group of four characters is decoded with one OR.  a
+ * character that is not in the alphabet sets the top byte, which is
+ * checked once per group.  the tables are built on first use.
+ */
+
+#define NGX_PROTOBUF_BASE64_BAD  0x01000000
+
+static u_char      ngx_protobuf_base64_pairs[4096][2];
+static uint32_t    ngx_protobuf_base64_bits[4][256];
+static ngx_uint_t  ngx_protobuf_base64_ready;
+
+static void
+ngx_protobuf_base64_init(void)
+{
+  static u_char  alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  ngx_uint_t     i;
+  ngx_uint_t     j;
+
+  for (i = 0; i < 4096; i++) {
+    ngx_protobuf_base64_pairs[i][0] = alphabet[i >> 6];
+    ngx_protobuf_base64_pairs[i][1] = alphabet[i & 0x3f];
+  }
+
+  for (i = 0; i < 256; i++) {
+    for (j = 0; j < 4; j++) {
+      ngx_protobuf_base64_bits[j][i] = NGX_PROTOBUF_BASE64_BAD;
+    }
+  }
+
+  for (i = 0; i < 64; i++) {
+    for (j = 0; j < 4; j++) {
+      ngx_protobuf_base64_bits[j][alphabet[i]] = i << (18 - 6 * j);
+    }
+  }
+
+  ngx_protobuf_base64_ready = 1;
+}
+
+/* encodes len bytes, padding the last group.  dst must have room for
+ * ngx_base64_encoded_length(len) bytes.  returns the end of the output.
+ */
+
+u_char *
+ngx_protobuf_base64_encode(u_char *dst, u_char *src, size_t len)
+{
+  u_char    *last = src + len;
+  uint32_t   v;
+
+  if (!ngx_protobuf_base64_ready) {
+    ngx_protobuf_base64_init();
+  }
+
+  while (last - src >= 3) {
+    v = ((uint32_t) src[0] << 16) | ((uint32_t) src[1] << 8) | src[2];
+    src += 3;
+
+    dst[0] = ngx_protobuf_base64_pairs[v >> 12][0];
+    dst[1] = ngx_protobuf_base64_pairs[v >> 12][1];
+    dst[2] = ngx_protobuf_base64_pairs[v & 0xfff][0];
+    dst[3] = ngx_protobuf_base64_pairs[v & 0xfff][1];
+    dst += 4;
+  }
+
+  if (src < last) {
+    v = (uint32_t) src[0] << 16;
+    if (last - src == 2) {
+      v |= (uint32_t) src[1] << 8;
+    }
+
+    dst[0] = ngx_protobuf_base64_pairs[v >> 12][0];
+    dst[1] = ngx_protobuf_base64_pairs[v >> 12][1];
+    dst[2] = (last - src == 2) ? ngx_protobuf_base64_pairs[v & 0xfff][0] : '=';
+    dst[3] = '=';
+    dst += 4;
+  }
+
+  return dst;
+}
+
+/* decodes len characters, a multiple of four, into dst, which may be
+ * src.  padded groups may appear anywhere, as they do where encoded
+ * pieces were concatenated.  returns the end of the output, or NULL if
+ * the input is not base64.
+ */
+
+u_char *
+ngx_protobuf_base64_decode(u_char *dst, u_char *src, size_t len)
+{
+  u_char    *last = src + len;
+  uint32_t   v;
+
+  if (!ngx_protobuf_base64_ready) {
+    ngx_protobuf_base64_init();
+  }
+
+  if (len % 4 != 0) {
+    return NULL;
+  }
+
+  for ( /* void */ ; src < last; src += 4) {
+    v = ngx_protobuf_base64_bits[0][src[0]]
+        | ngx_protobuf_base64_bits[1][src[1]]
+        | ngx_protobuf_base64_bits[2][src[2]]
+        | ngx_protobuf_base64_bits[3][src[3]];
+
+    if (!(v & NGX_PROTOBUF_BASE64_BAD)) {
+      dst[0] = (u_char) (v >> 16);
+      dst[1] = (u_char) (v >> 8);
+      dst[2] = (u_char) v;
+      dst += 3;
+      continue;
+    }
+
+    /* a padded group: "xx==" or "xxx=" */
+
+    if (src[3] != '=') {
+      return NULL;
+    }
+
+    v = ngx_protobuf_base64_bits[0][src[0]]
+        | ngx_protobuf_base64_bits[1][src[1]];
+
+    if (src[2] != '=') {
+      v |= ngx_protobuf_base64_bits[2][src[2]];
+    }
+
+    if (v & NGX_PROTOBUF_BASE64_BAD) {
+      return NULL;
+    }
+
+    *dst++ = (u_char) (v >> 16);
+
+    if (src[2] != '=') {
+      *dst++ = (u_char) (v >> 8);
+    }
+  }
+
+  return dst;
+}
+
+/* hands the data in a chain to a handler, buffer by buffer.  parts
+ * that were written to a file, such as a large request body, are read
+ * back a page at a time into one scratch buffer.
+ */
+
+ngx_int_t
+ngx_protobuf_read_chain(ngx_chain_t *in, ngx_pool_t *pool,
+                        ngx_protobuf_chunk_pt handler, void *data)
+{
+  ngx_chain_t  *cl;
+  ngx_buf_t    *b;
+  u_char       *chunk;
+  off_t         offset;
+  ssize_t       n;
+  ngx_int_t     rc;
+
+  chunk = NULL;
+
+  for (cl = in; cl; cl = cl->next) {
+    b = cl->buf;
+
+    if (ngx_buf_in_memory(b)) {
+      rc = handler(data, b->pos, b->last);
+      if (rc != NGX_OK) {
+        return rc;
+      }
+      continue;
+    }
+
+    if (!b->in_file) {
+      continue;
+    }
+
+    if (chunk == NULL) {
+      chunk = ngx_pnalloc(pool, ngx_pagesize);
+      if (chunk == NULL) {
+        return NGX_ERROR;
+      }
+    }
+
+    for (offset = b->file_pos; offset < b->file_last; offset += n) {
+      n = ngx_read_file(b->file, chunk,
+                        (size_t) ngx_min(b->file_last - offset,
+                                         (off_t) ngx_pagesize),
+                        offset);
+      if (n == NGX_ERROR || n == 0) {
+        return NGX_ERROR;
+      }
+
+      rc = handler(data, chunk, chunk + n);
+      if (rc != NGX_OK) {
+        return rc;
+      }
+    }
+  }
+
+  return NGX_OK;
+}
+
+/* JSON names.  the hash must match JsonHash() in protongx/ngx_json.cc,
+ * which builds the tables at generation time.
+ */
+
+uint32_t
+ngx_protobuf_json_hash(u_char *name, size_t len, uint32_t seed)
+{
+  uint32_t  h = 2166136261U ^ (seed * 0x9e3779b9U);
+
+  while (len--) {
+    h ^= *name++;
+    h *= 16777619U;
+  }
+
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+
+  return h;
+}
+
+/* the index of the field or value with a JSON name, or NGX_DECLINED */
+
+ngx_int_t
+ngx_protobuf_json_lookup(ngx_protobuf_json_names_t *names,
+                         u_char *name,
+                         size_t len)
+{
+  ngx_protobuf_json_key_t  *key;
+  ngx_uint_t                slot;
+  int32_t                   d;
+
+  if (names->nkeys == 0) {
+    return NGX_DECLINED;
+  }
+
+  d = names->displace[ngx_protobuf_json_hash(name, len, names->seed)
+                      % names->nkeys];
+
+  if (d < 0) {
+    slot = -1 - d;
+  } else {
+    slot = ngx_protobuf_json_hash(name, len, d) % names->nkeys;
+  }
+
+  key = &names->keys[slot];
+
+  if (key->name.len != len || ngx_memcmp(key->name.data, name, len) != 0) {
+    return NGX_DECLINED;
+  }
+
+  return key->index;
+}
+
+/* transcoder states */
+
+#define NGX_PROTOBUF_JSON_VALUE        0   /* a value */
+#define NGX_PROTOBUF_JSON_FIRST_VALUE  1   /* a value, or ] */
+#define NGX_PROTOBUF_JSON_KEY          2   /* a key */
+#define NGX_PROTOBUF_JSON_FIRST_KEY    3   /* a key, or } */
+#define NGX_PROTOBUF_JSON_COLON        4
+#define NGX_PROTOBUF_JSON_NEXT         5   /* a comma, or the closer */
+#define NGX_PROTOBUF_JSON_STRING       6
+#define NGX_PROTOBUF_JSON_ESCAPE       7
+#define NGX_PROTOBUF_JSON_UNICODE      8
+#define NGX_PROTOBUF_JSON_NUMBER       9
+#define NGX_PROTOBUF_JSON_LITERAL     10
+#define NGX_PROTOBUF_JSON_DONE        11
+
+/* scalar tokens */
+
+#define NGX_PROTOBUF_JSON_T_STRING     0
+#define NGX_PROTOBUF_JSON_T_NUMBER     1
+#define NGX_PROTOBUF_JSON_T_TRUE       2
+#define NGX_PROTOBUF_JSON_T_FALSE      3
+#define NGX_PROTOBUF_JSON_T_NULL       4
+
+/* the width at which length prefixes are reserved */
+
+#define NGX_PROTOBUF_JSON_PREFIX       5
+
+ngx_int_t
+ngx_protobuf_json_init(ngx_protobuf_json_t *json,
+                       ngx_protobuf_message_descriptor_t *desc,
+                       size_t size,
+                       ngx_pool_t *pool)
+{
+  ngx_memzero(json, sizeof(ngx_protobuf_json_t));
+
+  json->level[0].desc = desc;
+  json->pool = pool;
+
+  json->size = 64;
+  json->token = ngx_pnalloc(pool, json->size);
+  if (json->token == NULL) {
+    return NGX_ERROR;
+  }
+
+  if (size < 64) {
+    size = 64;
+  }
+
+  json->start = ngx_pnalloc(pool, size);
+  if (json->start == NULL) {
+    return NGX_ERROR;
+  }
+
+  json->last = json->start;
+  json->end = json->start + size;
+
+  return NGX_OK;
+}
+
+/* makes room for n more bytes of output */
+
+static ngx_int_t
+ngx_protobuf_json_reserve(ngx_protobuf_json_t *json, size_t n)
+{
+  size_t   size, used;
+  u_char  *p;
+
+  if ((size_t) (json->end - json->last) >= n) {
+    return NGX_OK;
+  }
+
+  size = json->end - json->start;
+  used = json->last - json->start;
+
+  size = ngx_max(size * 2, used + n);
+
+  p = ngx_pnalloc(json->pool, size);
+  if (p == NULL) {
+    return NGX_ERROR;
+  }
+
+  ngx_memcpy(p, json->start, used);
+
+  json->start = p;
+  json->last = p + used;
+  json->end = p + size;
+
+  return NGX_OK;
+}
+
+/* appends to the token, which is kept NUL-terminated for strtod() */
+
+static ngx_int_t
+ngx_protobuf_json_append(ngx_protobuf_json_t *json, u_char *p, size_t n)
+{
+  u_char  *token;
+  size_t   size;
+
+  if (json->len + n + 1 > json->size) {
+    size = ngx_max(json->size * 2, json->len + n + 1);
+
+    token = ngx_pnalloc(json->pool, size);
+    if (token == NULL) {
+      return NGX_ERROR;
+    }
+
+    ngx_memcpy(token, json->token, json->len);
+
+    json->token = token;
+    json->size = size;
+  }
+
+  ngx_memcpy(json->token + json->len, p, n);
+  json->len += n;
+  json->token[json->len] = '\0';
+
+  return NGX_OK;
+}
+
+/* appends the code point of a \u escape, or of a surrogate pair */
+
+static ngx_int_t
+ngx_protobuf_json_code_point(ngx_protobuf_json_t *json)
+{
+  uint32_t  code = json->code;
+  u_char    utf8[4];
+  size_t    n;
+
+  if (code >= 0xd800 && code <= 0xdbff) {
+    if (json->high) {
+      return NGX_ABORT;
+    }
+
+    json->high = code;
+    return NGX_OK;
+  }
+
+  if (code >= 0xdc00 && code <= 0xdfff) {
+    if (!json->high) {
+      return NGX_ABORT;
+    }
+
+    code = 0x10000 + ((json->high - 0xd800) << 10) + (code - 0xdc00);
+    json->high = 0;
+
+  } else if (json->high) {
+    return NGX_ABORT;
+  }
+
+  if (code < 0x80) {
+    utf8[0] = (u_char) code;
+    n = 1;
+  } else if (code < 0x800) {
+    utf8[0] = (u_char) (0xc0 | (code >> 6));
+    utf8[1] = (u_char) (0x80 | (code & 0x3f));
+    n = 2;
+  } else if (code < 0x10000) {
+    utf8[0] = (u_char) (0xe0 | (code >> 12));
+    utf8[1] = (u_char) (0x80 | ((code >> 6) & 0x3f));
+    utf8[2] = (u_char) (0x80 | (code & 0x3f));
+    n = 3;
+  } else {
+    utf8[0] = (u_char) (0xf0 | (code >> 18));
+    utf8[1] = (u_char) (0x80 | ((code >> 12) & 0x3f));
+    utf8[2] = (u_char) (0x80 | ((code >> 6) & 0x3f));
+    utf8[3] = (u_char) (0x80 | (code & 0x3f));
+    n = 4;
+  }
+
+  return ngx_protobuf_json_append(json, utf8, n);
+}
+
+/* the field that the next value belongs to, or NULL if it is skipped */
+
+static ngx_inline ngx_protobuf_field_descriptor_t *
+ngx_protobuf_json_field(ngx_protobuf_json_t *json)
+{
+  ngx_protobuf_json_level_t  *level = &json->level[json->depth - 1];
+
+  return level->skip ? NULL : level->field;
+}
+
+static ngx_int_t
+ngx_protobuf_json_open(ngx_protobuf_json_t *json, ngx_uint_t array)
+{
+  ngx_protobuf_field_descriptor_t  *field;
+  ngx_protobuf_json_level_t        *parent, *level;
+
+  if (json->depth == 0) {
+    /* the top level message, whose descriptor is already in place */
+    if (array) {
+      return NGX_ABORT;
+    }
+
+    json->depth = 1;
+    json->state = NGX_PROTOBUF_JSON_FIRST_KEY;
+
+    return NGX_OK;
+  }
+
+  if (json->depth == NGX_PROTOBUF_JSON_MAX_DEPTH) {
+    return NGX_ABORT;
+  }
+
+  parent = &json->level[json->depth - 1];
+  field = ngx_protobuf_json_field(json);
+
+  level = &json->level[json->depth++];
+  ngx_memzero(level, sizeof(ngx_protobuf_json_level_t));
+
+  level->array = array;
+
+  json->state = array ? NGX_PROTOBUF_JSON_FIRST_VALUE
+                      : NGX_PROTOBUF_JSON_FIRST_KEY;
+
+  if (field == NULL) {
+    level->skip = 1;
+    return NGX_OK;
+  }
+
+  if (array) {
+    if (parent->array || field->label != NGX_PROTOBUF_LABEL_REPEATED) {
+      return NGX_ABORT;
+    }
+
+    level->field = field;
+
+    if (!field->packed) {
+      return NGX_OK;
+    }
+
+  } else {
+    if (field->type != NGX_PROTOBUF_TYPE_MESSAGE) {
+      return NGX_ABORT;
+    }
+
+    level->desc = field->message;
+  }
+
+  if (ngx_protobuf_json_reserve(json, 5 + NGX_PROTOBUF_JSON_PREFIX)
+      != NGX_OK)
+  {
+    return NGX_ERROR;
+  }
+
+  json->last = ngx_protobuf_write_uint32(json->last,
+                   NGX_PROTOBUF_LENGTH_DELIMITED(field->number));
+
+  level->prefix = json->last - json->start;
+  json->last += NGX_PROTOBUF_JSON_PREFIX;
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_protobuf_json_close(ngx_protobuf_json_t *json, ngx_uint_t array)
+{
+  ngx_protobuf_json_level_t  *level = &json->level[json->depth - 1];
+  size_t                      len;
+
+  if (level->array != array) {
+    return NGX_ABORT;
+  }
+
+  if (level->prefix) {
+    len = json->last - json->start - level->prefix - NGX_PROTOBUF_JSON_PREFIX;
+
+    if (len > NGX_MAX_UINT32_VALUE) {
+      return NGX_ABORT;
+    }
+
+    ngx_protobuf_write_padded_uint32(json->start + level->prefix,
+                                     (uint32_t) len,
+                                     NGX_PROTOBUF_JSON_PREFIX);
+  }
+
+  json->state = (--json->depth == 0) ? NGX_PROTOBUF_JSON_DONE
+                                     : NGX_PROTOBUF_JSON_NEXT;
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_protobuf_json_key(ngx_protobuf_json_t *json)
+{
+  ngx_protobuf_json_level_t  *level = &json->level[json->depth - 1];
+  ngx_int_t                   i;
+
+  json->state = NGX_PROTOBUF_JSON_COLON;
+
+  if (level->skip) {
+    return NGX_OK;
+  }
+
+  i = ngx_protobuf_json_lookup(&level->desc->json, json->token, json->len);
+
+  /* unknown members are skipped */
+  level->field = (i >= 0) ? level->desc->fields[i] : NULL;
+
+  return NGX_OK;
+}
+
+/* a decimal integer in [min, max].  negative values are returned in
+ * two's complement.  returns NGX_DECLINED if the text has anything but
+ * digits after an optional sign.
+ */
+
+static ngx_int_t
+ngx_protobuf_parse_integer(u_char *p,
+                           u_char *end,
+                           int64_t min,
+                           uint64_t max,
+                           uint64_t *val)
+{
+  uint64_t   u;
+  ngx_uint_t negative;
+
+  negative = (p < end && *p == '-');
+  if (negative) {
+    p++;
+  }
+
+  if (p == end) {
+    return NGX_ABORT;
+  }
+
+  for (u = 0; p < end && *p >= '0' && *p <= '9'; p++) {
+    if (u > (UINT64_MAX - (*p - '0')) / 10) {
+      return NGX_ABORT;
+    }
+    u = u * 10 + (*p - '0');
+  }
+
+  if (p != end) {
+    return NGX_DECLINED;
+  }
+
+  if (negative) {
+    if (u > (uint64_t) -(min + 1) + 1) {
+      return NGX_ABORT;
+    }
+    *val = 0 - u;
+  } else {
+    if (u > max) {
+      return NGX_ABORT;
+    }
+    *val = u;
+  }
+
+  return NGX_OK;
+}
+
+/* an integer token, as a number or a string, in [min, max].  negative
+ * values are returned in two's complement.
+ */
+
+static ngx_int_t
+ngx_protobuf_json_integer(ngx_protobuf_json_t *json,
+                          ngx_uint_t token,
+                          int64_t min,
+                          uint64_t max,
+                          uint64_t *val)
+{
+  int64_t    i;
+  double     d;
+  char      *e;
+  ngx_int_t  rc;
+
+  if (token != NGX_PROTOBUF_JSON_T_NUMBER
+      && token != NGX_PROTOBUF_JSON_T_STRING)
+  {
+    return NGX_ABORT;
+  }
+
+  rc = ngx_protobuf_parse_integer(json->token, json->token + json->len,
+                                  min, max, val);
+  if (rc != NGX_DECLINED) {
+    return rc;
+  }
+
+  /* integral values may also be written with a fraction or exponent */
+
+  d = strtod((char *) json->token, &e);
+
+  if ((u_char *) e != json->token + json->len
+      || !(d > -9223372036854775808.0 && d < 9223372036854775808.0))
+  {
+    return NGX_ABORT;
+  }
+
+  i = (int64_t) d;
+
+  if ((double) i != d || i < min || (i > 0 && (uint64_t) i > max)) {
+    return NGX_ABORT;
+  }
+
+  *val = (uint64_t) i;
+
+  return NGX_OK;
+}
+
+/* a floating point token, as a number or a string */
+
+static ngx_int_t
+ngx_protobuf_json_double(ngx_protobuf_json_t *json,
+                         ngx_uint_t token,
+                         double *val)
+{
+  char  *e;
+
+  if (token == NGX_PROTOBUF_JSON_T_STRING) {
+    if (json->len == 3 && ngx_strncmp(json->token, "NaN", 3) == 0) {
+      *val = NAN;
+      return NGX_OK;
+    }
+
+    if (json->len == 8 && ngx_strncmp(json->token, "Infinity", 8) == 0) {
+      *val = INFINITY;
+      return NGX_OK;
+    }
+
+    if (json->len == 9 && ngx_strncmp(json->token, "-Infinity", 9) == 0) {
+      *val = -INFINITY;
+      return NGX_OK;
+    }
+
+  } else if (token != NGX_PROTOBUF_JSON_T_NUMBER) {
+    return NGX_ABORT;
+  }
+
+  *val = strtod((char *) json->token, &e);
+
+  if (json->len == 0
+      || (u_char *) e != json->token + json->len
+      || isinf(*val))
+  {
+    return NGX_ABORT;
+  }
+
+  return NGX_OK;
+}
+
+/* writes a scalar value of the current field */
+
+static ngx_int_t
+ngx_protobuf_json_value(ngx_protobuf_json_t *json, ngx_uint_t token)
+{
+  ngx_protobuf_field_descriptor_t  *field;
+  ngx_protobuf_json_level_t        *level;
+  ngx_protobuf_enum_descriptor_t   *e;
+  ngx_str_t                         s;
+  uint64_t                          v;
+  double                            d;
+  ngx_int_t                         rc, i;
+
+  if (json->depth == 0) {
+    return NGX_ABORT;
+  }
+
+  level = &json->level[json->depth - 1];
+  field = ngx_protobuf_json_field(json);
+
+  json->state = NGX_PROTOBUF_JSON_NEXT;
+
+  /* null is the default value, which is not written */
+
+  if (field == NULL || token == NGX_PROTOBUF_JSON_T_NULL) {
+    return NGX_OK;
+  }
+
+  v = 0;
+  d = 0;
+
+  switch (field->type) {
+
+  case NGX_PROTOBUF_TYPE_STRING:
+  case NGX_PROTOBUF_TYPE_BYTES:
+    if (token != NGX_PROTOBUF_JSON_T_STRING) {
+      return NGX_ABORT;
+    }
+
+    s.data = json->token;
+    s.len = json->len;
+
+    if (field->type == NGX_PROTOBUF_TYPE_BYTES) {
+      /* decoded in place, which base64 allows */
+      if (ngx_strlchr(s.data, s.data + s.len, '-') != NULL
+          || ngx_strlchr(s.data, s.data + s.len, '_') != NULL)
+      {
+        rc = ngx_decode_base64url(&s, &s);
+      } else {
+        rc = ngx_decode_base64(&s, &s);
+      }
+
+      if (rc != NGX_OK) {
+        return NGX_ABORT;
+      }
+    }
+
+    if (ngx_protobuf_json_reserve(json, 10 + s.len) != NGX_OK) {
+      return NGX_ERROR;
+    }
+
+    json->last = ngx_protobuf_write_string_field(json->last, &s,
+                                                 field->number);
+    return NGX_OK;
+
+  case NGX_PROTOBUF_TYPE_BOOL:
+    if (token != NGX_PROTOBUF_JSON_T_TRUE
+        && token != NGX_PROTOBUF_JSON_T_FALSE)
+    {
+      return NGX_ABORT;
+    }
+    v = (token == NGX_PROTOBUF_JSON_T_TRUE);
+    rc = NGX_OK;
+    break;
+
+  case NGX_PROTOBUF_TYPE_ENUM:
+    e = field->enum_type;
+
+    if (token == NGX_PROTOBUF_JSON_T_STRING && e != NULL) {
+      i = ngx_protobuf_json_lookup(&e->json, json->token, json->len);
+      if (i < 0) {
+        return NGX_ABORT;
+      }
+      v = (uint64_t) (int64_t) e->values[i].number;
+      rc = NGX_OK;
+      break;
+    }
+    /* fall through */
+
+  case NGX_PROTOBUF_TYPE_INT32:
+  case NGX_PROTOBUF_TYPE_SINT32:
+  case NGX_PROTOBUF_TYPE_SFIXED32:
+    rc = ngx_protobuf_json_integer(json, token, INT32_MIN, INT32_MAX, &v);
+    break;
+
+  case NGX_PROTOBUF_TYPE_UINT32:
+  case NGX_PROTOBUF_TYPE_FIXED32:
+    rc = ngx_protobuf_json_integer(json, token, 0, UINT32_MAX, &v);
+    break;
+
+  case NGX_PROTOBUF_TYPE_INT64:
+  case NGX_PROTOBUF_TYPE_SINT64:
+  case NGX_PROTOBUF_TYPE_SFIXED64:
+    rc = ngx_protobuf_json_integer(json, token, INT64_MIN, INT64_MAX, &v);
+    break;
+
+  case NGX_PROTOBUF_TYPE_UINT64:
+  case NGX_PROTOBUF_TYPE_FIXED64:
+    rc = ngx_protobuf_json_integer(json, token, 0, UINT64_MAX, &v);
+    break;
+
+  case NGX_PROTOBUF_TYPE_FLOAT:
+  case NGX_PROTOBUF_TYPE_DOUBLE:
+    rc = ngx_protobuf_json_double(json, token, &d);
+
+    if (rc == NGX_OK
+        && field->type == NGX_PROTOBUF_TYPE_FLOAT
+        && isinf((float) d) && !isinf(d))
+    {
+      rc = NGX_ABORT;
+    }
+    break;
+
+  default:
+    /* messages are objects, and groups are not supported */
+    return NGX_ABORT;
+  }
+
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  if (ngx_protobuf_json_reserve(json, 20) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  /* the elements of packed arrays have no tags */
+
+  if (!(level->array && level->prefix)) {
+    json->last = ngx_protobuf_write_uint32(json->last,
+                     (field->number << 3) | field->wire_type);
+  }
+
+  switch (field->type) {
+  case NGX_PROTOBUF_TYPE_SINT32:
+    json->last = ngx_protobuf_write_sint32(json->last, (int32_t) v);
+    break;
+  case NGX_PROTOBUF_TYPE_SINT64:
+    json->last = ngx_protobuf_write_sint64(json->last, (int64_t) v);
+    break;
+  case NGX_PROTOBUF_TYPE_FIXED32:
+  case NGX_PROTOBUF_TYPE_SFIXED32:
+    json->last = ngx_protobuf_write_fixed32(json->last, (uint32_t) v);
+    break;
+  case NGX_PROTOBUF_TYPE_FIXED64:
+  case NGX_PROTOBUF_TYPE_SFIXED64:
+    json->last = ngx_protobuf_write_fixed64(json->last, v);
+    break;
+  case NGX_PROTOBUF_TYPE_FLOAT:
+    json->last = ngx_protobuf_write_float(json->last, (float) d);
+    break;
+  case NGX_PROTOBUF_TYPE_DOUBLE:
+    json->last = ngx_protobuf_write_double(json->last, d);
+    break;
+  default:
+    json->last = ngx_protobuf_write_uint64(json->last, v);
+    break;
+  }
+
+  return NGX_OK;
+}
+
+/* ends a number or a literal, at the first byte that is not part of it */
+
+static ngx_int_t
+ngx_protobuf_json_end_token(ngx_protobuf_json_t *json)
+{
+  ngx_uint_t  token;
+
+  if (json->state == NGX_PROTOBUF_JSON_NUMBER) {
+    token = NGX_PROTOBUF_JSON_T_NUMBER;
+
+  } else if (json->len == 4 && ngx_strncmp(json->token, "true", 4) == 0) {
+    token = NGX_PROTOBUF_JSON_T_TRUE;
+
+  } else if (json->len == 5 && ngx_strncmp(json->token, "false", 5) == 0) {
+    token = NGX_PROTOBUF_JSON_T_FALSE;
+
+  } else if (json->len == 4 && ngx_strncmp(json->token, "null", 4) == 0) {
+    token = NGX_PROTOBUF_JSON_T_NULL;
+
+  } else {
+    return NGX_ABORT;
+  }
+
+  return ngx_protobuf_json_value(json, token);
+}
+
+/* feeds the next piece of JSON text to the transcoder */
+
+ngx_int_t
+ngx_protobuf_json_parse(ngx_protobuf_json_t *json, u_char *pos, u_char *last)
+{
+  u_char     *p, *q, c;
+  ngx_int_t   rc;
+
+  for (p = pos; p < last; p++) {
+    c = *p;
+    rc = NGX_OK;
+
+    switch (json->state) {
+
+    case NGX_PROTOBUF_JSON_STRING:
+      if (json->high && c != '\\') {
+        return NGX_ABORT;
+      }
+
+      /* copy the run of characters that need no attention at once */
+
+      for (q = p; q < last && *q != '"' && *q != '\\' && *q >= 0x20; q++) {
+        /* void */
+      }
+
+      if (q > p && ngx_protobuf_json_append(json, p, q - p) != NGX_OK) {
+        return NGX_ERROR;
+      }
+
+      if (q == last) {
+        return NGX_OK;
+      }
+
+      p = q;
+
+      if (*p == '"') {
+        rc = json->key ? ngx_protobuf_json_key(json)
+                       : ngx_protobuf_json_value(json,
+                                                 NGX_PROTOBUF_JSON_T_STRING);
+      } else if (*p == '\\') {
+        json->state = NGX_PROTOBUF_JSON_ESCAPE;
+      } else {
+        return NGX_ABORT;
+      }
+      break;
+
+    case NGX_PROTOBUF_JSON_ESCAPE:
+      if (json->high && c != 'u') {
+        return NGX_ABORT;
+      }
+
+      switch (c) {
+      case '"': case '\\': case '/':
+        break;
+      case 'b': c = '\b'; break;
+      case 'f': c = '\f'; break;
+      case 'n': c = '\n'; break;
+      case 'r': c = '\r'; break;
+      case 't': c = '\t'; break;
+      case 'u':
+        json->code = 0;
+        json->digits = 0;
+        json->state = NGX_PROTOBUF_JSON_UNICODE;
+        continue;
+      default:
+        return NGX_ABORT;
+      }
+
+      rc = ngx_protobuf_json_append(json, &c, 1);
+      json->state = NGX_PROTOBUF_JSON_STRING;
+      break;
+
+    case NGX_PROTOBUF_JSON_UNICODE:
+      if (c >= '0' && c <= '9') {
+        json->code = (json->code << 4) | (c - '0');
+      } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+        json->code = (json->code << 4) | ((c | 0x20) - 'a' + 10);
+      } else {
+        return NGX_ABORT;
+      }
+
+      if (++json->digits == 4) {
+        rc = ngx_protobuf_json_code_point(json);
+        json->state = NGX_PROTOBUF_JSON_STRING;
+      }
+      break;
+
+    case NGX_PROTOBUF_JSON_NUMBER:
+    case NGX_PROTOBUF_JSON_LITERAL:
+      if (json->state == NGX_PROTOBUF_JSON_NUMBER
+          ? ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.'
+             || c == 'e' || c == 'E')
+          : (c >= 'a' && c <= 'z'))
+      {
+        rc = ngx_protobuf_json_append(json, p, 1);
+        break;
+      }
+
+      rc = ngx_protobuf_json_end_token(json);
+
+      /* the byte is looked at again in the new state */
+      p--;
+      break;
+
+    default:
+      if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+        break;
+      }
+
+      switch (json->state) {
+
+      case NGX_PROTOBUF_JSON_FIRST_VALUE:
+        if (c == ']') {
+          rc = ngx_protobuf_json_close(json, 1);
+          break;
+        }
+        /* fall through */
+
+      case NGX_PROTOBUF_JSON_VALUE:
+        json->len = 0;
+
+        if (c == '{' || c == '[') {
+          rc = ngx_protobuf_json_open(json, c == '[');
+        } else if (c == '"') {
+          json->key = 0;
+          json->state = NGX_PROTOBUF_JSON_STRING;
+        } else if (c == '-' || (c >= '0' && c <= '9')) {
+          json->state = NGX_PROTOBUF_JSON_NUMBER;
+          rc = ngx_protobuf_json_append(json, p, 1);
+        } else if (c >= 'a' && c <= 'z') {
+          json->state = NGX_PROTOBUF_JSON_LITERAL;
+          rc = ngx_protobuf_json_append(json, p, 1);
+        } else {
+          return NGX_ABORT;
+        }
+        break;
+
+      case NGX_PROTOBUF_JSON_FIRST_KEY:
+        if (c == '}') {
+          rc = ngx_protobuf_json_close(json, 0);
+          break;
+        }
+        /* fall through */
+
+      case NGX_PROTOBUF_JSON_KEY:
+        if (c != '"') {
+          return NGX_ABORT;
+        }
+
+        json->len = 0;
+        json->key = 1;
+        json->state = NGX_PROTOBUF_JSON_STRING;
+        break;
+
+      case NGX_PROTOBUF_JSON_COLON:
+        if (c != ':') {
+          return NGX_ABORT;
+        }
+
+        json->state = NGX_PROTOBUF_JSON_VALUE;
+        break;
+
+      case NGX_PROTOBUF_JSON_NEXT:
+        if (c == ',') {
+          json->state = json->level[json->depth - 1].array
+                        ? NGX_PROTOBUF_JSON_VALUE
+                        : NGX_PROTOBUF_JSON_KEY;
+        } else if (c == '}' || c == ']') {
+          rc = ngx_protobuf_json_close(json, c == ']');
+        } else {
+          return NGX_ABORT;
+        }
+        break;
+
+      default: /* NGX_PROTOBUF_JSON_DONE */
+        return NGX_ABORT;
+      }
+    }
+
+    if (rc != NGX_OK) {
+      return rc;
+    }
+  }
+
+  return NGX_OK;
+}
+
+/* checks that the JSON text is complete, and returns the message */
+
+ngx_int_t
+ngx_protobuf_json_finish(ngx_protobuf_json_t *json, ngx_str_t *out)
+{
+  if (json->state != NGX_PROTOBUF_JSON_DONE) {
+    return NGX_ABORT;
+  }
+
+  out->data = json->start;
+  out->len = json->last - json->start;
+
+  return NGX_OK;
+}
+
+/* formats the value of a field, which starts at pos, as text.  string
+ * and bytes values point into the input; other values are printed into
+ * memory from the pool.
+ */
+
+ngx_int_t
+ngx_protobuf_format_value(ngx_protobuf_field_descriptor_t *field,
+                          u_char *pos,
+                          u_char *end,
+                          ngx_pool_t *pool,
+                          ngx_str_t *text)
+{
+  uint64_t   u64;
+  int64_t    i64;
+  uint32_t   u32;
+  int32_t    i32;
+  float      f;
+  double     d;
+  u_char    *p;
+  ngx_int_t  rc;
+
+  if (field->wire_type == NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED) {
+    return ngx_protobuf_read_string(&pos, end, text, NULL);
+  }
+
+  p = ngx_pnalloc(pool, NGX_INT64_LEN + 8);
+  if (p == NULL) {
+    return NGX_ERROR;
+  }
+
+  text->data = p;
+
+  switch (field->type) {
+  case NGX_PROTOBUF_TYPE_BOOL:
+  case NGX_PROTOBUF_TYPE_UINT64:
   case NGX_PROTOBUF_TYPE_UINT32:
+    rc = ngx_protobuf_read_uint64(&pos, end, &u64);
+    if (field->type == NGX_PROTOBUF_TYPE_BOOL) {
+      u64 = (u64 != 0);
+    } else if (field->type == NGX_PROTOBUF_TYPE_UINT32) {
+      u64 = (uint32_t) u64;
+    }
+    p = ngx_sprintf(p, "%uL", u64);
+    break;
+  case NGX_PROTOBUF_TYPE_INT64:
+    rc = ngx_protobuf_read_uint64(&pos, end, &u64);
+    p = ngx_sprintf(p, "%L", (int64_t) u64);
+    break;
+  case NGX_PROTOBUF_TYPE_INT32:
+  case NGX_PROTOBUF_TYPE_ENUM:
+    rc = ngx_protobuf_read_uint64(&pos, end, &u64);
+    p = ngx_sprintf(p, "%D", (int32_t) u64);
+    break;
+  case NGX_PROTOBUF_TYPE_SINT32:
+    rc = ngx_protobuf_read_sint32(&pos, end, &i32);
+    p = ngx_sprintf(p, "%D", i32);
+    break;
+  case NGX_PROTOBUF_TYPE_SINT64:
+    rc = ngx_protobuf_read_sint64(&pos, end, &i64);
+    p = ngx_sprintf(p, "%L", i64);
+    break;
+  case NGX_PROTOBUF_TYPE_FIXED32:
+    rc = ngx_protobuf_read_fixed32(&pos, end, &u32);
+    p = ngx_sprintf(p, "%uD", u32);
+    break;
+  case NGX_PROTOBUF_TYPE_SFIXED32:
+    rc = ngx_protobuf_read_sfixed32(&pos, end, &i32);
+    p = ngx_sprintf(p, "%D", i32);
+    break;
+  case NGX_PROTOBUF_TYPE_FIXED64:
+    rc = ngx_protobuf_read_fixed64(&pos, end, &u64);
+    p = ngx_sprintf(p, "%uL", u64);
+    break;
+  case NGX_PROTOBUF_TYPE_SFIXED64:
+    rc = ngx_protobuf_read_sfixed64(&pos, end, &i64);
+    p = ngx_sprintf(p, "%L", i64);
+    break;
+  case NGX_PROTOBUF_TYPE_FLOAT:
+    rc = ngx_protobuf_read_float(&pos, end, &f);
+    p = ngx_snprintf(p, NGX_INT64_LEN + 8, "%.6f", (double) f);
+    break;
+  case NGX_PROTOBUF_TYPE_DOUBLE:
+    rc = ngx_protobuf_read_double(&pos, end, &d);
+    p = ngx_snprintf(p, NGX_INT64_LEN + 8, "%.6f", d);
+    break;
+  default:
+    rc = NGX_ABORT;
+    break;
+  }
+
+  if (rc != NGX_OK) {
+    return NGX_ABORT;
+  }
+
+  text->len = p - text->data;
+
+  return NGX_OK;
+}
+
+/* the reverse of ngx_protobuf_format_value for fields that are not
+ * length-delimited: writes the value given as text to buf, which must
+ * have room for ten bytes, as it is encoded on the wire, without its
+ * tag.  enum values may also be given by name, and bools as "true" or
+ * "false".  returns the end of the value, or NULL if the text is not a
+ * value of the field's type.
+ */
+
+u_char *
+ngx_protobuf_parse_value(ngx_protobuf_field_descriptor_t *field,
+                         ngx_str_t *text,
+                         u_char *buf)
+{
+  ngx_protobuf_enum_descriptor_t  *e;
+  u_char                          *p, *end;
+  uint64_t                         v;
+  double                           d;
+  char                             num[NGX_INT64_LEN + 32];
+  char                            *q;
+  ngx_int_t                        i, rc;
+
+  p = text->data;
+  end = p + text->len;
+
+  switch (field->type) {
+
+  case NGX_PROTOBUF_TYPE_BOOL:
+    if (text->len == 4 && ngx_strncmp(p, "true", 4) == 0) {
+      v = 1;
+      rc = NGX_OK;
+    } else if (text->len == 5 && ngx_strncmp(p, "false", 5) == 0) {
+      v = 0;
+      rc = NGX_OK;
+    } else {
+      rc = ngx_protobuf_parse_integer(p, end, 0, 1, &v);
+    }
+    break;
+
+  case NGX_PROTOBUF_TYPE_ENUM:
+    e = field->enum_type;
+
+    rc = ngx_protobuf_parse_integer(p, end, INT32_MIN, INT32_MAX, &v);
+
+    if (rc == NGX_DECLINED && e != NULL) {
+      i = ngx_protobuf_json_lookup(&e->json, p, text->len);
+      if (i < 0) {
+        return NULL;
+      }
+      v = (uint64_t) (int64_t) e->values[i].number;
+      rc = NGX_OK;
+    }
+    break;
+
   case NGX_PROTOBUF_TYPE_INT32:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_uint32_field(ctx->buffer.pos,
-                                        ((uint32_t *)elts)[i], fnum);
+  case NGX_PROTOBUF_TYPE_SINT32:
+  case NGX_PROTOBUF_TYPE_SFIXED32:
+    rc = ngx_protobuf_parse_integer(p, end, INT32_MIN, INT32_MAX, &v);
+    break;
+
+  case NGX_PROTOBUF_TYPE_UINT32:
+  case NGX_PROTOBUF_TYPE_FIXED32:
+    rc = ngx_protobuf_parse_integer(p, end, 0, UINT32_MAX, &v);
+    break;
+
+  case NGX_PROTOBUF_TYPE_INT64:
+  case NGX_PROTOBUF_TYPE_SINT64:
+  case NGX_PROTOBUF_TYPE_SFIXED64:
+    rc = ngx_protobuf_parse_integer(p, end, INT64_MIN, INT64_MAX, &v);
+    break;
+
+  case NGX_PROTOBUF_TYPE_UINT64:
+  case NGX_PROTOBUF_TYPE_FIXED64:
+    rc = ngx_protobuf_parse_integer(p, end, 0, UINT64_MAX, &v);
+    break;
+
+  case NGX_PROTOBUF_TYPE_FLOAT:
+  case NGX_PROTOBUF_TYPE_DOUBLE:
+
+    /* strtod() needs the text terminated */
+
+    if (text->len == 0 || text->len >= sizeof(num)) {
+      return NULL;
+    }
+
+    ngx_memcpy(num, p, text->len);
+    num[text->len] = '\0';
+
+    d = strtod(num, &q);
+
+    if (q != num + text->len
+        || isinf(d)
+        || (field->type == NGX_PROTOBUF_TYPE_FLOAT && isinf((float) d)))
+    {
+      return NULL;
+    }
+
+    if (field->type == NGX_PROTOBUF_TYPE_FLOAT) {
+      return ngx_protobuf_write_float(buf, (float) d);
+    }
+
+    return ngx_protobuf_write_double(buf, d);
+
+  default:
+    return NULL;
+  }
+
+  if (rc != NGX_OK) {
+    return NULL;
+  }
+
+  switch (field->type) {
+  case NGX_PROTOBUF_TYPE_SINT32:
+    return ngx_protobuf_write_sint32(buf, (int32_t) v);
+  case NGX_PROTOBUF_TYPE_SINT64:
+    return ngx_protobuf_write_sint64(buf, (int64_t) v);
+  case NGX_PROTOBUF_TYPE_FIXED32:
+  case NGX_PROTOBUF_TYPE_SFIXED32:
+    return ngx_protobuf_write_fixed32(buf, (uint32_t) v);
+  case NGX_PROTOBUF_TYPE_FIXED64:
+  case NGX_PROTOBUF_TYPE_SFIXED64:
+    return ngx_protobuf_write_fixed64(buf, v);
+  default:
+    return ngx_protobuf_write_uint64(buf, v);
+  }
+}
+
+/* resolves a dotted path of field names, such as "user.id", in
+ * pp->message.  groups are not entered.  if the path is invalid,
+ * NGX_DECLINED is returned and the reason is written to the buffer in
+ * pp->err, as with ngx_regex_compile().
+ */
+
+ngx_int_t
+ngx_protobuf_resolve_path(ngx_protobuf_path_t *pp)
+{
+  ngx_protobuf_message_descriptor_t  *desc;
+  ngx_protobuf_field_descriptor_t    *field;
+  ngx_str_t                           part;
+  u_char                             *p, *last, *dot;
+  ngx_uint_t                          i;
+
+  desc = pp->message;
+  pp->depth = 0;
+
+  p = pp->path.data;
+  last = pp->path.data + pp->path.len;
+
+  for ( ;; ) {
+    dot = ngx_strlchr(p, last, '.');
+    if (dot == NULL) {
+      dot = last;
+    }
+
+    part.data = p;
+    part.len = dot - p;
+
+    if (part.len == 0) {
+      pp->err.len = ngx_snprintf(pp->err.data, pp->err.len,
+                                 "invalid field path \"%V\"", &pp->path)
+                    - pp->err.data;
+      return NGX_DECLINED;
+    }
+
+    if (desc == NULL) {
+      pp->err.len = ngx_snprintf(pp->err.data, pp->err.len,
+                                 "\"%V\" is not a message field",
+                                 &pp->fields[pp->depth - 1]->name)
+                    - pp->err.data;
+      return NGX_DECLINED;
+    }
+
+    if (pp->depth == pp->max) {
+      pp->err.len = ngx_snprintf(pp->err.data, pp->err.len,
+                                 "field path \"%V\" is too long", &pp->path)
+                    - pp->err.data;
+      return NGX_DECLINED;
+    }
+
+    field = NULL;
+    for (i = 0; i < desc->nfields; ++i) {
+      if (desc->fields[i]->name.len == part.len
+          && ngx_strncmp(desc->fields[i]->name.data, part.data,
+                         part.len) == 0)
+      {
+        field = desc->fields[i];
+        break;
+      }
+    }
+
+    if (field == NULL) {
+      pp->err.len = ngx_snprintf(pp->err.data, pp->err.len,
+                                 "unknown field \"%V\" in \"%V\"",
+                                 &part, &desc->name)
+                    - pp->err.data;
+      return NGX_DECLINED;
+    }
+
+    if (field->label == NGX_PROTOBUF_LABEL_REPEATED && !pp->repeated) {
+      pp->err.len = ngx_snprintf(pp->err.data, pp->err.len,
+                                 "field \"%V\" is repeated", &part)
+                    - pp->err.data;
+      return NGX_DECLINED;
+    }
+
+    pp->fields[pp->depth++] = field;
+
+    if (dot == last) {
+      return NGX_OK;
+    }
+
+    desc = (field->type == NGX_PROTOBUF_TYPE_MESSAGE) ? field->message : NULL;
+    p = dot + 1;
+  }
+}
+
+/* builds the field index for a serialized message in a single pass
+ * over the data.  the occurrences are collected in the order in which
+ * they appear and then distributed into their slots, which keeps the
+ * entries for each slot in wire order.
+ */
+
+ngx_int_t
+ngx_protobuf_build_index(ngx_protobuf_message_descriptor_t *desc,
+                         u_char *start,
+                         u_char *last,
+                         ngx_pool_t *pool,
+                         ngx_protobuf_index_t **index)
+{
+  ngx_array_t                  *temp;
+  ngx_protobuf_index_temp_t    *t;
+  ngx_protobuf_index_entry_t   *entries;
+  ngx_protobuf_index_t         *idx;
+  u_char                       *pos = start;
+  u_char                       *hdr;
+  uint32_t                      header;
+  ngx_uint_t                    slot;
+  ngx_uint_t                    i;
+  size_t                        size;
+
+  if ((uint64_t)(last - start) > NGX_MAX_UINT32_VALUE) {
+    return NGX_ABORT;
+  }
+
+  temp = ngx_array_create(pool, 16, sizeof(ngx_protobuf_index_temp_t));
+  if (temp == NULL) {
+    return NGX_ERROR;
+  }
+
+  while (pos < last) {
+    hdr = pos;
+
+    if (ngx_protobuf_read_uint32(&pos, last, &header) != NGX_OK) {
+      return NGX_ABORT;
+    }
+
+    if (ngx_protobuf_skip_field(&pos, last, header >> 3,
+                                header & 0x07) != NGX_OK)
+    {
+      return NGX_ABORT;
+    }
+
+    slot = ngx_protobuf_field_slot(desc, header >> 3);
+    if (slot == desc->nfields) {
+      continue;
+    }
+
+    t = ngx_array_push(temp);
+    if (t == NULL) {
+      return NGX_ERROR;
+    }
+
+    t->slot = slot;
+    t->entry.offset = hdr - start;
+    t->entry.len = pos - hdr;
+  }
+
+  size = offsetof(ngx_protobuf_index_t, slots)
+         + (desc->nfields + 1) * sizeof(uint32_t)
+         + temp->nelts * sizeof(ngx_protobuf_index_entry_t);
+
+  idx = ngx_pcalloc(pool, size);
+  if (idx == NULL) {
+    return NGX_ERROR;
+  }
+
+  idx->size = size;
+  idx->nfields = desc->nfields;
+  entries = ngx_protobuf_index_entries(idx);
+
+  /* count the entries for each slot, turn the counts into positions,
+   * and then place the entries.  placing an entry advances its slot's
+   * position, so afterwards each slot holds the position of the next
+   * slot, and the positions are shifted back into place.
+   */
+
+  t = temp->elts;
+
+  for (i = 0; i < temp->nelts; ++i) {
+    idx->slots[t[i].slot + 1]++;
+  }
+
+  for (i = 1; i <= desc->nfields; ++i) {
+    idx->slots[i] += idx->slots[i - 1];
+  }
+
+  for (i = 0; i < temp->nelts; ++i) {
+    entries[idx->slots[t[i].slot]++] = t[i].entry;
+  }
+
+  for (i = desc->nfields; i > 0; --i) {
+    idx->slots[i] = idx->slots[i - 1];
+  }
+
+  idx->slots[0] = 0;
+
+  ngx_array_destroy(temp);
+
+  *index = idx;
+
+  return NGX_OK;
+}
+
+/* read-only views */
+
+void
+ngx_protobuf_view_init(ngx_protobuf_view_t *view,
+                       u_char *start,
+                       u_char *last,
+                       ngx_pool_t *pool)
+{
+  view->start = start;
+  view->last = last;
+  view->pool = pool;
+  view->index = NULL;
+}
+
+static ngx_int_t
+ngx_protobuf_view_prepare(ngx_protobuf_view_t *view,
+                          ngx_protobuf_message_descriptor_t *desc)
+{
+  if (view->index != NULL || view->pool == NULL) {
+    return NGX_OK;
+  }
+
+  return ngx_protobuf_build_index(desc, view->start, view->last,
+                                  view->pool, &view->index);
+}
+
+/* finds the value of a non-repeated field.  as with unpack, the last
+ * occurrence of the field wins.  on success, pos points just past the
+ * field header.  returns NGX_DECLINED if the field is not present, and
+ * NGX_ABORT if the data are malformed or the field has the wrong wire
+ * type.
+ */
+
+ngx_int_t
+ngx_protobuf_view_find(ngx_protobuf_view_t *view,
+                       ngx_protobuf_message_descriptor_t *desc,
+                       ngx_uint_t slot,
+                       u_char **pos)
+{
+  ngx_protobuf_index_entry_t  *entries;
+  ngx_protobuf_index_t        *index;
+  u_char                      *p;
+  u_char                      *mark;
+  u_char                      *hdr = NULL;
+  uint32_t                     header;
+  ngx_int_t                    rc;
+
+  rc = ngx_protobuf_view_prepare(view, desc);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  index = view->index;
+
+  if (index != NULL) {
+    if (index->slots[slot + 1] > index->slots[slot]) {
+      entries = ngx_protobuf_index_entries(index);
+      hdr = view->start + entries[index->slots[slot + 1] - 1].offset;
     }
-    break;
-  case NGX_PROTOBUF_TYPE_SINT32:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_sint32_field(ctx->buffer.pos,
-                                        ((int32_t *)elts)[i], fnum);
+  } else {
+    p = view->start;
+    while (p < view->last) {
+      mark = p;
+      if (ngx_protobuf_read_uint32(&p, view->last, &header) != NGX_OK) {
+        return NGX_ABORT;
+      }
+      if ((header >> 3) == desc->fields[slot]->number) {
+        hdr = mark;
+      }
+      if (ngx_protobuf_skip_field(&p, view->last, header >> 3,
+                                  header & 0x07) != NGX_OK)
+      {
+        return NGX_ABORT;
+      }
     }
-    break;
-  case NGX_PROTOBUF_TYPE_UINT64:
-  case NGX_PROTOBUF_TYPE_INT64:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_uint64_field(ctx->buffer.pos,
-                                        ((uint64_t *)elts)[i], fnum);
+  }
+
+  if (hdr == NULL) {
+    return NGX_DECLINED;
+  }
+
+  if (ngx_protobuf_read_uint32(&hdr, view->last, &header) != NGX_OK) {
+    return NGX_ABORT;
+  }
+
+  if ((header & 0x07) != desc->fields[slot]->wire_type) {
+    return NGX_ABORT;
+  }
+
+  *pos = hdr;
+
+  return NGX_OK;
+}
+
+/* returns the next element of a repeated field, which may be spread
+ * over several occurrences and packed runs.  on success, pos points at
+ * the element's value.  returns NGX_DECLINED once the field has been
+ * exhausted.
+ */
+
+ngx_int_t
+ngx_protobuf_view_next(ngx_protobuf_view_t *view,
+                       ngx_protobuf_message_descriptor_t *desc,
+                       ngx_uint_t slot,
+                       ngx_protobuf_view_iter_t *iter,
+                       u_char **pos)
+{
+  ngx_protobuf_index_entry_t  *entries;
+  ngx_protobuf_index_t        *index;
+  uint32_t                     number = desc->fields[slot]->number;
+  uint32_t                     wire = desc->fields[slot]->wire_type;
+  u_char                      *p;
+  uint32_t                     header;
+  uint32_t                     len;
+  ngx_int_t                    rc;
+
+  if (iter->pos == NULL) {
+    rc = ngx_protobuf_view_prepare(view, desc);
+    if (rc != NGX_OK) {
+      return rc;
     }
-    break;
-  case NGX_PROTOBUF_TYPE_SINT64:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_sint64_field(ctx->buffer.pos,
-                                        ((int64_t *)elts)[i], fnum);
+
+    iter->pos = view->start;
+    if (view->index != NULL) {
+      iter->entry = view->index->slots[slot];
     }
-    break;
-  case NGX_PROTOBUF_TYPE_FIXED32:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_fixed32_field(ctx->buffer.pos,
-                                         ((uint32_t *)elts)[i], fnum);
+  }
+
+  index = view->index;
+
+  for ( ;; ) {
+    if (iter->end != NULL) {
+      /* inside a packed run */
+      if (iter->pos < iter->end) {
+        *pos = iter->pos;
+        return ngx_protobuf_skip(&iter->pos, iter->end, wire);
+      }
+      iter->end = NULL;
     }
-    break;
-  case NGX_PROTOBUF_TYPE_SFIXED32:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_sfixed32_field(ctx->buffer.pos,
-                                          ((int32_t *)elts)[i], fnum);
+
+    /* find the next occurrence of the field */
+
+    if (index != NULL) {
+      if (iter->entry >= index->slots[slot + 1]) {
+        iter->pos = view->last;
+        return NGX_DECLINED;
+      }
+
+      entries = ngx_protobuf_index_entries(index);
+      p = view->start + entries[iter->entry++].offset;
+
+      if (ngx_protobuf_read_uint32(&p, view->last, &header) != NGX_OK) {
+        return NGX_ABORT;
+      }
+    } else {
+      p = iter->pos;
+      for ( ;; ) {
+        if (p >= view->last) {
+          iter->pos = view->last;
+          return NGX_DECLINED;
+        }
+        if (ngx_protobuf_read_uint32(&p, view->last, &header) != NGX_OK) {
+          return NGX_ABORT;
+        }
+        if ((header >> 3) == number) {
+          break;
+        }
+        if (ngx_protobuf_skip_field(&p, view->last, header >> 3,
+                                    header & 0x07) != NGX_OK)
+        {
+          return NGX_ABORT;
+        }
+      }
     }
-    break;
-  case NGX_PROTOBUF_TYPE_FLOAT:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_float_field(ctx->buffer.pos,
-                                       ((float *)elts)[i], fnum);
+
+    if ((header & 0x07) == wire) {
+      *pos = p;
+      iter->pos = p;
+      return ngx_protobuf_skip(&iter->pos, view->last, wire);
     }
-    break;
-  case NGX_PROTOBUF_TYPE_FIXED64:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_fixed64_field(ctx->buffer.pos,
-                                         ((uint64_t *)elts)[i], fnum);
+
+    if ((header & 0x07) != NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED) {
+      return NGX_ABORT;
     }
-    break;
-  case NGX_PROTOBUF_TYPE_SFIXED64:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_sfixed64_field(ctx->buffer.pos,
-                                          ((int64_t *)elts)[i], fnum);
+
+    /* a packed run of elements */
+    if (ngx_protobuf_read_uint32(&p, view->last, &len) != NGX_OK) {
+      return NGX_ABORT;
     }
-    break;
-  case NGX_PROTOBUF_TYPE_DOUBLE:
-    for (i = 0; i < nelts; ++i) {
-      ctx->buffer.pos =
-        ngx_protobuf_write_double_field(ctx->buffer.pos,
-                                        ((double *)elts)[i], fnum);
+    if (p + len > view->last) {
+      return NGX_ABORT;
     }
-    break;
-  default:
-    break;
-  }
 
-  return NGX_OK;
+    iter->pos = p;
+    iter->end = p + len;
+  }
 }
 
+/* a submessage on the path to a patched field */
+
+typedef struct {
+  u_char                           *prefix;  /* its length prefix */
+  u_char                           *value;
+  uint32_t                          len;
+  size_t                            width;   /* of the length prefix */
+} ngx_protobuf_patch_level_t;
+
+/* finds the value of the last occurrence of a field */
+
 static ngx_int_t
-ngx_protobuf_pack_single_field(ngx_protobuf_field_descriptor_t *field,
-                               ngx_protobuf_context_t *ctx,
-                               ngx_protobuf_value_t *value)
+ngx_protobuf_patch_find(u_char *p, u_char *end, uint32_t field,
+                        uint32_t wire, u_char **value, u_char **next)
 {
-  uint32_t  fnum = field->number;
-  size_t    n;
+  u_char    *mark;
+  uint32_t   header;
 
-  switch (field->type) {
-  case NGX_PROTOBUF_TYPE_MESSAGE:
-    n = field->size(value->u.v_message);
-    ctx->buffer.pos =
-      ngx_protobuf_write_message_header(ctx->buffer.pos, n, fnum);
-    field->pack(value->u.v_message, ctx);
-    break;
-  case NGX_PROTOBUF_TYPE_BYTES:
-  case NGX_PROTOBUF_TYPE_STRING:
-    ctx->buffer.pos =
-      ngx_protobuf_write_string_field(ctx->buffer.pos,
-                                      &value->u.v_bytes, fnum);
-    break;
-  case NGX_PROTOBUF_TYPE_BOOL:
-    ctx->buffer.pos =
-      ngx_protobuf_write_uint32_field(ctx->buffer.pos,
-                                      (value->u.v_uint32 != 0), fnum);
-    break;
-  case NGX_PROTOBUF_TYPE_ENUM:
-  case NGX_PROTOBUF_TYPE_UINT32:
-  case NGX_PROTOBUF_TYPE_INT32:
-    ctx->buffer.pos =
-      ngx_protobuf_write_uint32_field(ctx->buffer.pos,
-                                      value->u.v_uint32, fnum);
-    break;
-  case NGX_PROTOBUF_TYPE_SINT32:
-    ctx->buffer.pos =
-      ngx_protobuf_write_sint32_field(ctx->buffer.pos,
-                                      value->u.v_int32, fnum);
-    break;
-  case NGX_PROTOBUF_TYPE_UINT64:
-  case NGX_PROTOBUF_TYPE_INT64:
-    ctx->buffer.pos =
-      ngx_protobuf_write_uint64_field(ctx->buffer.pos,
-                                      value->u.v_uint64, fnum);
-    break;
-  case NGX_PROTOBUF_TYPE_SINT64:
-    ctx->buffer.pos =
-      ngx_protobuf_write_sint64_field(ctx->buffer.pos,
-                                      value->u.v_int64, fnum);
-    break;
-  case NGX_PROTOBUF_TYPE_FIXED32:
-    ctx->buffer.pos =
-      ngx_protobuf_write_fixed32_field(ctx->buffer.pos,
-                                       value->u.v_uint32, fnum);
-    break;
-  case NGX_PROTOBUF_TYPE_SFIXED32:
-    ctx->buffer.pos =
-      ngx_protobuf_write_sfixed32_field(ctx->buffer.pos,
-                                        value->u.v_int32, fnum);
-    break;
-  case NGX_PROTOBUF_TYPE_FLOAT:
-    ctx->buffer.pos =
-      ngx_protobuf_write_float_field(ctx->buffer.pos,
-                                     value->u.v_float, fnum);
-    break;
-  case NGX_PROTOBUF_TYPE_FIXED64:
-    ctx->buffer.pos =
-      ngx_protobuf_write_fixed64_field(ctx->buffer.pos,
-                                       value->u.v_uint64, fnum);
-    break;
-  case NGX_PROTOBUF_TYPE_SFIXED64:
-    ctx->buffer.pos =
-      ngx_protobuf_write_sfixed64_field(ctx->buffer.pos,
-                                        value->u.v_int64, fnum);
-    break;
-  case NGX_PROTOBUF_TYPE_DOUBLE:
-    ctx->buffer.pos =
-      ngx_protobuf_write_double_field(ctx->buffer.pos,
-                                      value->u.v_double, fnum);
-    break;
-  default:
-    break;
+  *value = NULL;
+
+  while (p < end) {
+    if (ngx_protobuf_read_uint32(&p, end, &header) != NGX_OK) {
+      return NGX_ABORT;
+    }
+    mark = p;
+    if (ngx_protobuf_skip_field(&p, end, header >> 3,
+                                header & 0x07) != NGX_OK)
+    {
+      return NGX_ABORT;
+    }
+    if ((header >> 3) == field) {
+      if ((header & 0x07) != wire) {
+        return NGX_ABORT;
+      }
+      *value = mark;
+      *next = p;
+    }
   }
 
-  return NGX_OK;
+  return (*value != NULL) ? NGX_OK : NGX_DECLINED;
+}
+
+static u_char *
+ngx_protobuf_patch_value(u_char *p, uint32_t field, uint32_t wire,
+                         u_char *data, size_t len, ngx_uint_t tagged)
+{
+  if (tagged) {
+    p = ngx_protobuf_write_uint32(p, (field << 3) | wire);
+  }
+  if (wire == NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED) {
+    p = ngx_protobuf_write_uint32(p, len);
+  }
+
+  return ngx_cpymem(p, data, len);
 }
 
 static ngx_int_t
-ngx_protobuf_pack_extension(ngx_rbtree_node_t *node, void *data)
+ngx_protobuf_patch_link(ngx_pool_t *pool, ngx_chain_t ***ll,
+                        u_char *start, u_char *last, ngx_uint_t temporary)
 {
-  ngx_protobuf_extension_field_t   *field =
-    (ngx_protobuf_extension_field_t *)node;
-  ngx_protobuf_context_t           *ctx = data;
-  ngx_protobuf_value_t             *fval = &field->value;
-  ngx_protobuf_field_descriptor_t  *desc = field->descriptor;
-  size_t                            size = 0;
-  ngx_int_t                         rc = NGX_OK;
+  ngx_chain_t  *cl;
+  ngx_buf_t    *b;
 
-  if (!fval->exists) {
+  if (start == last) {
     return NGX_OK;
   }
 
-  ngx_protobuf_size_extension(node, &size);
-  if (ctx->buffer.pos + size > ctx->buffer.last) {
-    return NGX_ABORT;
+  cl = ngx_alloc_chain_link(pool);
+  b = ngx_calloc_buf(pool);
+  if (cl == NULL || b == NULL) {
+    return NGX_ERROR;
   }
 
-  if (desc->label == NGX_PROTOBUF_LABEL_REPEATED) {
-    if (desc->packed) {
-      rc = ngx_protobuf_pack_packed_field(desc, ctx, fval->u.v_repeated);
-    } else {
-      rc = ngx_protobuf_pack_repeated_field(desc, ctx, fval->u.v_repeated);
-    }
+  b->start = b->pos = start;
+  b->end = b->last = last;
+  if (temporary) {
+    b->temporary = 1;
   } else {
-    rc = ngx_protobuf_pack_single_field(desc, ctx, fval);
+    b->memory = 1;
   }
 
-  return rc;
-}
+  cl->buf = b;
+  cl->next = NULL;
+  **ll = cl;
+  *ll = &cl->next;
 
-ngx_int_t
-ngx_protobuf_pack_extensions(ngx_rbtree_t *extensions,
-                             uint32_t lower,
-                             uint32_t upper,
-                             ngx_protobuf_context_t *ctx)
-{
-  return ngx_protobuf_rbtree_iterate(extensions,
-                                     lower,
-                                     upper,
-                                     ngx_protobuf_pack_extension,
-                                     ctx);
+  return NGX_OK;
 }
 
+/* patches a field of a serialized message without unpacking it.  data
+ * is the encoded value, without its tag (and, for length-delimited
+ * fields, without its length).  the last occurrence of a singular
+ * field is replaced, or the field is added to the end of the message
+ * if it is not set; a repeated field is always appended to.  returns
+ * NGX_DECLINED if a submessage on the path is not set.
+ */
+
 ngx_int_t
-ngx_protobuf_unpack_unknown_field(uint32_t field,
-				  ngx_protobuf_wiretype_e wire,
-				  ngx_protobuf_context_t *ctx,
-				  ngx_array_t **unknown)
+ngx_protobuf_patch_field(ngx_protobuf_patch_t *patch,
+                         uint32_t field,
+                         uint32_t wire,
+                         u_char *data,
+                         size_t len,
+                         ngx_uint_t append)
 {
-  u_char                        **pos = &ctx->buffer.pos;
-  u_char                         *end = ctx->buffer.last;
-  ngx_protobuf_unknown_field_t   *u;
-  ngx_int_t                       rc;
+  ngx_protobuf_patch_level_t   level[NGX_PROTOBUF_MAX_PATCH_DEPTH];
+  ngx_chain_t                **ll;
+  u_char                      *p, *end, *a, *b, *from, *next, *m;
+  size_t                       size, n;
+  ssize_t                      delta;
+  ngx_uint_t                   i, k, replace;
+  ngx_int_t                    rc;
+
+  if (patch->depth > NGX_PROTOBUF_MAX_PATCH_DEPTH) {
+    return NGX_ABORT;
+  }
 
-  u = ngx_protobuf_push_array(unknown, ctx->pool,
-			      sizeof(ngx_protobuf_unknown_field_t));
-  if (u == NULL) {
-    return NGX_ERROR;
+  patch->out = NULL;
+
+  p = patch->start;
+  end = patch->last;
+
+  for (i = 0; i < patch->depth; ++i) {
+    rc = ngx_protobuf_patch_find(p, end, patch->path[i],
+                                 NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED,
+                                 &level[i].prefix, &next);
+    if (rc != NGX_OK) {
+      return rc;
+    }
+
+    p = level[i].prefix;
+    if (ngx_protobuf_read_uint32(&p, next, &level[i].len) != NGX_OK) {
+      return NGX_ABORT;
+    }
+    level[i].value = p;
+    level[i].width = p - level[i].prefix;
+    end = next;
   }
 
-  switch (wire) {
-  case NGX_PROTOBUF_WIRETYPE_VARINT:
-    rc = ngx_protobuf_read_uint64(pos, end, &u->value.u.v_uint64);
-    break;
-  case NGX_PROTOBUF_WIRETYPE_FIXED64:
-    rc = ngx_protobuf_read_fixed64(pos, end, &u->value.u.v_uint64);
-    break;
-  case NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED:
-    rc = ngx_protobuf_read_string(pos, end, &u->value.u.v_bytes,
-				  (ctx->reuse_strings) ? NULL : ctx->pool);
-    break;
-  case NGX_PROTOBUF_WIRETYPE_FIXED32:
-    rc = ngx_protobuf_read_fixed32(pos, end, &u->value.u.v_uint32);
-    break;
-  default:
-    rc = NGX_ABORT;
-    break;
+  a = b = end;
+  replace = 0;
+
+  if (!append) {
+    rc = ngx_protobuf_patch_find(p, end, field, wire, &a, &b);
+    if (rc == NGX_ABORT) {
+      return rc;
+    }
+    if (rc == NGX_OK) {
+      replace = 1;
+    } else {
+      a = b = end;
+    }
   }
 
-  return rc;
-}
+  size = len;
+  if (wire == NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED) {
+    size += ngx_protobuf_size_uint32(len);
+  }
+  if (!replace) {
+    size += ngx_protobuf_size_uint32((field << 3) | wire);
+  }
 
-size_t
-ngx_protobuf_size_unknown_field(ngx_protobuf_unknown_field_t *field)
-{
-  size_t n;
+  ll = &patch->out;
 
-  switch (field->wire_type) {
-  case NGX_PROTOBUF_WIRETYPE_VARINT:
-    n = ngx_protobuf_size_uint64_field(field->value.u.v_uint64, field->number);
-    break;
-  case NGX_PROTOBUF_WIRETYPE_FIXED64:
-    n = ngx_protobuf_size_fixed64_field(field->number);
-    break;
-  case NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED:
-    n = ngx_protobuf_size_string_field(&field->value.u.v_bytes, field->number);
-    break;
-  case NGX_PROTOBUF_WIRETYPE_FIXED32:
-    n = ngx_protobuf_size_fixed32_field(field->number);
-    break;
-  default:
-    /* we won't pack an unknown field of a bogus wire type */
-    n = 0;
-    break;
+  if (size == (size_t) (b - a)) {
+    ngx_protobuf_patch_value(a, field, wire, data, len, 0);
+    return ngx_protobuf_patch_link(patch->pool, &ll,
+                                   patch->start, patch->last, 0);
   }
 
-  return n;
-}
+  /* work out the new length prefixes from the innermost submessage
+   * out.  a prefix that still fits keeps its width and is rewritten in
+   * place.  one that has to grow is written into the middle buffer,
+   * along with everything between it and the patched field.
+   */
+
+  delta = size - (b - a);
+  k = patch->depth;
+
+  for (i = patch->depth; i-- > 0; /* void */) {
+    level[i].len += delta;
+    n = ngx_protobuf_size_uint32(level[i].len);
+    if (n > level[i].width) {
+      delta += n - level[i].width;
+      level[i].width = n;
+      k = i;
+    }
+  }
 
-ngx_int_t
-ngx_protobuf_pack_unknown_field(ngx_protobuf_unknown_field_t *field,
-				ngx_protobuf_context_t *ctx)
-{
-  switch (field->wire_type) {
-  case NGX_PROTOBUF_WIRETYPE_VARINT:
-    ctx->buffer.pos = ngx_protobuf_write_uint64_field(ctx->buffer.pos,
-						      field->value.u.v_uint64,
-						      field->number);
-    break;
-  case NGX_PROTOBUF_WIRETYPE_FIXED64:
-    ctx->buffer.pos = ngx_protobuf_write_fixed64_field(ctx->buffer.pos,
-						       field->value.u.v_uint64,
-						       field->number);
-    break;
-  case NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED:
-    ctx->buffer.pos = ngx_protobuf_write_string_field(ctx->buffer.pos,
-						      &field->value.u.v_bytes,
-						      field->number);
-    break;
-  case NGX_PROTOBUF_WIRETYPE_FIXED32:
-    ctx->buffer.pos = ngx_protobuf_write_fixed32_field(ctx->buffer.pos,
-						       field->value.u.v_uint32,
-						       field->number);
-    break;
-  default:
-    /* we won't pack an unknown field of a bogus wire type */
-    break;
+  from = (k < patch->depth) ? level[k].prefix : a;
+
+  n = size;
+  for (i = k; i < patch->depth; ++i) {
+    next = (i + 1 < patch->depth) ? level[i + 1].prefix : a;
+    n += level[i].width + (next - level[i].value);
+  }
+
+  m = ngx_pnalloc(patch->pool, n);
+  if (m == NULL) {
+    return NGX_ERROR;
+  }
+
+  if (ngx_protobuf_patch_link(patch->pool, &ll,
+                              patch->start, from, 0) != NGX_OK
+      || ngx_protobuf_patch_link(patch->pool, &ll, m, m + n, 1) != NGX_OK
+      || ngx_protobuf_patch_link(patch->pool, &ll,
+                                 b, patch->last, 0) != NGX_OK)
+  {
+    return NGX_ERROR;
+  }
+
+  /* nothing is written until the buffers have been allocated, so a
+   * failed patch leaves the message as it was.
+   */
+
+  for (i = 0; i < k; ++i) {
+    ngx_protobuf_write_padded_uint32(level[i].prefix, level[i].len,
+                                     level[i].width);
   }
 
+  p = m;
+  for (i = k; i < patch->depth; ++i) {
+    next = (i + 1 < patch->depth) ? level[i + 1].prefix : a;
+    p = ngx_protobuf_write_padded_uint32(p, level[i].len, level[i].width);
+    p = ngx_cpymem(p, level[i].value, next - level[i].value);
+  }
+
+  ngx_protobuf_patch_value(p, field, wire, data, len, !replace);
+
   return NGX_OK;
 }
-
@@ -47,10 +47,20 @@ typedef enum {
   NGX_PROTOBUF_TYPE_SINT64   = 18,
 } ngx_protobuf_type_e;
 
-/* hook for protobuf modules to register extensions. */
+typedef struct ngx_protobuf_message_descriptor_s
+  ngx_protobuf_message_descriptor_t;
+
+typedef struct ngx_protobuf_service_descriptor_s
+  ngx_protobuf_service_descriptor_t;
+
+/* hook for protobuf modules to register extensions, and the message
+ * types and services they define (NULL-terminated lists).
+ */
 
 typedef struct {
   ngx_int_t (*register_extensions)(ngx_cycle_t *cycle);
+  ngx_protobuf_message_descriptor_t **messages;
+  ngx_protobuf_service_descriptor_t **services;
 } ngx_protobuf_module_t;
 
 /* protobuf module identifier */
@@ -69,6 +79,11 @@ typedef ngx_int_t (*ngx_protobuf_unpack_pt)
   (void *obj, ngx_protobuf_context_t *ctx);
 typedef size_t (*ngx_protobuf_size_pt)(void *obj);
 
+/* handler for data read by ngx_protobuf_read_chain(). */
+
+typedef ngx_int_t (*ngx_protobuf_chunk_pt)
+  (void *data, u_char *pos, u_char *last);
+
 /* protobuf pack/unpack buffer.  when packing a protobuf message into
  * a buffer, it is the caller's responsibility to ensure that there is
  * enough space in the buffer to fit the message.  when unpacking, the
@@ -83,6 +98,13 @@ typedef struct {
   u_char  *last;
 } ngx_protobuf_buffer_t;
 
+/* readable bytes that must follow buffer.last when unpacking with the
+ * padded flag set.  the padded readers load a whole varint before they
+ * check it against last, so they may look up to this far past it.
+ */
+
+#define NGX_PROTOBUF_SLOP  16
+
 #if 0
 /* protobuf context state object.  this object contains the internal
  * state of the pack or unpack routines as they execute, such that a
@@ -116,10 +138,45 @@ struct ngx_protobuf_context_s {
   ngx_protobuf_buffer_t    buffer;
   // ngx_protobuf_state_t     state;
   uint32_t                 reuse_strings : 1;
+  uint32_t                 padded : 1;
   ngx_pool_t              *pool;
   ngx_log_t               *log;
 };
 
+/* JSON names of the fields of a message, or of the values of an enum,
+ * in a minimal perfect hash generated by protongx.  a name hashes with
+ * the seed to one of nkeys buckets.  a negative displacement is the
+ * slot of the bucket's only name (as -1 - slot); otherwise it seeds a
+ * second hash that gives the slot.  the key in the slot is compared
+ * with the name, so each lookup probes a single key.
+ */
+
+typedef struct {
+  ngx_str_t                   name;
+  ngx_uint_t                  index;     /* of the field or value */
+} ngx_protobuf_json_key_t;
+
+typedef struct {
+  ngx_uint_t                  nkeys;
+  uint32_t                    seed;
+  int32_t                    *displace;
+  ngx_protobuf_json_key_t    *keys;
+} ngx_protobuf_json_names_t;
+
+/* enum descriptor, with the values in number order */
+
+typedef struct {
+  int32_t                  number;
+  ngx_str_t                name;
+} ngx_protobuf_enum_value_t;
+
+typedef struct {
+  ngx_str_t                   name;
+  ngx_uint_t                  nvalues;
+  ngx_protobuf_enum_value_t  *values;
+  ngx_protobuf_json_names_t   json;
+} ngx_protobuf_enum_descriptor_t;
+
 /* field descriptor */
 
 typedef struct {
@@ -133,6 +190,19 @@ typedef struct {
   ngx_protobuf_pack_pt     pack;
   ngx_protobuf_unpack_pt   unpack;
   ngx_protobuf_size_pt     size;
+  const void              *defaults;
+  /* extensions only: unpack a single value into an element, and size
+   * or pack the whole field (tags included) from its value
+   */
+  ngx_protobuf_unpack_pt   unpack_value;
+  ngx_protobuf_size_pt     size_field;
+  ngx_protobuf_pack_pt     pack_field;
+  /* message fields only */
+  ngx_protobuf_message_descriptor_t *message;
+  /* enum fields only */
+  ngx_protobuf_enum_descriptor_t *enum_type;
+  /* the field's name in JSON (lowerCamelCase unless set by json_name) */
+  ngx_str_t                json_name;
 } ngx_protobuf_field_descriptor_t;
 
 /* generic container for an unpacked value. */
@@ -161,21 +231,346 @@ typedef struct {
   ngx_protobuf_value_t     value;
 } ngx_protobuf_unknown_field_t;
 
-/* rbtree node for an extension descriptor */
+/* a run of consecutive unknown fields, kept as the raw bytes of the
+ * input (tags included).  aliased spans still point into the buffer
+ * that was unpacked.
+ */
 
 typedef struct {
-  ngx_rbtree_node_t                 node;
-  ngx_protobuf_field_descriptor_t  *descriptor;
-} ngx_protobuf_extension_descriptor_t;
+  u_char                  *data;
+  size_t                   len;
+  unsigned                 aliased:1;
+} ngx_protobuf_unknown_span_t;
 
-/* rbtree node for an extension field. */
+/* the deepest nesting of unknown groups that will be skipped */
+
+#define NGX_PROTOBUF_MAX_GROUP_DEPTH  32
+
+/* the deepest submessage that can be patched */
+
+#define NGX_PROTOBUF_MAX_PATCH_DEPTH  32
+
+/* extension registry for an extendee.  descriptors are collected
+ * while the protobuf modules register their extensions, and are then
+ * frozen by ngx_protobuf_init into a sorted array of field numbers with
+ * a parallel array of descriptors.  if the field numbers are
+ * contiguous, a lookup is a single subtraction.  the frozen arrays of
+ * a new cycle only replace these once nginx has committed to it.
+ */
 
 typedef struct {
-  ngx_rbtree_node_t                 node;
+  uint32_t                          *numbers;
+  ngx_protobuf_field_descriptor_t  **descriptors;
+  ngx_uint_t                         nelts;
+  uint32_t                           base;      /* lowest field number */
+  unsigned                           dense:1;   /* no gaps in numbers */
+} ngx_protobuf_registry_t;
+
+/* an extension field that is set on a message. */
+
+typedef struct {
+  uint32_t                          number;
   ngx_protobuf_field_descriptor_t  *descriptor;
   ngx_protobuf_value_t              value;
 } ngx_protobuf_extension_field_t;
 
+/* the extension fields of a message, kept inline in the message as a
+ * small array sorted by field number.  the array is allocated when the
+ * first extension is set, and reallocated from the pool as it grows,
+ * so pointers into it are only good until the next extension is added.
+ */
+
+typedef struct {
+  ngx_protobuf_extension_field_t   *elts;
+  ngx_uint_t                        nelts;
+  ngx_uint_t                        nalloc;
+} ngx_protobuf_extensions_t;
+
+/* shared memory message store.  a store keeps the serialized form of
+ * the most recently published message in a shared memory zone, along
+ * with a version number that is bumped on every publish.  each worker
+ * unpacks a snapshot at most once per version (with string fields
+ * pointing directly into shared memory) and hands out the resulting
+ * read-only object until a newer version is published.
+ *
+ * a snapshot records the workers that hold a view of it by process
+ * slot, rather than counting references, so that the holds of a worker
+ * that has exited or crashed can be dropped by whoever takes over its
+ * slot.  superseded snapshots stay on the retired list until no slot
+ * holds them.
+ */
+
+#define NGX_PROTOBUF_SHM_HOLDERS  ((NGX_MAX_PROCESSES + 31) / 32)
+
+typedef struct ngx_protobuf_shm_snapshot_s ngx_protobuf_shm_snapshot_t;
+
+struct ngx_protobuf_shm_snapshot_s {
+  ngx_uint_t                        version;
+  uint32_t                          holders[NGX_PROTOBUF_SHM_HOLDERS];
+  ngx_uint_t                        retired;   /* superseded */
+  size_t                            len;
+  u_char                           *data;
+  ngx_protobuf_shm_snapshot_t      *next;      /* on the retired list */
+};
+
+typedef struct {
+  ngx_atomic_t                      version;
+  ngx_protobuf_shm_snapshot_t      *current;
+  ngx_protobuf_shm_snapshot_t      *retired;
+} ngx_protobuf_shm_store_t;
+
+/* a worker's unpacked copy of a snapshot.  the view is released once
+ * it has been replaced by a newer one and every pool that acquired it
+ * has been destroyed.
+ */
+
+typedef struct {
+  ngx_protobuf_shm_snapshot_t      *snapshot;
+  ngx_slab_pool_t                  *shpool;
+  ngx_protobuf_shm_store_t         *store;
+  ngx_pool_t                       *pool;
+  void                             *obj;
+  ngx_uint_t                        refcount;
+} ngx_protobuf_shm_view_t;
+
+/* per-zone context (zone->data).  this lives in process memory, so
+ * each worker has its own current view.
+ */
+
+typedef struct {
+  ngx_slab_pool_t                  *shpool;
+  ngx_protobuf_shm_store_t         *store;
+  ngx_protobuf_shm_view_t          *view;
+} ngx_protobuf_shm_ctx_t;
+
+/* message descriptor.  the fields are sorted by field number, and a
+ * field's position in the list is its slot in a field index.
+ */
+
+struct ngx_protobuf_message_descriptor_s {
+  ngx_str_t                         name;
+  ngx_uint_t                        nfields;
+  ngx_protobuf_field_descriptor_t **fields;
+  ngx_protobuf_json_names_t         json;
+};
+
+/* a field path, such as "user.id", resolved by
+ * ngx_protobuf_resolve_path().  the caller sets the path, the message
+ * type, room for max fields, and a buffer for the error in err.
+ */
+
+typedef struct {
+  ngx_str_t                           path;
+  ngx_protobuf_message_descriptor_t  *message;
+  ngx_protobuf_field_descriptor_t   **fields;
+  ngx_uint_t                          max;
+  ngx_uint_t                          depth;     /* fields resolved */
+  unsigned                            repeated:1;  /* allowed */
+  ngx_str_t                           err;
+} ngx_protobuf_path_t;
+
+/* RPC call.  the transport that accepts the call (the gRPC module, for
+ * one) fills in the call and its send and finish handlers, and passes
+ * the serialized request to the method's handler.  the handler, which
+ * protongx generates, unpacks the request, runs the implementation of
+ * the service and sends the reply; a server-streaming implementation
+ * sends each reply as it has it.  a non-zero status is the call's gRPC
+ * status code, with message as its text.  an implementation that
+ * returns NGX_AGAIN keeps the call open, and ends it later with
+ * ngx_protobuf_rpc_finish().
+ *
+ * a call that is kept open may go away first, if the client resets
+ * the stream, for instance.  the transport then calls
+ * ngx_protobuf_rpc_cancel(), which marks the call cancelled and calls
+ * its cancel handler, if the implementation set one.  from then on,
+ * sending and finishing do nothing, and once the handler returns the
+ * call's memory is freed, so the implementation must drop the call
+ * there (delete its timer, say).
+ *
+ * sending returns NGX_AGAIN when the reply was taken but the
+ * transport could not write it all out.  the call is then blocked: a
+ * server-streaming implementation should return NGX_AGAIN to keep the
+ * call open and send no more until the transport calls
+ * ngx_protobuf_rpc_ready(), which clears rpc->blocked and calls the
+ * call's ready handler, if the implementation set one.
+ */
+
+typedef struct ngx_protobuf_rpc_s ngx_protobuf_rpc_t;
+
+typedef ngx_int_t (*ngx_protobuf_rpc_handler_pt)
+  (ngx_protobuf_rpc_t *rpc, ngx_str_t *request);
+typedef ngx_int_t (*ngx_protobuf_rpc_send_pt)
+  (ngx_protobuf_rpc_t *rpc, ngx_str_t *message);
+typedef void (*ngx_protobuf_rpc_finish_pt)(ngx_protobuf_rpc_t *rpc);
+typedef void (*ngx_protobuf_rpc_cancel_pt)(ngx_protobuf_rpc_t *rpc);
+typedef void (*ngx_protobuf_rpc_ready_pt)(ngx_protobuf_rpc_t *rpc);
+
+/* gRPC status codes */
+
+#define NGX_PROTOBUF_RPC_OK                   0
+#define NGX_PROTOBUF_RPC_CANCELLED            1
+#define NGX_PROTOBUF_RPC_UNKNOWN              2
+#define NGX_PROTOBUF_RPC_INVALID_ARGUMENT     3
+#define NGX_PROTOBUF_RPC_DEADLINE_EXCEEDED    4
+#define NGX_PROTOBUF_RPC_NOT_FOUND            5
+#define NGX_PROTOBUF_RPC_ALREADY_EXISTS       6
+#define NGX_PROTOBUF_RPC_PERMISSION_DENIED    7
+#define NGX_PROTOBUF_RPC_RESOURCE_EXHAUSTED   8
+#define NGX_PROTOBUF_RPC_FAILED_PRECONDITION  9
+#define NGX_PROTOBUF_RPC_ABORTED              10
+#define NGX_PROTOBUF_RPC_OUT_OF_RANGE         11
+#define NGX_PROTOBUF_RPC_UNIMPLEMENTED        12
+#define NGX_PROTOBUF_RPC_INTERNAL             13
+#define NGX_PROTOBUF_RPC_UNAVAILABLE          14
+#define NGX_PROTOBUF_RPC_DATA_LOSS            15
+#define NGX_PROTOBUF_RPC_UNAUTHENTICATED      16
+
+/* method descriptor.  path is the method's HTTP/2 path (e.g.
+ * "/pkg.Service/Method").  client-streaming methods have no handler.
+ */
+
+typedef struct {
+  ngx_str_t                          name;
+  ngx_str_t                          path;
+  ngx_protobuf_message_descriptor_t *input;
+  ngx_protobuf_message_descriptor_t *output;
+  ngx_flag_t                         client_streaming;
+  ngx_flag_t                         server_streaming;
+  ngx_protobuf_rpc_handler_pt        handler;
+} ngx_protobuf_method_descriptor_t;
+
+/* service descriptor */
+
+struct ngx_protobuf_service_descriptor_s {
+  ngx_str_t                          name;
+  ngx_uint_t                         nmethods;
+  ngx_protobuf_method_descriptor_t  *methods;
+};
+
+struct ngx_protobuf_rpc_s {
+  ngx_protobuf_method_descriptor_t  *method;
+  ngx_pool_t                        *pool;
+  ngx_log_t                         *log;
+  void                              *data;     /* the transport's */
+  ngx_protobuf_rpc_send_pt           send;
+  ngx_protobuf_rpc_finish_pt         finish;
+  ngx_protobuf_rpc_cancel_pt         cancel;   /* the implementation's */
+  ngx_protobuf_rpc_ready_pt          ready;    /* the implementation's */
+  ngx_uint_t                         status;
+  ngx_str_t                          message;
+  unsigned                           finished:1;
+  unsigned                           cancelled:1;
+  unsigned                           blocked:1;
+};
+
+/* field index over serialized data.  the index maps every known field
+ * of a message to the byte ranges at which it occurs, and holds offsets
+ * rather than pointers so that it can be copied with the data it
+ * describes (into shared memory, for instance) and reused from there.
+ * the index is a single block of index->size bytes: the header, then
+ * nfields + 1 slot positions, then the entries, sorted by slot and
+ * then by offset.  the entries for slot i are entries[slots[i]] up to
+ * (but not including) entries[slots[i + 1]].
+ */
+
+typedef struct {
+  uint32_t                          offset;  /* of the field header */
+  uint32_t                          len;     /* of the header and value */
+} ngx_protobuf_index_entry_t;
+
+typedef struct {
+  uint32_t                          size;
+  uint32_t                          nfields;
+  uint32_t                          slots[1];
+} ngx_protobuf_index_t;
+
+#define ngx_protobuf_index_entries(index)                               \
+  ((ngx_protobuf_index_entry_t *) &(index)->slots[(index)->nfields + 1])
+
+/* read-only view over a serialized message.  the generated __view_
+ * accessors locate a single field by scanning the wire data, without
+ * unpacking the message or allocating memory.  if the view has an
+ * index, or a pool from which one can be built on the first lookup,
+ * fields are located through the index instead.
+ */
+
+typedef struct {
+  u_char                           *start;
+  u_char                           *last;
+  ngx_pool_t                       *pool;   /* for the index, or NULL */
+  ngx_protobuf_index_t             *index;
+} ngx_protobuf_view_t;
+
+/* position within a repeated field.  must be zeroed before the first
+ * call to a repeated field's view accessor.
+ */
+
+typedef struct {
+  u_char                           *pos;
+  u_char                           *end;    /* end of a packed run */
+  ngx_uint_t                        entry;  /* next index entry */
+} ngx_protobuf_view_iter_t;
+
+/* a field patch applied to a serialized message.  path holds the field
+ * numbers of the submessages leading to the patched message, if it is
+ * not the top-level one.  the message is patched in place when the
+ * field keeps its encoded width, and out is then a single buffer over
+ * the message.  otherwise out is the head of the message (with the
+ * enclosing length prefixes rewritten in place), a new middle buffer,
+ * and the rest of the message.  either way the message must be
+ * writable, and must not be patched again once it has been spliced.
+ */
+
+typedef struct {
+  u_char                           *start;
+  u_char                           *last;
+  uint32_t                         *path;
+  ngx_uint_t                        depth;
+  ngx_pool_t                       *pool;
+  ngx_chain_t                      *out;
+} ngx_protobuf_patch_t;
+
+/* JSON to protobuf transcoder.  the JSON text is fed in pieces of any
+ * size, and the serialized message is written as the text is parsed,
+ * into a buffer from the pool that grows as needed.  the length prefix
+ * of each submessage (and packed array) is reserved at its largest
+ * width and written, padded, when the submessage ends.  members that
+ * the message does not have are skipped, along with their contents.
+ */
+
+#define NGX_PROTOBUF_JSON_MAX_DEPTH  32
+
+typedef struct {
+  ngx_protobuf_message_descriptor_t *desc;    /* objects only */
+  ngx_protobuf_field_descriptor_t   *field;   /* of the member, or array */
+  size_t                             prefix;  /* reserved, or 0 */
+  unsigned                           array:1;
+  unsigned                           skip:1;  /* of an unknown member */
+} ngx_protobuf_json_level_t;
+
+typedef struct {
+  ngx_uint_t                         state;
+  ngx_uint_t                         depth;
+  ngx_protobuf_json_level_t          level[NGX_PROTOBUF_JSON_MAX_DEPTH];
+  unsigned                           key:1;
+  /* the string, number or literal being read */
+  u_char                            *token;
+  size_t                             len;
+  size_t                             size;
+  uint32_t                           code;    /* of a \u escape */
+  uint32_t                           high;    /* surrogate */
+  ngx_uint_t                         digits;
+  /* the serialized message */
+  u_char                            *start;
+  u_char                            *last;
+  u_char                            *end;
+  ngx_pool_t                        *pool;
+} ngx_protobuf_json_t;
+
+/* the largest valid field number */
+
+#define NGX_PROTOBUF_MAX_FIELD  536870911
+
 /* field prefix macros */
 
 #define NGX_PROTOBUF_HEADER(field, wire)         \
@@ -213,12 +608,15 @@ typedef struct {
 #define NGX_PROTOBUF_Z64_DECODE(val)             \
   (int64_t)((val >> 1) ^ -(int64_t)(val & 1))
 
-/* accessor macros */
+/* accessor macros.  the mutators also mark the message dirty, which
+ * stops __size and __pack from reusing the bytes it was unpacked from.
+ */
 
 #define NGX_PROTOBUF_CLEAR_MEMBER(obj, field)    \
   do {                                           \
     (obj)->field = NULL;                         \
     (obj)->__has_##field = 0;                    \
+    (obj)->__dirty = 1;                          \
   } while (0)
 
 #define NGX_PROTOBUF_CLEAR_STRING(obj, field)    \
@@ -226,12 +624,21 @@ typedef struct {
     (obj)->field.data = NULL;                    \
     (obj)->field.len = 0;                        \
     (obj)->__has_##field = 0;                    \
+    (obj)->__dirty = 1;                          \
   } while (0)
 
 #define NGX_PROTOBUF_CLEAR_NUMBER(obj, field)    \
   do {                                           \
     (obj)->field = 0;                            \
     (obj)->__has_##field = 0;                    \
+    (obj)->__dirty = 1;                          \
+  } while (0)
+
+#define NGX_PROTOBUF_CLEAR_DEFAULT(obj, field, def) \
+  do {                                           \
+    (obj)->field = (def).field;                  \
+    (obj)->__has_##field = 0;                    \
+    (obj)->__dirty = 1;                          \
   } while (0)
 
 #define NGX_PROTOBUF_SET_MEMBER(obj, field, val) \
@@ -240,6 +647,7 @@ typedef struct {
     if (val != NULL) {                           \
       (obj)->__has_##field = 1 ;                 \
     }                                            \
+    (obj)->__dirty = 1;                          \
   } while (0)
 
 #define NGX_PROTOBUF_SET_STRING(obj, field, str) \
@@ -247,12 +655,14 @@ typedef struct {
     (obj)->field.data = str->data;               \
     (obj)->field.len = str->len;                 \
     (obj)->__has_##field = 1;                    \
+    (obj)->__dirty = 1;                          \
   } while (0)
 
 #define NGX_PROTOBUF_SET_NUMBER(obj, field, val) \
   do {                                           \
     (obj)->field = val;                          \
     (obj)->__has_##field = 1;                    \
+    (obj)->__dirty = 1;                          \
   } while (0)  
 
 #define NGX_PROTOBUF_SET_ARRAY(obj, field, val)  \
@@ -261,11 +671,91 @@ typedef struct {
     if (val != NULL && val->nelts > 0) {         \
       (obj)->__has_##field = 1;                  \
     }                                            \
+    (obj)->__dirty = 1;                          \
   } while (0)
 
 #define NGX_PROTOBUF_HAS_FIELD(obj, field)       \
   (obj)->__has_##field
 
+/* accessor macros for messages with presence words, where each field
+ * is identified by the index of its word and its bit mask.
+ */
+
+#define NGX_PROTOBUF_CLEAR_MEMBER_BIT(obj, field, w, bit) \
+  do {                                           \
+    (obj)->field = NULL;                         \
+    (obj)->__has[w] &= ~(bit);                   \
+    (obj)->__dirty = 1;                          \
+  } while (0)
+
+#define NGX_PROTOBUF_CLEAR_STRING_BIT(obj, field, w, bit) \
+  do {                                           \
+    (obj)->field.data = NULL;                    \
+    (obj)->field.len = 0;                        \
+    (obj)->__has[w] &= ~(bit);                   \
+    (obj)->__dirty = 1;                          \
+  } while (0)
+
+#define NGX_PROTOBUF_CLEAR_NUMBER_BIT(obj, field, w, bit) \
+  do {                                           \
+    (obj)->field = 0;                            \
+    (obj)->__has[w] &= ~(bit);                   \
+    (obj)->__dirty = 1;                          \
+  } while (0)
+
+#define NGX_PROTOBUF_CLEAR_DEFAULT_BIT(obj, field, def, w, bit) \
+  do {                                           \
+    (obj)->field = (def).field;                  \
+    (obj)->__has[w] &= ~(bit);                   \
+    (obj)->__dirty = 1;                          \
+  } while (0)
+
+#define NGX_PROTOBUF_SET_MEMBER_BIT(obj, field, w, bit, val) \
+  do {                                           \
+    (obj)->field = val;                          \
+    if (val != NULL) {                           \
+      (obj)->__has[w] |= (bit);                  \
+    }                                            \
+    (obj)->__dirty = 1;                          \
+  } while (0)
+
+#define NGX_PROTOBUF_SET_STRING_BIT(obj, field, w, bit, str) \
+  do {                                           \
+    (obj)->field.data = str->data;               \
+    (obj)->field.len = str->len;                 \
+    (obj)->__has[w] |= (bit);                    \
+    (obj)->__dirty = 1;                          \
+  } while (0)
+
+#define NGX_PROTOBUF_SET_NUMBER_BIT(obj, field, w, bit, val) \
+  do {                                           \
+    (obj)->field = val;                          \
+    (obj)->__has[w] |= (bit);                    \
+    (obj)->__dirty = 1;                          \
+  } while (0)
+
+#define NGX_PROTOBUF_HAS_BIT(obj, w, bit)        \
+  (((obj)->__has[w] & (bit)) != 0)
+
+/* index of the lowest set bit in a (non-zero) presence word */
+
+static ngx_inline ngx_uint_t
+ngx_protobuf_ctz(uint32_t bits)
+{
+#if (__GNUC__ >= 4)
+  return __builtin_ctz(bits);
+#else
+  ngx_uint_t  n = 0;
+
+  while ((bits & 1) == 0) {
+    bits >>= 1;
+    n++;
+  }
+
+  return n;
+#endif
+}
+
 /* datatype size calculations */
 
 #define NGX_PROTOBUF_SIZE_UINT                   \
@@ -406,6 +896,34 @@ ngx_protobuf_copy_float8(u_char *dst, u_char *src)
 #endif /* __FLOAT_WORD_ORDER */
 }
 
+/* object allocation */
+
+static ngx_inline u_char *
+ngx_protobuf_alloc_padded(ngx_pool_t *pool, size_t size)
+{
+  u_char *buf;
+
+  buf = ngx_palloc(pool, size + NGX_PROTOBUF_SLOP);
+  if (buf != NULL) {
+    ngx_memzero(buf + size, NGX_PROTOBUF_SLOP);
+  }
+
+  return buf;
+}
+
+static ngx_inline void *
+ngx_protobuf_alloc_default(ngx_pool_t *pool, const void *defaults, size_t n)
+{
+  void *obj;
+
+  obj = ngx_palloc(pool, n);
+  if (obj != NULL) {
+    ngx_memcpy(obj, defaults, n);
+  }
+
+  return obj;
+}
+
 /* reading values */
 
 static ngx_inline ngx_int_t
@@ -422,7 +940,7 @@ ngx_protobuf_read_uint64(u_char **buf, u_char *end, uint64_t *val)
   do {
     v |= (uint64_t)(*p & 0x7f) << s;
     s += 7;
-  } while ((*p++ & 0x80) && (p <= end) && (s < 64));
+  } while ((*p++ & 0x80) && (p < end) && (s < 64));
 
   *buf = p;
 
@@ -454,6 +972,108 @@ ngx_int_t ngx_protobuf_read_string(u_char **buf,
                                    ngx_str_t *val,
                                    ngx_pool_t *pool);
 
+/* string readers for the generated unpack variants.  the alias readers
+ * point into the input, and the copy readers always allocate the value
+ * from the pool.
+ */
+
+static ngx_inline ngx_int_t
+ngx_protobuf_read_string_alias(u_char **buf, u_char *end, ngx_str_t *val)
+{
+  uint64_t  v;
+
+  if (ngx_protobuf_read_uint64(buf, end, &v) != NGX_OK
+      || v > (uint64_t) (end - *buf))
+  {
+    *buf = end;
+
+    return NGX_ABORT;
+  }
+
+  val->data = *buf;
+  val->len = v;
+  *buf += v;
+
+  return NGX_OK;
+}
+
+ngx_int_t ngx_protobuf_read_string_copy(u_char **buf,
+                                        u_char *end,
+                                        ngx_str_t *val,
+                                        ngx_pool_t *pool);
+
+/* reading from padded buffers.  varints are decoded without looking at
+ * end, and only the position after the value is checked against it.
+ * at least NGX_PROTOBUF_SLOP readable bytes must follow end.
+ */
+
+static ngx_inline ngx_int_t
+ngx_protobuf_read_padded_uint64(u_char **buf, u_char *end, uint64_t *val)
+{
+  uint64_t    v = 0;
+  u_char     *p = *buf;
+  ngx_uint_t  i;
+
+  for (i = 0; i < 10; i++) {
+    v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+
+    if (p[i] < 0x80) {
+      p += i + 1;
+      if (p > end) {
+        return NGX_ABORT;
+      }
+
+      *buf = p;
+      *val = v;
+
+      return NGX_OK;
+    }
+  }
+
+  return NGX_ABORT;
+}
+
+static ngx_inline ngx_int_t
+ngx_protobuf_read_padded_uint32(u_char **buf, u_char *end, uint32_t *val)
+{
+  uint64_t v64;
+
+  if (ngx_protobuf_read_padded_uint64(buf, end, &v64) != NGX_OK) {
+    return NGX_ABORT;
+  }
+
+  *val = (uint32_t)v64;
+
+  return NGX_OK;
+}
+
+static ngx_inline ngx_int_t
+ngx_protobuf_read_padded_string_alias(u_char **buf,
+                                      u_char *end,
+                                      ngx_str_t *val)
+{
+  uint64_t  v;
+
+  if (ngx_protobuf_read_padded_uint64(buf, end, &v) != NGX_OK
+      || v > (uint64_t) (end - *buf))
+  {
+    *buf = end;
+
+    return NGX_ABORT;
+  }
+
+  val->data = *buf;
+  val->len = v;
+  *buf += v;
+
+  return NGX_OK;
+}
+
+ngx_int_t ngx_protobuf_read_padded_string_copy(u_char **buf,
+                                               u_char *end,
+                                               ngx_str_t *val,
+                                               ngx_pool_t *pool);
+
 static ngx_inline ngx_int_t
 ngx_protobuf_read_bool(u_char **buf, u_char *end, uint32_t *val)
 {
@@ -473,7 +1093,7 @@ ngx_protobuf_read_bool(u_char **buf, u_char *end, uint32_t *val)
     return NGX_ABORT;                                           \
   }                                                             \
                                                                 \
-  ngx_protobuf_copy_##method##size(*buf, (u_char *)dst);        \
+  ngx_protobuf_copy_##method##size((u_char *)dst, *buf);        \
   *buf += size
 
 static ngx_inline ngx_int_t
@@ -487,10 +1107,7 @@ ngx_protobuf_read_fixed32(u_char **buf, u_char *end, uint32_t *val)
 static ngx_inline ngx_int_t
 ngx_protobuf_read_sfixed32(u_char **buf, u_char *end, int32_t *val)
 {
-  uint32_t uval;
-
-  NGX_PROTOBUF_READ_COPY(endian, &uval, 4);
-  *val = NGX_PROTOBUF_Z32_DECODE(uval);
+  NGX_PROTOBUF_READ_COPY(endian, val, 4);
 
   return NGX_OK;
 }
@@ -506,10 +1123,7 @@ ngx_protobuf_read_fixed64(u_char **buf, u_char *end, uint64_t *val)
 static ngx_inline ngx_int_t
 ngx_protobuf_read_sfixed64(u_char **buf, u_char *end, int64_t *val)
 {
-  uint64_t uval;
-  
-  NGX_PROTOBUF_READ_COPY(endian, &uval, 8);
-  *val = NGX_PROTOBUF_Z64_DECODE(uval);
+  NGX_PROTOBUF_READ_COPY(endian, val, 8);
 
   return NGX_OK;
 }
@@ -553,11 +1167,23 @@ ngx_protobuf_read_float(u_char **buf, u_char *end, float *val)
 static ngx_inline ngx_int_t
 ngx_protobuf_read_double(u_char **buf, u_char *end, double *val)
 {
-  NGX_PROTOBUF_READ_COPY(endian, val, 8);
+  NGX_PROTOBUF_READ_COPY(float, val, 8);
 
   return NGX_OK;
 }
 
+/* matching expected tags.  serializers write fields in field number
+ * order, so the generated unpack methods first check for each field's
+ * tag in that order, comparing the encoded tag bytes directly.  tags of
+ * fields numbered below 2048 take one or two bytes.
+ */
+
+#define NGX_PROTOBUF_EXPECT_TAG1(pos, end, b0)                  \
+  (*(pos) < (end) && (*(pos))[0] == (b0))
+
+#define NGX_PROTOBUF_EXPECT_TAG2(pos, end, b0, b1)              \
+  ((end) - *(pos) >= 2 && (*(pos))[0] == (b0) && (*(pos))[1] == (b1))
+
 /* writing values */
 
 #define NGX_PROTOBUF_WRITE_UINT                                 \
@@ -605,10 +1231,10 @@ ngx_protobuf_write_fixed64(u_char *buf, uint64_t val)
 }
 
 #define ngx_protobuf_write_sfixed32(buf, val) \
-  ngx_protobuf_write_fixed32(buf, NGX_PROTOBUF_Z32_ENCODE(val))
+  ngx_protobuf_write_fixed32(buf, (uint32_t) (val))
 
 #define ngx_protobuf_write_sfixed64(buf, val) \
-  ngx_protobuf_write_fixed64(buf, NGX_PROTOBUF_Z64_ENCODE(val))
+  ngx_protobuf_write_fixed64(buf, (uint64_t) (val))
 
 #define ngx_protobuf_write_sint32(buf, val) \
   ngx_protobuf_write_uint32(buf, NGX_PROTOBUF_Z32_ENCODE(val))
@@ -676,10 +1302,10 @@ ngx_protobuf_write_fixed64_field(u_char *buf, uint64_t val, uint32_t field)
 }
 
 #define ngx_protobuf_write_sfixed32_field(buf, val, field) \
-  ngx_protobuf_write_fixed32_field(buf, NGX_PROTOBUF_Z32_ENCODE(val), field)
+  ngx_protobuf_write_fixed32_field(buf, (uint32_t) (val), field)
 
 #define ngx_protobuf_write_sfixed64_field(buf, val, field) \
-  ngx_protobuf_write_fixed64_field(buf, NGX_PROTOBUF_Z64_ENCODE(val), field)
+  ngx_protobuf_write_fixed64_field(buf, (uint64_t) (val), field)
 
 #define ngx_protobuf_write_sint32_field(buf, val, field) \
   ngx_protobuf_write_uint32_field(buf, NGX_PROTOBUF_Z32_ENCODE(val), field)
@@ -697,9 +1323,9 @@ ngx_protobuf_write_float_field(u_char *buf, float val, uint32_t field)
 }
 
 static ngx_inline u_char *
-ngx_protobuf_write_double_field(u_char *buf, float val, uint32_t field)
+ngx_protobuf_write_double_field(u_char *buf, double val, uint32_t field)
 {
-  buf = ngx_protobuf_write_uint32(buf, NGX_PROTOBUF_FIXED32(field));
+  buf = ngx_protobuf_write_uint32(buf, NGX_PROTOBUF_FIXED64(field));
   buf = ngx_protobuf_write_double(buf, val);
 
   return buf;
@@ -714,43 +1340,208 @@ ngx_protobuf_write_message_header(u_char *buf, size_t len, uint32_t field)
   return buf;
 }
 
+/* writes a varint padded to width bytes, which decoders accept as the
+ * same value.  this lets a length prefix shrink without moving the
+ * bytes that follow it.
+ */
+
+static ngx_inline u_char *
+ngx_protobuf_write_padded_uint32(u_char *buf, uint32_t val, size_t width)
+{
+  while (--width) {
+    *buf++ = (u_char) (val | 0x80);
+    val >>= 7;
+  }
+
+  *buf++ = (u_char) val;
+
+  return buf;
+}
+
+/* writing backwards.  each method writes its value so that it ends
+ * just before buf, and returns a pointer to the first byte written.
+ * the caller makes sure that there is room for the exact size of the
+ * value, so that a buffer of the packed size is never too short.  a
+ * header goes in front of the bytes written since mark.
+ */
+
+#define NGX_PROTOBUF_REVERSE_ROOM(ctx, n)        \
+  ((size_t) ((ctx)->buffer.pos - (ctx)->buffer.start) >= (size_t) (n))
+
+#define NGX_PROTOBUF_REVERSE_HEADER_ROOM(ctx, mark, field)                  \
+  NGX_PROTOBUF_REVERSE_ROOM(ctx,                                            \
+    ngx_protobuf_size_uint32(NGX_PROTOBUF_LENGTH_DELIMITED(field)) +        \
+    ngx_protobuf_size_uint32((uint32_t) ((mark) - (ctx)->buffer.pos)))
+
+static ngx_inline u_char *
+ngx_protobuf_rwrite_uint32(u_char *buf, uint32_t val)
+{
+  buf -= ngx_protobuf_size_uint32(val);
+  ngx_protobuf_write_uint32(buf, val);
+
+  return buf;
+}
+
+static ngx_inline u_char *
+ngx_protobuf_rwrite_uint64(u_char *buf, uint64_t val)
+{
+  buf -= ngx_protobuf_size_uint64(val);
+  ngx_protobuf_write_uint64(buf, val);
+
+  return buf;
+}
+
+static ngx_inline u_char *
+ngx_protobuf_rwrite_string(u_char *buf, ngx_str_t *val)
+{
+  buf -= val->len;
+  ngx_memcpy(buf, val->data, val->len);
+
+  return ngx_protobuf_rwrite_uint32(buf, val->len);
+}
+
+static ngx_inline u_char *
+ngx_protobuf_rwrite_fixed32(u_char *buf, uint32_t val)
+{
+  return ngx_protobuf_write_fixed32(buf - 4, val) - 4;
+}
+
+static ngx_inline u_char *
+ngx_protobuf_rwrite_fixed64(u_char *buf, uint64_t val)
+{
+  return ngx_protobuf_write_fixed64(buf - 8, val) - 8;
+}
+
+static ngx_inline u_char *
+ngx_protobuf_rwrite_float(u_char *buf, float val)
+{
+  return ngx_protobuf_write_float(buf - 4, val) - 4;
+}
+
+static ngx_inline u_char *
+ngx_protobuf_rwrite_double(u_char *buf, double val)
+{
+  return ngx_protobuf_write_double(buf - 8, val) - 8;
+}
+
+static ngx_inline u_char *
+ngx_protobuf_rwrite_uint32_field(u_char *buf, uint32_t val, uint32_t field)
+{
+  buf = ngx_protobuf_rwrite_uint32(buf, val);
+  buf = ngx_protobuf_rwrite_uint32(buf, NGX_PROTOBUF_VARINT(field));
+
+  return buf;
+}
+
+static ngx_inline u_char *
+ngx_protobuf_rwrite_uint64_field(u_char *buf, uint64_t val, uint32_t field)
+{
+  buf = ngx_protobuf_rwrite_uint64(buf, val);
+  buf = ngx_protobuf_rwrite_uint32(buf, NGX_PROTOBUF_VARINT(field));
+
+  return buf;
+}
+
+static ngx_inline u_char *
+ngx_protobuf_rwrite_string_field(u_char *buf, ngx_str_t *val, uint32_t field)
+{
+  buf = ngx_protobuf_rwrite_string(buf, val);
+  buf = ngx_protobuf_rwrite_uint32(buf, NGX_PROTOBUF_LENGTH_DELIMITED(field));
+
+  return buf;
+}
+
+static ngx_inline u_char *
+ngx_protobuf_rwrite_fixed32_field(u_char *buf, uint32_t val, uint32_t field)
+{
+  buf = ngx_protobuf_rwrite_fixed32(buf, val);
+  buf = ngx_protobuf_rwrite_uint32(buf, NGX_PROTOBUF_FIXED32(field));
+
+  return buf;
+}
+
+static ngx_inline u_char *
+ngx_protobuf_rwrite_fixed64_field(u_char *buf, uint64_t val, uint32_t field)
+{
+  buf = ngx_protobuf_rwrite_fixed64(buf, val);
+  buf = ngx_protobuf_rwrite_uint32(buf, NGX_PROTOBUF_FIXED64(field));
+
+  return buf;
+}
+
+static ngx_inline u_char *
+ngx_protobuf_rwrite_float_field(u_char *buf, float val, uint32_t field)
+{
+  buf = ngx_protobuf_rwrite_float(buf, val);
+  buf = ngx_protobuf_rwrite_uint32(buf, NGX_PROTOBUF_FIXED32(field));
+
+  return buf;
+}
+
+static ngx_inline u_char *
+ngx_protobuf_rwrite_double_field(u_char *buf, double val, uint32_t field)
+{
+  buf = ngx_protobuf_rwrite_double(buf, val);
+  buf = ngx_protobuf_rwrite_uint32(buf, NGX_PROTOBUF_FIXED64(field));
+
+  return buf;
+}
+
+static ngx_inline u_char *
+ngx_protobuf_rwrite_message_header(u_char *buf, size_t len, uint32_t field)
+{
+  buf = ngx_protobuf_rwrite_uint32(buf, len);
+  buf = ngx_protobuf_rwrite_uint32(buf, NGX_PROTOBUF_LENGTH_DELIMITED(field));
+
+  return buf;
+}
+
 /* other non-inlined methods */
 
 ngx_int_t ngx_protobuf_skip(u_char **buf, u_char *end, uint32_t wire);
 
+ngx_int_t ngx_protobuf_skip_field(u_char **buf,
+                                  u_char *end,
+                                  uint32_t field,
+                                  uint32_t wire);
+
 void *ngx_protobuf_push_array(ngx_array_t **a, ngx_pool_t *p, size_t n);
 
-ngx_int_t ngx_protobuf_import_extension(ngx_rbtree_t **registry,
+ngx_int_t ngx_protobuf_import_extension(ngx_protobuf_registry_t *registry,
                                         ngx_protobuf_field_descriptor_t *desc,
                                         ngx_cycle_t *cycle);
 
-ngx_protobuf_value_t *ngx_protobuf_get_extension(ngx_rbtree_t *extensions,
-                                                 uint32_t field);
+ngx_protobuf_value_t *ngx_protobuf_get_extension(
+    ngx_protobuf_extensions_t *extensions,
+    uint32_t field);
 
-ngx_int_t ngx_protobuf_set_extension(ngx_rbtree_t **extensions,
-                                     ngx_rbtree_t *registry,
+ngx_int_t ngx_protobuf_set_extension(ngx_protobuf_extensions_t *extensions,
+                                     ngx_protobuf_registry_t *registry,
                                      uint32_t field,
                                      ngx_protobuf_value_t *value,
                                      ngx_pool_t *pool);
 
-ngx_int_t ngx_protobuf_add_extension(ngx_rbtree_t **extensions,
-                                     ngx_rbtree_t *registry,
+ngx_int_t ngx_protobuf_add_extension(ngx_protobuf_extensions_t *extensions,
+                                     ngx_protobuf_registry_t *registry,
                                      uint32_t field,
                                      void **ptr,
                                      ngx_pool_t *pool);
 
-void ngx_protobuf_clear_extension(ngx_rbtree_t *extensions,
+void ngx_protobuf_clear_extension(ngx_protobuf_extensions_t *extensions,
                                   uint32_t field);
 
 ngx_int_t ngx_protobuf_unpack_extension(uint32_t field,
                                         ngx_protobuf_wiretype_e wire,
                                         ngx_protobuf_context_t *ctx,
-                                        ngx_rbtree_t *registry,
-                                        ngx_rbtree_t **extensions);
+                                        ngx_protobuf_registry_t *registry,
+                                        ngx_protobuf_extensions_t *ext);
+
+size_t ngx_protobuf_size_extensions(ngx_protobuf_extensions_t *extensions);
 
-size_t ngx_protobuf_size_extensions(ngx_rbtree_t *extensions);
+ngx_int_t ngx_protobuf_extensions_clean(
+    ngx_protobuf_extensions_t *extensions);
 
-ngx_int_t ngx_protobuf_pack_extensions(ngx_rbtree_t *extensions,
+ngx_int_t ngx_protobuf_pack_extensions(ngx_protobuf_extensions_t *extensions,
                                        uint32_t lower,
                                        uint32_t upper,
                                        ngx_protobuf_context_t *ctx);
@@ -765,4 +1556,145 @@ size_t ngx_protobuf_size_unknown_field(ngx_protobuf_unknown_field_t *field);
 ngx_int_t ngx_protobuf_pack_unknown_field(ngx_protobuf_unknown_field_t *field,
 					  ngx_protobuf_context_t *ctx);
 
+ngx_int_t ngx_protobuf_pack_extensions_reverse(
+    ngx_protobuf_extensions_t *extensions,
+    uint32_t lower,
+    uint32_t upper,
+    ngx_protobuf_context_t *ctx);
+
+ngx_int_t ngx_protobuf_pack_unknown_reverse(ngx_array_t *unknown,
+                                            ngx_protobuf_context_t *ctx);
+
+ngx_int_t ngx_protobuf_unpack_unknown_span(u_char *start,
+                                           uint32_t field,
+                                           ngx_protobuf_wiretype_e wire,
+                                           ngx_protobuf_context_t *ctx,
+                                           ngx_array_t **unknown);
+
+ngx_int_t ngx_protobuf_copy_unknown_spans(ngx_array_t *unknown,
+                                          ngx_pool_t *pool);
+
+size_t ngx_protobuf_size_unknown_spans(ngx_array_t *unknown);
+
+ngx_int_t ngx_protobuf_pack_unknown_spans(ngx_array_t *unknown,
+                                          ngx_protobuf_context_t *ctx);
+
+ngx_int_t ngx_protobuf_pack_unknown_spans_reverse(ngx_array_t *unknown,
+                                                  ngx_protobuf_context_t *ctx);
+
+ngx_shm_zone_t *ngx_protobuf_shm_add(ngx_conf_t *cf,
+                                     ngx_str_t *name,
+                                     size_t size,
+                                     void *tag);
+
+ngx_int_t ngx_protobuf_shm_publish(ngx_shm_zone_t *zone,
+                                   void *obj,
+                                   ngx_protobuf_size_pt size,
+                                   ngx_protobuf_pack_pt pack);
+
+void *ngx_protobuf_shm_view(ngx_shm_zone_t *zone,
+                            size_t width,
+                            const void *defaults,
+                            ngx_protobuf_unpack_pt unpack,
+                            ngx_pool_t *pool);
+
+void ngx_protobuf_view_init(ngx_protobuf_view_t *view,
+                            u_char *start,
+                            u_char *last,
+                            ngx_pool_t *pool);
+
+ngx_protobuf_message_descriptor_t *ngx_protobuf_find_message(
+    ngx_str_t *name);
+
+ngx_protobuf_method_descriptor_t *ngx_protobuf_find_method(
+    ngx_str_t *path);
+
+ngx_int_t ngx_protobuf_rpc_unpack(ngx_protobuf_rpc_t *rpc,
+                                  ngx_str_t *request,
+                                  void *obj,
+                                  ngx_protobuf_unpack_pt unpack);
+
+ngx_int_t ngx_protobuf_rpc_send(ngx_protobuf_rpc_t *rpc,
+                                void *obj,
+                                ngx_protobuf_size_pt size,
+                                ngx_protobuf_pack_pt pack);
+
+void ngx_protobuf_rpc_finish(ngx_protobuf_rpc_t *rpc);
+
+void ngx_protobuf_rpc_cancel(ngx_protobuf_rpc_t *rpc);
+
+void ngx_protobuf_rpc_ready(ngx_protobuf_rpc_t *rpc);
+
+ngx_uint_t ngx_protobuf_field_slot(ngx_protobuf_message_descriptor_t *desc,
+                                   uint32_t field);
+
+ngx_protobuf_field_descriptor_t *ngx_protobuf_find_field(
+    ngx_protobuf_message_descriptor_t *desc,
+    uint32_t number);
+
+ngx_int_t ngx_protobuf_resolve_path(ngx_protobuf_path_t *pp);
+
+ngx_str_t *ngx_protobuf_enum_name(ngx_protobuf_enum_descriptor_t *desc,
+                                  int32_t number);
+
+u_char *ngx_protobuf_base64_encode(u_char *dst, u_char *src, size_t len);
+
+u_char *ngx_protobuf_base64_decode(u_char *dst, u_char *src, size_t len);
+
+ngx_int_t ngx_protobuf_read_chain(ngx_chain_t *in, ngx_pool_t *pool,
+                                  ngx_protobuf_chunk_pt handler,
+                                  void *data);
+
+uint32_t ngx_protobuf_json_hash(u_char *name, size_t len, uint32_t seed);
+
+ngx_int_t ngx_protobuf_json_lookup(ngx_protobuf_json_names_t *names,
+                                   u_char *name,
+                                   size_t len);
+
+ngx_int_t ngx_protobuf_json_init(ngx_protobuf_json_t *json,
+                                 ngx_protobuf_message_descriptor_t *desc,
+                                 size_t size,
+                                 ngx_pool_t *pool);
+
+ngx_int_t ngx_protobuf_json_parse(ngx_protobuf_json_t *json,
+                                  u_char *pos,
+                                  u_char *last);
+
+ngx_int_t ngx_protobuf_json_finish(ngx_protobuf_json_t *json,
+                                   ngx_str_t *out);
+
+ngx_int_t ngx_protobuf_format_value(ngx_protobuf_field_descriptor_t *field,
+                                    u_char *pos,
+                                    u_char *end,
+                                    ngx_pool_t *pool,
+                                    ngx_str_t *text);
+
+u_char *ngx_protobuf_parse_value(ngx_protobuf_field_descriptor_t *field,
+                                 ngx_str_t *text,
+                                 u_char *buf);
+
+ngx_int_t ngx_protobuf_build_index(ngx_protobuf_message_descriptor_t *desc,
+                                   u_char *start,
+                                   u_char *last,
+                                   ngx_pool_t *pool,
+                                   ngx_protobuf_index_t **index);
+
+ngx_int_t ngx_protobuf_view_find(ngx_protobuf_view_t *view,
+                                 ngx_protobuf_message_descriptor_t *desc,
+                                 ngx_uint_t slot,
+                                 u_char **pos);
+
+ngx_int_t ngx_protobuf_view_next(ngx_protobuf_view_t *view,
+                                 ngx_protobuf_message_descriptor_t *desc,
+                                 ngx_uint_t slot,
+                                 ngx_protobuf_view_iter_t *iter,
+                                 u_char **pos);
+
+ngx_int_t ngx_protobuf_patch_field(ngx_protobuf_patch_t *patch,
+                                   uint32_t field,
+                                   uint32_t wire,
+                                   u_char *data,
+                                   size_t len,
+                                   ngx_uint_t append);
+
 #endif /* _NGX_PROTOBUF_H_INCLUDED_ */
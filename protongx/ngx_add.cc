@@ -31,6 +31,7 @@ Generator::GenerateAdd(const Descriptor* desc, io::Printer& printer)
     if (field->is_repeated()) {
       vars["field"] = FieldRealType(field);
       vars["fname"] = field->name();
+      PresenceVars(field, vars);
 
       printer.Print(vars,
                     "$field$ *\n"
@@ -47,8 +48,14 @@ Generator::GenerateAdd(const Descriptor* desc, io::Printer& printer)
                     "    sizeof($field$));\n"
                     "if (ret != NULL) {\n");
       Indent(printer);
+      if (field->type() == FieldDescriptor::TYPE_MESSAGE &&
+          HasDefaultValues(field->message_type())) {
+        printer.Print("$froot$__clear(ret);\n",
+                      "froot", TypedefRoot(field->message_type()->full_name()));
+      }
       printer.Print(vars,
-                    "obj->__has_$fname$ = 1;\n");
+                    "$sethas$;\n"
+                    "obj->__dirty = 1;\n");
       Outdent(printer);
       printer.Print("}\n"
                     "\n"
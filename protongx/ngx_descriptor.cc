@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <set>
+
 #include <ngx_generator.h>
 #include <google/protobuf/descriptor.pb.h>
 
@@ -6,6 +9,85 @@ namespace protobuf {
 namespace compiler {
 namespace nginx {
 
+// enum values are listed in number order, so that names can be looked
+// up by binary search.  aliases share a number; the first name is used.
+
+struct EnumValueSorter {
+  bool operator()(const EnumValueDescriptor *left,
+                  const EnumValueDescriptor *right) const
+  {
+    return (left->number() < right->number());
+  }
+};
+
+void
+Generator::GenerateEnumDescriptor(const EnumDescriptor *desc,
+                                  io::Printer& printer)
+{
+  std::vector<const EnumValueDescriptor *> values;
+
+  for (int i = 0; i < desc->value_count(); ++i) {
+    const EnumValueDescriptor *value = desc->value(i);
+
+    if (desc->FindValueByNumber(value->number()) == value) {
+      values.push_back(value);
+    }
+  }
+
+  std::stable_sort(values.begin(), values.end(), EnumValueSorter());
+
+  std::map<std::string, std::string> vars;
+
+  vars["name"] = desc->full_name();
+  vars["root"] = TypedefRoot(desc->full_name());
+  vars["nvalues"] = Number(values.size());
+
+  printer.Print(vars,
+                "/* $name$ enum descriptor */\n"
+                "\n"
+                "static ngx_protobuf_enum_value_t $root$__values[] = {\n");
+  Indent(printer);
+  for (size_t i = 0; i < values.size(); ++i) {
+    printer.Print("{ $number$, ngx_string(\"$vname$\") }$comma$\n",
+                  "number", Number(values[i]->number()),
+                  "vname", values[i]->name(),
+                  "comma", (i + 1 < values.size()) ? "," : "");
+  }
+  Outdent(printer);
+  printer.Print("};\n"
+                "\n");
+
+  // every name, aliases included, is looked up to its value's position
+
+  std::vector<std::pair<std::string, int> > names;
+
+  for (int i = 0; i < desc->value_count(); ++i) {
+    const EnumValueDescriptor *value = desc->value(i);
+    const EnumValueDescriptor *first;
+
+    first = desc->FindValueByNumber(value->number());
+
+    names.push_back(std::make_pair(value->name(),
+                                   std::find(values.begin(), values.end(),
+                                             first) - values.begin()));
+  }
+
+  vars["json"] = GenerateJsonNames(vars["root"], names, printer);
+
+  printer.Print(vars,
+                "ngx_protobuf_enum_descriptor_t\n"
+                "$root$__descriptor = {\n");
+  Indent(printer);
+  printer.Print(vars,
+                "ngx_string(\"$name$\"),\n"
+                "$nvalues$,\n"
+                "$root$__values,\n"
+                "$json$\n");
+  Outdent(printer);
+  printer.Print("};\n"
+                "\n");
+}
+
 void
 Generator::GenerateFieldDescriptor(const FieldDescriptor *field,
                                    io::Printer& printer)
@@ -42,10 +124,41 @@ Generator::GenerateFieldDescriptor(const FieldDescriptor *field,
     vars["pack"] = froot + "__pack";
     vars["unpack"] = froot + "__unpack";
     vars["size"] = froot + "__size";
+
+    vars["message"] = "&" + froot + "__descriptor";
+
+    if (HasDefaultValues(field->message_type())) {
+      vars["defaults"] = "&" + froot + "__default";
+    } else {
+      vars["defaults"] = "NULL";
+    }
   } else {
     vars["pack"] = "NULL";
     vars["unpack"] = "NULL";
     vars["size"] = "NULL";
+    vars["defaults"] = "NULL";
+    vars["message"] = "NULL";
+  }
+
+  if (field->type() == FieldDescriptor::TYPE_ENUM) {
+    vars["enum"] = "&" + TypedefRoot(field->enum_type()->full_name()) +
+      "__descriptor";
+  } else {
+    vars["enum"] = "NULL";
+  }
+
+  vars["jname"] = field->json_name();
+
+  if (field->is_extension()) {
+    GenerateExtensionValueMethods(field, printer);
+
+    vars["unpack_value"] = type + "_" + name + "__unpack_value";
+    vars["size_field"] = type + "_" + name + "__size_field";
+    vars["pack_field"] = type + "_" + name + "__pack_field";
+  } else {
+    vars["unpack_value"] = "NULL";
+    vars["size_field"] = "NULL";
+    vars["pack_field"] = "NULL";
   }
 
   printer.Print(vars,
@@ -65,7 +178,14 @@ Generator::GenerateFieldDescriptor(const FieldDescriptor *field,
                 "(ngx_protobuf_unpack_pt)\n"
                 "$unpack$,\n"
                 "(ngx_protobuf_size_pt)\n"
-                "$size$\n");
+                "$size$,\n"
+                "$defaults$,\n"
+                "$unpack_value$,\n"
+                "$size_field$,\n"
+                "$pack_field$,\n"
+                "$message$,\n"
+                "$enum$,\n"
+                "ngx_string(\"$jname$\")\n");
   Outdent(printer);
   printer.Print("};\n"
                 "\n");
@@ -79,6 +199,10 @@ Generator::GenerateDescriptors(const Descriptor *desc,
     GenerateDescriptors(desc->nested_type(i), printer);
   }
 
+  for (int i = 0; i < desc->enum_type_count(); ++i) {
+    GenerateEnumDescriptor(desc->enum_type(i), printer);
+  }
+
   printer.Print("/* $type$ field descriptors */\n"
                 "\n",
                 "type", desc->full_name());
@@ -97,7 +221,122 @@ Generator::GenerateDescriptors(const Descriptor *desc,
     }
   }
 
-  // TODO: generate message descriptor
+  // the message descriptor lists the fields in field number order,
+  // which is the order in which field indexes assign their slots.
+
+  std::vector<const FieldDescriptor *> fields;
+
+  for (int i = 0; i < desc->field_count(); ++i) {
+    fields.push_back(desc->field(i));
+  }
+
+  std::sort(fields.begin(), fields.end(), FieldDescriptorSorter());
+
+  std::map<std::string, std::string> vars;
+
+  vars["name"] = desc->full_name();
+  vars["root"] = TypedefRoot(desc->full_name());
+  vars["nfields"] = Number(fields.size());
+
+  printer.Print(vars,
+                "/* $name$ message descriptor */\n"
+                "\n");
+
+  if (!fields.empty()) {
+    printer.Print(vars,
+                  "static ngx_protobuf_field_descriptor_t *"
+                  "$root$__fields[] = {\n");
+    Indent(printer);
+    for (size_t i = 0; i < fields.size(); ++i) {
+      printer.Print("&$type$_$fname$$comma$\n",
+                    "type", vars["root"],
+                    "fname", fields[i]->name(),
+                    "comma", (i + 1 < fields.size()) ? "," : "");
+    }
+    Outdent(printer);
+    printer.Print("};\n"
+                  "\n");
+    vars["fields"] = vars["root"] + "__fields";
+  } else {
+    vars["fields"] = "NULL";
+  }
+
+  // JSON parsers accept the original field names as well as the JSON
+  // names; where the two collide, the JSON name wins.
+
+  std::vector<std::pair<std::string, int> > names;
+  std::set<std::string> seen;
+
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t i = 0; i < fields.size(); ++i) {
+      std::string name(pass ? fields[i]->name() : fields[i]->json_name());
+
+      if (seen.insert(name).second) {
+        names.push_back(std::make_pair(name, (int) i));
+      }
+    }
+  }
+
+  vars["json"] = GenerateJsonNames(vars["root"], names, printer);
+
+  printer.Print(vars,
+                "ngx_protobuf_message_descriptor_t\n"
+                "$root$__descriptor = {\n");
+  Indent(printer);
+  printer.Print(vars,
+                "ngx_string(\"$name$\"),\n"
+                "$nfields$,\n"
+                "$fields$,\n"
+                "$json$\n");
+  Outdent(printer);
+  printer.Print("};\n"
+                "\n");
+
+  if (HasDefaultValues(desc)) {
+    GenerateDefaultInstance(desc, printer);
+  }
+}
+
+void
+Generator::GenerateDefaultInstance(const Descriptor *desc,
+                                   io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+  bool first = true;
+
+  vars["name"] = desc->full_name();
+  vars["root"] = TypedefRoot(desc->full_name());
+  vars["type"] = StructType(desc->full_name());
+
+  // only the fields with a default are named; the compiler zeroes
+  // every other member, and designated initializers keep -W quiet
+  // about the members that are left out.
+
+  printer.Print(vars,
+                "/* $name$ default instance */\n"
+                "\n"
+                "const $type$\n"
+                "$root$__default = {\n");
+  Indent(printer);
+  for (int i = 0; i < desc->field_count(); ++i) {
+    const FieldDescriptor *field = desc->field(i);
+
+    if (!HasDefaultValue(field)) {
+      continue;
+    }
+
+    if (!first) {
+      printer.Print(",\n");
+    }
+    printer.Print(".$fname$ = $value$",
+                  "fname", field->name(),
+                  "value", DefaultValue(field));
+    first = false;
+  }
+  printer.Print("\n");
+  Outdent(printer);
+  printer.Print("};\n"
+                "\n");
 }
 
 } // namespace nginx
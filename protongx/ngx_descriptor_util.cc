@@ -6,12 +6,30 @@ namespace protobuf {
 namespace compiler {
 namespace nginx {
 
+// set from the generator parameter for the current run
+
+static bool raw_unknown = false;
+
+void
+Generator::SetRawUnknown(bool raw)
+{
+  raw_unknown = raw;
+}
+
 bool
 Generator::HasUnknownFields(const Descriptor *desc)
 {
   return (desc->file()->options().optimize_for() != FileOptions::LITE_RUNTIME);
 }
 
+// unknown fields are kept as spans of the raw input
+
+bool
+Generator::HasRawUnknown(const Descriptor *desc)
+{
+  return (raw_unknown && HasUnknownFields(desc));
+}
+
 bool
 Generator::HasExtensionFields(const Descriptor *desc)
 {
@@ -24,6 +42,18 @@ Generator::HasExtensionFields(const Descriptor *desc)
   return false;
 }
 
+bool
+Generator::HasDefaultValues(const Descriptor *desc)
+{
+  for (int i = 0; i < desc->field_count(); ++i) {
+    if (HasDefaultValue(desc->field(i))) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
 } // namespace nginx
 } // namespace compiler
 } // namespace protobuf
@@ -25,13 +25,13 @@ Generator::GenerateExtendeeDecls(const Descriptor *desc,
                 "    ngx_cycle_t *cycle);\n"
                 "\n"
                 "ngx_int_t $root$__set_extension(\n"
-                "    ngx_rbtree_t **extensions,\n"
+                "    ngx_protobuf_extensions_t *extensions,\n"
                 "    uint32_t field,\n"
                 "    ngx_protobuf_value_t *val,\n"
                 "    ngx_pool_t *pool);\n"
                 "\n"
                 "void *$root$__add_extension(\n"
-                "    ngx_rbtree_t **extensions,\n"
+                "    ngx_protobuf_extensions_t *extensions,\n"
                 "    uint32_t field,\n"
                 "    ngx_pool_t *pool);\n"
                 "\n",
@@ -70,14 +70,14 @@ Generator::GenerateExtendeeMethods(const Descriptor *desc,
 
   printer.Print("ngx_int_t\n"
                 "$root$__set_extension(\n"
-                "    ngx_rbtree_t **extensions,\n"
+                "    ngx_protobuf_extensions_t *extensions,\n"
                 "    uint32_t field,\n"
                 "    ngx_protobuf_value_t *val,\n"
                 "    ngx_pool_t *pool)\n",
                 "root", root);
   OpenBrace(printer);
   printer.Print("return ngx_protobuf_set_extension(extensions,\n"
-                "    $root$__extensions,\n"
+                "    &$root$__extensions,\n"
                 "    field, val, pool);\n",
                 "root", root);
   CloseBrace(printer);
@@ -87,7 +87,7 @@ Generator::GenerateExtendeeMethods(const Descriptor *desc,
 
   printer.Print("void *\n"
                 "$root$__add_extension(\n"
-                "    ngx_rbtree_t **extensions,\n"
+                "    ngx_protobuf_extensions_t *extensions,\n"
                 "    uint32_t field,\n"
                 "    ngx_pool_t *pool)\n",
                 "root", root);
@@ -95,7 +95,7 @@ Generator::GenerateExtendeeMethods(const Descriptor *desc,
   printer.Print("void *val = NULL;\n"
                 "\n"
                 "ngx_protobuf_add_extension(extensions,\n"
-                "    $root$__extensions,\n"
+                "    &$root$__extensions,\n"
                 "    field, &val, pool);\n"
                 "\n"
                 "return val;\n",
@@ -127,12 +127,13 @@ Generator::GenerateExtensionFieldDecls(const FieldDescriptor *field,
 
   printer.Print(vars,
                 "#define $mtype$__has_$name$(obj) \\\n"
-                "    (ngx_protobuf_get_extension(obj->__extensions, $fnum$) "
+                "    (ngx_protobuf_get_extension(&(obj)->__extensions, $fnum$) "
                 "!= NULL)\n"
                 "\n"
                 "#define $mtype$__clear_$name$(obj) \\\n"
-                "    ngx_protobuf_clear_extension(obj->__extensions, "
-                "$fnum$);\n"
+                "    ((obj)->__dirty = 1, \\\n"
+                "     ngx_protobuf_clear_extension(&(obj)->__extensions, "
+                "$fnum$))\n"
                 "\n"
                 "$stype$$space$$mtype$__get_$name$(\n"
                 "    $mtype$_t *obj);\n"
@@ -190,21 +191,16 @@ Generator::GenerateExtensionFieldMethods(const FieldDescriptor *field,
   printer.Print(vars,
                 "ngx_protobuf_value_t *val;\n"
                 "\n"
-                "val = ngx_protobuf_get_extension(obj->__extensions, "
+                "val = ngx_protobuf_get_extension(&obj->__extensions, "
                 "$fnum$);\n");
-  FullSimpleIf(printer, vars,
-               "val == NULL || !val->exists",
-               "return NULL;");
-
-  printer.Print("\n");
 
   if (primitive) {
     FullSimpleIf(printer, vars,
-                 "val->type != $dtype$",
+                 "val == NULL || !val->exists || val->type != $dtype$",
                  "return 0;");
   } else {
     FullSimpleIf(printer, vars,
-                 "val->type != $dtype$",
+                 "val == NULL || !val->exists || val->type != $dtype$",
                  "return NULL;");
   }
 
@@ -212,27 +208,11 @@ Generator::GenerateExtensionFieldMethods(const FieldDescriptor *field,
 
   if (field->is_repeated()) {
     rval = "val->u.v_repeated";
+  } else if (field->type() == FieldDescriptor::TYPE_BYTES ||
+             field->type() == FieldDescriptor::TYPE_STRING) {
+    rval = "&val->u.v_bytes";
   } else {
-    switch (field->type()) {
-    case FieldDescriptor::TYPE_MESSAGE:   rval = "val->u.v_message"; break;
-    case FieldDescriptor::TYPE_BYTES:
-    case FieldDescriptor::TYPE_STRING:    rval = "&val->u.v_bytes";  break;
-    case FieldDescriptor::TYPE_BOOL:
-    case FieldDescriptor::TYPE_ENUM:
-    case FieldDescriptor::TYPE_UINT32:
-    case FieldDescriptor::TYPE_FIXED32:   rval = "val->u.v_uint32";  break;
-    case FieldDescriptor::TYPE_INT32:
-    case FieldDescriptor::TYPE_SINT32:
-    case FieldDescriptor::TYPE_SFIXED32:  rval = "val->u.v_int32";   break;
-    case FieldDescriptor::TYPE_UINT64:
-    case FieldDescriptor::TYPE_FIXED64:   rval = "val->u.v_uint64";  break;
-    case FieldDescriptor::TYPE_INT64:
-    case FieldDescriptor::TYPE_SINT64:
-    case FieldDescriptor::TYPE_SFIXED64:  rval = "val->u.v_int64";   break;
-    case FieldDescriptor::TYPE_FLOAT:     rval = "val->u.v_float";   break;
-    case FieldDescriptor::TYPE_DOUBLE:    rval = "val->u.v_double";  break;
-    default:                              rval = "FIXME";            break;
-    }
+    rval = "val->u." + ExtensionValueMember(field);
   }
 
   printer.Print("\n"
@@ -272,10 +252,14 @@ Generator::GenerateExtensionFieldMethods(const FieldDescriptor *field,
     printer.Print("val.exists = 0;\n");
     CloseBrace(printer);
   } else {
-    printer.Print("val.exists = 1;\n");
+    printer.Print("val.u.$member$ = ext;\n"
+                  "val.exists = 1;\n",
+                  "member", ExtensionValueMember(field));
   }
 
   printer.Print(vars,
+                "\n"
+                "obj->__dirty = 1;\n"
                 "\n"
                 "return $mtype$__set_extension(\n"
                 "    &obj->__extensions, $fnum$, &val, pool);\n");
@@ -293,6 +277,8 @@ Generator::GenerateExtensionFieldMethods(const FieldDescriptor *field,
                   "    ngx_pool_t *pool)\n");
     OpenBrace(printer);
     printer.Print(vars,
+                  "obj->__dirty = 1;\n"
+                  "\n"
                   "return $mtype$__add_extension(\n"
                   "    &obj->__extensions, $fnum$, pool);\n");
     CloseBrace(printer);
@@ -0,0 +1,427 @@
+#include <ngx_generator.h>
+#include <google/protobuf/descriptor.pb.h>
+
+namespace google {
+namespace protobuf {
+namespace compiler {
+namespace nginx {
+
+// fixed-width values of 4 and 8 bytes
+
+static bool
+IsFixed32(const FieldDescriptor *field)
+{
+  return (field->type() == FieldDescriptor::TYPE_FIXED32 ||
+          field->type() == FieldDescriptor::TYPE_SFIXED32 ||
+          field->type() == FieldDescriptor::TYPE_FLOAT);
+}
+
+static bool
+IsFixed64(const FieldDescriptor *field)
+{
+  return (field->type() == FieldDescriptor::TYPE_FIXED64 ||
+          field->type() == FieldDescriptor::TYPE_SFIXED64 ||
+          field->type() == FieldDescriptor::TYPE_DOUBLE);
+}
+
+// the read/write method suffix for a scalar extension value
+
+static std::string
+ValueMethod(const FieldDescriptor *field)
+{
+  switch (field->type()) {
+  case FieldDescriptor::TYPE_BYTES:
+  case FieldDescriptor::TYPE_STRING:    return "string";
+  case FieldDescriptor::TYPE_BOOL:
+  case FieldDescriptor::TYPE_ENUM:
+  case FieldDescriptor::TYPE_UINT32:
+  case FieldDescriptor::TYPE_INT32:     return "uint32";
+  case FieldDescriptor::TYPE_SINT32:    return "sint32";
+  case FieldDescriptor::TYPE_UINT64:
+  case FieldDescriptor::TYPE_INT64:     return "uint64";
+  case FieldDescriptor::TYPE_SINT64:    return "sint64";
+  case FieldDescriptor::TYPE_FIXED32:   return "fixed32";
+  case FieldDescriptor::TYPE_SFIXED32:  return "sfixed32";
+  case FieldDescriptor::TYPE_FLOAT:     return "float";
+  case FieldDescriptor::TYPE_FIXED64:   return "fixed64";
+  case FieldDescriptor::TYPE_SFIXED64:  return "sfixed64";
+  case FieldDescriptor::TYPE_DOUBLE:    return "double";
+  default:                              return "FIXME";
+  }
+}
+
+// the argument that writes or sizes the value val
+
+static std::string
+ValueArg(const FieldDescriptor *field, const std::string& val)
+{
+  switch (field->type()) {
+  case FieldDescriptor::TYPE_BYTES:
+  case FieldDescriptor::TYPE_STRING:
+    return "&" + val;
+  case FieldDescriptor::TYPE_BOOL:
+    return "(" + val + " != 0)";
+  default:
+    return val;
+  }
+}
+
+// the size of the untagged value val
+
+static std::string
+ValueSize(const FieldDescriptor *field, const std::string& val)
+{
+  if (IsFixed32(field)) {
+    return "4";
+  } else if (IsFixed64(field)) {
+    return "8";
+  }
+
+  return "ngx_protobuf_size_" + ValueMethod(field) + "(" +
+    ValueArg(field, val) + ")";
+}
+
+// the size of the value val with its tag
+
+static std::string
+FieldSize(const FieldDescriptor *field,
+          const std::string& val,
+          const std::string& fnum)
+{
+  if (IsFixed32(field)) {
+    return "ngx_protobuf_size_fixed32_field(" + fnum + ")";
+  } else if (IsFixed64(field)) {
+    return "ngx_protobuf_size_fixed64_field(" + fnum + ")";
+  }
+
+  return "ngx_protobuf_size_" + ValueMethod(field) + "_field(" +
+    ValueArg(field, val) + ", " + fnum + ")";
+}
+
+void
+Generator::GenerateExtensionUnpackValue(const FieldDescriptor *field,
+                                        io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  vars["xroot"] = TypedefRoot(field->containing_type()->full_name()) +
+    "_" + ExtensionFieldName(field);
+  vars["method"] = ValueMethod(field);
+
+  printer.Print(vars,
+                "static ngx_int_t\n"
+                "$xroot$__unpack_value(void *obj, "
+                "ngx_protobuf_context_t *ctx)\n");
+  OpenBrace(printer);
+
+  switch (field->type()) {
+  case FieldDescriptor::TYPE_MESSAGE:
+    vars["froot"] = TypedefRoot(field->message_type()->full_name());
+    printer.Print(vars,
+                  "u_char     *end = ctx->buffer.last;\n"
+                  "uint32_t    len;\n"
+                  "ngx_int_t   rc;\n"
+                  "\n"
+                  "rc = ngx_protobuf_read_uint32(&ctx->buffer.pos, end, "
+                  "&len);\n");
+    FullSimpleIf(printer, vars, "rc != NGX_OK", "return rc;");
+    printer.Print("\n");
+    FullSimpleIf(printer, vars,
+                 "len > (uint32_t) (end - ctx->buffer.pos)",
+                 "return NGX_ABORT;");
+    printer.Print(vars,
+                  "\n"
+                  "ctx->buffer.last = ctx->buffer.pos + len;\n"
+                  "rc = $froot$__unpack(obj, ctx);\n"
+                  "ctx->buffer.last = end;\n"
+                  "\n"
+                  "return rc;\n");
+    break;
+  case FieldDescriptor::TYPE_BYTES:
+  case FieldDescriptor::TYPE_STRING:
+    printer.Print("return ngx_protobuf_read_string(&ctx->buffer.pos, "
+                  "ctx->buffer.last,\n"
+                  "    obj, ctx->pool);\n");
+    break;
+  case FieldDescriptor::TYPE_BOOL:
+    if (field->is_repeated()) {
+
+      // the elements of a repeated bool are ngx_flag_t, which is wider
+      // than the value that ngx_protobuf_read_bool stores, and val is
+      // only set when the read succeeds.
+
+      printer.Print("uint32_t   val;\n"
+                    "ngx_int_t  rc;\n"
+                    "\n"
+                    "rc = ngx_protobuf_read_bool(&ctx->buffer.pos, "
+                    "ctx->buffer.last, &val);\n");
+      FullSimpleIf(printer, vars, "rc != NGX_OK", "return rc;");
+      printer.Print("\n"
+                    "*(ngx_flag_t *) obj = val;\n"
+                    "\n"
+                    "return NGX_OK;\n");
+    } else {
+      printer.Print("return ngx_protobuf_read_bool(&ctx->buffer.pos, "
+                    "ctx->buffer.last, obj);\n");
+    }
+    break;
+  default:
+    printer.Print(vars,
+                  "return ngx_protobuf_read_$method$(&ctx->buffer.pos, "
+                  "ctx->buffer.last, obj);\n");
+    break;
+  }
+
+  CloseBrace(printer);
+  printer.Print("\n");
+}
+
+void
+Generator::GenerateExtensionSizeField(const FieldDescriptor *field,
+                                      io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+  bool packed = field->is_packable() && field->options().packed();
+  bool fixed = IsFixed32(field) || IsFixed64(field);
+
+  vars["xroot"] = TypedefRoot(field->containing_type()->full_name()) +
+    "_" + ExtensionFieldName(field);
+  vars["fnum"] = Number(field->number());
+  vars["ftype"] = FieldRealType(field);
+
+  if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+    vars["froot"] = TypedefRoot(field->message_type()->full_name());
+  }
+
+  printer.Print(vars,
+                "static size_t\n"
+                "$xroot$__size_field(void *data)\n");
+  OpenBrace(printer);
+
+  if (!field->is_repeated()) {
+    if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+      printer.Print(vars,
+                    "ngx_protobuf_value_t  *value = data;\n"
+                    "size_t                 n;\n"
+                    "\n"
+                    "n = $froot$__size(value->u.v_message);\n"
+                    "\n"
+                    "return ngx_protobuf_size_message_field(n, $fnum$);\n");
+    } else if (fixed) {
+      printer.Print("return $size$;\n",
+                    "size", FieldSize(field, "", vars["fnum"]));
+    } else {
+      std::string member(ExtensionValueMember(field));
+
+      printer.Print("ngx_protobuf_value_t  *value = data;\n"
+                    "\n"
+                    "return $size$;\n",
+                    "size", FieldSize(field, "value->u." + member,
+                                      vars["fnum"]));
+    }
+
+    CloseBrace(printer);
+    printer.Print("\n");
+    return;
+  }
+
+  if (fixed) {
+    vars["width"] = IsFixed32(field) ? "4" : "8";
+    vars["size"] = FieldSize(field, "", vars["fnum"]);
+    printer.Print("ngx_protobuf_value_t  *value = data;\n");
+    if (packed) {
+      printer.Print(vars,
+                    "size_t                 n;\n"
+                    "\n"
+                    "n = value->u.v_repeated->nelts * $width$;\n"
+                    "\n"
+                    "return ngx_protobuf_size_message_field(n, $fnum$);\n");
+    } else {
+      printer.Print(vars,
+                    "\n"
+                    "return value->u.v_repeated->nelts\n"
+                    "    * $size$;\n");
+    }
+
+    CloseBrace(printer);
+    printer.Print("\n");
+    return;
+  }
+
+  vars["vspace"] = Spaces(vars["ftype"].length() < 21 ?
+                          21 - vars["ftype"].length() : 0);
+  printer.Print(vars,
+                "ngx_protobuf_value_t  *value = data;\n"
+                "$ftype$ $vspace$*vals = value->u.v_repeated->elts;\n"
+                "ngx_uint_t             i;\n"
+                "size_t                 n = 0;\n");
+  if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+    printer.Print("size_t                 m;\n");
+  }
+  printer.Print("\n"
+                "for (i = 0; i < value->u.v_repeated->nelts; ++i) {\n");
+  Indent(printer);
+
+  if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+    printer.Print(vars,
+                  "m = $froot$__size(vals + i);\n"
+                  "n += ngx_protobuf_size_message_field(m, $fnum$);\n");
+  } else if (packed) {
+    printer.Print("n += $size$;\n",
+                  "size", ValueSize(field, "vals[i]"));
+  } else {
+    printer.Print("n += $size$;\n",
+                  "size", FieldSize(field, "vals[i]", vars["fnum"]));
+  }
+
+  Outdent(printer);
+  printer.Print("}\n"
+                "\n");
+
+  if (packed) {
+    printer.Print(vars,
+                  "return ngx_protobuf_size_message_field(n, $fnum$);\n");
+  } else {
+    printer.Print("return n;\n");
+  }
+
+  CloseBrace(printer);
+  printer.Print("\n");
+}
+
+void
+Generator::GenerateExtensionPackField(const FieldDescriptor *field,
+                                      io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+  bool packed = field->is_packable() && field->options().packed();
+
+  vars["xroot"] = TypedefRoot(field->containing_type()->full_name()) +
+    "_" + ExtensionFieldName(field);
+  vars["fnum"] = Number(field->number());
+  vars["ftype"] = FieldRealType(field);
+  vars["method"] = ValueMethod(field);
+
+  if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+    vars["froot"] = TypedefRoot(field->message_type()->full_name());
+  }
+
+  printer.Print(vars,
+                "static ngx_int_t\n"
+                "$xroot$__pack_field(void *data, "
+                "ngx_protobuf_context_t *ctx)\n");
+  OpenBrace(printer);
+
+  if (!field->is_repeated()) {
+    if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+      printer.Print(vars,
+                    "ngx_protobuf_value_t  *value = data;\n"
+                    "size_t                 n;\n"
+                    "\n"
+                    "n = $froot$__size(value->u.v_message);\n"
+                    "ctx->buffer.pos = ngx_protobuf_write_message_header(\n"
+                    "    ctx->buffer.pos, n, $fnum$);\n"
+                    "\n"
+                    "return $froot$__pack(value->u.v_message, ctx);\n");
+    } else {
+      std::string member(ExtensionValueMember(field));
+
+      vars["val"] = ValueArg(field, "value->u." + member);
+      printer.Print(vars,
+                    "ngx_protobuf_value_t  *value = data;\n"
+                    "\n"
+                    "ctx->buffer.pos = ngx_protobuf_write_$method$_field(\n"
+                    "    ctx->buffer.pos, $val$, $fnum$);\n"
+                    "\n"
+                    "return NGX_OK;\n");
+    }
+
+    CloseBrace(printer);
+    printer.Print("\n");
+    return;
+  }
+
+  vars["vspace"] = Spaces(vars["ftype"].length() < 21 ?
+                          21 - vars["ftype"].length() : 0);
+  vars["val"] = ValueArg(field, "vals[i]");
+  printer.Print(vars,
+                "ngx_protobuf_value_t  *value = data;\n"
+                "$ftype$ $vspace$*vals = value->u.v_repeated->elts;\n"
+                "ngx_uint_t             i;\n");
+
+  if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+    printer.Print("size_t                 n;\n"
+                  "ngx_int_t              rc;\n"
+                  "\n");
+    printer.Print(vars,
+                  "for (i = 0; i < value->u.v_repeated->nelts; ++i) {\n");
+    Indent(printer);
+    printer.Print(vars,
+                  "n = $froot$__size(vals + i);\n"
+                  "ctx->buffer.pos = ngx_protobuf_write_message_header(\n"
+                  "    ctx->buffer.pos, n, $fnum$);\n"
+                  "rc = $froot$__pack(vals + i, ctx);\n");
+    FullSimpleIf(printer, vars, "rc != NGX_OK", "return rc;");
+    Outdent(printer);
+    printer.Print("}\n");
+  } else if (packed) {
+
+    // the elements share a single header and are written untagged
+
+    printer.Print("size_t                 n = 0;\n"
+                  "\n");
+    if (IsFixed32(field) || IsFixed64(field)) {
+      printer.Print("n = value->u.v_repeated->nelts * $width$;\n",
+                    "width", IsFixed32(field) ? "4" : "8");
+    } else {
+      printer.Print("for (i = 0; i < value->u.v_repeated->nelts; ++i) {\n");
+      Indent(printer);
+      printer.Print("n += $size$;\n",
+                    "size", ValueSize(field, "vals[i]"));
+      Outdent(printer);
+      printer.Print("}\n");
+    }
+    printer.Print(vars,
+                  "\n"
+                  "ctx->buffer.pos = ngx_protobuf_write_message_header(\n"
+                  "    ctx->buffer.pos, n, $fnum$);\n"
+                  "\n"
+                  "for (i = 0; i < value->u.v_repeated->nelts; ++i) {\n");
+    Indent(printer);
+    printer.Print(vars,
+                  "ctx->buffer.pos = ngx_protobuf_write_$method$(\n"
+                  "    ctx->buffer.pos, $val$);\n");
+    Outdent(printer);
+    printer.Print("}\n");
+  } else {
+    printer.Print(vars,
+                  "\n"
+                  "for (i = 0; i < value->u.v_repeated->nelts; ++i) {\n");
+    Indent(printer);
+    printer.Print(vars,
+                  "ctx->buffer.pos = ngx_protobuf_write_$method$_field(\n"
+                  "    ctx->buffer.pos, $val$, $fnum$);\n");
+    Outdent(printer);
+    printer.Print("}\n");
+  }
+
+  printer.Print("\n"
+                "return NGX_OK;\n");
+
+  CloseBrace(printer);
+  printer.Print("\n");
+}
+
+void
+Generator::GenerateExtensionValueMethods(const FieldDescriptor *field,
+                                         io::Printer& printer)
+{
+  GenerateExtensionUnpackValue(field, printer);
+  GenerateExtensionSizeField(field, printer);
+  GenerateExtensionPackField(field, printer);
+}
+
+} // namespace nginx
+} // namespace compiler
+} // namespace protobuf
+} // namespace google
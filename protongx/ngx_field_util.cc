@@ -1,4 +1,8 @@
+#include <limits>
+#include <sstream>
+
 #include <ngx_generator.h>
+#include <google/protobuf/stubs/strutil.h>
 
 namespace google {
 namespace protobuf {
@@ -197,6 +201,33 @@ Generator::IsFixedWidth(const FieldDescriptor *field)
   return fixed;
 }
 
+// the member of ngx_protobuf_value_t that holds a singular extension
+
+std::string
+Generator::ExtensionValueMember(const FieldDescriptor *field)
+{
+  switch (field->type()) {
+  case FieldDescriptor::TYPE_MESSAGE:   return "v_message";
+  case FieldDescriptor::TYPE_BYTES:
+  case FieldDescriptor::TYPE_STRING:    return "v_bytes";
+  case FieldDescriptor::TYPE_BOOL:
+  case FieldDescriptor::TYPE_ENUM:
+  case FieldDescriptor::TYPE_UINT32:
+  case FieldDescriptor::TYPE_FIXED32:   return "v_uint32";
+  case FieldDescriptor::TYPE_INT32:
+  case FieldDescriptor::TYPE_SINT32:
+  case FieldDescriptor::TYPE_SFIXED32:  return "v_int32";
+  case FieldDescriptor::TYPE_UINT64:
+  case FieldDescriptor::TYPE_FIXED64:   return "v_uint64";
+  case FieldDescriptor::TYPE_INT64:
+  case FieldDescriptor::TYPE_SINT64:
+  case FieldDescriptor::TYPE_SFIXED64:  return "v_int64";
+  case FieldDescriptor::TYPE_FLOAT:     return "v_float";
+  case FieldDescriptor::TYPE_DOUBLE:    return "v_double";
+  default:                              return "FIXME";
+  }
+}
+
 bool
 Generator::FieldIsPointer(const FieldDescriptor *field)
 {
@@ -209,6 +240,108 @@ Generator::FieldIsPointer(const FieldDescriptor *field)
   return false;
 }
 
+bool
+Generator::HasDefaultValue(const FieldDescriptor *field)
+{
+  // only non-zero defaults matter, since everything else is zeroed
+
+  if (field->is_repeated()) {
+    return false;
+  }
+
+  switch (field->cpp_type()) {
+  case FieldDescriptor::CPPTYPE_INT32:
+    return field->default_value_int32() != 0;
+  case FieldDescriptor::CPPTYPE_INT64:
+    return field->default_value_int64() != 0;
+  case FieldDescriptor::CPPTYPE_UINT32:
+    return field->default_value_uint32() != 0;
+  case FieldDescriptor::CPPTYPE_UINT64:
+    return field->default_value_uint64() != 0;
+  case FieldDescriptor::CPPTYPE_DOUBLE:
+    return field->default_value_double() != 0;
+  case FieldDescriptor::CPPTYPE_FLOAT:
+    return field->default_value_float() != 0;
+  case FieldDescriptor::CPPTYPE_BOOL:
+    return field->default_value_bool();
+  case FieldDescriptor::CPPTYPE_ENUM:
+    return field->default_value_enum()->number() != 0;
+  case FieldDescriptor::CPPTYPE_STRING:
+    return !field->default_value_string().empty();
+  default:
+    return false;
+  }
+}
+
+template <typename T>
+static std::string
+FloatLiteral(T value)
+{
+  std::ostringstream os;
+
+  if (value != value) {
+    return "NAN";
+  } else if (value == std::numeric_limits<T>::infinity()) {
+    return "INFINITY";
+  } else if (value == -std::numeric_limits<T>::infinity()) {
+    return "-INFINITY";
+  }
+
+  os.precision(std::numeric_limits<T>::digits10 + 3);
+  os << value;
+
+  return os.str();
+}
+
+std::string
+Generator::DefaultValue(const FieldDescriptor *field)
+{
+  std::ostringstream os;
+
+  switch (field->cpp_type()) {
+  case FieldDescriptor::CPPTYPE_INT32:
+    if (field->default_value_int32() == std::numeric_limits<int32>::min()) {
+      os << "(-2147483647 - 1)";
+    } else {
+      os << field->default_value_int32();
+    }
+    break;
+  case FieldDescriptor::CPPTYPE_INT64:
+    if (field->default_value_int64() == std::numeric_limits<int64>::min()) {
+      os << "(-9223372036854775807LL - 1)";
+    } else {
+      os << field->default_value_int64() << "LL";
+    }
+    break;
+  case FieldDescriptor::CPPTYPE_UINT32:
+    os << field->default_value_uint32() << "U";
+    break;
+  case FieldDescriptor::CPPTYPE_UINT64:
+    os << field->default_value_uint64() << "ULL";
+    break;
+  case FieldDescriptor::CPPTYPE_DOUBLE:
+    os << FloatLiteral(field->default_value_double());
+    break;
+  case FieldDescriptor::CPPTYPE_FLOAT:
+    os << FloatLiteral(field->default_value_float());
+    break;
+  case FieldDescriptor::CPPTYPE_BOOL:
+    os << (field->default_value_bool() ? "1" : "0");
+    break;
+  case FieldDescriptor::CPPTYPE_ENUM:
+    os << EnumValue(field->default_value_enum()->full_name());
+    break;
+  case FieldDescriptor::CPPTYPE_STRING:
+    os << "ngx_string(\"" << CEscape(field->default_value_string()) << "\")";
+    break;
+  default:
+    os << "FIXME";
+    break;
+  }
+
+  return os.str();
+}
+
 } // namespace nginx
 } // namespace compiler
 } // namespace protobuf
@@ -42,12 +42,8 @@ Flags::Flags(const Descriptor *desc) :
     case FieldDescriptor::TYPE_BOOL:     has_bool_    = true; break;
     case FieldDescriptor::TYPE_FLOAT:    has_float_   = true; break;
     case FieldDescriptor::TYPE_DOUBLE:   has_double_  = true; break;
-    case FieldDescriptor::TYPE_INT32:
-    case FieldDescriptor::TYPE_SINT32:
-    case FieldDescriptor::TYPE_SFIXED32: has_int32_   = true; break;
-    case FieldDescriptor::TYPE_INT64:
-    case FieldDescriptor::TYPE_SINT64:
-    case FieldDescriptor::TYPE_SFIXED64: has_int64_   = true; break;
+    case FieldDescriptor::TYPE_SINT32:   has_int32_   = true; break;
+    case FieldDescriptor::TYPE_SINT64:   has_int64_   = true; break;
     default:
       break;
     }
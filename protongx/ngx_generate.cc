@@ -18,6 +18,24 @@ Generator::Generate(const FileDescriptor* file,
   std::string doth(root + ".h");
   std::string conf("config");
 
+  std::vector<std::pair<std::string, std::string> > options;
+
+  ParseGeneratorParameter(parameter, &options);
+
+  SetPresenceWords(false);
+  SetRawUnknown(false);
+
+  for (size_t i = 0; i < options.size(); ++i) {
+    if (options[i].first == "presence_words") {
+      SetPresenceWords(true);
+    } else if (options[i].first == "raw_unknown") {
+      SetRawUnknown(true);
+    } else {
+      *error = "unknown generator option: " + options[i].first;
+      return false;
+    }
+  }
+
   scoped_ptr<io::ZeroCopyOutputStream> source(outdir->Open(root + "/" + dotc));
   scoped_ptr<io::ZeroCopyOutputStream> header(outdir->Open(root + "/" + doth));
   scoped_ptr<io::ZeroCopyOutputStream> config(outdir->Open(root + "/" + conf));
@@ -78,6 +96,10 @@ Generator::Generate(const FileDescriptor* file,
     GenerateMethodDecls(file->message_type(i), hprint);
   }
 
+  for (int i = 0; i < file->service_count(); ++i) {
+    GenerateServiceDecls(file->service(i), hprint);
+  }
+
   if (file->extension_count() > 0) {
     hprint.Print("/* file-level extensions */\n");
 
@@ -97,10 +119,15 @@ Generator::Generate(const FileDescriptor* file,
   sprint.Print(vars,
                "/* Generated by $p$ $v$ - DO NOT EDIT */\n"
                "\n"
+               "#include <math.h>\n"
                "#include <ngx_protobuf.h>\n"
                "#include <$r$/$h$>\n"
                "\n");
 
+  for (int i = 0; i < file->enum_type_count(); ++i) {
+    GenerateEnumDescriptor(file->enum_type(i), sprint);
+  }
+
   for (int i = 0; i < file->message_type_count(); ++i) {
     GenerateDescriptors(file->message_type(i), sprint);
   }
@@ -114,6 +141,10 @@ Generator::Generate(const FileDescriptor* file,
     }
   }
 
+  for (int i = 0; i < file->service_count(); ++i) {
+    GenerateService(file->service(i), sprint);
+  }
+
   GenerateModule(file, sprint);
 
   for (int i = 0; i < file->message_type_count(); ++i) {
@@ -4,6 +4,7 @@
 #define NGX_GENERATOR_H_
 
 #include <string>
+#include <vector>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/io/printer.h>
 #include <google/protobuf/compiler/code_generator.h>
@@ -13,6 +14,21 @@ namespace protobuf {
 namespace compiler {
 namespace nginx {
 
+struct FieldDescriptorSorter {
+  bool operator()(const FieldDescriptor *left,
+                  const FieldDescriptor *right) const
+  {
+    return (left->number() < right->number());
+  }
+};
+
+// variants of the generated unpack methods
+
+enum UnpackVariant {
+  UNPACK_PADDED = 0x01,
+  UNPACK_ALIAS  = 0x02
+};
+
 class Generator : public CodeGenerator {
 public:
   Generator() {}
@@ -34,14 +50,21 @@ private:
                           io::Printer& printer);
 
   // ngx_descriptor.cc
+  static void GenerateEnumDescriptor(const EnumDescriptor *desc,
+                                     io::Printer& printer);
   static void GenerateFieldDescriptor(const FieldDescriptor *field,
                                       io::Printer& printer);
   static void GenerateDescriptors(const Descriptor *desc,
                                   io::Printer& printer);
+  static void GenerateDefaultInstance(const Descriptor *desc,
+                                      io::Printer& printer);
 
   // ngx_descriptor_util.cc
+  static void SetRawUnknown(bool raw);
   static bool HasUnknownFields(const Descriptor *desc);
+  static bool HasRawUnknown(const Descriptor *desc);
   static bool HasExtensionFields(const Descriptor *desc);
+  static bool HasDefaultValues(const Descriptor *desc);
 
   // ngx_extension.cc
   static void GenerateExtendeeDecls(const Descriptor *desc,
@@ -55,6 +78,16 @@ private:
   static void GenerateExtensionMethods(const Descriptor *desc,
                                        io::Printer& printer);
 
+  // ngx_extension_value.cc
+  static void GenerateExtensionUnpackValue(const FieldDescriptor *field,
+                                           io::Printer& printer);
+  static void GenerateExtensionSizeField(const FieldDescriptor *field,
+                                         io::Printer& printer);
+  static void GenerateExtensionPackField(const FieldDescriptor *field,
+                                         io::Printer& printer);
+  static void GenerateExtensionValueMethods(const FieldDescriptor *field,
+                                            io::Printer& printer);
+
   // ngx_field_util.cc
   static std::string ExtensionSetterType(const FieldDescriptor *field,
                                          int *primitive);
@@ -65,12 +98,24 @@ private:
   static std::string Label(const FieldDescriptor *field);
   static std::string Type(const FieldDescriptor *field);
   static bool IsFixedWidth(const FieldDescriptor *field);
+  static std::string ExtensionValueMember(const FieldDescriptor *field);
   static bool FieldIsPointer(const FieldDescriptor *field); 
+  static bool HasDefaultValue(const FieldDescriptor *field);
+  static std::string DefaultValue(const FieldDescriptor *field);
+
+  // ngx_is_clean.cc
+  static void GenerateIsClean(const Descriptor *desc, io::Printer& printer);
 
   // ngx_is_initialized.cc
   static void GenerateIsInitialized(const Descriptor *desc,
 				    io::Printer& printer);
 
+  // ngx_json.cc
+  static std::string GenerateJsonNames(const std::string& root,
+                                       const std::vector<std::pair<std::string,
+                                       int> >& names,
+                                       io::Printer& printer);
+
   // ngx_methods.cc
   static void GenerateMethodDecls(const Descriptor* desc,
                                   io::Printer& printer);
@@ -84,6 +129,8 @@ private:
                                                 io::Printer& printer);
   static int CountMessageExtensions(const Descriptor *desc);
   static int CountExtensions(const FileDescriptor *file);
+  static void GenerateMessageList(const Descriptor *desc,
+                                  io::Printer& printer);
   static void GenerateModule(const FileDescriptor *file,
                              io::Printer& printer);
 
@@ -98,13 +145,45 @@ private:
 
   // ngx_pack.cc
   static void GeneratePackField(const FieldDescriptor *field,
+                                bool check,
                                 io::Printer& printer);
   static void GeneratePackRange(const Descriptor::ExtensionRange *range,
                                 io::Printer& printer);
   static void GeneratePackUnknown(const Descriptor *desc,
 				  io::Printer& printer);
+  static void GeneratePackUnknownSpans(const Descriptor *desc,
+                                       io::Printer& printer);
   static void GeneratePack(const Descriptor* desc, io::Printer& printer);
 
+  // ngx_pack_reverse.cc
+  static void GenerateReverseWrite(const FieldDescriptor *field,
+                                   const char *val,
+                                   bool tagged,
+                                   io::Printer& printer);
+  static void GeneratePackReverseField(const FieldDescriptor *field,
+                                       io::Printer& printer);
+  static void GeneratePackReverseRange(const Descriptor::ExtensionRange *range,
+                                       io::Printer& printer);
+  static void GeneratePackReverse(const Descriptor* desc,
+                                  io::Printer& printer);
+
+  // ngx_presence.cc
+  static void SetPresenceWords(bool words);
+  static bool HasPresenceWords(const Descriptor *desc);
+  static int PresenceWordCount(const Descriptor *desc);
+  static int PresenceBit(const FieldDescriptor *field);
+  static std::string PresenceMask(const FieldDescriptor *field);
+  static std::string PresenceMaskValue(uint32_t mask);
+  static void PresenceVars(const FieldDescriptor *field,
+                           std::map<std::string, std::string>& vars);
+  static void GeneratePresenceBits(const Descriptor *desc,
+                                   io::Printer& printer);
+  static void GeneratePresenceLoop(const Descriptor *desc,
+                                   const std::vector<const FieldDescriptor *>&
+                                   fields,
+                                   bool pack,
+                                   io::Printer& printer);
+
   // ngx_print.cc
   static void Indented(io::Printer& printer,
                        const std::map<std::string, std::string>& vars,
@@ -137,7 +216,26 @@ private:
   static void Indent(io::Printer& printer);
   static void Outdent(io::Printer& printer);
 
+  // ngx_service.cc
+  static void MethodVars(const MethodDescriptor *method,
+                         std::map<std::string, std::string>& vars);
+  static void GenerateServiceDecls(const ServiceDescriptor *service,
+                                   io::Printer& printer);
+  static void GenerateMethodHandler(const MethodDescriptor *method,
+                                    io::Printer& printer);
+  static void GenerateService(const ServiceDescriptor *service,
+                              io::Printer& printer);
+
+  // ngx_shm.cc
+  static void GenerateShmDecls(const Descriptor* desc,
+                               io::Printer& printer);
+  static void GenerateShm(const Descriptor* desc,
+                          io::Printer& printer);
+
   // ngx_size.cc
+  static void GenerateSizeField(const FieldDescriptor *field,
+                                bool check,
+                                io::Printer& printer);
   static void GenerateSize(const Descriptor* desc,
                            io::Printer& printer);
 
@@ -150,8 +248,42 @@ private:
   // ngx_unpack.cc
   static void GenerateUnpackUnknown(const Descriptor *desc,
 				    io::Printer& printer);
+  static void UnpackVariantVars(int variant,
+                                std::map<std::string, std::string>& vars);
+  static void GenerateUnpackVars(const FieldDescriptor *field,
+                                 int variant,
+                                 std::map<std::string, std::string>& vars);
+  static void GenerateUnpackValue(const FieldDescriptor *field,
+                                  int variant,
+                                  io::Printer& printer);
+  static void GenerateUnpackPacked(const FieldDescriptor *field,
+                                   int variant,
+                                   io::Printer& printer);
+  static void GenerateUnpackFastPath(const Descriptor* desc,
+                                     int variant,
+                                     io::Printer& printer);
+  static void GenerateUnpackVariant(const Descriptor* desc,
+                                    int variant,
+                                    io::Printer& printer);
   static void GenerateUnpack(const Descriptor* desc,
                              io::Printer& printer);
+
+  // ngx_view.cc
+  static void GenerateViewDecls(const Descriptor* desc,
+                                io::Printer& printer);
+  static void GenerateViewField(const FieldDescriptor *field,
+                                int slot,
+                                io::Printer& printer);
+  static void GenerateView(const Descriptor* desc,
+                           io::Printer& printer);
+
+  // ngx_patch.cc
+  static void GeneratePatchDecls(const Descriptor* desc,
+                                 io::Printer& printer);
+  static void GeneratePatchField(const FieldDescriptor *field,
+                                 io::Printer& printer);
+  static void GeneratePatch(const Descriptor* desc,
+                            io::Printer& printer);
 };
 
 } // namespace nginx
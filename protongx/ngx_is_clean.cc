@@ -0,0 +1,98 @@
+#include <ngx_generator.h>
+
+namespace google {
+namespace protobuf {
+namespace compiler {
+namespace nginx {
+
+void
+Generator::GenerateIsClean(const Descriptor *desc, io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  vars["root"] = TypedefRoot(desc->full_name());
+  vars["type"] = StructType(desc->full_name());
+
+  printer.Print(vars,
+                "ngx_int_t\n"
+                "$root$__is_clean(\n"
+                "    $type$ *obj)\n");
+  OpenBrace(printer);
+
+  bool repeated = false;
+
+  for (int i = 0; i < desc->field_count(); ++i) {
+    const FieldDescriptor *field = desc->field(i);
+
+    if (field->type() == FieldDescriptor::TYPE_MESSAGE &&
+        field->is_repeated()) {
+      repeated = true;
+      break;
+    }
+  }
+
+  if (repeated) {
+    printer.Print("ngx_uint_t  i;\n"
+                  "\n");
+  }
+
+  FullCuddledIf(printer, vars,
+                "obj->__dirty",
+                "|| obj->__wire.data == NULL",
+                "return 0;");
+
+  // a submessage can be changed through its own mutators, which only
+  // mark the submessage itself, so the whole tree has to be clean.
+
+  for (int i = 0; i < desc->field_count(); ++i) {
+    const FieldDescriptor *field = desc->field(i);
+
+    if (field->type() != FieldDescriptor::TYPE_MESSAGE) {
+      continue;
+    }
+
+    vars["fname"] = field->name();
+    vars["ftype"] = FieldRealType(field);
+    vars["froot"] = TypedefRoot(field->message_type()->full_name());
+
+    printer.Print("\n");
+
+    if (field->is_repeated()) {
+      SimpleIf(printer, vars, "obj->$fname$ != NULL");
+      printer.Print(vars,
+                    "$ftype$ *vals = obj->$fname$->elts;\n"
+                    "\n"
+                    "for (i = 0; i < obj->$fname$->nelts; ++i) ");
+      OpenBrace(printer);
+      FullSimpleIf(printer, vars,
+                   "!$froot$__is_clean(vals + i)",
+                   "return 0;");
+      CloseBrace(printer);
+      CloseBrace(printer);
+    } else {
+      FullCuddledIf(printer, vars,
+                    "obj->$fname$ != NULL",
+                    "&& !$froot$__is_clean(obj->$fname$)",
+                    "return 0;");
+    }
+  }
+
+  if (desc->extension_range_count() > 0) {
+    printer.Print("\n");
+    FullCuddledIf(printer, vars,
+                  "obj->__extensions.nelts > 0",
+                  "&& !ngx_protobuf_extensions_clean(&obj->__extensions)",
+                  "return 0;");
+  }
+
+  printer.Print("\n"
+                "return 1;\n");
+
+  CloseBrace(printer);
+  printer.Print("\n");
+}
+
+} // namespace nginx
+} // namespace compiler
+} // namespace protobuf
+} // namespace google
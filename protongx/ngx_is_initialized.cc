@@ -1,3 +1,5 @@
+#include <vector>
+
 #include <ngx_flags.h>
 #include <ngx_generator.h>
 
@@ -23,7 +25,38 @@ Generator::GenerateIsInitialized(const Descriptor *desc, io::Printer& printer)
 		"    $type$ *obj)\n");
   OpenBrace(printer);
 
-  if (flags.has_required()) {
+  if (flags.has_required() && HasPresenceWords(desc)) {
+    std::vector<uint32_t> masks(PresenceWordCount(desc), 0);
+    int rcnt = 0;
+
+    // compare each word against the mask of its required fields
+
+    for (int i = 0; i < desc->field_count(); ++i) {
+      const FieldDescriptor *field = desc->field(i);
+
+      if (field->is_required()) {
+        int bit = PresenceBit(field);
+
+        masks[bit / 32] |= 1U << (bit % 32);
+      }
+    }
+
+    printer.Print("return (");
+    for (size_t w = 0; w < masks.size(); ++w) {
+      if (masks[w] == 0) {
+        continue;
+      }
+
+      vars["word"] = Number(w);
+      vars["mask"] = PresenceMaskValue(masks[w]);
+
+      if (rcnt++ > 0) {
+	printer.Print("\n    && ");
+      }
+      printer.Print(vars, "(obj->__has[$word$] & $mask$) == $mask$");
+    }
+    printer.Print(");\n");
+  } else if (flags.has_required()) {
     int rcnt = 0;
 
     printer.Print("return (");
@@ -0,0 +1,194 @@
+#include <algorithm>
+
+#include <ngx_generator.h>
+
+namespace google {
+namespace protobuf {
+namespace compiler {
+namespace nginx {
+
+// must match ngx_protobuf_json_hash() in nginx/ngx_protobuf.c
+
+static uint32_t
+JsonHash(const std::string& name, uint32_t seed)
+{
+  uint32_t h = 2166136261U ^ (seed * 0x9e3779b9U);
+
+  for (size_t i = 0; i < name.size(); ++i) {
+    h ^= (unsigned char) name[i];
+    h *= 16777619U;
+  }
+
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+
+  return h;
+}
+
+struct JsonBucketSorter {
+  const std::vector<std::vector<size_t> > *buckets;
+
+  bool operator()(size_t left, size_t right) const
+  {
+    return ((*buckets)[left].size() > (*buckets)[right].size());
+  }
+};
+
+// places the names of a bucket by trying displacements until they all
+// hash to free, distinct slots.  returns the displacement, or 0.
+
+static int32_t
+JsonDisplace(const std::vector<std::pair<std::string, int> >& names,
+             const std::vector<size_t>& bucket,
+             std::vector<int>& slots)
+{
+  size_t n = slots.size();
+
+  for (uint32_t d = 1; d < 0x10000; ++d) {
+    std::vector<size_t> taken;
+    bool ok = true;
+
+    for (size_t i = 0; ok && i < bucket.size(); ++i) {
+      size_t slot = JsonHash(names[bucket[i]].first, d) % n;
+
+      ok = (slots[slot] < 0 &&
+            std::find(taken.begin(), taken.end(), slot) == taken.end());
+      taken.push_back(slot);
+    }
+
+    if (ok) {
+      for (size_t i = 0; i < bucket.size(); ++i) {
+        slots[taken[i]] = bucket[i];
+      }
+      return d;
+    }
+  }
+
+  return 0;
+}
+
+// builds a minimal perfect hash over names: each name hashes with the
+// seed to one of n buckets, and the bucket's displacement either is the
+// slot of its only name (stored as -1 - slot) or seeds a second hash
+// that sends each of its names to a slot of its own.  buckets are
+// placed largest first, while most slots are still free.
+
+static bool
+JsonPerfectHash(const std::vector<std::pair<std::string, int> >& names,
+                uint32_t seed,
+                std::vector<int32_t>& displace,
+                std::vector<int>& slots)
+{
+  size_t n = names.size();
+  std::vector<std::vector<size_t> > buckets(n);
+  std::vector<size_t> order;
+
+  for (size_t i = 0; i < n; ++i) {
+    buckets[JsonHash(names[i].first, seed) % n].push_back(i);
+    order.push_back(i);
+  }
+
+  JsonBucketSorter sorter;
+  sorter.buckets = &buckets;
+
+  std::stable_sort(order.begin(), order.end(), sorter);
+
+  displace.assign(n, 0);
+  slots.assign(n, -1);
+
+  size_t b = 0;
+
+  for (; b < n && buckets[order[b]].size() > 1; ++b) {
+    int32_t d = JsonDisplace(names, buckets[order[b]], slots);
+
+    if (d == 0) {
+      return false;
+    }
+
+    displace[order[b]] = d;
+  }
+
+  size_t slot = 0;
+
+  for (; b < n && buckets[order[b]].size() == 1; ++b) {
+    while (slots[slot] >= 0) {
+      ++slot;
+    }
+
+    slots[slot] = buckets[order[b]][0];
+    displace[order[b]] = -1 - (int32_t) slot;
+  }
+
+  return true;
+}
+
+std::string
+Generator::GenerateJsonNames(const std::string& root,
+                             const std::vector<std::pair<std::string, int> >&
+                             names,
+                             io::Printer& printer)
+{
+  std::vector<int32_t> displace;
+  std::vector<int> slots;
+  uint32_t seed;
+
+  if (names.empty()) {
+    return "{ 0, 0, NULL, NULL }";
+  }
+
+  // a seed that leaves no bucket unplaceable is usually found at once
+
+  seed = 0;
+  while (!JsonPerfectHash(names, seed, displace, slots)) {
+    ++seed;
+  }
+
+  std::map<std::string, std::string> vars;
+
+  vars["root"] = root;
+  vars["n"] = Number(names.size());
+  vars["seed"] = Number(seed);
+
+  printer.Print(vars,
+                "static int32_t $root$__json_displace[] = {\n");
+  Indent(printer);
+  for (size_t i = 0; i < displace.size(); i += 8) {
+    std::string line;
+
+    for (size_t j = i; j < displace.size() && j < i + 8; ++j) {
+      line += Number(displace[j]);
+      if (j + 1 < displace.size()) {
+        line += (j + 1 < i + 8) ? ", " : ",";
+      }
+    }
+
+    printer.Print("$line$\n", "line", line);
+  }
+  Outdent(printer);
+  printer.Print("};\n"
+                "\n");
+
+  printer.Print(vars,
+                "static ngx_protobuf_json_key_t $root$__json_keys[] = {\n");
+  Indent(printer);
+  for (size_t i = 0; i < slots.size(); ++i) {
+    printer.Print("{ ngx_string(\"$name$\"), $index$ }$comma$\n",
+                  "name", names[slots[i]].first,
+                  "index", Number(names[slots[i]].second),
+                  "comma", (i + 1 < slots.size()) ? "," : "");
+  }
+  Outdent(printer);
+  printer.Print("};\n"
+                "\n");
+
+  return "{ " + vars["n"] + ", " + vars["seed"] + ", " +
+    root + "__json_displace, " + root + "__json_keys }";
+}
+
+} // namespace nginx
+} // namespace compiler
+} // namespace protobuf
+} // namespace google
@@ -19,6 +19,12 @@ Generator::GenerateMethodDecls(const Descriptor *desc, io::Printer& printer)
   vars["root"] = TypedefRoot(desc->full_name());
   vars["type"] = StructType(desc->full_name());
 
+  bool words = HasPresenceWords(desc);
+
+  if (words) {
+    GeneratePresenceBits(desc, printer);
+  }
+
   printer.Print(vars,
                 "/* $name$ field methods */\n"
                 "\n");
@@ -29,24 +35,41 @@ Generator::GenerateMethodDecls(const Descriptor *desc, io::Printer& printer)
     vars["field"] = FieldRealType(field);
     vars["fname"] = field->name();
 
+    // with presence words, the accessors take the field's word and bit
+    // in addition to its name.
+
+    if (words) {
+      std::string hword(Number(PresenceBit(field) / 32));
+      std::string hmask(PresenceMask(field));
+
+      vars["bit"] = "_BIT";
+      vars["hargs"] = ", " + hword + ", " + hmask;
+      vars["hasf"] = "NGX_PROTOBUF_HAS_BIT(obj, " + hword + ", " +
+        hmask + ")";
+    } else {
+      vars["bit"] = "";
+      vars["hargs"] = "";
+      vars["hasf"] = "NGX_PROTOBUF_HAS_FIELD(obj, " + field->name() + ")";
+    }
+
     // set
 
     if (field->is_repeated() ||
         field->type() == FieldDescriptor::TYPE_MESSAGE) {
       printer.Print(vars,
                     "#define $root$__set_$fname$(obj, val) \\\n"
-                    "    NGX_PROTOBUF_SET_MEMBER(obj, $fname$, val)\n"
+                    "    NGX_PROTOBUF_SET_MEMBER$bit$(obj, $fname$$hargs$, val)\n"
                     "\n");
     } else if (field->type() == FieldDescriptor::TYPE_BYTES ||
                field->type() == FieldDescriptor::TYPE_STRING) {
       printer.Print(vars,
                     "#define $root$__set_$fname$(obj, val) \\\n"
-                    "    NGX_PROTOBUF_SET_STRING(obj, $fname$, val)\n"
+                    "    NGX_PROTOBUF_SET_STRING$bit$(obj, $fname$$hargs$, val)\n"
                     "\n");
     } else {
       printer.Print(vars,
                     "#define $root$__set_$fname$(obj, val) \\\n"
-                    "    NGX_PROTOBUF_SET_NUMBER(obj, $fname$, val)\n"
+                    "    NGX_PROTOBUF_SET_NUMBER$bit$(obj, $fname$$hargs$, val)\n"
                     "\n");
     }
 
@@ -67,18 +90,24 @@ Generator::GenerateMethodDecls(const Descriptor *desc, io::Printer& printer)
         field->type() == FieldDescriptor::TYPE_MESSAGE) {
       printer.Print(vars,
                     "#define $root$__clear_$fname$(obj) \\\n"
-                    "    NGX_PROTOBUF_CLEAR_MEMBER(obj, $fname$)\n"
+                    "    NGX_PROTOBUF_CLEAR_MEMBER$bit$(obj, $fname$$hargs$)\n"
+                    "\n");
+    } else if (HasDefaultValue(field)) {
+      printer.Print(vars,
+                    "#define $root$__clear_$fname$(obj) \\\n"
+                    "    NGX_PROTOBUF_CLEAR_DEFAULT$bit$(obj, $fname$, "
+                    "$root$__default$hargs$)\n"
                     "\n");
     } else if (field->type() == FieldDescriptor::TYPE_BYTES ||
                field->type() == FieldDescriptor::TYPE_STRING) {
       printer.Print(vars,
                     "#define $root$__clear_$fname$(obj) \\\n"
-                    "    NGX_PROTOBUF_CLEAR_STRING(obj, $fname$)\n"
+                    "    NGX_PROTOBUF_CLEAR_STRING$bit$(obj, $fname$$hargs$)\n"
                     "\n");
     } else {
       printer.Print(vars,
                     "#define $root$__clear_$fname$(obj) \\\n"
-                    "    NGX_PROTOBUF_CLEAR_NUMBER(obj, $fname$)\n"
+                    "    NGX_PROTOBUF_CLEAR_NUMBER$bit$(obj, $fname$$hargs$)\n"
                     "\n");
     }
 
@@ -87,13 +116,33 @@ Generator::GenerateMethodDecls(const Descriptor *desc, io::Printer& printer)
     if (field->is_repeated()) {
       printer.Print(vars,
                     "#define $root$__has_$fname$(obj) \\\n"
-                    "    (NGX_PROTOBUF_HAS_FIELD(obj, $fname$) && \\\n"
+                    "    ($hasf$ && \\\n"
                     "     (obj)->$fname$->nelts > 0)\n"
                     "\n");
     } else {
       printer.Print(vars,
                     "#define $root$__has_$fname$(obj) \\\n"
-                    "    (NGX_PROTOBUF_HAS_FIELD(obj, $fname$))\n"
+                    "    ($hasf$)\n"
+                    "\n");
+    }
+
+    // get (if singular and not a message)
+
+    if (field->is_repeated() ||
+        field->type() == FieldDescriptor::TYPE_MESSAGE) {
+      continue;
+    }
+
+    if (HasDefaultValue(field)) {
+      printer.Print(vars,
+                    "#define $root$__get_$fname$(obj) \\\n"
+                    "    ($hasf$ ? (obj)->$fname$ : \\\n"
+                    "     $root$__default.$fname$)\n"
+                    "\n");
+    } else {
+      printer.Print(vars,
+                    "#define $root$__get_$fname$(obj) \\\n"
+                    "    ((obj)->$fname$)\n"
                     "\n");
     }
   }
@@ -101,28 +150,80 @@ Generator::GenerateMethodDecls(const Descriptor *desc, io::Printer& printer)
   printer.Print(vars,
                 "/* $name$ message methods */\n"
                 "\n"
-                "#define $root$__alloc(pool) \\\n"
-                "    ngx_pcalloc(pool, \\\n"
-                "    sizeof($type$))\n"
-                "\n"
-                "#define $root$__clear(obj) \\\n"
-                "    ngx_memzero(obj, sizeof($type$))\n"
-                "\n"
+                "extern ngx_protobuf_message_descriptor_t $root$__descriptor;\n"
+                "\n");
+
+  // messages with non-zero defaults start out as a copy of their
+  // default instance rather than as zeroed memory.
+
+  if (HasDefaultValues(desc)) {
+    printer.Print(vars,
+                  "extern const $type$ $root$__default;\n"
+                  "\n"
+                  "#define $root$__alloc(pool) \\\n"
+                  "    ngx_protobuf_alloc_default(pool, &$root$__default, \\\n"
+                  "    sizeof($type$))\n"
+                  "\n"
+                  "#define $root$__clear(obj) \\\n"
+                  "    ngx_memcpy(obj, &$root$__default, sizeof($type$))\n"
+                  "\n");
+  } else {
+    printer.Print(vars,
+                  "#define $root$__alloc(pool) \\\n"
+                  "    ngx_pcalloc(pool, \\\n"
+                  "    sizeof($type$))\n"
+                  "\n"
+                  "#define $root$__clear(obj) \\\n"
+                  "    ngx_memzero(obj, sizeof($type$))\n"
+                  "\n");
+  }
+
+  // __touch marks a message whose members were changed directly
+
+  printer.Print(vars,
+                "#define $root$__touch(obj) \\\n"
+                "    ((obj)->__dirty = 1)\n"
+                "\n");
+
+  printer.Print(vars,
 		"ngx_int_t $root$__is_initialized(\n"
 		"    $type$ *obj);\n"
 		"\n"
+                "ngx_int_t $root$__is_clean(\n"
+                "    $type$ *obj);\n"
+                "\n"
                 "ngx_int_t $root$__unpack(\n"
                 "    $type$ *obj,\n"
                 "    ngx_protobuf_context_t *ctx);\n"
                 "\n"
+                "ngx_int_t $root$__unpack_alias(\n"
+                "    $type$ *obj,\n"
+                "    ngx_protobuf_context_t *ctx);\n"
+                "\n"
+                "ngx_int_t $root$__unpack_padded(\n"
+                "    $type$ *obj,\n"
+                "    ngx_protobuf_context_t *ctx);\n"
+                "\n"
+                "ngx_int_t $root$__unpack_padded_alias(\n"
+                "    $type$ *obj,\n"
+                "    ngx_protobuf_context_t *ctx);\n"
+                "\n"
                 "size_t $root$__size(\n"
                 "    $type$ *obj);\n"
                 "\n"
                 "ngx_int_t $root$__pack(\n"
                 "    $type$ *obj,\n"
                 "    ngx_protobuf_context_t *ctx);\n"
+                "\n"
+                "ngx_int_t $root$__pack_reverse(\n"
+                "    $type$ *obj,\n"
+                "    ngx_protobuf_context_t *ctx);\n"
                 "\n");
 
+  GenerateShmDecls(desc, printer);
+  GenerateViewDecls(desc, printer);
+  GeneratePatchDecls(desc, printer);
+
   if (desc->extension_range_count() > 0) {
     GenerateExtendeeDecls(desc, printer);
   }
@@ -144,7 +245,7 @@ Generator::GenerateMethods(const Descriptor* desc, io::Printer& printer)
 
     printer.Print("/* extension registry for $name$ */\n"
                   "\n"
-                  "static ngx_rbtree_t *$root$__extensions = NULL;\n"
+                  "static ngx_protobuf_registry_t $root$__extensions;\n"
                   "\n", "name", desc->full_name(), "root", root);
   }
 
@@ -154,9 +255,28 @@ Generator::GenerateMethods(const Descriptor* desc, io::Printer& printer)
                 "\n", "name", desc->full_name());
 
   GenerateIsInitialized(desc, printer);
+  GenerateIsClean(desc, printer);
   GenerateUnpack(desc, printer);
   GenerateSize(desc, printer);
   GeneratePack(desc, printer);
+  GeneratePackReverse(desc, printer);
+
+  printer.Print("/* $name$ shared memory methods */\n"
+                "\n", "name", desc->full_name());
+
+  GenerateShm(desc, printer);
+
+  if (desc->field_count() > 0) {
+    printer.Print("/* $name$ view accessors */\n"
+                  "\n", "name", desc->full_name());
+
+    GenerateView(desc, printer);
+
+    printer.Print("/* $name$ patch functions */\n"
+                  "\n", "name", desc->full_name());
+
+    GeneratePatch(desc, printer);
+  }
 
   if (desc->extension_range_count() > 0) {
     printer.Print("/* $name$ extendee methods */\n"
@@ -57,6 +57,17 @@ Generator::CountExtensions(const FileDescriptor *file)
   return count + file->extension_count();
 }
 
+void
+Generator::GenerateMessageList(const Descriptor *desc, io::Printer& printer)
+{
+  for (int i = 0; i < desc->nested_type_count(); ++i) {
+    GenerateMessageList(desc->nested_type(i), printer);
+  }
+
+  printer.Print("&$root$__descriptor,\n",
+                "root", TypedefRoot(desc->full_name()));
+}
+
 void
 Generator::GenerateModule(const FileDescriptor *file, io::Printer& printer)
 {
@@ -83,26 +94,61 @@ Generator::GenerateModule(const FileDescriptor *file, io::Printer& printer)
     Outdent(printer);
     printer.Print("}\n"
                   "\n");
+  }
 
-    printer.Print("static ngx_protobuf_module_t\n"
-                  "$root$_module_ctx = {\n",
+  // the message descriptors of the file, which let other modules look
+  // up a message type by name at configuration time.
+
+  printer.Print("static ngx_protobuf_message_descriptor_t *\n"
+                "$root$__messages[] = {\n",
+                "root", root);
+  Indent(printer);
+  for (int i = 0; i < file->message_type_count(); ++i) {
+    GenerateMessageList(file->message_type(i), printer);
+  }
+  printer.Print("NULL\n");
+  Outdent(printer);
+  printer.Print("};\n"
+                "\n");
+
+  // and its services, which the gRPC module looks up by method path
+
+  if (file->service_count() > 0) {
+    printer.Print("static ngx_protobuf_service_descriptor_t *\n"
+                  "$root$__services[] = {\n",
                   "root", root);
     Indent(printer);
-    printer.Print("$root$__register_extensions\n",
-                  "root", root);
+    for (int i = 0; i < file->service_count(); ++i) {
+      printer.Print("&$sroot$__descriptor,\n",
+                    "sroot", TypedefRoot(file->service(i)->full_name()));
+    }
+    printer.Print("NULL\n");
     Outdent(printer);
     printer.Print("};\n"
                   "\n");
+  }
+
+  printer.Print("static ngx_protobuf_module_t\n"
+                "$root$_module_ctx = {\n",
+                "root", root);
+  Indent(printer);
+  if (ecount > 0) {
+    printer.Print("$root$__register_extensions,\n",
+                  "root", root);
   } else {
-    printer.Print("static ngx_protobuf_module_t\n"
-                  "$root$_module_ctx = {\n",
+    printer.Print("NULL,\n");
+  }
+  printer.Print("$root$__messages,\n",
+                "root", root);
+  if (file->service_count() > 0) {
+    printer.Print("$root$__services\n",
                   "root", root);
-    Indent(printer);
+  } else {
     printer.Print("NULL\n");
-    Outdent(printer);
-    printer.Print("};\n"
-                  "\n");
   }
+  Outdent(printer);
+  printer.Print("};\n"
+                "\n");
 
   printer.Print("ngx_module_t $root$_module = {\n",
                 "root", root);
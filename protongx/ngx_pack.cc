@@ -17,35 +17,43 @@ struct ExtensionRangeSorter {
   }
 };
 
-struct FieldDescriptorSorter {
-  bool operator()(const FieldDescriptor *left,
-                  const FieldDescriptor *right) const
-  {
-    return (left->number() < right->number());
-  }
-};
-
 void
 Generator::GeneratePackField(const FieldDescriptor *field,
+                             bool check,
                              io::Printer& printer)
 {
   std::map<std::string, std::string> vars;
+  bool braced = true;
 
   vars["fname"] = field->name();
   vars["ftype"] = FieldRealType(field);
   vars["fnum"] = Number(field->number());
 
+  PresenceVars(field, vars);
+
   if (field->is_repeated()) {
-    CuddledIf(printer, vars,
-              "obj->__has_$fname$",
-              "&& obj->$fname$ != NULL\n"
-              "&& obj->$fname$->nelts > 0");
+    if (check) {
+      CuddledIf(printer, vars,
+                "$has$",
+                "&& obj->$fname$ != NULL\n"
+                "&& obj->$fname$->nelts > 0");
+    } else {
+      CuddledIf(printer, vars,
+                "obj->$fname$ != NULL",
+                "&& obj->$fname$->nelts > 0");
+    }
   } else if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
-    CuddledIf(printer, vars,
-              "obj->__has_$fname$",
-              "&& obj->$fname$ != NULL");
+    if (check) {
+      CuddledIf(printer, vars,
+                "$has$",
+                "&& obj->$fname$ != NULL");
+    } else {
+      SimpleIf(printer, vars, "obj->$fname$ != NULL");
+    }
+  } else if (check) {
+    SimpleIf(printer, vars, "$has$");
   } else {
-    SimpleIf(printer, vars, "obj->__has_$fname$");
+    braced = false;
   }
 
   if (field->is_repeated()) {
@@ -55,12 +63,21 @@ Generator::GeneratePackField(const FieldDescriptor *field,
                   "\n");
 
     if (field->is_packable() && field->options().packed()) {
+
+      // the elements of a packed field share a single header and are
+      // written without tags of their own.
+
       vars["root"] = TypedefRoot(field->containing_type()->full_name());
+      vars["wfield"] = "";
+      vars["wfnum"] = "";
       printer.Print(vars,
                     "n = $root$_$fname$__packed_size(obj->$fname$);\n"
                     "ctx->buffer.pos = ngx_protobuf_write_message_header(\n"
                     "    ctx->buffer.pos, n, $fnum$);\n"
                     "\n");
+    } else {
+      vars["wfield"] = "_field";
+      vars["wfnum"] = ", " + vars["fnum"];
     }
 
     printer.Print(vars,
@@ -83,55 +100,55 @@ Generator::GeneratePackField(const FieldDescriptor *field,
       break;
     case FieldDescriptor::TYPE_BOOL:
       printer.Print(vars,
-                    "ctx->buffer.pos = ngx_protobuf_write_uint32_field(\n"
-                    "    ctx->buffer.pos, (vals[i] != 0), $fnum$);\n");
+                    "ctx->buffer.pos = ngx_protobuf_write_uint32$wfield$(\n"
+                    "    ctx->buffer.pos, (vals[i] != 0)$wfnum$);\n");
       break;
     case FieldDescriptor::TYPE_ENUM:
     case FieldDescriptor::TYPE_UINT32:
     case FieldDescriptor::TYPE_INT32:
       printer.Print(vars,
-                    "ctx->buffer.pos = ngx_protobuf_write_uint32_field(\n"
-                    "    ctx->buffer.pos, vals[i], $fnum$);\n");
+                    "ctx->buffer.pos = ngx_protobuf_write_uint32$wfield$(\n"
+                    "    ctx->buffer.pos, vals[i]$wfnum$);\n");
       break;
     case FieldDescriptor::TYPE_SINT32:
       printer.Print(vars,
-                    "ctx->buffer.pos = ngx_protobuf_write_uint32_field(\n"
+                    "ctx->buffer.pos = ngx_protobuf_write_uint32$wfield$(\n"
                     "    ctx->buffer.pos, "
-                    "NGX_PROTOBUF_Z32_ENCODE(vals[i]), $fnum$);\n");
+                    "NGX_PROTOBUF_Z32_ENCODE(vals[i])$wfnum$);\n");
       break;
     case FieldDescriptor::TYPE_UINT64:
     case FieldDescriptor::TYPE_INT64:
       printer.Print(vars,
-                    "ctx->buffer.pos = ngx_protobuf_write_uint64_field(\n"
-                    "    ctx->buffer.pos, vals[i], $fnum$);\n");
+                    "ctx->buffer.pos = ngx_protobuf_write_uint64$wfield$(\n"
+                    "    ctx->buffer.pos, vals[i]$wfnum$);\n");
       break;
     case FieldDescriptor::TYPE_SINT64:
       printer.Print(vars,
-                    "ctx->buffer.pos = ngx_protobuf_write_uint64_field(\n"
+                    "ctx->buffer.pos = ngx_protobuf_write_uint64$wfield$(\n"
                     "    ctx->buffer.pos, "
-                    "NGX_PROTOBUF_Z64_ENCODE(vals[i]), $fnum$);\n");
+                    "NGX_PROTOBUF_Z64_ENCODE(vals[i])$wfnum$);\n");
       break;
     case FieldDescriptor::TYPE_FIXED32:
     case FieldDescriptor::TYPE_SFIXED32:
       printer.Print(vars,
-                    "ctx->buffer.pos = ngx_protobuf_write_fixed32_field(\n"
-                    "    ctx->buffer.pos, vals[i], $fnum$);\n");
+                    "ctx->buffer.pos = ngx_protobuf_write_fixed32$wfield$(\n"
+                    "    ctx->buffer.pos, vals[i]$wfnum$);\n");
       break;
     case FieldDescriptor::TYPE_FLOAT:
       printer.Print(vars,
-                    "ctx->buffer.pos = ngx_protobuf_write_float_field(\n"
-                    "    ctx->buffer.pos, vals[i], $fnum$);\n");
+                    "ctx->buffer.pos = ngx_protobuf_write_float$wfield$(\n"
+                    "    ctx->buffer.pos, vals[i]$wfnum$);\n");
       break;
     case FieldDescriptor::TYPE_FIXED64:
     case FieldDescriptor::TYPE_SFIXED64:
       printer.Print(vars,
-                    "ctx->buffer.pos = ngx_protobuf_write_fixed64_field(\n"
-                    "    ctx->buffer.pos, vals[i], $fnum$);\n");
+                    "ctx->buffer.pos = ngx_protobuf_write_fixed64$wfield$(\n"
+                    "    ctx->buffer.pos, vals[i]$wfnum$);\n");
       break;
     case FieldDescriptor::TYPE_DOUBLE:
       printer.Print(vars,
-                    "ctx->buffer.pos = ngx_protobuf_write_double_field(\n"
-                    "    ctx->buffer.pos, vals[i], $fnum$);\n");
+                    "ctx->buffer.pos = ngx_protobuf_write_double$wfield$(\n"
+                    "    ctx->buffer.pos, vals[i]$wfnum$);\n");
       break;
     default:
       printer.Print(vars,
@@ -234,8 +251,9 @@ Generator::GeneratePackField(const FieldDescriptor *field,
     }
   }
 
-  Outdent(printer);
-  printer.Print("}\n");
+  if (braced) {
+    CloseBrace(printer);
+  }
 }
 
 void
@@ -247,14 +265,27 @@ Generator::GeneratePackRange(const Descriptor::ExtensionRange *range,
   vars["lower"] = Number(range->start);
   vars["upper"] = Number(range->end);
 
-  SimpleIf(printer, vars, "obj->__extensions != NULL");
+  SimpleIf(printer, vars, "obj->__extensions.nelts > 0");
   printer.Print(vars,
-                "rc = ngx_protobuf_pack_extensions(obj->__extensions,\n"
+                "rc = ngx_protobuf_pack_extensions(&obj->__extensions,\n"
                 "    $lower$, $upper$, ctx);\n");
   FullSimpleIf(printer, vars, "rc != NGX_OK", "return rc;");
   CloseBrace(printer);
 }
 
+void
+Generator::GeneratePackUnknownSpans(const Descriptor *desc,
+                                    io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  printer.Print("\n");
+  SimpleIf(printer, vars, "obj->__unknown != NULL");
+  printer.Print("rc = ngx_protobuf_pack_unknown_spans(obj->__unknown, ctx);\n");
+  FullSimpleIf(printer, vars, "rc != NGX_OK", "return rc;");
+  CloseBrace(printer);
+}
+
 void
 Generator::GeneratePackUnknown(const Descriptor *desc, io::Printer& printer)
 {
@@ -307,6 +338,10 @@ Generator::GeneratePack(const Descriptor* desc, io::Printer& printer)
     printer.Print("ngx_int_t  rc;\n");
   }
 
+  if (HasPresenceWords(desc)) {
+    printer.Print("uint32_t   bits;\n");
+  }
+
   printer.Print("\n");
   FullSimpleIf(printer, vars, "size == 0", "return NGX_OK;");
   printer.Print("\n");
@@ -315,6 +350,18 @@ Generator::GeneratePack(const Descriptor* desc, io::Printer& printer)
                "return NGX_ABORT;");
   printer.Print("\n");
 
+  // a clean message is written as the bytes it was unpacked from
+
+  CuddledIf(printer, vars,
+            "obj->__wire.data != NULL",
+            "&& $root$__is_clean(obj)");
+  printer.Print("ctx->buffer.pos = ngx_cpymem(ctx->buffer.pos, "
+                "obj->__wire.data,\n"
+                "    obj->__wire.len);\n"
+                "return NGX_OK;\n");
+  CloseBrace(printer);
+  printer.Print("\n");
+
   // fields and extension ranges may be declared in any order,
   // but we should serialize in canonical order
 
@@ -338,19 +385,44 @@ Generator::GeneratePack(const Descriptor* desc, io::Printer& printer)
   ei = extensions.begin();
   fi = fields.begin();
 
-  while (ei != extensions.end() || fi != fields.end()) {
-    if (ei == extensions.end()) {
-      GeneratePackField(*fi++, printer);
-    } else if (fi == fields.end()) {
-      GeneratePackRange(*ei++, printer);
-    } else if ((*fi)->number() < (*ei)->start) {
-      GeneratePackField(*fi++, printer);
-    } else {
-      GeneratePackRange(*ei++, printer);
+  if (HasPresenceWords(desc)) {
+
+    // walk the presence bits of each run of fields that falls between
+    // two extension ranges.
+
+    while (ei != extensions.end() || fi != fields.end()) {
+      std::vector<const FieldDescriptor *> run;
+
+      while (fi != fields.end() &&
+             (ei == extensions.end() || (*fi)->number() < (*ei)->start)) {
+        run.push_back(*fi++);
+      }
+
+      if (!run.empty()) {
+        GeneratePresenceLoop(desc, run, true, printer);
+      }
+
+      if (ei != extensions.end()) {
+        GeneratePackRange(*ei++, printer);
+      }
+    }
+  } else {
+    while (ei != extensions.end() || fi != fields.end()) {
+      if (ei == extensions.end()) {
+        GeneratePackField(*fi++, true, printer);
+      } else if (fi == fields.end()) {
+        GeneratePackRange(*ei++, printer);
+      } else if ((*fi)->number() < (*ei)->start) {
+        GeneratePackField(*fi++, true, printer);
+      } else {
+        GeneratePackRange(*ei++, printer);
+      }
     }
   }
 
-  if (HasUnknownFields(desc)) {
+  if (HasRawUnknown(desc)) {
+    GeneratePackUnknownSpans(desc, printer);
+  } else if (HasUnknownFields(desc)) {
     GeneratePackUnknown(desc, printer);
   }
 
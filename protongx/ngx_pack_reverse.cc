@@ -0,0 +1,363 @@
+#include <algorithm>
+
+#include <ngx_flags.h>
+#include <ngx_generator.h>
+#include <google/protobuf/descriptor.pb.h>
+
+namespace google {
+namespace protobuf {
+namespace compiler {
+namespace nginx {
+
+struct ExtensionRangeReverseSorter {
+  bool operator()(const Descriptor::ExtensionRange *left,
+                  const Descriptor::ExtensionRange *right) const
+  {
+    return (left->start > right->start);
+  }
+};
+
+void
+Generator::GenerateReverseWrite(const FieldDescriptor *field,
+                                const char *val,
+                                bool tagged,
+                                io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+  std::string method;
+  std::string value(val);
+  std::string size;
+  std::string room;
+
+  // the room check uses the exact width of what is written, so a
+  // buffer sized by __size always fits.
+
+  switch (field->type()) {
+  case FieldDescriptor::TYPE_BOOL:
+    method = "uint32";
+    value = "(" + value + " != 0)";
+    break;
+  case FieldDescriptor::TYPE_ENUM:
+  case FieldDescriptor::TYPE_UINT32:
+  case FieldDescriptor::TYPE_INT32:
+    method = "uint32";
+    break;
+  case FieldDescriptor::TYPE_SINT32:
+    method = "uint32";
+    value = "NGX_PROTOBUF_Z32_ENCODE(" + value + ")";
+    break;
+  case FieldDescriptor::TYPE_UINT64:
+  case FieldDescriptor::TYPE_INT64:
+    method = "uint64";
+    break;
+  case FieldDescriptor::TYPE_SINT64:
+    method = "uint64";
+    value = "NGX_PROTOBUF_Z64_ENCODE(" + value + ")";
+    break;
+  case FieldDescriptor::TYPE_FIXED32:
+  case FieldDescriptor::TYPE_SFIXED32:
+    method = "fixed32";
+    break;
+  case FieldDescriptor::TYPE_FLOAT:
+    method = "float";
+    size = "fixed32";
+    break;
+  case FieldDescriptor::TYPE_FIXED64:
+  case FieldDescriptor::TYPE_SFIXED64:
+    method = "fixed64";
+    break;
+  case FieldDescriptor::TYPE_DOUBLE:
+    method = "double";
+    size = "fixed64";
+    break;
+  case FieldDescriptor::TYPE_BYTES:
+  case FieldDescriptor::TYPE_STRING:
+    method = "string";
+    value = "&" + value;
+    break;
+  default:
+    method = "FIXME";
+    break;
+  }
+
+  vars["fnum"] = Number(field->number());
+
+  if (size.empty()) {
+    size = method;
+  }
+
+  if (size == "fixed32" || size == "fixed64") {
+    if (tagged) {
+      room = "ngx_protobuf_size_" + size + "_field(" + vars["fnum"] + ")";
+    } else {
+      room = (size == "fixed32") ? "4" : "8";
+    }
+  } else if (tagged) {
+    room = "ngx_protobuf_size_" + size + "_field(" + value + ", " +
+      vars["fnum"] + ")";
+  } else {
+    room = "ngx_protobuf_size_" + size + "(" + value + ")";
+  }
+
+  if (tagged) {
+    method += "_field";
+  }
+
+  vars["method"] = method;
+  vars["value"] = value;
+  vars["room"] = room;
+
+  FullCuddledIf(printer, vars,
+                "!NGX_PROTOBUF_REVERSE_ROOM(ctx,",
+                "$room$)",
+                "return NGX_ABORT;");
+
+  if (tagged) {
+    printer.Print(vars,
+                  "ctx->buffer.pos = ngx_protobuf_rwrite_$method$(\n"
+                  "    ctx->buffer.pos,\n"
+                  "    $value$,\n"
+                  "    $fnum$);\n");
+  } else {
+    printer.Print(vars,
+                  "ctx->buffer.pos = ngx_protobuf_rwrite_$method$(\n"
+                  "    ctx->buffer.pos,\n"
+                  "    $value$);\n");
+  }
+}
+
+void
+Generator::GeneratePackReverseField(const FieldDescriptor *field,
+                                    io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  vars["fname"] = field->name();
+  vars["ftype"] = FieldRealType(field);
+  vars["fnum"] = Number(field->number());
+
+  PresenceVars(field, vars);
+
+  if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+    vars["froot"] = TypedefRoot(field->message_type()->full_name());
+  }
+
+  if (field->is_repeated()) {
+    CuddledIf(printer, vars,
+              "$has$",
+              "&& obj->$fname$ != NULL\n"
+              "&& obj->$fname$->nelts > 0");
+    printer.Print(vars,
+                  "$ftype$ *vals = obj->$fname$->elts;\n"
+                  "\n");
+
+    if (field->is_packable() && field->options().packed()) {
+
+      // write the elements without tags, then the header in front of
+      // them once their length is known.
+
+      printer.Print("mark = ctx->buffer.pos;\n"
+                    "\n");
+      printer.Print(vars, "for (i = obj->$fname$->nelts; i > 0; --i) ");
+      OpenBrace(printer);
+      GenerateReverseWrite(field, "vals[i - 1]", false, printer);
+      CloseBrace(printer);
+      printer.Print("\n");
+      FullSimpleIf(printer, vars,
+                   "!NGX_PROTOBUF_REVERSE_HEADER_ROOM(ctx, mark, $fnum$)",
+                   "return NGX_ABORT;");
+      printer.Print(vars,
+                    "ctx->buffer.pos = ngx_protobuf_rwrite_message_header(\n"
+                    "    ctx->buffer.pos,\n"
+                    "    mark - ctx->buffer.pos,\n"
+                    "    $fnum$);\n");
+    } else if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+      printer.Print(vars, "for (i = obj->$fname$->nelts; i > 0; --i) ");
+      OpenBrace(printer);
+      printer.Print(vars,
+                    "mark = ctx->buffer.pos;\n"
+                    "rc = $froot$__pack_reverse(vals + i - 1, ctx);\n");
+      FullSimpleIf(printer, vars, "rc != NGX_OK", "return rc;");
+      printer.Print("\n");
+      FullSimpleIf(printer, vars,
+                   "!NGX_PROTOBUF_REVERSE_HEADER_ROOM(ctx, mark, $fnum$)",
+                   "return NGX_ABORT;");
+      printer.Print(vars,
+                    "ctx->buffer.pos = ngx_protobuf_rwrite_message_header(\n"
+                    "    ctx->buffer.pos,\n"
+                    "    mark - ctx->buffer.pos,\n"
+                    "    $fnum$);\n");
+      CloseBrace(printer);
+    } else {
+      printer.Print(vars, "for (i = obj->$fname$->nelts; i > 0; --i) ");
+      OpenBrace(printer);
+      GenerateReverseWrite(field, "vals[i - 1]", true, printer);
+      CloseBrace(printer);
+    }
+
+    CloseBrace(printer);
+  } else if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+    CuddledIf(printer, vars,
+              "$has$",
+              "&& obj->$fname$ != NULL");
+    printer.Print(vars,
+                  "mark = ctx->buffer.pos;\n"
+                  "rc = $froot$__pack_reverse(obj->$fname$, ctx);\n");
+    FullSimpleIf(printer, vars, "rc != NGX_OK", "return rc;");
+    printer.Print("\n");
+    FullSimpleIf(printer, vars,
+                 "!NGX_PROTOBUF_REVERSE_HEADER_ROOM(ctx, mark, $fnum$)",
+                 "return NGX_ABORT;");
+    printer.Print(vars,
+                  "ctx->buffer.pos = ngx_protobuf_rwrite_message_header(\n"
+                  "    ctx->buffer.pos,\n"
+                  "    mark - ctx->buffer.pos,\n"
+                  "    $fnum$);\n");
+    CloseBrace(printer);
+  } else {
+    std::string val("obj->" + field->name());
+
+    SimpleIf(printer, vars, "$has$");
+    GenerateReverseWrite(field, val.c_str(), true, printer);
+    CloseBrace(printer);
+  }
+}
+
+void
+Generator::GeneratePackReverseRange(const Descriptor::ExtensionRange *range,
+                                    io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  vars["lower"] = Number(range->start);
+  vars["upper"] = Number(range->end);
+
+  SimpleIf(printer, vars, "obj->__extensions.nelts > 0");
+  printer.Print(vars,
+                "rc = ngx_protobuf_pack_extensions_reverse("
+                "&obj->__extensions,\n"
+                "    $lower$, $upper$, ctx);\n");
+  FullSimpleIf(printer, vars, "rc != NGX_OK", "return rc;");
+  CloseBrace(printer);
+}
+
+void
+Generator::GeneratePackReverse(const Descriptor* desc, io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  vars["name"] = desc->full_name();
+  vars["root"] = TypedefRoot(desc->full_name());
+  vars["type"] = StructType(desc->full_name());
+
+  printer.Print(vars,
+                "ngx_int_t\n"
+                "$root$__pack_reverse(\n"
+                "    $type$ *obj,\n"
+                "    ngx_protobuf_context_t *ctx)\n"
+                "{\n");
+  Indent(printer);
+
+  Flags flags(desc);
+  bool  locals = false;
+
+  if (flags.has_message() || flags.has_packed()) {
+    printer.Print("u_char     *mark;\n");
+    locals = true;
+  }
+
+  if (flags.has_array()) {
+    printer.Print("ngx_uint_t  i;\n");
+    locals = true;
+  }
+
+  if (flags.has_message() || desc->extension_range_count() > 0 ||
+      HasUnknownFields(desc))
+  {
+    printer.Print("ngx_int_t   rc;\n");
+    locals = true;
+  }
+
+  if (locals) {
+    printer.Print("\n");
+  }
+
+  CuddledIf(printer, vars,
+            "obj->__wire.data != NULL",
+            "&& $root$__is_clean(obj)");
+  FullSimpleIf(printer, vars,
+               "!NGX_PROTOBUF_REVERSE_ROOM(ctx, obj->__wire.len)",
+               "return NGX_ABORT;");
+  printer.Print("\n"
+                "ctx->buffer.pos -= obj->__wire.len;\n"
+                "ngx_memcpy(ctx->buffer.pos, obj->__wire.data, "
+                "obj->__wire.len);\n"
+                "\n"
+                "return NGX_OK;\n");
+  CloseBrace(printer);
+  printer.Print("\n");
+
+  // everything is written back to front: unknown fields first, since
+  // they are packed last, then the fields and extension ranges in
+  // descending order.
+
+  if (HasRawUnknown(desc)) {
+    SimpleIf(printer, vars, "obj->__unknown != NULL");
+    printer.Print("rc = ngx_protobuf_pack_unknown_spans_reverse("
+                  "obj->__unknown, ctx);\n");
+    FullSimpleIf(printer, vars, "rc != NGX_OK", "return rc;");
+    CloseBrace(printer);
+    printer.Print("\n");
+  } else if (HasUnknownFields(desc)) {
+    printer.Print("rc = ngx_protobuf_pack_unknown_reverse("
+                  "obj->__unknown, ctx);\n");
+    FullSimpleIf(printer, vars, "rc != NGX_OK", "return rc;");
+    printer.Print("\n");
+  }
+
+  std::vector<const Descriptor::ExtensionRange *> extensions;
+  std::vector<const FieldDescriptor *> fields;
+
+  for (int i = 0; i < desc->field_count(); ++i) {
+    fields.push_back(desc->field(i));
+  }
+
+  for (int i = 0; i < desc->extension_range_count(); ++i) {
+    extensions.push_back(desc->extension_range(i));
+  }
+
+  std::sort(extensions.begin(), extensions.end(),
+            ExtensionRangeReverseSorter());
+  std::sort(fields.begin(), fields.end(), FieldDescriptorSorter());
+  std::reverse(fields.begin(), fields.end());
+
+  std::vector<const Descriptor::ExtensionRange *>::const_iterator ei;
+  std::vector<const FieldDescriptor *>::const_iterator fi;
+
+  ei = extensions.begin();
+  fi = fields.begin();
+
+  while (ei != extensions.end() || fi != fields.end()) {
+    if (ei == extensions.end()) {
+      GeneratePackReverseField(*fi++, printer);
+    } else if (fi == fields.end()) {
+      GeneratePackReverseRange(*ei++, printer);
+    } else if ((*fi)->number() > (*ei)->start) {
+      GeneratePackReverseField(*fi++, printer);
+    } else {
+      GeneratePackReverseRange(*ei++, printer);
+    }
+  }
+
+  printer.Print("\n"
+                "return NGX_OK;\n");
+
+  CloseBrace(printer);
+
+  printer.Print("\n");
+}
+
+} // namespace nginx
+} // namespace compiler
+} // namespace protobuf
+} // namespace google
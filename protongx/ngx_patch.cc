@@ -0,0 +1,145 @@
+#include <ngx_generator.h>
+#include <google/protobuf/descriptor.pb.h>
+
+namespace google {
+namespace protobuf {
+namespace compiler {
+namespace nginx {
+
+// the write method for a scalar value
+
+static std::string
+WriteMethod(const FieldDescriptor *field)
+{
+  switch (field->type()) {
+  case FieldDescriptor::TYPE_BOOL:
+  case FieldDescriptor::TYPE_ENUM:
+  case FieldDescriptor::TYPE_UINT32:
+  case FieldDescriptor::TYPE_INT32:     return "uint32";
+  case FieldDescriptor::TYPE_SINT32:    return "sint32";
+  case FieldDescriptor::TYPE_UINT64:
+  case FieldDescriptor::TYPE_INT64:     return "uint64";
+  case FieldDescriptor::TYPE_SINT64:    return "sint64";
+  case FieldDescriptor::TYPE_FIXED32:   return "fixed32";
+  case FieldDescriptor::TYPE_SFIXED32:  return "sfixed32";
+  case FieldDescriptor::TYPE_FLOAT:     return "float";
+  case FieldDescriptor::TYPE_FIXED64:   return "fixed64";
+  case FieldDescriptor::TYPE_SFIXED64:  return "sfixed64";
+  case FieldDescriptor::TYPE_DOUBLE:    return "double";
+  default:                              return "FIXME";
+  }
+}
+
+// strings, bytes and submessages are patched with their encoded bytes
+
+static bool
+PatchesBytes(const FieldDescriptor *field)
+{
+  return (field->type() == FieldDescriptor::TYPE_STRING ||
+          field->type() == FieldDescriptor::TYPE_BYTES ||
+          field->type() == FieldDescriptor::TYPE_MESSAGE);
+}
+
+void
+Generator::GeneratePatchDecls(const Descriptor* desc, io::Printer& printer)
+{
+  if (desc->field_count() == 0) {
+    return;
+  }
+
+  std::map<std::string, std::string> vars;
+
+  vars["name"] = desc->full_name();
+  vars["root"] = TypedefRoot(desc->full_name());
+
+  printer.Print(vars,
+                "/* $name$ patch functions */\n"
+                "\n");
+
+  for (int i = 0; i < desc->field_count(); ++i) {
+    const FieldDescriptor *field = desc->field(i);
+
+    vars["fname"] = field->name();
+
+    if (PatchesBytes(field)) {
+      vars["vtype"] = "ngx_str_t *";
+    } else {
+      vars["vtype"] = FieldRealType(field) + " ";
+    }
+
+    printer.Print(vars,
+                  "ngx_int_t $root$__patch_$fname$(\n"
+                  "    ngx_protobuf_patch_t *patch,\n"
+                  "    $vtype$val);\n"
+                  "\n");
+  }
+}
+
+void
+Generator::GeneratePatchField(const FieldDescriptor *field,
+                              io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  vars["root"] = TypedefRoot(field->containing_type()->full_name());
+  vars["fname"] = field->name();
+  vars["fnum"] = Number(field->number());
+  vars["wire"] = WireType(field);
+  vars["append"] = field->is_repeated() ? "1" : "0";
+
+  if (PatchesBytes(field)) {
+    vars["vtype"] = "ngx_str_t *";
+  } else {
+    vars["vtype"] = FieldRealType(field) + " ";
+  }
+
+  printer.Print(vars,
+                "ngx_int_t\n"
+                "$root$__patch_$fname$(\n"
+                "    ngx_protobuf_patch_t *patch,\n"
+                "    $vtype$val)\n");
+  OpenBrace(printer);
+
+  // a repeated field is appended to: packed fields accept unpacked
+  // elements, so the new element is always written with its own tag.
+
+  if (PatchesBytes(field)) {
+    printer.Print(vars,
+                  "return ngx_protobuf_patch_field(patch, $fnum$,\n"
+                  "    $wire$,\n"
+                  "    val->data, val->len, $append$);\n");
+  } else {
+    vars["method"] = WriteMethod(field);
+    if (field->type() == FieldDescriptor::TYPE_BOOL) {
+      vars["val"] = "(val != 0)";
+    } else {
+      vars["val"] = "val";
+    }
+
+    printer.Print(vars,
+                  "u_char   buf[10];\n"
+                  "u_char  *p;\n"
+                  "\n"
+                  "p = ngx_protobuf_write_$method$(buf, $val$);\n"
+                  "\n"
+                  "return ngx_protobuf_patch_field(patch, $fnum$,\n"
+                  "    $wire$,\n"
+                  "    buf, p - buf, $append$);\n");
+  }
+
+  CloseBrace(printer);
+  printer.Print("\n");
+}
+
+void
+Generator::GeneratePatch(const Descriptor* desc, io::Printer& printer)
+{
+  for (int i = 0; i < desc->field_count(); ++i) {
+    GeneratePatchField(desc->field(i), printer);
+  }
+}
+
+} // namespace nginx
+} // namespace compiler
+} // namespace protobuf
+} // namespace google
@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+
+#include <ngx_generator.h>
+#include <google/protobuf/descriptor.pb.h>
+
+namespace google {
+namespace protobuf {
+namespace compiler {
+namespace nginx {
+
+// set from the generator parameter for the current run
+
+static bool presence_words = false;
+
+void
+Generator::SetPresenceWords(bool words)
+{
+  presence_words = words;
+}
+
+bool
+Generator::HasPresenceWords(const Descriptor *desc)
+{
+  return (presence_words && desc->field_count() > 0);
+}
+
+int
+Generator::PresenceWordCount(const Descriptor *desc)
+{
+  return (desc->field_count() + 31) / 32;
+}
+
+int
+Generator::PresenceBit(const FieldDescriptor *field)
+{
+  // bits are assigned in field number order, which is also the order
+  // of the message descriptor slots, so that walking the set bits
+  // visits the fields in the order in which they are serialized.
+
+  const Descriptor *desc = field->containing_type();
+  int bit = 0;
+
+  for (int i = 0; i < desc->field_count(); ++i) {
+    if (desc->field(i)->number() < field->number()) {
+      ++bit;
+    }
+  }
+
+  return bit;
+}
+
+std::string
+Generator::PresenceMask(const FieldDescriptor *field)
+{
+  std::string name(TypedefRoot(field->containing_type()->full_name()) +
+                   "__has_" + field->name());
+
+  for (size_t i = 0; i < name.length(); ++i) {
+    name[i] = toupper(name[i]);
+  }
+
+  return name;
+}
+
+std::string
+Generator::PresenceMaskValue(uint32_t mask)
+{
+  char buf[sizeof("0x00000000")];
+
+  snprintf(buf, sizeof(buf), "0x%08x", mask);
+
+  return buf;
+}
+
+void
+Generator::PresenceVars(const FieldDescriptor *field,
+                        std::map<std::string, std::string>& vars)
+{
+  if (HasPresenceWords(field->containing_type())) {
+    int bit = PresenceBit(field);
+
+    vars["hword"] = Number(bit / 32);
+    vars["hmask"] = PresenceMask(field);
+    vars["has"] = "(obj->__has[" + vars["hword"] + "] & " +
+      vars["hmask"] + ")";
+    vars["sethas"] = "obj->__has[" + vars["hword"] + "] |= " +
+      vars["hmask"];
+  } else {
+    vars["has"] = "obj->__has_" + field->name();
+    vars["sethas"] = "obj->__has_" + field->name() + " = 1";
+  }
+}
+
+void
+Generator::GeneratePresenceBits(const Descriptor *desc, io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+  size_t maxname = 0;
+
+  vars["name"] = desc->full_name();
+
+  for (int i = 0; i < desc->field_count(); ++i) {
+    maxname = std::max(maxname, PresenceMask(desc->field(i)).length());
+  }
+
+  printer.Print(vars,
+                "/* $name$ presence bits */\n"
+                "\n");
+
+  for (int i = 0; i < desc->field_count(); ++i) {
+    const FieldDescriptor *field = desc->field(i);
+    std::string mask(PresenceMask(field));
+
+    vars["mask"] = mask;
+    vars["space"] = Spaces(maxname - mask.length());
+    vars["value"] = PresenceMaskValue(1U << (PresenceBit(field) % 32));
+
+    printer.Print(vars, "#define $mask$$space$ $value$\n");
+  }
+
+  printer.Print("\n");
+}
+
+void
+Generator::GeneratePresenceLoop(const Descriptor *desc,
+                                const std::vector<const FieldDescriptor *>&
+                                fields,
+                                bool pack,
+                                io::Printer& printer)
+{
+  // fields must be a run of consecutive bits in field number order.
+  // each presence word that the run touches is masked and its set bits
+  // are walked lowest first, so only the fields that are actually
+  // present are visited.
+
+  std::map<std::string, std::string> vars;
+  size_t i = 0;
+
+  while (i < fields.size()) {
+    int word = PresenceBit(fields[i]) / 32;
+    uint32_t mask = 0;
+    size_t j;
+
+    for (j = i; j < fields.size(); ++j) {
+      int bit = PresenceBit(fields[j]);
+
+      if (bit / 32 != word) {
+        break;
+      }
+      mask |= 1U << (bit % 32);
+    }
+
+    vars["word"] = Number(word);
+
+    if (mask == 0xffffffff) {
+      vars["bits"] = "obj->__has[" + vars["word"] + "]";
+    } else {
+      vars["bits"] = "obj->__has[" + vars["word"] + "] & " +
+        PresenceMaskValue(mask);
+    }
+
+    printer.Print(vars,
+                  "for (bits = $bits$; bits != 0; bits &= bits - 1) {\n");
+    Indent(printer);
+    printer.Print("switch (ngx_protobuf_ctz(bits)) {\n");
+
+    for (; i < j; ++i) {
+      vars["bit"] = Number(PresenceBit(fields[i]) % 32);
+      vars["ffull"] = fields[i]->full_name();
+
+      printer.Print(vars, "case $bit$: /* $ffull$ */\n");
+      Indent(printer);
+      if (pack) {
+        GeneratePackField(fields[i], false, printer);
+      } else {
+        GenerateSizeField(fields[i], false, printer);
+      }
+      printer.Print("break;\n");
+      Outdent(printer);
+    }
+
+    printer.Print("}\n");
+    Outdent(printer);
+    printer.Print("}\n");
+  }
+}
+
+} // namespace nginx
+} // namespace compiler
+} // namespace protobuf
+} // namespace google
@@ -93,7 +93,7 @@ Generator::Else(io::Printer& printer)
 void
 Generator::SkipUnknown(io::Printer& printer)
 {
-  printer.Print("if (ngx_protobuf_skip(pos, end, wire) != NGX_OK) ");
+  printer.Print("if (ngx_protobuf_skip_field(pos, end, field, wire) != NGX_OK) ");
   BracedReturn(printer, "NGX_ABORT");
 }
 
@@ -0,0 +1,262 @@
+#include <ngx_generator.h>
+
+namespace google {
+namespace protobuf {
+namespace compiler {
+namespace nginx {
+
+void
+Generator::MethodVars(const MethodDescriptor *method,
+                      std::map<std::string, std::string>& vars)
+{
+  const ServiceDescriptor *service = method->service();
+
+  vars["service"] = service->full_name();
+  vars["sroot"] = TypedefRoot(service->full_name());
+  vars["method"] = method->name();
+  vars["member"] = BareRoot(method->name());
+  vars["root"] = vars["sroot"] + "_" + vars["member"];
+  vars["in"] = TypedefRoot(method->input_type()->full_name());
+  vars["itype"] = StructType(method->input_type()->full_name());
+  vars["out"] = TypedefRoot(method->output_type()->full_name());
+  vars["otype"] = StructType(method->output_type()->full_name());
+}
+
+void
+Generator::GenerateServiceDecls(const ServiceDescriptor *service,
+                                io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  vars["name"] = service->full_name();
+  vars["root"] = TypedefRoot(service->full_name());
+  vars["type"] = StructType(service->full_name());
+
+  // the implementation: a function for each method that takes a single
+  // request.  a unary method fills in its reply, which is sent when it
+  // returns NGX_OK; a server-streaming method sends its replies itself.
+
+  printer.Print(vars,
+                "/* $name$ service */\n"
+                "\n"
+                "typedef struct {\n");
+  Indent(printer);
+  for (int i = 0; i < service->method_count(); ++i) {
+    const MethodDescriptor *method = service->method(i);
+    std::map<std::string, std::string> mvars;
+
+    if (method->client_streaming()) {
+      continue;
+    }
+
+    MethodVars(method, mvars);
+
+    if (method->server_streaming()) {
+      printer.Print(mvars,
+                    "ngx_int_t (*$member$)(\n"
+                    "    ngx_protobuf_rpc_t *rpc,\n"
+                    "    $itype$ *request);\n");
+    } else {
+      printer.Print(mvars,
+                    "ngx_int_t (*$member$)(\n"
+                    "    ngx_protobuf_rpc_t *rpc,\n"
+                    "    $itype$ *request,\n"
+                    "    $otype$ *reply);\n");
+    }
+  }
+  Outdent(printer);
+  printer.Print(vars,
+                "} $type$;\n"
+                "\n"
+                "extern ngx_protobuf_service_descriptor_t $root$__descriptor;\n"
+                "\n"
+                "void $root$__implement(\n"
+                "    $type$ *impl);\n"
+                "\n");
+
+  for (int i = 0; i < service->method_count(); ++i) {
+    const MethodDescriptor *method = service->method(i);
+    std::map<std::string, std::string> mvars;
+
+    if (method->client_streaming()) {
+      continue;
+    }
+
+    MethodVars(method, mvars);
+
+    printer.Print(mvars,
+                  "ngx_int_t $root$__send(\n"
+                  "    ngx_protobuf_rpc_t *rpc,\n"
+                  "    $otype$ *reply);\n"
+                  "\n");
+  }
+}
+
+void
+Generator::GenerateMethodHandler(const MethodDescriptor *method,
+                                 io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  MethodVars(method, vars);
+
+  printer.Print(vars,
+                "ngx_int_t\n"
+                "$root$__send(\n"
+                "    ngx_protobuf_rpc_t *rpc,\n"
+                "    $otype$ *reply)\n");
+  OpenBrace(printer);
+  printer.Print(vars,
+                "return ngx_protobuf_rpc_send(rpc, reply,\n"
+                "    (ngx_protobuf_size_pt)$out$__size,\n"
+                "    (ngx_protobuf_pack_pt)$out$__pack);\n");
+  CloseBrace(printer);
+  printer.Print("\n");
+
+  printer.Print(vars,
+                "static ngx_int_t\n"
+                "$root$__handler(\n"
+                "    ngx_protobuf_rpc_t *rpc,\n"
+                "    ngx_str_t *request)\n");
+  OpenBrace(printer);
+  printer.Print(vars, "$itype$ *in;\n");
+  if (!method->server_streaming()) {
+    printer.Print(vars,
+                  "$otype$ *out;\n"
+                  "ngx_int_t rc;\n");
+  }
+  printer.Print("\n");
+
+  CuddledIf(printer, vars,
+            "$sroot$__impl == NULL",
+            "|| $sroot$__impl->$member$ == NULL");
+  printer.Print("rpc->status = NGX_PROTOBUF_RPC_UNIMPLEMENTED;\n"
+                "return NGX_OK;\n");
+  CloseBrace(printer);
+  printer.Print("\n");
+
+  printer.Print(vars, "in = $in$__alloc(rpc->pool);\n");
+  FullSimpleIf(printer, vars, "in == NULL", "return NGX_ERROR;");
+  printer.Print("\n");
+
+  // a malformed request fails the call, not the transport
+
+  printer.Print(vars,
+                "if (ngx_protobuf_rpc_unpack(rpc, request, in,\n"
+                "        (ngx_protobuf_unpack_pt)$in$__unpack) != NGX_OK)\n");
+  OpenBrace(printer);
+  printer.Print("return NGX_OK;\n");
+  CloseBrace(printer);
+  printer.Print("\n");
+
+  if (method->server_streaming()) {
+    printer.Print(vars,
+                  "return $sroot$__impl->$member$(rpc, in);\n");
+  } else {
+    printer.Print(vars, "out = $out$__alloc(rpc->pool);\n");
+    FullSimpleIf(printer, vars, "out == NULL", "return NGX_ERROR;");
+    printer.Print("\n");
+    printer.Print(vars,
+                  "rc = $sroot$__impl->$member$(rpc, in, out);\n");
+    FullCuddledIf(printer, vars,
+                  "rc != NGX_OK",
+                  "|| rpc->status != NGX_PROTOBUF_RPC_OK",
+                  "return rc;");
+    printer.Print("\n");
+    printer.Print(vars, "rc = $root$__send(rpc, out);\n");
+    printer.Print("\n");
+
+    // a reply that could not be written out at once still goes out
+    // ahead of the trailers, so the call can be finished
+
+    printer.Print("return (rc == NGX_AGAIN) ? NGX_OK : rc;\n");
+  }
+  CloseBrace(printer);
+  printer.Print("\n");
+}
+
+void
+Generator::GenerateService(const ServiceDescriptor *service,
+                           io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  vars["name"] = service->full_name();
+  vars["root"] = TypedefRoot(service->full_name());
+  vars["type"] = StructType(service->full_name());
+  vars["n"] = Number(service->method_count());
+
+  printer.Print(vars,
+                "/* $name$ service */\n"
+                "\n"
+                "static $type$ *$root$__impl;\n"
+                "\n"
+                "void\n"
+                "$root$__implement(\n"
+                "    $type$ *impl)\n");
+  OpenBrace(printer);
+  printer.Print(vars, "$root$__impl = impl;\n");
+  CloseBrace(printer);
+  printer.Print("\n");
+
+  for (int i = 0; i < service->method_count(); ++i) {
+    if (!service->method(i)->client_streaming()) {
+      GenerateMethodHandler(service->method(i), printer);
+    }
+  }
+
+  // client-streaming methods are described, but have no handler: the
+  // transport answers them as unimplemented.
+
+  if (service->method_count() > 0) {
+    printer.Print(vars,
+                  "static ngx_protobuf_method_descriptor_t\n"
+                  "$root$__methods[] = {\n");
+    Indent(printer);
+    for (int i = 0; i < service->method_count(); ++i) {
+      const MethodDescriptor *method = service->method(i);
+      std::map<std::string, std::string> mvars;
+
+      MethodVars(method, mvars);
+      mvars["cs"] = method->client_streaming() ? "1" : "0";
+      mvars["ss"] = method->server_streaming() ? "1" : "0";
+      mvars["handler"] = method->client_streaming()
+        ? "NULL" : mvars["root"] + "__handler";
+      mvars["comma"] = (i + 1 < service->method_count()) ? "," : "";
+
+      printer.Print(mvars,
+                    "{\n"
+                    "    ngx_string(\"$method$\"),\n"
+                    "    ngx_string(\"/$service$/$method$\"),\n"
+                    "    &$in$__descriptor,\n"
+                    "    &$out$__descriptor,\n"
+                    "    $cs$,\n"
+                    "    $ss$,\n"
+                    "    $handler$\n"
+                    "}$comma$\n");
+    }
+    Outdent(printer);
+    printer.Print("};\n"
+                  "\n");
+    vars["methods"] = vars["root"] + "__methods";
+  } else {
+    vars["methods"] = "NULL";
+  }
+
+  printer.Print(vars,
+                "ngx_protobuf_service_descriptor_t\n"
+                "$root$__descriptor = {\n");
+  Indent(printer);
+  printer.Print(vars,
+                "ngx_string(\"$name$\"),\n"
+                "$n$,\n"
+                "$methods$\n");
+  Outdent(printer);
+  printer.Print("};\n"
+                "\n");
+}
+
+} // namespace nginx
+} // namespace compiler
+} // namespace protobuf
+} // namespace google
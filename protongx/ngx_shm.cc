@@ -0,0 +1,75 @@
+#include <ngx_generator.h>
+
+namespace google {
+namespace protobuf {
+namespace compiler {
+namespace nginx {
+
+void
+Generator::GenerateShmDecls(const Descriptor* desc, io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  vars["name"] = desc->full_name();
+  vars["root"] = TypedefRoot(desc->full_name());
+  vars["type"] = StructType(desc->full_name());
+
+  printer.Print(vars,
+                "/* $name$ shared memory methods */\n"
+                "\n"
+                "ngx_int_t $root$__shm_publish(\n"
+                "    ngx_shm_zone_t *zone,\n"
+                "    $type$ *obj);\n"
+                "\n"
+                "const $type$ *$root$__shm_view(\n"
+                "    ngx_shm_zone_t *zone,\n"
+                "    ngx_pool_t *pool);\n"
+                "\n");
+}
+
+void
+Generator::GenerateShm(const Descriptor* desc, io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  vars["name"] = desc->full_name();
+  vars["root"] = TypedefRoot(desc->full_name());
+  vars["type"] = StructType(desc->full_name());
+
+  if (HasDefaultValues(desc)) {
+    vars["defaults"] = "&" + vars["root"] + "__default";
+  } else {
+    vars["defaults"] = "NULL";
+  }
+
+  printer.Print(vars,
+                "ngx_int_t\n"
+                "$root$__shm_publish(\n"
+                "    ngx_shm_zone_t *zone,\n"
+                "    $type$ *obj)\n");
+  OpenBrace(printer);
+  printer.Print(vars,
+                "return ngx_protobuf_shm_publish(zone, obj,\n"
+                "    (ngx_protobuf_size_pt)$root$__size,\n"
+                "    (ngx_protobuf_pack_pt)$root$__pack);\n");
+  CloseBrace(printer);
+  printer.Print("\n");
+
+  printer.Print(vars,
+                "const $type$ *\n"
+                "$root$__shm_view(\n"
+                "    ngx_shm_zone_t *zone,\n"
+                "    ngx_pool_t *pool)\n");
+  OpenBrace(printer);
+  printer.Print(vars,
+                "return ngx_protobuf_shm_view(zone, sizeof($type$), "
+                "$defaults$,\n"
+                "    (ngx_protobuf_unpack_pt)$root$__unpack, pool);\n");
+  CloseBrace(printer);
+  printer.Print("\n");
+}
+
+} // namespace nginx
+} // namespace compiler
+} // namespace protobuf
+} // namespace google
@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include <ngx_flags.h>
 #include <ngx_generator.h>
 #include <google/protobuf/descriptor.pb.h>
@@ -7,6 +9,211 @@ namespace protobuf {
 namespace compiler {
 namespace nginx {
 
+void
+Generator::GenerateSizeField(const FieldDescriptor *field,
+                             bool check,
+                             io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  vars["root"] = TypedefRoot(field->containing_type()->full_name());
+  vars["fname"] = field->name();
+  vars["ftype"] = FieldRealType(field);
+  vars["fnum"] = Number(field->number());
+
+  PresenceVars(field, vars);
+
+  if (field->is_repeated()) {
+
+    if (check) {
+      CuddledIf(printer, vars,
+                "$has$",
+                "&& obj->$fname$ != NULL\n"
+                "&& obj->$fname$->nelts > 0");
+    } else {
+      CuddledIf(printer, vars,
+                "obj->$fname$ != NULL",
+                "&& obj->$fname$->nelts > 0");
+    }
+
+    if (field->is_packable() && field->options().packed()) {
+      printer.Print(vars,
+                    "n = $root$_$fname$__packed_size(\n");
+      Indented(printer, vars, "obj->$fname$);\n");
+
+      printer.Print("\n");
+
+      printer.Print(vars,
+                    "size += ngx_protobuf_size_message_field(n, $fnum$);\n");
+
+    } else if (IsFixedWidth(field)) {
+
+      // size calculation of a non-packed repeated fixed-width field
+
+      switch (field->type()) {
+      case FieldDescriptor::TYPE_FIXED32:
+      case FieldDescriptor::TYPE_SFIXED32:
+      case FieldDescriptor::TYPE_FLOAT:
+        printer.Print(vars,
+                      "size += obj->$fname$->nelts *\n"
+                      "    ngx_protobuf_size_fixed32_field($fnum$);\n");
+        break;
+      case FieldDescriptor::TYPE_FIXED64:
+      case FieldDescriptor::TYPE_SFIXED64:
+      case FieldDescriptor::TYPE_DOUBLE:
+        printer.Print(vars,
+                      "size += obj->$fname$->nelts *\n"
+                      "    ngx_protobuf_size_fixed64_field($fnum$);\n");
+        break;
+      default:
+        break;
+      }
+    } else {
+
+      // size calculation of a non-packed repeated non-fixed width field
+
+      printer.Print(vars,
+                    "$ftype$ *vals = obj->$fname$->elts;\n"
+                    "\n"
+                    "for (i = 0; i < obj->$fname$->nelts; ++i) {\n");
+      Indent(printer);
+
+      switch (field->type()) {
+      case FieldDescriptor::TYPE_MESSAGE:
+        vars["froot"] = TypedefRoot(field->message_type()->full_name());
+        printer.Print(vars,
+                      "n = $froot$__size(vals + i);\n"
+                      "size += ngx_protobuf_size_message_field("
+                      "n, $fnum$);\n");
+        break;
+      case FieldDescriptor::TYPE_BYTES:
+      case FieldDescriptor::TYPE_STRING:
+        printer.Print(vars,
+                      "size += ngx_protobuf_size_string_field("
+                      "vals + i, $fnum$);\n");
+        break;
+      case FieldDescriptor::TYPE_BOOL:
+        printer.Print(vars,
+                      "size += ngx_protobuf_size_uint32_field("
+                      "(vals[i] != 0), $fnum$);\n");
+        break;
+      case FieldDescriptor::TYPE_ENUM:
+      case FieldDescriptor::TYPE_UINT32:
+      case FieldDescriptor::TYPE_INT32:
+        printer.Print(vars,
+                      "size += ngx_protobuf_size_uint32_field("
+                      "vals[i], $fnum$);\n");
+        break;
+      case FieldDescriptor::TYPE_SINT32:
+        printer.Print(vars,
+                      "size += ngx_protobuf_size_sint32_field("
+                      "vals[i], $fnum$);\n");
+        break;
+      case FieldDescriptor::TYPE_UINT64:
+      case FieldDescriptor::TYPE_INT64:
+        printer.Print(vars,
+                      "size += ngx_protobuf_size_uint64_field("
+                      "vals[i], $fnum$);\n");
+        break;
+      case FieldDescriptor::TYPE_SINT64:
+        printer.Print(vars,
+                      "size += ngx_protobuf_size_sint64_field("
+                      "vals[i], $fnum$);\n");
+        break;
+      case FieldDescriptor::TYPE_FIXED32:
+      case FieldDescriptor::TYPE_SFIXED32:
+      case FieldDescriptor::TYPE_FLOAT:
+        printer.Print(vars,
+                      "size += ngx_protobuf_size_fixed32_field($fnum$);\n");
+        break;
+      case FieldDescriptor::TYPE_FIXED64:
+      case FieldDescriptor::TYPE_SFIXED64:
+      case FieldDescriptor::TYPE_DOUBLE:
+        printer.Print(vars,
+                      "size += ngx_protobuf_size_fixed64_field($fnum$);\n");
+        break;
+      default:
+        printer.Print(vars,
+                      "size += FIXME; /* size $ftype$ */\n");
+        break;
+      }
+
+      Outdent(printer);
+      printer.Print("}\n");
+    }
+    Outdent(printer);
+    printer.Print("}\n");
+  } else if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+    vars["froot"] = TypedefRoot(field->message_type()->full_name());
+
+    if (check) {
+      FullCuddledIf(printer, vars,
+                    "$has$",
+                    "&& obj->$fname$ != NULL",
+                    "n = $froot$__size(obj->$fname$);\n"
+                    "size += ngx_protobuf_size_message_field(n, $fnum$);");
+    } else {
+      FullSimpleIf(printer, vars,
+                   "obj->$fname$ != NULL",
+                   "n = $froot$__size(obj->$fname$);\n"
+                   "size += ngx_protobuf_size_message_field(n, $fnum$);");
+    }
+  } else {
+    const char *stmt;
+
+    switch (field->type()) {
+    case FieldDescriptor::TYPE_BYTES:
+    case FieldDescriptor::TYPE_STRING:
+      stmt = "size += ngx_protobuf_size_string_field("
+        "&obj->$fname$, $fnum$);";
+      break;
+    case FieldDescriptor::TYPE_BOOL:
+      stmt = "size += ngx_protobuf_size_uint32_field("
+        "(obj->$fname$ != 0), $fnum$);";
+      break;
+    case FieldDescriptor::TYPE_ENUM:
+    case FieldDescriptor::TYPE_UINT32:
+    case FieldDescriptor::TYPE_INT32:
+      stmt = "size += ngx_protobuf_size_uint32_field("
+        "obj->$fname$, $fnum$);";
+      break;
+    case FieldDescriptor::TYPE_SINT32:
+      stmt = "size += ngx_protobuf_size_sint32_field("
+        "obj->$fname$, $fnum$);";
+      break;
+    case FieldDescriptor::TYPE_UINT64:
+    case FieldDescriptor::TYPE_INT64:
+      stmt = "size += ngx_protobuf_size_uint64_field("
+        "obj->$fname$, $fnum$);";
+      break;
+    case FieldDescriptor::TYPE_SINT64:
+      stmt = "size += ngx_protobuf_size_sint64_field("
+        "obj->$fname$, $fnum$);";
+      break;
+    case FieldDescriptor::TYPE_FIXED32:
+    case FieldDescriptor::TYPE_SFIXED32:
+    case FieldDescriptor::TYPE_FLOAT:
+      stmt = "size += ngx_protobuf_size_fixed32_field($fnum$);";
+      break;
+    case FieldDescriptor::TYPE_FIXED64:
+    case FieldDescriptor::TYPE_SFIXED64:
+    case FieldDescriptor::TYPE_DOUBLE:
+      stmt = "size += ngx_protobuf_size_fixed64_field($fnum$);";
+      break;
+    default:
+      stmt = "size += FIXME; /* size $ftype$ */";
+      break;
+    }
+
+    if (check) {
+      FullSimpleIf(printer, vars, "$has$", stmt);
+    } else {
+      printer.Print(vars, stmt);
+      printer.Print("\n");
+    }
+  }
+}
+
 void
 Generator::GenerateSize(const Descriptor* desc, io::Printer& printer)
 {
@@ -79,7 +286,7 @@ Generator::GenerateSize(const Descriptor* desc, io::Printer& printer)
           break;
         case FieldDescriptor::TYPE_UINT64:
         case FieldDescriptor::TYPE_INT64:
-          printer.Print("size += ngx_protobuf_size_uint32(fptr[i]);\n");
+          printer.Print("size += ngx_protobuf_size_uint64(fptr[i]);\n");
           break;
         case FieldDescriptor::TYPE_SINT64:
           printer.Print("size += ngx_protobuf_size_sint64(fptr[i]);\n");
@@ -121,215 +328,51 @@ Generator::GenerateSize(const Descriptor* desc, io::Printer& printer)
   }
 
   printer.Print("size_t      size = 0;\n");
+  if (HasPresenceWords(desc)) {
+    printer.Print("uint32_t    bits;\n");
+  }
   if (flags.has_packed() || flags.has_message()) {
     printer.Print("size_t      n;\n");
   }
-  if (iterates || HasUnknownFields(desc)) {
+  if (iterates || (HasUnknownFields(desc) && !HasRawUnknown(desc))) {
     // we need to iterate any repeated non-fixed field or unknown fields
     printer.Print("ngx_uint_t  i;\n");
   }
   printer.Print("\n");
+  FullCuddledIf(printer, vars,
+                "obj->__wire.data != NULL",
+                "&& $root$__is_clean(obj)",
+                "return obj->__wire.len;");
+  printer.Print("\n");
 
-  for (int i = 0; i < desc->field_count(); ++i) {
-    const FieldDescriptor *field = desc->field(i);
-
-    vars["fname"] = field->name();
-    vars["ftype"] = FieldRealType(field);
-    vars["fnum"] = Number(field->number());
-
-    if (field->is_repeated()) {
-
-      CuddledIf(printer, vars,
-                "obj->__has_$fname$",
-                "&& obj->$fname$ != NULL\n"
-                "&& obj->$fname$->nelts > 0");
-
-      if (field->is_packable() && field->options().packed()) {
-        printer.Print(vars,
-                      "n = $root$_$fname$__packed_size(\n");
-        Indented(printer, vars, "obj->$fname$);\n");
-
-        printer.Print("\n");
-
-        printer.Print(vars,
-                      "size += ngx_protobuf_size_message_field(n, $fnum$);\n");
-
-      } else if (IsFixedWidth(field)) {
-
-        // size calculation of a non-packed repeated fixed-width field
+  if (HasPresenceWords(desc)) {
+    std::vector<const FieldDescriptor *> fields;
 
-        switch (field->type()) {
-        case FieldDescriptor::TYPE_FIXED32:
-        case FieldDescriptor::TYPE_SFIXED32:
-        case FieldDescriptor::TYPE_FLOAT:
-          printer.Print(vars,
-                        "size += obj->$fname$->nelts *\n"
-                        "    ngx_protobuf_size_fixed32_field($fnum$);\n");
-          break;
-        case FieldDescriptor::TYPE_FIXED64:
-        case FieldDescriptor::TYPE_SFIXED64:
-        case FieldDescriptor::TYPE_DOUBLE:
-          printer.Print(vars,
-                        "size += obj->$fname$->nelts *\n"
-                        "    ngx_protobuf_size_fixed64_field($fnum$);\n");
-          break;
-        default:
-          break;
-        }
-      } else {
-
-        // size calculation of a non-packed repeated non-fixed width field
+    for (int i = 0; i < desc->field_count(); ++i) {
+      fields.push_back(desc->field(i));
+    }
 
-        printer.Print(vars,
-                      "$ftype$ *vals = obj->$fname$->elts;\n"
-                      "\n"
-                      "for (i = 0; i < obj->$fname$->nelts; ++i) {\n");
-        Indent(printer);
+    std::sort(fields.begin(), fields.end(), FieldDescriptorSorter());
 
-        switch (field->type()) {
-        case FieldDescriptor::TYPE_MESSAGE:
-          vars["froot"] = TypedefRoot(field->message_type()->full_name());
-          printer.Print(vars,
-                        "n = $froot$__size(vals + i);\n"
-                        "size += ngx_protobuf_size_message_field("
-                        "n, $fnum$);\n");
-          break;
-        case FieldDescriptor::TYPE_BYTES:
-        case FieldDescriptor::TYPE_STRING:
-          printer.Print(vars,
-                        "size += ngx_protobuf_size_string_field("
-                        "vals + i, $fnum$);\n");
-          break;
-        case FieldDescriptor::TYPE_BOOL:
-          printer.Print(vars,
-                        "size += ngx_protobuf_size_uint32_field("
-                        "(vals[i] != 0), $fnum$);\n");
-          break;
-        case FieldDescriptor::TYPE_ENUM:
-        case FieldDescriptor::TYPE_UINT32:
-        case FieldDescriptor::TYPE_INT32:
-          printer.Print(vars,
-                        "size += ngx_protobuf_size_uint32_field("
-                        "vals[i], $fnum$);\n");
-          break;
-        case FieldDescriptor::TYPE_SINT32:
-          printer.Print(vars,
-                        "size += ngx_protobuf_size_sint32_field("
-                        "vals[i], $fnum$);\n");
-          break;
-        case FieldDescriptor::TYPE_UINT64:
-        case FieldDescriptor::TYPE_INT64:
-          printer.Print(vars,
-                        "size += ngx_protobuf_size_uint64_field("
-                        "vals[i], $fnum$);\n");
-          break;
-        case FieldDescriptor::TYPE_SINT64:
-          printer.Print(vars,
-                        "size += ngx_protobuf_size_sint64_field("
-                        "vals[i], $fnum$);\n");
-          break;
-        case FieldDescriptor::TYPE_FIXED32:
-        case FieldDescriptor::TYPE_SFIXED32:
-        case FieldDescriptor::TYPE_FLOAT:
-          printer.Print(vars,
-                        "size += ngx_protobuf_size_fixed32_field($fnum$);\n");
-          break;
-        case FieldDescriptor::TYPE_FIXED64:
-        case FieldDescriptor::TYPE_SFIXED64:
-        case FieldDescriptor::TYPE_DOUBLE:
-          printer.Print(vars,
-                        "size += ngx_protobuf_size_fixed64_field($fnum$);\n");
-          break;
-        default:
-          printer.Print(vars,
-                        "size += FIXME; /* size $ftype$ */\n");
-          break;
-        }
-
-        Outdent(printer);
-        printer.Print("}\n");
-      }
-      Outdent(printer);
-      printer.Print("}\n");
-    } else {
-      switch (field->type()) {
-      case FieldDescriptor::TYPE_MESSAGE:
-        vars["froot"] = TypedefRoot(field->message_type()->full_name());
-        FullCuddledIf(printer, vars,
-                      "obj->__has_$fname$",
-                      "&& obj->$fname$ != NULL",
-                      "n = $froot$__size(obj->$fname$);\n"
-                      "size += ngx_protobuf_size_message_field(n, $fnum$);");
-        break;
-      case FieldDescriptor::TYPE_BYTES:
-      case FieldDescriptor::TYPE_STRING:
-        FullSimpleIf(printer, vars,
-                     "obj->__has_$fname$",
-                     "size += ngx_protobuf_size_string_field("
-                     "&obj->$fname$, $fnum$);");
-        break;
-      case FieldDescriptor::TYPE_BOOL:
-        FullSimpleIf(printer, vars,
-                     "obj->__has_$fname$",
-                     "size += ngx_protobuf_size_uint32_field("
-                     "(obj->$fname$ != 0), $fnum$);");
-        break;
-      case FieldDescriptor::TYPE_ENUM:
-      case FieldDescriptor::TYPE_UINT32:
-      case FieldDescriptor::TYPE_INT32:
-        FullSimpleIf(printer, vars,
-                     "obj->__has_$fname$",
-                     "size += ngx_protobuf_size_uint32_field("
-                     "obj->$fname$, $fnum$);");
-        break;
-      case FieldDescriptor::TYPE_SINT32:
-        FullSimpleIf(printer, vars,
-                     "obj->__has_$fname$",
-                     "size += ngx_protobuf_size_sint32_field("
-                     "obj->$fname$, $fnum$);");
-        break;
-      case FieldDescriptor::TYPE_UINT64:
-      case FieldDescriptor::TYPE_INT64:
-        FullSimpleIf(printer, vars,
-                     "obj->__has_$fname$",
-                     "size += ngx_protobuf_size_uint64_field("
-                     "obj->$fname$, $fnum$);");
-        break;
-      case FieldDescriptor::TYPE_SINT64:
-        FullSimpleIf(printer, vars,
-                     "obj->__has_$fname$",
-                     "size += ngx_protobuf_size_sint64_field("
-                     "obj->$fname$, $fnum$);");
-        break;
-      case FieldDescriptor::TYPE_FIXED32:
-      case FieldDescriptor::TYPE_SFIXED32:
-      case FieldDescriptor::TYPE_FLOAT:
-        FullSimpleIf(printer, vars,
-                     "obj->__has_$fname$",
-                     "size += ngx_protobuf_size_fixed32_field($fnum$);");
-        break;
-      case FieldDescriptor::TYPE_FIXED64:
-      case FieldDescriptor::TYPE_SFIXED64:
-      case FieldDescriptor::TYPE_DOUBLE:
-        FullSimpleIf(printer, vars,
-                     "obj->__has_$fname$",
-                     "size += ngx_protobuf_size_fixed64_field($fnum$);");
-        break;
-      default:
-        printer.Print(vars,
-                      "size += FIXME; /* size $ftype$ */\n");
-        break;
-      }
+    GeneratePresenceLoop(desc, fields, false, printer);
+  } else {
+    for (int i = 0; i < desc->field_count(); ++i) {
+      GenerateSizeField(desc->field(i), true, printer);
     }
   }
 
   if (desc->extension_range_count() > 0) {
     FullSimpleIf(printer, vars,
-                 "obj->__extensions != NULL",
-                 "size += ngx_protobuf_size_extensions(obj->__extensions);");
+                 "obj->__extensions.nelts > 0",
+                 "size += ngx_protobuf_size_extensions(&obj->__extensions);");
   }
 
-  if (HasUnknownFields(desc)) {
+  if (HasRawUnknown(desc)) {
+    printer.Print("\n");
+    FullSimpleIf(printer, vars,
+                 "obj->__unknown != NULL",
+                 "size += ngx_protobuf_size_unknown_spans(obj->__unknown);");
+  } else if (HasUnknownFields(desc)) {
     printer.Print("\n");
     CuddledIf(printer, vars,
 	      "obj->__unknown != NULL",
@@ -52,8 +52,11 @@ Generator::GenerateEnumDecl(const EnumDescriptor* desc, io::Printer& printer)
 
   Outdent(printer);
   printer.Print("} $type$;\n"
+                "\n"
+                "extern ngx_protobuf_enum_descriptor_t $root$__descriptor;\n"
                 "\n",
-                "type", type);
+                "type", type,
+                "root", TypedefRoot(desc->full_name()));
 }
 
 void
@@ -78,14 +81,16 @@ Generator::GenerateTypedef(const Descriptor* desc, io::Printer& printer)
   bool hasself = false;
   bool unknown = HasUnknownFields(desc);
 
+  // the extension fields are inline, but unknown fields are a pointer
+
   if (desc->extension_range_count() > 0) {
-    maxtype = sizeof("ngx_rbtree_t") - 1;
-    hasptr = true;
+    maxtype = sizeof("ngx_protobuf_extensions_t") - 1;
+    hasptr = unknown;
   } else if (unknown) {
     maxtype = sizeof("ngx_array_t") - 1;
     hasptr = true;
   } else {
-    maxtype = sizeof("uint32_t") - 1;
+    maxtype = sizeof("ngx_str_t") - 1;
   }
 
   for (int i = 0; i < desc->field_count(); ++i) {
@@ -150,15 +155,16 @@ Generator::GenerateTypedef(const Descriptor* desc, io::Printer& printer)
     printer.Print(vars, "$type$$tspace$ $star$$fname$;\n");
   }
 
-  // extension tree
+  // extension fields
 
   if (desc->extension_range_count() > 0) {
     std::map<std::string, std::string> vars;
-    std::string ftype = "ngx_rbtree_t";
+    std::string ftype = "ngx_protobuf_extensions_t";
 
     vars["type"] = ftype;
     vars["tspace"] = Spaces(maxtype - ftype.length());
-    printer.Print(vars, "$type$$tspace$ *__extensions;\n");
+    vars["star"] = hasptr ? " " : "";
+    printer.Print(vars, "$type$$tspace$ $star$__extensions;\n");
   }
 
   // unknown fields (if applicable)
@@ -169,23 +175,67 @@ Generator::GenerateTypedef(const Descriptor* desc, io::Printer& printer)
 
     vars["type"] = ftype;
     vars["tspace"] = Spaces(maxtype - ftype.length());
+    vars["utype"] = HasRawUnknown(desc)
+      ? "ngx_protobuf_unknown_span_t" : "ngx_protobuf_unknown_field_t";
     printer.Print(vars,
-		  "/* ngx_protobuf_unknown_field_t */\n"
+		  "/* $utype$ */\n"
 		  "$type$$tspace$ *__unknown;\n");
   }
 
+  // the bytes the message was unpacked from, reused by __size and
+  // __pack for as long as the message is clean
+
+  {
+    std::map<std::string, std::string> vars;
+    std::string ftype = "ngx_str_t";
+
+    vars["type"] = ftype;
+    vars["tspace"] = Spaces(maxtype - ftype.length());
+    vars["star"] = hasptr ? " " : "";
+    printer.Print(vars, "$type$$tspace$ $star$__wire;\n");
+  }
+
   // the "has" bits are last
 
-  for (int i = 0; i < desc->field_count(); ++i) {
-    const FieldDescriptor *field = desc->field(i);
+  if (HasPresenceWords(desc)) {
     std::string ftype = "uint32_t";
-    std::string fname = field->name();
     std::map<std::string, std::string> vars;
 
     vars["type"] = ftype;
     vars["tspace"] = Spaces(maxtype - ftype.length());
-    vars["fname"] = "__has_" + field->name();
-    vars["nspace"] = Spaces(maxname - field->name().length());
+    vars["star"] = (hasptr) ? " " : "";
+    vars["words"] = Number(PresenceWordCount(desc));
+
+    printer.Print(vars, "$type$$tspace$ $star$__has[$words$];\n");
+  } else {
+    for (int i = 0; i < desc->field_count(); ++i) {
+      const FieldDescriptor *field = desc->field(i);
+      std::string ftype = "uint32_t";
+      std::string fname = field->name();
+      std::map<std::string, std::string> vars;
+
+      vars["type"] = ftype;
+      vars["tspace"] = Spaces(maxtype - ftype.length());
+      vars["fname"] = "__has_" + field->name();
+      vars["nspace"] = Spaces(maxname - field->name().length());
+      vars["star"] = (hasptr) ? " " : "";
+
+      printer.Print(vars, "$type$$tspace$ $star$$fname$$nspace$ : 1;\n");
+    }
+  }
+
+  // followed by the dirty bit, which is set by the mutators
+
+  {
+    std::map<std::string, std::string> vars;
+    std::string ftype = "uint32_t";
+    std::string fname = "__dirty";
+    unsigned int width = HasPresenceWords(desc) ? 0 : maxname + 6;
+
+    vars["type"] = ftype;
+    vars["tspace"] = Spaces(maxtype - ftype.length());
+    vars["fname"] = fname;
+    vars["nspace"] = Spaces(width > fname.length() ? width - fname.length() : 0);
     vars["star"] = (hasptr) ? " " : "";
 
     printer.Print(vars, "$type$$tspace$ $star$$fname$$nspace$ : 1;\n");
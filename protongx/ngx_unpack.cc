@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cstdio>
+
 #include <ngx_flags.h>
 #include <ngx_generator.h>
 #include <google/protobuf/descriptor.pb.h>
@@ -11,9 +14,15 @@ void
 Generator::GenerateUnpackUnknown(const Descriptor *desc, io::Printer& printer)
 {
   if (HasUnknownFields(desc)) {
-    printer.Print("rc = ngx_protobuf_unpack_unknown_field(field, wire, ctx,\n"
-		  "    &obj->__unknown);\n"
-		  "if (rc != NGX_OK) ");
+    if (HasRawUnknown(desc)) {
+      printer.Print("rc = ngx_protobuf_unpack_unknown_span(tag, field, wire, "
+                    "ctx,\n"
+                    "    &obj->__unknown);\n");
+    } else {
+      printer.Print("rc = ngx_protobuf_unpack_unknown_field(field, wire, ctx,\n"
+                    "    &obj->__unknown);\n");
+    }
+    printer.Print("if (rc != NGX_OK) ");
     OpenBrace(printer);
     printer.Print("return rc;\n");
     CloseBrace(printer);
@@ -23,7 +32,533 @@ Generator::GenerateUnpackUnknown(const Descriptor *desc, io::Printer& printer)
 }
 
 void
-Generator::GenerateUnpack(const Descriptor* desc, io::Printer& printer)
+Generator::UnpackVariantVars(int variant,
+                             std::map<std::string, std::string>& vars)
+{
+  std::string suffix;
+
+  if (variant & UNPACK_PADDED) {
+    suffix += "_padded";
+    vars["read"] = "ngx_protobuf_read_padded_";
+  } else {
+    vars["read"] = "ngx_protobuf_read_";
+  }
+
+  if (variant & UNPACK_ALIAS) {
+    suffix += "_alias";
+    vars["string"] = vars["read"] + "string_alias";
+    vars["spool"] = "";
+  } else {
+    vars["string"] = vars["read"] + "string_copy";
+    vars["spool"] = ", pool";
+  }
+
+  vars["variant"] = suffix;
+}
+
+void
+Generator::GenerateUnpackVars(const FieldDescriptor *field,
+                              int variant,
+                              std::map<std::string, std::string>& vars)
+{
+  vars["root"] = TypedefRoot(field->containing_type()->full_name());
+  vars["fname"] = field->name();
+  vars["ffull"] = field->full_name();
+  vars["ftype"] = FieldRealType(field);
+  vars["fnum"] = Number(field->number());
+
+  PresenceVars(field, vars);
+  UnpackVariantVars(variant, vars);
+}
+
+void
+Generator::GenerateUnpackValue(const FieldDescriptor *field,
+                               int variant,
+                               io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  GenerateUnpackVars(field, variant, vars);
+
+  if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+
+    // messages have a helper function that we call, which takes
+    // care of everything.
+
+    FullSimpleIf(printer, vars,
+                 "$read$uint32(pos, end, &mlen) != NGX_OK",
+                 "return NGX_ABORT;");
+    printer.Print(vars, "rc = $root$__unpack$variant$_$fname$(obj, ctx, mlen);\n");
+    FullSimpleIf(printer, vars, "rc != NGX_OK", "return rc;");
+
+  } else if (field->is_repeated()) {
+
+    // repeated non-message field
+
+    printer.Print(vars,
+                  "$ftype$ *fptr;\n"
+                  "\n"
+                  "fptr = $root$__add__$fname$(obj, pool);\n");
+
+    FullSimpleIf(printer, vars, "fptr == NULL", "return NGX_ERROR;");
+
+    switch (field->type()) {
+    case FieldDescriptor::TYPE_BYTES:
+    case FieldDescriptor::TYPE_STRING:
+      FullSimpleIf(printer, vars,
+                   "$string$(pos, end, fptr$spool$) != NGX_OK",
+                   "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_BOOL:
+      FullSimpleIf(printer, vars,
+                   "$read$uint32(pos, end, &flag) != NGX_OK",
+                   "return NGX_ABORT;");
+      printer.Print(vars,
+                    "*fptr = (flag != 0);\n"
+                    "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_UINT32:
+      FullSimpleIf(printer, vars,
+                   "$read$uint32(pos, end, fptr) != NGX_OK",
+                   "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_ENUM:
+    case FieldDescriptor::TYPE_INT32:
+      FullCuddledIf(printer, vars,
+                    "$read$uint32(pos, end,",
+                    "(uint32_t *)fptr) != NGX_OK",
+                    "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_SINT32:
+      FullSimpleIf(printer, vars,
+                   "$read$uint32(pos, end, &u32v) "
+                   "!= NGX_OK",
+                   "return NGX_ABORT;");
+      printer.Print(vars,
+                    "*fptr = NGX_PROTOBUF_Z32_DECODE(u32v);\n"
+                    "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_UINT64:
+      FullSimpleIf(printer, vars,
+                   "$read$uint64(pos, end, fptr) != NGX_OK",
+                   "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_INT64:
+      FullCuddledIf(printer, vars,
+                    "$read$uint64(pos, end,",
+                    "(uint64_t *)fptr) != NGX_OK",
+                    "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_SINT64:
+      FullSimpleIf(printer, vars,
+                   "$read$uint64(pos, end, &u64v) "
+                   "!= NGX_OK",
+                   "return NGX_ABORT;");
+      printer.Print(vars,
+                    "*fptr = NGX_PROTOBUF_Z64_DECODE(u64v);\n"
+                    "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_FIXED32:
+      FullSimpleIf(printer, vars,
+                   "ngx_protobuf_read_fixed32(pos, end, fptr) != NGX_OK",
+                   "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_SFIXED32:
+      FullCuddledIf(printer, vars,
+                    "ngx_protobuf_read_fixed32(pos, end,",
+                    "(uint32_t *)fptr) != NGX_OK",
+                    "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_FLOAT:
+      FullSimpleIf(printer, vars,
+                   "ngx_protobuf_read_float(pos, end, fptr) != NGX_OK",
+                   "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n"); 
+      break;
+    case FieldDescriptor::TYPE_FIXED64:
+      FullSimpleIf(printer, vars,
+                   "ngx_protobuf_read_fixed64(pos, end, fptr) != NGX_OK",
+                   "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_SFIXED64:
+      FullCuddledIf(printer, vars,
+                    "ngx_protobuf_read_fixed64(pos, end,",
+                    "(uint64_t *)fptr) != NGX_OK",
+                    "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_DOUBLE:
+      FullSimpleIf(printer, vars,
+                   "ngx_protobuf_read_double(pos, end, fptr) != NGX_OK",
+                   "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n"); 
+      break;
+    default:
+      printer.Print(vars, "#error cannot read $ftype$\n");
+      break;
+    }
+  } else {
+
+    // non-repeated non-message field
+
+    switch (field->type()) {
+    case FieldDescriptor::TYPE_BYTES:
+    case FieldDescriptor::TYPE_STRING:
+      FullCuddledIf(printer, vars,
+                    "$string$(pos, end,",
+                    "&obj->$fname$$spool$) != NGX_OK",
+                    "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_BOOL:
+      FullCuddledIf(printer, vars,
+                    "$read$uint32(pos, end,",
+                    "(uint32_t *)&flag) != NGX_OK",
+                    "return NGX_ABORT;");
+      printer.Print(vars,
+                    "obj->$fname$ = (flag != 0);\n"
+                    "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_UINT32:
+      FullCuddledIf(printer, vars,
+                    "$read$uint32(pos, end,",
+                    "&obj->$fname$) != NGX_OK",
+                    "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_ENUM:
+    case FieldDescriptor::TYPE_INT32:
+      FullCuddledIf(printer, vars,
+                    "$read$uint32(pos, end,",
+                    "(uint32_t *)&obj->$fname$) != NGX_OK",
+                    "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_SINT32:
+      FullSimpleIf(printer, vars,
+                   "$read$uint32(pos, end, &u32v) != NGX_OK",
+                   "return NGX_ABORT;");
+      printer.Print(vars,
+                    "obj->$fname$ = NGX_PROTOBUF_Z32_DECODE(u32v);\n"
+                    "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_UINT64:
+      FullCuddledIf(printer, vars,
+                    "$read$uint64(pos, end,",
+                    "&obj->$fname$) != NGX_OK",
+                    "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_INT64:
+      FullCuddledIf(printer, vars,
+                    "$read$uint64(pos, end,",
+                    "(uint64_t *)&obj->$fname$) != NGX_OK",
+                    "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_SINT64:
+      FullSimpleIf(printer, vars,
+                   "$read$uint64(pos, end, &u64v) != NGX_OK",
+                   "return NGX_ABORT;");
+      printer.Print(vars,
+                    "obj->$fname$ = NGX_PROTOBUF_Z64_DECODE(u64v);\n"
+                    "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_FIXED32:
+      FullCuddledIf(printer, vars,
+                    "ngx_protobuf_read_fixed32(pos, end,",
+                    "&obj->$fname$) != NGX_OK",
+                   "return NGX_ABORT;");
+      printer.Print(vars,
+                    "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_SFIXED32:
+      FullCuddledIf(printer, vars,
+                    "ngx_protobuf_read_fixed32(pos, end,",
+                    "(uint32_t *)&obj->$fname$) != NGX_OK",
+                    "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_FLOAT:
+      FullCuddledIf(printer, vars,
+                    "ngx_protobuf_read_float(pos, end,",
+                    "&obj->$fname$) != NGX_OK",
+                    "return NGX_ABORT;");
+      printer.Print(vars,
+                    "$sethas$;\n"); 
+      break;
+    case FieldDescriptor::TYPE_FIXED64:
+      FullCuddledIf(printer, vars,
+                    "ngx_protobuf_read_fixed64(pos, end,",
+                    "&obj->$fname$) != NGX_OK",
+                   "return NGX_ABORT;");
+      printer.Print(vars,
+                    "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_SFIXED64:
+      FullCuddledIf(printer, vars,
+                    "ngx_protobuf_read_fixed64(pos, end,",
+                    "(uint64_t *)&obj->$fname$) != NGX_OK",
+                    "return NGX_ABORT;");
+      printer.Print(vars, "$sethas$;\n");
+      break;
+    case FieldDescriptor::TYPE_DOUBLE:
+      FullCuddledIf(printer, vars,
+                    "ngx_protobuf_read_double(pos, end,",
+                    "&obj->$fname$) != NGX_OK",
+                    "return NGX_ABORT;");
+      printer.Print(vars,
+                    "$sethas$;\n"); 
+      break;
+    default:
+      printer.Print(vars,
+                    "FIXME; /* read $ftype$ */\n");
+      break;
+    }
+  }
+}
+
+void
+Generator::GenerateUnpackPacked(const FieldDescriptor *field,
+                                int variant,
+                                io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  GenerateUnpackVars(field, variant, vars);
+
+  FullSimpleIf(printer, vars,
+               "$read$uint32(pos, end, &mlen) != NGX_OK",
+               "return NGX_ABORT;");
+
+  printer.Print("mend = *pos + mlen;\n");
+  FullSimpleIf(printer, vars, "mend > end", "return NGX_ABORT;");
+  printer.Print("while (*pos < mend) {\n");
+  Indent(printer);
+
+  printer.Print(vars,
+                "$ftype$ *fptr;\n"
+                "\n"
+                "fptr = $root$__add__$fname$(obj, pool);\n");
+
+  FullSimpleIf(printer, vars, "fptr == NULL", "return NGX_ERROR;");
+
+  // now read the data type
+
+  switch (field->type()) {
+  case FieldDescriptor::TYPE_BOOL:
+    FullSimpleIf(printer, vars,
+                 "$read$uint32(pos, end, &flag) != NGX_OK",
+                 "return NGX_ABORT;");
+    printer.Print(vars,
+                  "*fptr = (flag != 0);\n"
+                  "$sethas$;\n");
+    break;
+  case FieldDescriptor::TYPE_UINT32:
+    FullSimpleIf(printer, vars,
+                 "$read$uint32(pos, end, fptr) != NGX_OK",
+                 "return NGX_ABORT;");
+    printer.Print(vars,
+                  "$sethas$;\n");
+    break;
+  case FieldDescriptor::TYPE_ENUM:
+  case FieldDescriptor::TYPE_INT32:
+    FullCuddledIf(printer, vars,
+                  "$read$uint32(pos, end,",
+                  "(uint32_t *)fptr) != NGX_OK",
+                  "return NGX_ABORT;");
+    printer.Print(vars,
+                  "$sethas$;\n");
+    break;
+  case FieldDescriptor::TYPE_SINT32:
+    FullSimpleIf(printer, vars,
+                 "$read$uint32(pos, end, &u32v) "
+                 "!= NGX_OK",
+                 "return NGX_ABORT;");
+    printer.Print(vars,
+                  "*fptr = NGX_PROTOBUF_Z32_DECODE(u32v);\n"
+                  "$sethas$;\n");
+    break;
+  case FieldDescriptor::TYPE_UINT64:
+    FullSimpleIf(printer, vars,
+                 "$read$uint64(pos, end, fptr) != NGX_OK",
+                 "return NGX_ABORT;");
+    printer.Print(vars,
+                  "$sethas$;\n");
+    break;
+  case FieldDescriptor::TYPE_INT64:
+    FullCuddledIf(printer, vars,
+                  "$read$uint64(pos, end,",
+                  "(uint64_t *)fptr) != NGX_OK",
+                  "return NGX_ABORT;");
+    printer.Print(vars,
+                  "$sethas$;\n");
+    break;
+  case FieldDescriptor::TYPE_SINT64:
+    FullSimpleIf(printer, vars,
+                 "$read$uint64(pos, end, &u64v) "
+                 "!= NGX_OK",
+                 "return NGX_ABORT;");
+    printer.Print(vars,
+                  "*fptr = NGX_PROTOBUF_Z64_DECODE(u64v);\n"
+                  "$sethas$;\n");
+    break;
+  case FieldDescriptor::TYPE_FIXED32:
+    FullSimpleIf(printer, vars,
+                 "ngx_protobuf_read_fixed32(pos, end, fptr) != NGX_OK",
+                 "return NGX_ABORT;");
+    printer.Print(vars,
+                  "$sethas$;\n");
+    break;
+  case FieldDescriptor::TYPE_SFIXED32:
+    FullCuddledIf(printer, vars,
+                  "ngx_protobuf_read_fixed32(pos, end,",
+                  "(uint32_t *)fptr) != NGX_OK",
+                  "return NGX_ABORT;");
+    printer.Print(vars, "$sethas$;\n");
+    break;
+  case FieldDescriptor::TYPE_FLOAT:
+    FullSimpleIf(printer, vars,
+                 "ngx_protobuf_read_float(pos, end, fptr) != NGX_OK",
+                 "return NGX_ABORT;");
+    printer.Print(vars,
+                  "$sethas$;\n"); 
+    break;
+  case FieldDescriptor::TYPE_FIXED64:
+    FullSimpleIf(printer, vars,
+                 "ngx_protobuf_read_fixed64(pos, end, fptr) != NGX_OK",
+                 "return NGX_ABORT;");
+    printer.Print(vars,
+                  "$sethas$;\n");
+    break;
+  case FieldDescriptor::TYPE_SFIXED64:
+    FullCuddledIf(printer, vars,
+                  "ngx_protobuf_read_fixed64(pos, end,",
+                  "(uint64_t *)fptr) != NGX_OK",
+                  "return NGX_ABORT;");
+    printer.Print(vars, "$sethas$;\n");
+    break;
+  case FieldDescriptor::TYPE_DOUBLE:
+    FullSimpleIf(printer, vars,
+                 "ngx_protobuf_read_double(pos, end, fptr) != NGX_OK",
+                 "return NGX_ABORT;");
+    printer.Print(vars,
+                  "$sethas$;\n"); 
+    break;
+  default:
+    printer.Print(vars,
+                  "#error cannot read packed $ftype$\n");
+    break;
+  }
+
+  CloseBrace(printer);
+}
+
+void
+Generator::GenerateUnpackFastPath(const Descriptor* desc,
+                                  int variant,
+                                  io::Printer& printer)
+{
+  std::vector<const FieldDescriptor *> fields;
+
+  for (int i = 0; i < desc->field_count(); ++i) {
+    fields.push_back(desc->field(i));
+  }
+
+  std::sort(fields.begin(), fields.end(), FieldDescriptorSorter());
+
+  printer.Print("\n"
+                "/* fields in field number order */\n");
+
+  for (size_t i = 0; i < fields.size(); ++i) {
+    const FieldDescriptor *field = fields[i];
+    std::map<std::string, std::string> vars;
+    uint32_t tag = (uint32_t) field->number() << 3;
+    char b0[sizeof("0x00")];
+    char b1[sizeof("0x00")];
+
+    // the tag that the field is expected to be written with
+
+    if (field->is_packable() && field->options().packed()) {
+      tag |= 2;
+    } else {
+      switch (field->type()) {
+      case FieldDescriptor::TYPE_FIXED64:
+      case FieldDescriptor::TYPE_SFIXED64:
+      case FieldDescriptor::TYPE_DOUBLE:
+        tag |= 1;
+        break;
+      case FieldDescriptor::TYPE_MESSAGE:
+      case FieldDescriptor::TYPE_BYTES:
+      case FieldDescriptor::TYPE_STRING:
+        tag |= 2;
+        break;
+      case FieldDescriptor::TYPE_FIXED32:
+      case FieldDescriptor::TYPE_SFIXED32:
+      case FieldDescriptor::TYPE_FLOAT:
+        tag |= 5;
+        break;
+      default:
+        break;
+      }
+    }
+
+    // longer tags are rare enough to be left to the switch
+
+    if (tag >= 0x4000) {
+      continue;
+    }
+
+    vars["ffull"] = field->full_name();
+    vars["loop"] = field->is_repeated() ? "while" : "if";
+
+    if (tag < 0x80) {
+      snprintf(b0, sizeof(b0), "0x%02x", tag);
+      vars["b0"] = b0;
+      vars["len"] = "1";
+      printer.Print(vars,
+                    "\n"
+                    "/* $ffull$ */\n"
+                    "$loop$ (NGX_PROTOBUF_EXPECT_TAG1(pos, end, $b0$)) {\n"
+                    "    *pos += $len$;\n");
+    } else {
+      snprintf(b0, sizeof(b0), "0x%02x", (tag & 0x7f) | 0x80);
+      snprintf(b1, sizeof(b1), "0x%02x", tag >> 7);
+      vars["b0"] = b0;
+      vars["b1"] = b1;
+      vars["len"] = "2";
+      printer.Print(vars,
+                    "\n"
+                    "/* $ffull$ */\n"
+                    "$loop$ (NGX_PROTOBUF_EXPECT_TAG2(pos, end, $b0$, $b1$)) "
+                    "{\n"
+                    "    *pos += $len$;\n");
+    }
+
+    Indent(printer);
+
+    if (field->is_packable() && field->options().packed()) {
+      GenerateUnpackPacked(field, variant, printer);
+    } else {
+      GenerateUnpackValue(field, variant, printer);
+    }
+
+    CloseBrace(printer);
+  }
+}
+
+void
+Generator::GenerateUnpackVariant(const Descriptor* desc,
+                                 int variant,
+                                 io::Printer& printer)
 {
   Flags flags(desc);
 
@@ -33,6 +568,8 @@ Generator::GenerateUnpack(const Descriptor* desc, io::Printer& printer)
   vars["root"] = TypedefRoot(desc->full_name());
   vars["type"] = StructType(desc->full_name());
 
+  UnpackVariantVars(variant, vars);
+
   if (flags.has_message()) {
 
     // generate a static helper method to unpack each message field
@@ -56,9 +593,11 @@ Generator::GenerateUnpack(const Descriptor* desc, io::Printer& printer)
         vars["froot"] = TypedefRoot(field->message_type()->full_name());
         vars["space"] = Spaces(space);
 
+        PresenceVars(field, vars);
+
         printer.Print(vars,
                       "static ngx_int_t\n"
-                      "$root$__unpack_$fname$(\n"
+                      "$root$__unpack$variant$_$fname$(\n"
                       "    $type$ *obj,\n"
                       "    ngx_protobuf_context_t *ctx,\n"
                       "    size_t len)\n");
@@ -114,9 +653,9 @@ Generator::GenerateUnpack(const Descriptor* desc, io::Printer& printer)
 
 
         if (field->is_repeated()) {
-          printer.Print(vars, "rc = $froot$__unpack(fptr, ctx);\n");
+          printer.Print(vars, "rc = $froot$__unpack$variant$(fptr, ctx);\n");
         } else {
-          printer.Print(vars, "rc = $froot$__unpack(obj->$fname$, ctx);\n");
+          printer.Print(vars, "rc = $froot$__unpack$variant$(obj->$fname$, ctx);\n");
         }
                       
         printer.Print("ctx->buffer.last = end0;\n"
@@ -124,7 +663,7 @@ Generator::GenerateUnpack(const Descriptor* desc, io::Printer& printer)
 
         FullSimpleIf(printer, vars,
                      "rc == NGX_OK",
-                     "obj->__has_$fname$ = 1;");
+                     "$sethas$;");
 
         printer.Print("\n"
                       "return rc;\n");
@@ -139,7 +678,7 @@ Generator::GenerateUnpack(const Descriptor* desc, io::Printer& printer)
 
   printer.Print(vars,
                 "ngx_int_t\n"
-                "$root$__unpack(\n"
+                "$root$__unpack$variant$(\n"
                 "    $type$ *obj,\n"
                 "    ngx_protobuf_context_t *ctx)\n"
                 "{\n");
@@ -150,7 +689,13 @@ Generator::GenerateUnpack(const Descriptor* desc, io::Printer& printer)
                 "u_char      **pos = &ctx->buffer.pos;\n"
                 "u_char       *end = ctx->buffer.last;\n");
 
-  if (flags.has_string() || flags.has_repnm()) {
+  if (variant & UNPACK_ALIAS) {
+    printer.Print("u_char       *start = *pos;\n");
+  }
+
+  if ((flags.has_string() && !(variant & UNPACK_ALIAS))
+      || flags.has_repnm())
+  {
     printer.Print("ngx_pool_t   *pool = ctx->pool;\n");
   }
 
@@ -173,20 +718,70 @@ Generator::GenerateUnpack(const Descriptor* desc, io::Printer& printer)
   if (flags.has_packed()) {
     printer.Print("u_char       *mend;\n");
   }
+  if (HasRawUnknown(desc)) {
+    printer.Print("u_char       *tag;\n");
+  }
   if (flags.has_message()
       || desc->extension_range_count() > 0
       || HasUnknownFields(desc)) {
     printer.Print("ngx_int_t     rc;\n");
   }
 
+  // __unpack picks the variant for the context once per message, so
+  // the variants themselves never look at its flags.  without a pool,
+  // strings can only be aliased.
+
+  if (variant == 0) {
+    printer.Print("\n");
+    SimpleIf(printer, vars, "ctx->padded");
+    FullCuddledIf(printer, vars,
+                  "ctx->reuse_strings",
+                  "|| ctx->pool == NULL",
+                  "return $root$__unpack_padded_alias(obj, ctx);");
+    printer.Print(vars,
+                  "\n"
+                  "return $root$__unpack_padded(obj, ctx);\n");
+    CloseBrace(printer);
+    printer.Print("\n");
+    FullCuddledIf(printer, vars,
+                  "ctx->reuse_strings",
+                  "|| ctx->pool == NULL",
+                  "return $root$__unpack_alias(obj, ctx);");
+  }
+
+  // adding repeated submessages marks the message dirty, so whether
+  // it was fresh is decided up front.
+
+  if (variant & UNPACK_ALIAS) {
+    printer.Print("\n");
+    FullCuddledIf(printer, vars,
+                  "obj->__wire.data != NULL",
+                  "|| obj->__dirty",
+                  "start = NULL;");
+  }
+
+  // well-formed input is consumed by the fast path, and whatever it
+  // stops at (fields out of order, extensions, unknown fields) goes
+  // through the switch below.
+
+  GenerateUnpackFastPath(desc, variant, printer);
+
   printer.Print("\n"
                 "while (*pos < end) {\n");
   Indent(printer);
+  if (HasRawUnknown(desc)) {
+    printer.Print("tag = *pos;\n");
+  }
   FullSimpleIf(printer, vars,
-               "ngx_protobuf_read_uint32(pos, end, &header) != NGX_OK",
+               "$read$uint32(pos, end, &header) != NGX_OK",
                "return NGX_ABORT;");
-  printer.Print("\n");
-  FullSimpleIf(printer, vars, "*pos >= end", "return NGX_ABORT;");
+
+  // the padded readers check the position after each value instead
+
+  if (!(variant & UNPACK_PADDED)) {
+    printer.Print("\n");
+    FullSimpleIf(printer, vars, "*pos >= end", "return NGX_ABORT;");
+  }
   printer.Print("\n"
                 "field = header >> 3;\n"
                 "wire = header & 0x07;\n"
@@ -201,6 +796,8 @@ Generator::GenerateUnpack(const Descriptor* desc, io::Printer& printer)
     vars["ftype"] = FieldRealType(field);
     vars["fnum"] = Number(field->number());
 
+    PresenceVars(field, vars);
+
     printer.Print(vars,
                   "case $fnum$: /* $ffull$ */\n");
     Indent(printer);
@@ -239,259 +836,7 @@ Generator::GenerateUnpack(const Descriptor* desc, io::Printer& printer)
 
     Indent(printer);
 
-    // the actual code to unpack this field
-
-    if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
-
-      // messages have a helper function that we call, which takes
-      // care of everything.
-
-      FullSimpleIf(printer, vars,
-                   "ngx_protobuf_read_uint32(pos, end, &mlen) != NGX_OK",
-                   "return NGX_ABORT;");
-      printer.Print(vars, "rc = $root$__unpack_$fname$(obj, ctx, mlen);\n");
-      FullSimpleIf(printer, vars, "rc != NGX_OK", "return rc;");
-
-    } else if (field->is_repeated()) {
-
-      // repeated non-message field
-
-      printer.Print(vars,
-                    "$ftype$ *fptr;\n"
-                    "\n"
-                    "fptr = $root$__add__$fname$(obj, pool);\n");
-
-      FullSimpleIf(printer, vars, "fptr == NULL", "return NGX_ERROR;");
-
-      switch (field->type()) {
-      case FieldDescriptor::TYPE_BYTES:
-      case FieldDescriptor::TYPE_STRING:
-        FullCuddledIf(printer, vars,
-                      "ngx_protobuf_read_string(pos, end, fptr,",
-                      "(ctx->reuse_strings) ? NULL : pool) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars, "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_BOOL:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_uint32(pos, end, &flag) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "*fptr = (flag != 0);\n"
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_UINT32:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_uint32(pos, end, fptr) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars, "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_ENUM:
-      case FieldDescriptor::TYPE_INT32:
-        FullCuddledIf(printer, vars,
-                      "ngx_protobuf_read_uint32(pos, end,",
-                      "(uint32_t *)fptr) != NGX_OK",
-                      "return NGX_ABORT;");
-        printer.Print(vars, "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_SINT32:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_uint32(pos, end, &u32v) "
-                     "!= NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "*fptr = NGX_PROTOBUF_Z32_DECODE(u32v);\n"
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_UINT64:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_uint64(pos, end, fptr) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars, "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_INT64:
-        FullCuddledIf(printer, vars,
-                      "ngx_protobuf_read_uint64(pos, end,",
-                      "(uint64_t *)fptr) != NGX_OK",
-                      "return NGX_ABORT;");
-        printer.Print(vars, "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_SINT64:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_uint64(pos, end, &u64v) "
-                     "!= NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "*fptr = NGX_PROTOBUF_Z64_DECODE(u64v);\n"
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_FIXED32:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_fixed32(pos, end, fptr) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars, "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_SFIXED32:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_fixed32(pos, end, &u32v) "
-                     "!= NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "*fptr = NGX_PROTOBUF_Z32_DECODE(u32v);\n"
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_FLOAT:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_float(pos, end, fptr) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars, "obj->__has_$fname$ = 1;\n"); 
-        break;
-      case FieldDescriptor::TYPE_FIXED64:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_fixed64(pos, end, fptr) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars, "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_SFIXED64:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_fixed64(pos, end, &u64v) "
-                     "!= NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "*fptr = NGX_PROTOBUF_Z64_DECODE(u64v);\n"
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_DOUBLE:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_double(pos, end, fptr) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars, "obj->__has_$fname$ = 1;\n"); 
-        break;
-      default:
-        printer.Print(vars, "#error cannot read $ftype$\n");
-        break;
-      }
-    } else {
-
-      // non-repeated non-message field
-
-      switch (field->type()) {
-      case FieldDescriptor::TYPE_BYTES:
-      case FieldDescriptor::TYPE_STRING:
-        FullCuddledIf(printer, vars,
-                      "ngx_protobuf_read_string(pos, end,",
-                      "&obj->$fname$,\n"
-                      "(ctx->reuse_strings) ? NULL : pool) != NGX_OK",
-                      "return NGX_ABORT;");
-        printer.Print(vars, "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_BOOL:
-        FullCuddledIf(printer, vars,
-                      "ngx_protobuf_read_uint32(pos, end,",
-                      "(uint32_t *)&flag) != NGX_OK",
-                      "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->$fname$ = (flag != 0);\n"
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_UINT32:
-        FullCuddledIf(printer, vars,
-                      "ngx_protobuf_read_uint32(pos, end,",
-                      "&obj->$fname$) != NGX_OK",
-                      "return NGX_ABORT;");
-        printer.Print(vars, "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_ENUM:
-      case FieldDescriptor::TYPE_INT32:
-        FullCuddledIf(printer, vars,
-                      "ngx_protobuf_read_uint32(pos, end,",
-                      "(uint32_t *)&obj->$fname$) != NGX_OK",
-                      "return NGX_ABORT;");
-        printer.Print(vars, "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_SINT32:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_uint32(pos, end, &u32v) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->$fname$ = NGX_PROTOBUF_Z32_DECODE(u32v);\n"
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_UINT64:
-        FullCuddledIf(printer, vars,
-                      "ngx_protobuf_read_uint64(pos, end,",
-                      "&obj->$fname$) != NGX_OK",
-                      "return NGX_ABORT;");
-        printer.Print(vars, "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_INT64:
-        FullCuddledIf(printer, vars,
-                      "ngx_protobuf_read_uint64(pos, end,",
-                      "(uint64_t *)&obj->$fname$) != NGX_OK",
-                      "return NGX_ABORT;");
-        printer.Print(vars, "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_SINT64:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_uint64(pos, end, &u64v) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->$fname$ = NGX_PROTOBUF_Z64_DECODE(u64v);\n"
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_FIXED32:
-        FullCuddledIf(printer, vars,
-                      "ngx_protobuf_read_fixed32(pos, end,",
-                      "&obj->$fname$) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_SFIXED32:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_fixed32(pos, end, &u32v) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->$fname$ = NGX_PROTOBUF_Z32_DECODE(u32v);\n"
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_FLOAT:
-        FullCuddledIf(printer, vars,
-                      "ngx_protobuf_read_float(pos, end,",
-                      "&obj->$fname$) != NGX_OK",
-                      "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->__has_$fname$ = 1;\n"); 
-        break;
-      case FieldDescriptor::TYPE_FIXED64:
-        FullCuddledIf(printer, vars,
-                      "ngx_protobuf_read_fixed64(pos, end,",
-                      "&obj->$fname$) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->__has_$fname$ = 1;\n");
-      case FieldDescriptor::TYPE_SFIXED64:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_fixed64(pos, end, &u64v) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->$fname$ = NGX_PROTOBUF_Z64_DECODE(u64v);\n"
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_DOUBLE:
-        FullCuddledIf(printer, vars,
-                      "ngx_protobuf_read_double(pos, end,",
-                      "&obj->$fname$) != NGX_OK",
-                      "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->__has_$fname$ = 1;\n"); 
-        break;
-      default:
-        printer.Print(vars,
-                      "FIXME; /* read $ftype$ */\n");
-        break;
-      }
-    }
+    GenerateUnpackValue(field, variant, printer);
 
     if (field->is_packable() && field->options().packed()) {
 
@@ -501,137 +846,10 @@ Generator::GenerateUnpack(const Descriptor* desc, io::Printer& printer)
       printer.Print("} else if (wire == "
                     "NGX_PROTOBUF_WIRETYPE_LENGTH_DELIMITED) {\n");
       Indent(printer);
-
-      FullSimpleIf(printer, vars,
-                   "ngx_protobuf_read_uint32(pos, end, &mlen) != NGX_OK",
-                   "return NGX_ABORT;");
-
-      printer.Print("mend = *pos + mlen;\n");
-      FullSimpleIf(printer, vars, "mend > end", "return NGX_ABORT;");
-      printer.Print("while (*pos < mend) {\n");
-      Indent(printer);
-
-      printer.Print(vars,
-                    "$ftype$ *fptr;\n"
-                    "\n"
-                    "fptr = $root$__add__$fname$(obj, pool);\n");
-
-      FullSimpleIf(printer, vars, "fptr == NULL", "return NGX_ERROR;");
-
-      // now read the data type
-
-      switch (field->type()) {
-      case FieldDescriptor::TYPE_BOOL:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_uint32(pos, end, &flag) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "*fptr = (flag != 0);\n"
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_UINT32:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_uint32(pos, end, fptr) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_ENUM:
-      case FieldDescriptor::TYPE_INT32:
-        FullCuddledIf(printer, vars,
-                      "ngx_protobuf_read_uint32(pos, end,",
-                      "(uint32_t *)fptr) != NGX_OK",
-                      "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_SINT32:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_uint32(pos, end, &u32v) "
-                     "!= NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "*fptr = NGX_PROTOBUF_Z32_DECODE(u32v);\n"
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_UINT64:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_uint64(pos, end, fptr) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_INT64:
-        FullCuddledIf(printer, vars,
-                      "ngx_protobuf_read_uint64(pos, end,",
-                      "(uint64_t *)fptr) != NGX_OK",
-                      "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_SINT64:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_uint64(pos, end, &u64v) "
-                     "!= NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "*fptr = NGX_PROTOBUF_Z64_DECODE(u64v);\n"
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_FIXED32:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_fixed32(pos, end, fptr) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_SFIXED32:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_fixed32(pos, end, &u32v) "
-                     "!= NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "*fptr = NGX_PROTOBUF_Z32_DECODE(u32v);\n"
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_FLOAT:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_float(pos, end, fptr) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->__has_$fname$ = 1;\n"); 
-        break;
-      case FieldDescriptor::TYPE_FIXED64:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_fixed64(pos, end, fptr) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->__has_$fname$ = 1;\n");
-      case FieldDescriptor::TYPE_SFIXED64:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_fixed64(pos, end, &u64v) "
-                     "!= NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "*fptr = NGX_PROTOBUF_Z64_DECODE(u64v);\n"
-                      "obj->__has_$fname$ = 1;\n");
-        break;
-      case FieldDescriptor::TYPE_DOUBLE:
-        FullSimpleIf(printer, vars,
-                     "ngx_protobuf_read_double(pos, end, fptr) != NGX_OK",
-                     "return NGX_ABORT;");
-        printer.Print(vars,
-                      "obj->__has_$fname$ = 1;\n"); 
-        break;
-      default:
-        printer.Print(vars,
-                      "#error cannot read packed $ftype$\n");
-        break;
-      }
-
-      CloseBrace(printer);
+      GenerateUnpackPacked(field, variant, printer);
     }
 
+
     Else(printer);
     SkipUnknown(printer);
     CloseBrace(printer);
@@ -646,7 +864,7 @@ Generator::GenerateUnpack(const Descriptor* desc, io::Printer& printer)
   if (desc->extension_range_count() > 0) {
     printer.Print(vars,
                   "rc = ngx_protobuf_unpack_extension(field, wire, ctx,\n"
-                  "    $root$__extensions,\n"
+                  "    &$root$__extensions,\n"
                   "    &obj->__extensions);\n");
     SimpleIf(printer, vars, "rc != NGX_OK");
     SimpleIf(printer, vars, "rc == NGX_DECLINED");
@@ -662,12 +880,52 @@ Generator::GenerateUnpack(const Descriptor* desc, io::Printer& printer)
   printer.Print("break;\n");
   CloseBrace(printer);
   CloseBrace(printer);
+
+  // unknown spans are aliased while the input is walked, so that runs
+  // of them can be merged, and copied once at the end.
+
+  if (HasRawUnknown(desc) && !(variant & UNPACK_ALIAS)) {
+    printer.Print("\n");
+    SimpleIf(printer, vars, "obj->__unknown != NULL");
+    printer.Print("rc = ngx_protobuf_copy_unknown_spans(obj->__unknown, "
+                  "ctx->pool);\n");
+    FullSimpleIf(printer, vars, "rc != NGX_OK", "return rc;");
+    CloseBrace(printer);
+  }
+
+  // the input outlives an aliased message, so its bytes can stand in
+  // for the message until it is changed.  unpacking into a message
+  // that isn't fresh merges, and a copied message has no bytes to
+  // keep; both are dirty from here on.
+
+  printer.Print("\n");
+  if (variant & UNPACK_ALIAS) {
+    SimpleIf(printer, vars, "start != NULL");
+    printer.Print("obj->__wire.data = start;\n"
+                  "obj->__wire.len = *pos - start;\n"
+                  "obj->__dirty = 0;\n");
+    Else(printer);
+    printer.Print("obj->__dirty = 1;\n");
+    CloseBrace(printer);
+  } else {
+    printer.Print("obj->__dirty = 1;\n");
+  }
+
   printer.Print("\n"
                 "return NGX_OK;\n");
   CloseBrace(printer);
   printer.Print("\n");
 }
 
+void
+Generator::GenerateUnpack(const Descriptor* desc, io::Printer& printer)
+{
+  GenerateUnpackVariant(desc, UNPACK_PADDED | UNPACK_ALIAS, printer);
+  GenerateUnpackVariant(desc, UNPACK_PADDED, printer);
+  GenerateUnpackVariant(desc, UNPACK_ALIAS, printer);
+  GenerateUnpackVariant(desc, 0, printer);
+}
+
 } // namespace nginx
 } // namespace compiler
 } // namespace protobuf
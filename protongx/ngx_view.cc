@@ -0,0 +1,216 @@
+#include <algorithm>
+
+#include <ngx_generator.h>
+#include <google/protobuf/descriptor.pb.h>
+
+namespace google {
+namespace protobuf {
+namespace compiler {
+namespace nginx {
+
+void
+Generator::GenerateViewDecls(const Descriptor* desc, io::Printer& printer)
+{
+  if (desc->field_count() == 0) {
+    return;
+  }
+
+  std::map<std::string, std::string> vars;
+
+  vars["name"] = desc->full_name();
+  vars["root"] = TypedefRoot(desc->full_name());
+
+  printer.Print(vars,
+                "/* $name$ view accessors */\n"
+                "\n");
+
+  for (int i = 0; i < desc->field_count(); ++i) {
+    const FieldDescriptor *field = desc->field(i);
+
+    vars["fname"] = field->name();
+
+    if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+      vars["vtype"] = "ngx_protobuf_view_t";
+    } else {
+      vars["vtype"] = FieldRealType(field);
+    }
+
+    if (field->is_repeated()) {
+      printer.Print(vars,
+                    "ngx_int_t $root$__view_$fname$(\n"
+                    "    ngx_protobuf_view_t *view,\n"
+                    "    ngx_protobuf_view_iter_t *iter,\n"
+                    "    $vtype$ *val);\n"
+                    "\n");
+    } else {
+      printer.Print(vars,
+                    "ngx_int_t $root$__view_$fname$(\n"
+                    "    ngx_protobuf_view_t *view,\n"
+                    "    $vtype$ *val);\n"
+                    "\n");
+    }
+  }
+}
+
+void
+Generator::GenerateViewField(const FieldDescriptor *field,
+                             int slot,
+                             io::Printer& printer)
+{
+  std::map<std::string, std::string> vars;
+
+  vars["root"] = TypedefRoot(field->containing_type()->full_name());
+  vars["fname"] = field->name();
+  vars["slot"] = Number(slot);
+
+  if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+    vars["vtype"] = "ngx_protobuf_view_t";
+  } else {
+    vars["vtype"] = FieldRealType(field);
+  }
+
+  printer.Print(vars,
+                "ngx_int_t\n"
+                "$root$__view_$fname$(\n"
+                "    ngx_protobuf_view_t *view,\n");
+  if (field->is_repeated()) {
+    printer.Print("    ngx_protobuf_view_iter_t *iter,\n");
+  }
+  printer.Print(vars,
+                "    $vtype$ *val)\n");
+  OpenBrace(printer);
+
+  printer.Print("u_char     *pos;\n");
+  if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+    printer.Print("ngx_str_t   data;\n");
+  } else if (field->type() == FieldDescriptor::TYPE_BOOL) {
+    printer.Print("uint32_t    flag;\n");
+  }
+  printer.Print("ngx_int_t   rc;\n"
+                "\n");
+
+  if (field->is_repeated()) {
+    printer.Print(vars,
+                  "rc = ngx_protobuf_view_next(view, &$root$__descriptor, "
+                  "$slot$,\n"
+                  "    iter, &pos);\n");
+  } else {
+    printer.Print(vars,
+                  "rc = ngx_protobuf_view_find(view, &$root$__descriptor, "
+                  "$slot$,\n"
+                  "    &pos);\n");
+  }
+  FullSimpleIf(printer, vars, "rc != NGX_OK", "return rc;");
+  printer.Print("\n");
+
+  // the field has been located and checked by the core module, so
+  // the value can be read with the usual helpers.
+
+  switch (field->type()) {
+  case FieldDescriptor::TYPE_MESSAGE:
+    printer.Print("rc = ngx_protobuf_read_string(&pos, view->last, "
+                  "&data, NULL);\n");
+    FullSimpleIf(printer, vars,
+                 "rc == NGX_OK",
+                 "ngx_protobuf_view_init(val, data.data, "
+                 "data.data + data.len,\n"
+                 "    view->pool);");
+    printer.Print("\n"
+                  "return rc;\n");
+    break;
+  case FieldDescriptor::TYPE_BYTES:
+  case FieldDescriptor::TYPE_STRING:
+    printer.Print("return ngx_protobuf_read_string(&pos, view->last, "
+                  "val, NULL);\n");
+    break;
+  case FieldDescriptor::TYPE_BOOL:
+    printer.Print("rc = ngx_protobuf_read_bool(&pos, view->last, &flag);\n");
+    FullSimpleIf(printer, vars, "rc == NGX_OK", "*val = flag;");
+    printer.Print("\n"
+                  "return rc;\n");
+    break;
+  case FieldDescriptor::TYPE_UINT32:
+    printer.Print("return ngx_protobuf_read_uint32(&pos, view->last, "
+                  "val);\n");
+    break;
+  case FieldDescriptor::TYPE_ENUM:
+  case FieldDescriptor::TYPE_INT32:
+    printer.Print("return ngx_protobuf_read_uint32(&pos, view->last,\n"
+                  "    (uint32_t *)val);\n");
+    break;
+  case FieldDescriptor::TYPE_SINT32:
+    printer.Print("return ngx_protobuf_read_sint32(&pos, view->last, "
+                  "val);\n");
+    break;
+  case FieldDescriptor::TYPE_UINT64:
+    printer.Print("return ngx_protobuf_read_uint64(&pos, view->last, "
+                  "val);\n");
+    break;
+  case FieldDescriptor::TYPE_INT64:
+    printer.Print("return ngx_protobuf_read_uint64(&pos, view->last,\n"
+                  "    (uint64_t *)val);\n");
+    break;
+  case FieldDescriptor::TYPE_SINT64:
+    printer.Print("return ngx_protobuf_read_sint64(&pos, view->last, "
+                  "val);\n");
+    break;
+  case FieldDescriptor::TYPE_FIXED32:
+    printer.Print("return ngx_protobuf_read_fixed32(&pos, view->last, "
+                  "val);\n");
+    break;
+  case FieldDescriptor::TYPE_SFIXED32:
+    printer.Print("return ngx_protobuf_read_sfixed32(&pos, view->last, "
+                  "val);\n");
+    break;
+  case FieldDescriptor::TYPE_FLOAT:
+    printer.Print("return ngx_protobuf_read_float(&pos, view->last, "
+                  "val);\n");
+    break;
+  case FieldDescriptor::TYPE_FIXED64:
+    printer.Print("return ngx_protobuf_read_fixed64(&pos, view->last, "
+                  "val);\n");
+    break;
+  case FieldDescriptor::TYPE_SFIXED64:
+    printer.Print("return ngx_protobuf_read_sfixed64(&pos, view->last, "
+                  "val);\n");
+    break;
+  case FieldDescriptor::TYPE_DOUBLE:
+    printer.Print("return ngx_protobuf_read_double(&pos, view->last, "
+                  "val);\n");
+    break;
+  default:
+    printer.Print(vars, "#error cannot view $vtype$\n");
+    break;
+  }
+
+  CloseBrace(printer);
+  printer.Print("\n");
+}
+
+void
+Generator::GenerateView(const Descriptor* desc, io::Printer& printer)
+{
+  if (desc->field_count() == 0) {
+    return;
+  }
+
+  // a field's slot is its position in the message descriptor, which
+  // lists the fields in field number order.
+
+  std::vector<const FieldDescriptor *> fields;
+
+  for (int i = 0; i < desc->field_count(); ++i) {
+    fields.push_back(desc->field(i));
+  }
+
+  std::sort(fields.begin(), fields.end(), FieldDescriptorSorter());
+
+  for (size_t i = 0; i < fields.size(); ++i) {
+    GenerateViewField(fields[i], i, printer);
+  }
+}
+
+} // namespace nginx
+} // namespace compiler
+} // namespace protobuf
+} // namespace google